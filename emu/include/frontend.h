@@ -38,6 +38,9 @@ public:
     bool PollEvent();
     void Clear();
     void DrawPixel(int x, int y, int r, int g, int b);
+    // Copy a RGBA8 image to the window, with its top left corner at x, y
+    void Present(const uint8_t* rgba, unsigned width, unsigned height,
+            unsigned x = 0, unsigned y = 0);
     void Flip();
     void Wait();
 
@@ -282,4 +282,90 @@ inline void EncodeX24S8(uint8_t stencil, uint8_t* bytes) {
     bytes[3] = stencil;
 }
 
+/// Instruction set extensions the span conversions below may use
+enum class SpanISA {
+    Scalar = 0,
+    SSE2,
+    SSSE3,
+    AVX2
+};
+
+/// Best instruction set supported by the host, detected on first use
+SpanISA GetHostSpanISA();
+
+/// Instruction set currently used by the span conversions
+SpanISA GetSpanISA();
+
+/**
+ * Limit the span conversions to the given instruction set, e.g. to compare
+ * them against the scalar path. Levels above what the host supports are
+ * clamped.
+ * @param isa Highest instruction set allowed
+ * @return The instruction set actually selected
+ */
+SpanISA SetSpanISA(SpanISA isa);
+
+/**
+ * Decode count consecutive pixels into RGBA8 bytes (r, g, b, a per pixel),
+ * producing the same result as the scalar Decode functions above.
+ * @param src Pointer to the first encoded pixel
+ * @param rgba Destination, 4 * count bytes
+ * @param count Number of pixels to convert
+ */
+void DecodeRGBA8Span(const uint8_t* src, uint8_t* rgba, size_t count);
+void DecodeRGB8Span(const uint8_t* src, uint8_t* rgba, size_t count);
+void DecodeRG8Span(const uint8_t* src, uint8_t* rgba, size_t count);
+void DecodeRGB565Span(const uint8_t* src, uint8_t* rgba, size_t count);
+void DecodeRGB5A1Span(const uint8_t* src, uint8_t* rgba, size_t count);
+void DecodeRGBA4Span(const uint8_t* src, uint8_t* rgba, size_t count);
+
+/**
+ * Encode count RGBA8 pixels (r, g, b, a bytes per pixel) into consecutive
+ * pixels, producing the same result as the scalar Encode functions above.
+ * @param rgba Source, 4 * count bytes
+ * @param dst Pointer where to store the first encoded pixel
+ * @param count Number of pixels to convert
+ */
+void EncodeRGBA8Span(const uint8_t* rgba, uint8_t* dst, size_t count);
+void EncodeRGB8Span(const uint8_t* rgba, uint8_t* dst, size_t count);
+void EncodeRG8Span(const uint8_t* rgba, uint8_t* dst, size_t count);
+void EncodeRGB565Span(const uint8_t* rgba, uint8_t* dst, size_t count);
+void EncodeRGB5A1Span(const uint8_t* rgba, uint8_t* dst, size_t count);
+void EncodeRGBA4Span(const uint8_t* rgba, uint8_t* dst, size_t count);
+
+/**
+ * Decode count consecutive depth (and stencil) values
+ * @param src Pointer to the first encoded value
+ * @param depth Destination for the depth values
+ * @param stencil Destination for the stencil values
+ * @param count Number of values to convert
+ */
+void DecodeD16Span(const uint8_t* src, uint32_t* depth, size_t count);
+void DecodeD24Span(const uint8_t* src, uint32_t* depth, size_t count);
+void DecodeD24S8Span(const uint8_t* src, uint32_t* depth, uint8_t* stencil, size_t count);
+
+/**
+ * Encode count depth (and stencil) values into consecutive pixels. Depth bits
+ * above the format's width are ignored.
+ * @param depth Source depth values
+ * @param stencil Source stencil values
+ * @param dst Pointer where to store the first encoded value
+ * @param count Number of values to convert
+ */
+void EncodeD16Span(const uint32_t* depth, uint8_t* dst, size_t count);
+void EncodeD24Span(const uint32_t* depth, uint8_t* dst, size_t count);
+void EncodeD24S8Span(const uint32_t* depth, const uint8_t* stencil, uint8_t* dst, size_t count);
+
+/**
+ * Average horizontal pairs of RGBA8 pixels, as display transfer does when
+ * downscaling. Results are truncated.
+ * @param row Source pixels, 8 * count bytes
+ * @param dst Destination, 4 * count bytes
+ * @param count Number of destination pixels
+ */
+void BoxFilter2x1Span(const uint8_t* row, uint8_t* dst, size_t count);
+
+/// Same as BoxFilter2x1Span(), averaging 2x2 blocks spread over row0 and row1
+void BoxFilter2x2Span(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, size_t count);
+
 } // namespace Color
@@ -0,0 +1,284 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Command list processor
+#include <vector>
+#include "cos.h"
+#include "isa.h"
+#include "regs.h"
+#include "shader.h"
+#include "vertexloader.h"
+#include "rasterizer.h"
+
+namespace Command {
+    // Longest burst a single command header can describe
+    constexpr unsigned MAX_BURST_LENGTH = 256;
+
+    // Command header, stored after the first parameter of each command.
+    // Commands are padded to an even number of words.
+    union CommandHeader {
+        uint32_t hex;
+        isa::BitField<0, 16, uint32_t> id;
+        // Byte enables for all the parameters of the command
+        isa::BitField<16, 4, uint32_t> mask;
+        // Number of parameters after the first one
+        isa::BitField<20, 8, uint32_t> extra_params;
+        // Parameters go to consecutive registers instead of a single one
+        isa::BitField<31, 1, uint32_t> incremental;
+    };
+
+    /**
+    * Command list builder, mirroring libctru's GPUCMD_* functions. Bursts
+    * longer than MAX_BURST_LENGTH are split into several commands.
+    */
+    class CommandList {
+    public:
+        void AddWrite(unsigned id, uint32_t value) {
+            AddMaskedWrite(id, 0xf, value);
+        }
+
+        void AddMaskedWrite(unsigned id, unsigned mask, uint32_t value) {
+            Add(id, mask, &value, 1, false);
+        }
+
+        // Write count values to the same register, e.g. a data port
+        void AddWrites(unsigned id, const uint32_t* values, unsigned count) {
+            Add(id, 0xf, values, count, false);
+        }
+
+        // Write count values to count consecutive registers
+        void AddIncrementalWrites(unsigned id, const uint32_t* values,
+                unsigned count) {
+            Add(id, 0xf, values, count, true);
+        }
+
+        const uint32_t* Data() const {
+            return words.data();
+        }
+
+        // Size in 32-bit words
+        size_t Size() const {
+            return words.size();
+        }
+
+        void Clear() {
+            words.clear();
+        }
+
+    private:
+        void Add(unsigned id, unsigned mask, const uint32_t* values,
+                unsigned count, bool incremental);
+
+        std::vector<uint32_t> words;
+    };
+
+    /**
+    * Parses command lists into the register file and drives the units
+    * behind it. Registers of the output merger, early depth, fog, lighting
+    * and procedural texture blocks are forwarded to the units as they are
+    * written, the vertex shader and geometry pipeline state is kept here
+    * and latched when a draw starts.
+    */
+    class CommandProcessor {
+    public:
+        // Work done since the last ResetStats()
+        struct Stats {
+            uint64_t draws = 0;
+            uint64_t vertices = 0; // Run through the vertex shader
+            // Writes leaving a register unchanged, dropped without
+            // reaching the units
+            uint64_t redundant_writes = 0;
+        };
+
+        // The units are wired into the rasterizer
+        CommandProcessor(Rasterizer& rasterizer,
+                Framebuffer::OutputMerger& output_merger,
+                Framebuffer::EarlyDepthUnit& early_depth,
+                TexEnv::FogUnit& fog, Lighting::LightingUnit& lighting,
+                Texturing::ProcTexUnit& proctex);
+
+        /**
+        * Execute a command list, following GPUREG_CMDBUF_JUMP0/1 into other
+        * lists in emulated memory. Processing stops at the end of the list
+        * or at a write to GPUREG_FINALIZE.
+        * @param list,words The list in host memory, size in 32-bit words
+        */
+        void ProcessCommandList(const uint32_t* list, size_t words);
+
+        /**
+        * Write a single register.
+        * @param id Register number
+        * @param mask Byte enables, bytes not enabled keep their value
+        */
+        void WriteRegister(unsigned id, uint32_t value, unsigned mask = 0xf);
+
+        /**
+        * Write a burst of values. Runs of registers without side effects
+        * are compared with and copied into the register file at once,
+        * bursts to the shader data ports are uploaded in bulk.
+        * @param id First register number
+        * @param incremental Write consecutive registers instead of one
+        */
+        void WriteRegisters(unsigned id, const uint32_t* values,
+                unsigned count, unsigned mask, bool incremental);
+
+        uint32_t ReadRegister(unsigned id) const {
+            return regs[id];
+        }
+
+        const Stats& GetStats() const {
+            return stats;
+        }
+
+        void ResetStats() {
+            stats = Stats();
+        }
+
+        // Identifies the uploaded vertex shader code and swizzle data,
+        // only changes when their contents do
+        uint64_t GetProgramHash() const {
+            return program_hash;
+        }
+
+    private:
+        // Where writes to a register go, besides the register file
+        enum class Target : uint8_t {
+            None,
+            OutputMerger,
+            EarlyDepth,
+            Fog,
+            Lighting,
+            ProcTex,
+            Processor,
+            CodeData,
+            SwizzleData,
+            FloatUniformData,
+            FixedAttributeData
+        };
+
+        // Derived state rebuilt when a draw starts, one bit per group of
+        // registers it depends on
+        enum DirtyFlag : uint32_t {
+            DIRTY_TEXENV = 1 << 0,
+            DIRTY_TEXTURE = 1 << 1,
+            DIRTY_VIEWPORT = 1 << 2,
+            DIRTY_DEPTH_MAP = 1 << 3,
+            DIRTY_OUTPUT_MAP = 1 << 4,
+            DIRTY_VERTEX_LAYOUT = 1 << 5,
+            DIRTY_ENTRY_POINT = 1 << 6,
+            DIRTY_PROGRAM = 1 << 7,
+            DIRTY_ALL = 0xff
+        };
+
+        struct RegisterInfo {
+            Target target;
+            // Writes have an effect even if the value does not change,
+            // e.g. triggers, data ports and their index registers
+            bool strobe;
+            // DirtyFlag bits of the state derived from the register
+            uint8_t dirty;
+        };
+
+        static const std::array<RegisterInfo, NUM_REGS>& GetRegisterInfo();
+
+        // Side effects of registers handled by the processor itself
+        void Execute(unsigned id, uint32_t value);
+
+        void UploadCode(const uint32_t* values, unsigned count);
+        void UploadSwizzle(const uint32_t* values, unsigned count);
+        void UploadFloatUniforms(const uint32_t* values, unsigned count);
+        void UploadFixedAttributes(const uint32_t* values, unsigned count);
+
+        // Rebuild dirty state and latch it into the rasterizer and the
+        // shader
+        void SyncState();
+
+        // Texture unit setup from the GPUREG_TEXUNITi registers
+        Texturing::TextureUnit GetTextureUnit(unsigned index) const;
+
+        // Derived state of a new program, its hash and the inputs it reads
+        void UpdateProgram();
+
+        void Draw(bool indexed);
+        // Shade the queued immediate mode vertices as one batch
+        void FlushImmediate();
+        Vec4<float24>* ClearInputRegisters();
+
+        /**
+        * Run the vertex shader on a batch of vertices and assemble the
+        * results into primitives.
+        * @param count Number of vertices
+        * @param load Called as load(i, input) to fill the input registers
+        * with the attributes of vertex i
+        */
+        template <typename LoadFunc>
+        void ShadeVertices(unsigned count, LoadFunc load);
+        void SubmitVertex(const Shader::OutputVertex& vtx);
+
+        Rasterizer& rasterizer;
+        Framebuffer::OutputMerger& output_merger;
+        Framebuffer::EarlyDepthUnit& early_depth;
+        TexEnv::FogUnit& fog;
+        Lighting::LightingUnit& lighting;
+        Texturing::ProcTexUnit& proctex;
+
+        std::array<uint32_t, NUM_REGS> regs{};
+        uint32_t dirty = DIRTY_ALL;
+        Shader::VertexLoader vertex_loader;
+
+        // Vertex shader state filled through the data ports
+        Shader::Setup setup;
+        Shader::Uniforms uniforms;
+        Shader::ShaderEngine shader_engine;
+        Shader::OutputMap output_map;
+        uint64_t program_hash = 0;
+        uint16_t input_mask = 0;
+        unsigned code_offset = 0;
+        unsigned swizzle_offset = 0;
+        unsigned float_uniform_index = 0;
+        bool float_uniform_f32 = false;
+        uint32_t float_uniform_buffer[4];
+        unsigned float_uniform_words = 0;
+
+        // GPUREG_FIXEDATTRIB_INDEX/DATA0-2
+        Vec4<float24> fixed_attributes[12];
+        unsigned fixed_attribute_index = 0;
+        uint32_t fixed_attribute_buffer[3];
+        unsigned fixed_attribute_words = 0;
+        // Immediate mode vertices not shaded yet, all attributes of a
+        // vertex in order
+        std::vector<Vec4<float24>> immediate_attributes;
+
+        // Primitive assembly, latest vertices of the current strip or fan
+        Shader::OutputVertex primitive_buffer[2];
+        unsigned primitive_index = 0;
+        bool strip_ready = false;
+
+        // Cleared by GPUREG_START_DRAW_FUNC0 while draws are issued
+        bool configuring = true;
+
+        // Set by GPUREG_CMDBUF_JUMP0/1 and GPUREG_FINALIZE
+        const uint32_t* jump_target = nullptr;
+        size_t jump_words = 0;
+        bool finalized = false;
+
+        Stats stats;
+    };
+}
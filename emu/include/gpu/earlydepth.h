@@ -0,0 +1,135 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Early depth test, rejecting fragments before interpolation and shading
+#include "cos.h"
+#include <algorithm>
+#include <vector>
+
+namespace Framebuffer {
+    // GPUREG_EARLYDEPTH_FUNC
+    enum class EarlyDepthFunc : uint32_t {
+        GreaterThanOrEqual = 0,
+        GreaterThan = 1,
+        LessThanOrEqual = 2,
+        LessThan = 3
+    };
+
+    /**
+    * The early depth buffer keeps one conservative depth per 8x8 tile. How
+    * the hardware updates its buffer is not documented, this model only
+    * rejects fragments the regular depth test would reject as well: a tile
+    * holds the clear value until every pixel of it has been written, then
+    * the farthest depth written since the clear. Depths are quantized like
+    * the depth buffer does, so that ties of the stored format agree.
+    */
+    class EarlyDepthUnit {
+    public:
+        EarlyDepthUnit();
+
+        /**
+        * Write one of GPUREG_EARLYDEPTH_FUNC, GPUREG_EARLYDEPTH_TEST1,
+        * GPUREG_EARLYDEPTH_CLEAR, GPUREG_EARLYDEPTH_DATA or
+        * GPUREG_EARLYDEPTH_TEST2.
+        * @param id Register number
+        */
+        void WriteRegister(unsigned id, uint32_t value);
+
+        // Both enable registers have to be set
+        bool IsEnabled() const {
+            return test1 && test2;
+        }
+
+        /**
+        * Match the buffer to the render target, resets it on a change.
+        * @param depth_bits 16 or 24, the precision of the depth buffer
+        */
+        void SetDimensions(unsigned width, unsigned height, unsigned depth_bits);
+
+        /**
+        * @param x,y Fragment position
+        * @param depth Fragment depth in [0, 1]
+        * @return false if the fragment is known to fail the depth test
+        */
+        bool Test(unsigned x, unsigned y, float depth) const {
+            if ((x >= width) || (y >= height))
+                return true;
+            const uint32_t z = Quantize(depth);
+            const Tile& tile = tiles[(y / 8) * tiles_per_row + x / 8];
+            uint32_t ref = clear_value >> (24 - depth_bits);
+            if (tile.coverage == ~uint64_t(0))
+                ref = IsGreater() ? tile.min_z : tile.max_z;
+            switch (func) {
+            case EarlyDepthFunc::GreaterThanOrEqual:
+                return z >= ref;
+            case EarlyDepthFunc::GreaterThan:
+                return z > ref;
+            case EarlyDepthFunc::LessThanOrEqual:
+                return z <= ref;
+            case EarlyDepthFunc::LessThan:
+                return z < ref;
+            }
+            return true;
+        }
+
+        /**
+        * Record a depth written to the depth buffer.
+        * @param depth Depth in [0, 1]
+        */
+        void Update(unsigned x, unsigned y, float depth) {
+            if ((x >= width) || (y >= height))
+                return;
+            const uint32_t z = Quantize(depth);
+            Tile& tile = tiles[(y / 8) * tiles_per_row + x / 8];
+            tile.coverage |= uint64_t(1) << ((y % 8) * 8 + x % 8);
+            tile.min_z = std::min(tile.min_z, z);
+            tile.max_z = std::max(tile.max_z, z);
+        }
+
+    private:
+        struct Tile {
+            // Pixels written since the last clear
+            uint64_t coverage;
+            uint32_t min_z;
+            uint32_t max_z;
+        };
+
+        // Same conversion as the depth buffer writes
+        uint32_t Quantize(float depth) const {
+            return static_cast<uint32_t>(depth * ((1u << depth_bits) - 1));
+        }
+
+        bool IsGreater() const {
+            return (func == EarlyDepthFunc::GreaterThanOrEqual) ||
+                    (func == EarlyDepthFunc::GreaterThan);
+        }
+
+        void Clear();
+
+        std::vector<Tile> tiles;
+        unsigned width;
+        unsigned height;
+        unsigned tiles_per_row;
+        unsigned depth_bits;
+        EarlyDepthFunc func;
+        uint32_t clear_value;
+        bool test1;
+        bool test2;
+    };
+}
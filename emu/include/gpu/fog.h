@@ -0,0 +1,93 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Fog and gas shading, applied to the texture combiner output
+#include "cos.h"
+#include "isa.h"
+#include "fragment.h"
+#include "texenv.h"
+
+namespace TexEnv {
+    constexpr unsigned FOG_LUT_SIZE = 128;
+    constexpr unsigned GAS_LUT_SIZE = 8;
+
+    // Gas LUT index selected by GPUREG_GAS_LIGHT_Z_COLOR
+    enum class GasLUTInput : uint32_t {
+        Density = 0,
+        LightFactor = 1
+    };
+
+    // GPUREG_GAS_LIGHT_XY and GPUREG_GAS_LIGHT_Z, 8-bit unorm values
+    union GasLight {
+        uint32_t hex;
+        isa::BitField<0, 8, uint32_t> min;
+        isa::BitField<8, 8, uint32_t> max;
+        isa::BitField<16, 8, uint32_t> attenuation;
+    };
+
+    class FogUnit {
+    public:
+        FogUnit();
+
+        /**
+        * Write one of the fog and gas registers: GPUREG_FOG_COLOR,
+        * GPUREG_GAS_ATTENUATION, GPUREG_GAS_ACCMAX, GPUREG_FOG_LUT_INDEX,
+        * GPUREG_FOG_LUT_DATA0-7 and GPUREG_GAS_LIGHT_XY - GPUREG_GAS_LUT_DATA.
+        * LUT data is unpacked to float as it is written.
+        * @param id Register number
+        */
+        void WriteRegister(unsigned id, uint32_t value);
+
+        /**
+        * Apply fog or gas shading to the combiner output of a quad. Must
+        * not be called when the fog mode is None.
+        * @param config Update buffer register selecting the mode
+        * @param depth Fragment depth per lane, in [0, 1]
+        * @param color Combiner output, modified in place
+        */
+        void Apply(const UpdateBuffer& config, const float (&depth)[QUAD_SIZE],
+                ColorQuad& color) const;
+
+    private:
+        void ApplyFog(bool flip, const float (&depth)[QUAD_SIZE],
+                ColorQuad& color) const;
+        void ApplyGas(GasDensity source, ColorQuad& color) const;
+
+        // Fog factor and difference to the next entry
+        float fog_value[FOG_LUT_SIZE];
+        float fog_diff[FOG_LUT_SIZE];
+        unsigned fog_lut_index;
+        // In 0-255 range
+        float fog_color[3];
+
+        GasLight gas_light_xy;
+        GasLight gas_light_z;
+        float gas_light_direction;
+        GasLUTInput gas_lut_input;
+        float gas_attenuation;
+        float gas_accmax;
+
+        // Written as eight differences followed by eight colors, in 0-255
+        // range once unpacked
+        float gas_color[GAS_LUT_SIZE][3];
+        float gas_diff[GAS_LUT_SIZE][3];
+        unsigned gas_lut_index;
+    };
+}
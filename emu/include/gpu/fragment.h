@@ -0,0 +1,55 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Data passed between the per-fragment stages
+#include "cos.h"
+#include "texturing.h"
+
+// Fragments travel through the per-fragment stages in quads: up to four
+// covered pixels of a triangle, stored as structure of arrays.
+constexpr unsigned QUAD_SIZE = 4;
+
+using ColorQuad = Texturing::TexelBatch<QUAD_SIZE>;
+
+struct FragmentQuad {
+    // Number of valid lanes, unused lanes repeat lane 0
+    unsigned count;
+
+    // Screen position
+    uint16_t x[QUAD_SIZE];
+    uint16_t y[QUAD_SIZE];
+
+    // Depth after the viewport depth mapping, in [0, 1]
+    float depth[QUAD_SIZE];
+
+    // Texture coordinates 0-2, and the third component of coordinate 0
+    // used by cube, shadow and projective lookups
+    float tc_u[3][QUAD_SIZE];
+    float tc_v[3][QUAD_SIZE];
+    float tc0_w[QUAD_SIZE];
+
+    // Normal quaternion and view vector, only used by fragment lighting
+    float quat[4][QUAD_SIZE];
+    float view[3][QUAD_SIZE];
+
+    ColorQuad primary_color;
+    ColorQuad texture_color[4];
+    ColorQuad primary_fragment_color;
+    ColorQuad secondary_fragment_color;
+};
@@ -0,0 +1,456 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Output merger and the tiled color/depth buffers in emulated memory
+#include "cos.h"
+#include "isa.h"
+#include "texturing.h"
+#include <vector>
+
+namespace Framebuffer {
+    // First register of the block, GPUREG_COLOR_OPERATION
+    constexpr unsigned REGISTER_BASE = 0x100;
+
+    enum class FragmentOperationMode : uint32_t {
+        Default = 0,
+        Gas = 1,
+        Shadow = 3
+    };
+
+    // Depth test of gas fragments against the depth buffer
+    enum class GasDepthFunc : uint32_t {
+        Never = 0,
+        Always = 1,
+        GreaterThanOrEqual = 2,
+        LessThanOrEqual = 3
+    };
+
+    enum class LogicOp : uint32_t {
+        Clear = 0,
+        And = 1,
+        AndReverse = 2,
+        Copy = 3,
+        Set = 4,
+        CopyInverted = 5,
+        NoOp = 6,
+        Invert = 7,
+        Nand = 8,
+        Or = 9,
+        Nor = 10,
+        Xor = 11,
+        Equiv = 12,
+        AndInverted = 13,
+        OrReverse = 14,
+        OrInverted = 15
+    };
+
+    enum class BlendEquation : uint32_t {
+        Add = 0,
+        Subtract = 1,
+        ReverseSubtract = 2,
+        Min = 3,
+        Max = 4
+    };
+
+    enum class BlendFactor : uint32_t {
+        Zero = 0,
+        One = 1,
+        SourceColor = 2,
+        OneMinusSourceColor = 3,
+        DestColor = 4,
+        OneMinusDestColor = 5,
+        SourceAlpha = 6,
+        OneMinusSourceAlpha = 7,
+        DestAlpha = 8,
+        OneMinusDestAlpha = 9,
+        ConstantColor = 10,
+        OneMinusConstantColor = 11,
+        ConstantAlpha = 12,
+        OneMinusConstantAlpha = 13,
+        SourceAlphaSaturate = 14
+    };
+
+    enum class CompareFunc : uint32_t {
+        Never = 0,
+        Always = 1,
+        Equal = 2,
+        NotEqual = 3,
+        LessThan = 4,
+        LessThanOrEqual = 5,
+        GreaterThan = 6,
+        GreaterThanOrEqual = 7
+    };
+
+    enum class StencilAction : uint32_t {
+        Keep = 0,
+        Zero = 1,
+        Replace = 2,
+        Increment = 3,
+        Decrement = 4,
+        Invert = 5,
+        IncrementWrap = 6,
+        DecrementWrap = 7
+    };
+
+    // Components are laid out in reverse byte order, most significant bits
+    // first
+    enum class ColorFormat : uint32_t {
+        RGBA8 = 0,
+        RGB8 = 1,
+        RGB5A1 = 2,
+        RGB565 = 3,
+        RGBA4 = 4
+    };
+
+    enum class DepthFormat : uint32_t {
+        D16 = 0,
+        D24 = 2,
+        D24S8 = 3
+    };
+
+    // Display transfer downscaling, the average of each 2x1 or 2x2 block of
+    // the render target becomes one output pixel
+    enum class DownscaleMode : uint32_t {
+        None = 0,
+        X = 1,
+        XY = 2
+    };
+
+    // GPUREG_COLOR_OPERATION - GPUREG_FRAGOP_SHADOW
+    struct Registers {
+        union {
+            uint32_t hex;
+            isa::BitField<0, 2, FragmentOperationMode> fragment_operation_mode;
+            // If false, logic blending is used
+            isa::BitField<8, 1, uint32_t> alphablend_enable;
+        } color_operation;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, BlendEquation> blend_equation_rgb;
+            isa::BitField<8, 3, BlendEquation> blend_equation_a;
+            isa::BitField<16, 4, BlendFactor> factor_source_rgb;
+            isa::BitField<20, 4, BlendFactor> factor_dest_rgb;
+            isa::BitField<24, 4, BlendFactor> factor_source_a;
+            isa::BitField<28, 4, BlendFactor> factor_dest_a;
+        } alpha_blending;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 4, LogicOp> logic_op;
+        } logic_op;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 8, uint32_t> r;
+            isa::BitField<8, 8, uint32_t> g;
+            isa::BitField<16, 8, uint32_t> b;
+            isa::BitField<24, 8, uint32_t> a;
+        } blend_const;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 1, uint32_t> enable;
+            isa::BitField<4, 3, CompareFunc> func;
+            isa::BitField<8, 8, uint32_t> ref;
+        } alpha_test;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 1, uint32_t> enable;
+            isa::BitField<4, 3, CompareFunc> func;
+            // Mask used to control writing to the stencil buffer
+            isa::BitField<8, 8, uint32_t> write_mask;
+            isa::BitField<16, 8, uint32_t> reference_value;
+            // Mask to apply on stencil test inputs
+            isa::BitField<24, 8, uint32_t> input_mask;
+        } stencil_test;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, StencilAction> action_stencil_fail;
+            isa::BitField<4, 3, StencilAction> action_depth_fail;
+            isa::BitField<8, 3, StencilAction> action_depth_pass;
+        } stencil_op;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 1, uint32_t> depth_test_enable;
+            isa::BitField<4, 3, CompareFunc> depth_test_func;
+            isa::BitField<8, 1, uint32_t> red_enable;
+            isa::BitField<9, 1, uint32_t> green_enable;
+            isa::BitField<10, 1, uint32_t> blue_enable;
+            isa::BitField<11, 1, uint32_t> alpha_enable;
+            isa::BitField<12, 1, uint32_t> depth_write_enable;
+        } depth_color_mask;
+
+        INSERT_PADDING_WORDS(0xa);
+
+        // 0 disables color buffer reads / writes
+        uint32_t color_read;
+        uint32_t color_write;
+
+        // Bit 0 stencil, bit 1 depth
+        uint32_t depth_stencil_read;
+        uint32_t depth_stencil_write;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 2, DepthFormat> depth_format;
+        } depth_format;
+
+        union {
+            uint32_t hex;
+            isa::BitField<16, 3, ColorFormat> color_format;
+        } color_format;
+
+        INSERT_PADDING_WORDS(0x4);
+
+        // Physical address >> 3
+        uint32_t depth_buffer_address;
+        uint32_t color_buffer_address;
+
+        // The height is stored as the actual height minus one, use the
+        // accessors instead
+        union {
+            uint32_t hex;
+            isa::BitField<0, 11, uint32_t> width;
+            isa::BitField<12, 10, uint32_t> height;
+        } dim;
+
+        // Early depth and gas registers, handled by their own units
+        INSERT_PADDING_WORDS(0x7);
+
+        // Gas density accumulation. Fragments weigh less the closer they
+        // are to the depth buffer, delta_z is the 24-bit depth distance at
+        // which they reach full weight.
+        union {
+            uint32_t hex;
+            isa::BitField<0, 24, uint32_t> delta_z;
+            isa::BitField<24, 2, GasDepthFunc> depth_func;
+        } gas_delta_z_depth;
+
+        INSERT_PADDING_WORDS(0x9);
+
+        // Shadow attenuation, float16 values
+        union {
+            uint32_t hex;
+            isa::BitField<0, 16, uint32_t> constant;
+            isa::BitField<16, 16, uint32_t> linear;
+        } shadow;
+
+        uint32_t GetColorBufferPhysicalAddress() const {
+            return (color_buffer_address & 0x0fffffff) * 8;
+        }
+
+        uint32_t GetDepthBufferPhysicalAddress() const {
+            return (depth_buffer_address & 0x0fffffff) * 8;
+        }
+
+        unsigned GetWidth() const {
+            return dim.width;
+        }
+
+        unsigned GetHeight() const {
+            return dim.height + 1;
+        }
+    };
+
+    static_assert(sizeof(Registers) == (0x130 - REGISTER_BASE + 1) * sizeof(uint32_t),
+            "Framebuffer Registers has invalid size");
+
+    unsigned BytesPerPixel(ColorFormat format);
+    unsigned BytesPerPixel(DepthFormat format);
+    unsigned DepthBitsPerPixel(DepthFormat format);
+
+    /**
+    * Byte offset of a pixel in a tiled buffer. Like textures, buffers are
+    * stored in 8x8 tiles with the last row first.
+    * @param x,y Fragment coordinates
+    * @param width,height Buffer dimensions
+    * @param bytes_per_pixel Pixel size of the buffer format
+    */
+    uint32_t GetPixelOffset(unsigned x, unsigned y, unsigned width,
+            unsigned height, unsigned bytes_per_pixel);
+
+    /**
+    * Per tile state of a render target.
+    *
+    * Pixels that still hold the value of the last fill have their bit set,
+    * one bit per pixel of each 8x8 tile. Filling only sets the bits, a pixel
+    * is written to memory when it is first drawn to or when the buffer is
+    * flushed. Tiles fully drawn over before that are never filled.
+    *
+    * Tiles written since the last flush are listed, so that the flush can
+    * invalidate cached texture data of exactly those tiles.
+    */
+    class TileTracker {
+    public:
+        // Forget pending fills, for a buffer of the given size
+        void Reset(unsigned num_tiles, unsigned bytes_per_pixel);
+
+        /**
+        * Mark every pixel as holding the given value.
+        * @param value Encoded pixel, little endian
+        */
+        void Fill(uint32_t value);
+
+        // Pixel indices are GetPixelOffset() with a pixel size of 1
+        bool IsPending(uint32_t pixel) const {
+            return (pending[pixel / 64] >> (pixel % 64)) & 1;
+        }
+
+        // The encoded fill value, bytes_per_pixel bytes
+        const uint8_t* GetValue() const {
+            return value;
+        }
+
+        /**
+        * Called before a pixel is written. Threads may write to distinct
+        * 8x8 tiles concurrently.
+        * @param dst Pixel in memory
+        * @param partial Set if the write leaves some bytes of the pixel
+        * untouched, they then receive the fill value first
+        */
+        void Write(uint32_t pixel, uint8_t* dst, bool partial) {
+            const uint32_t tile = pixel / 64;
+            dirty[tile] = true;
+
+            uint64_t& bits = pending[tile];
+            const uint64_t bit = uint64_t(1) << (pixel % 64);
+            if (!(bits & bit))
+                return;
+            if (partial)
+                std::memcpy(dst, value, bytes_per_pixel);
+            bits &= ~bit;
+        }
+
+        /**
+        * Write all pending pixels to memory, then invalidate the texture
+        * data cached for every tile written since the last flush.
+        * @param buffer,address The buffer in host and physical memory
+        */
+        void Flush(uint8_t* buffer, uint32_t address);
+
+    private:
+        std::vector<uint64_t> pending;
+        // Tiles written since the last flush, one byte each
+        std::vector<uint8_t> dirty;
+        uint8_t value[4] = {};
+        unsigned bytes_per_pixel = 0;
+    };
+
+    class OutputMerger {
+    public:
+        OutputMerger();
+
+        /**
+        * Write a register of the output merger / framebuffer block.
+        * @param index Register index relative to REGISTER_BASE
+        */
+        void WriteRegister(unsigned index, uint32_t value);
+
+        const Registers& GetRegisters() const {
+            return regs;
+        }
+
+        /**
+        * Alpha test the combiner output of a span of fragments.
+        * @param color Combiner output
+        * @param mask Bit i is set if lane i holds a fragment
+        * @return The mask with failing lanes cleared
+        */
+        template <unsigned N>
+        unsigned AlphaTest(const Texturing::TexelBatch<N>& color,
+                unsigned mask) const;
+
+        /**
+        * Run the stencil and depth tests on a span of fragments, then blend
+        * or apply the logic op and write the survivors to the framebuffer.
+        * Buffers are only read when their read masks are enabled.
+        * @param x,y Arrays of N fragment positions
+        * @param depth Arrays of N depth values in [0, 1]
+        * @param color Combiner output after fog
+        * @param mask Lanes to process, lanes must cover distinct pixels
+        * @return Lanes whose depth was written to the depth buffer
+        */
+        template <unsigned N>
+        unsigned Merge(const uint16_t* x, const uint16_t* y, const float* depth,
+                const Texturing::TexelBatch<N>& color, unsigned mask);
+
+        /**
+        * Memory fill engine. Fills matching one of the bound buffers are
+        * only recorded per tile, other ranges are written immediately.
+        * @param address,size Physical range to fill
+        * @param value Fill value, little endian
+        * @param value_bytes 2, 3 or 4 bytes per value
+        */
+        void MemoryFill(uint32_t address, uint32_t size, uint32_t value,
+                unsigned value_bytes);
+
+        /**
+        * Write pending fills to memory and invalidate cached texture data
+        * of the tiles written, before the buffers are read by something
+        * else than the output merger. Also triggered by writing
+        * GPUREG_FRAMEBUFFER_FLUSH.
+        */
+        void Flush();
+
+        /**
+        * Decode the color buffer to linear RGBA8. Row i holds the pixels
+        * fragments with y == i are written to.
+        * @param rgba Destination of GetWidth() * GetHeight() * 4 bytes,
+        *             halved in each downscaled direction
+        * @param scaling Box filter a supersampled buffer down to its size
+        *                on the display
+        */
+        void ReadColorBuffer(uint8_t* rgba,
+                DownscaleMode scaling = DownscaleMode::None) const;
+
+        // Same as ReadColorBuffer(), the depth as a gray level
+        void ReadDepthBuffer(uint8_t* rgba,
+                DownscaleMode scaling = DownscaleMode::None) const;
+
+    private:
+        void UpdateSetup();
+
+        // Shadow map output, keeps the closest depth of each pixel
+        template <unsigned N>
+        void MergeShadow(const uint32_t* pixel, const float* depth,
+                const Texturing::TexelBatch<N>& color, unsigned mask);
+
+        // Gas density accumulation into the red and green channels
+        template <unsigned N>
+        void MergeGas(const uint32_t* pixel, const float* depth,
+                const Texturing::TexelBatch<N>& color, unsigned mask);
+
+        Registers regs;
+
+        TileTracker color_tiles;
+        TileTracker depth_tiles;
+
+        // Derived from the registers, buffers are nullptr when not mapped
+        uint8_t* color_buffer;
+        uint8_t* depth_buffer;
+        unsigned color_bytes_per_pixel;
+        unsigned depth_bytes_per_pixel;
+        bool stencil_enable;
+    };
+}
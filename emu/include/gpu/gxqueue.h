@@ -0,0 +1,125 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Asynchronous GX command queue
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "cos.h"
+#include "command.h"
+#include "framebuffer.h"
+#include "transfer.h"
+
+namespace GX {
+    // Increases with each command, a fence is signaled once the command
+    // it was returned for and all earlier ones completed
+    using Fence = uint64_t;
+    using Callback = std::function<void()>;
+
+    /**
+    * Runs GX commands (command lists, memory fills and display transfers)
+    * in order on a worker thread, so that the host can prepare the next
+    * frame while the current one renders. The GPU units passed in belong
+    * to the worker while commands are pending, and memory the commands
+    * read or write must not be touched by the host before their fence is
+    * signaled.
+    */
+    class CommandQueue {
+    public:
+        CommandQueue(Command::CommandProcessor& processor,
+                Framebuffer::OutputMerger& output_merger);
+        // Completes the pending commands
+        ~CommandQueue();
+
+        /**
+        * Process a command list. The list is not copied.
+        * @param list,words Command list, valid until the fence is signaled
+        * @param callback Called on the worker once the list completed
+        */
+        Fence ProcessCommandList(const uint32_t* list, size_t words,
+                Callback callback = nullptr);
+
+        // See Framebuffer::OutputMerger::MemoryFill()
+        Fence MemoryFill(uint32_t address, uint32_t size, uint32_t value,
+                unsigned value_bytes, Callback callback = nullptr);
+
+        // Display transfer or texture copy, see Transfer::Execute()
+        Fence DisplayTransfer(const Transfer::Config& config,
+                Callback callback = nullptr);
+
+        bool IsSignaled(Fence fence);
+
+        // Block until the fence is signaled
+        void Wait(Fence fence);
+
+        // Block until all commands completed
+        void Finish();
+
+        /**
+        * Set a function called on the worker each time the queue runs
+        * empty, e.g. to kick off the next frame.
+        */
+        void SetFinishCallback(Callback callback);
+
+    private:
+        enum class Type {
+            CommandList,
+            MemoryFill,
+            DisplayTransfer
+        };
+
+        struct Entry {
+            Type type;
+            Fence fence;
+            Callback callback;
+            // CommandList
+            const uint32_t* list;
+            size_t words;
+            // MemoryFill
+            uint32_t address;
+            uint32_t size;
+            uint32_t value;
+            unsigned value_bytes;
+            // DisplayTransfer
+            Transfer::Config transfer;
+        };
+
+        Fence Push(Entry& entry);
+        void Run();
+
+        Command::CommandProcessor& processor;
+        Framebuffer::OutputMerger& output_merger;
+
+        std::mutex mutex;
+        // Signaled when an entry is pushed or the queue stops
+        std::condition_variable pushed;
+        // Signaled when an entry completed
+        std::condition_variable completed;
+        std::deque<Entry> entries;
+        Fence last_fence = 0;
+        Fence completed_fence = 0;
+        Callback finish_callback;
+        bool stop = false;
+
+        // Last member, starts once everything else is constructed
+        std::thread worker;
+    };
+}
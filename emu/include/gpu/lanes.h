@@ -0,0 +1,107 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Four float lanes, one per fragment of a quad
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "cos.h"
+#include "fragment.h"
+
+static_assert(QUAD_SIZE == 4, "Lanes hold exactly one quad");
+
+// One float per fragment of a quad
+struct Lanes {
+#if defined(__SSE2__)
+    __m128 v;
+
+    Lanes() = default;
+    Lanes(__m128 v) : v(v) {}
+    Lanes(float f) : v(_mm_set1_ps(f)) {}
+
+    static Lanes Load(const float* p) { return _mm_loadu_ps(p); }
+    void Store(float* p) const { _mm_storeu_ps(p, v); }
+
+    friend Lanes operator+(Lanes a, Lanes b) { return _mm_add_ps(a.v, b.v); }
+    friend Lanes operator-(Lanes a, Lanes b) { return _mm_sub_ps(a.v, b.v); }
+    friend Lanes operator*(Lanes a, Lanes b) { return _mm_mul_ps(a.v, b.v); }
+    friend Lanes operator/(Lanes a, Lanes b) { return _mm_div_ps(a.v, b.v); }
+    friend Lanes operator-(Lanes a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+    // NaN in a yields b
+    friend Lanes Min(Lanes a, Lanes b) { return _mm_min_ps(a.v, b.v); }
+    friend Lanes Max(Lanes a, Lanes b) { return _mm_max_ps(a.v, b.v); }
+    friend Lanes Abs(Lanes a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+    friend Lanes Sqrt(Lanes a) { return _mm_sqrt_ps(a.v); }
+    friend Lanes Floor(Lanes a) {
+        __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+        return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f)));
+    }
+    // Lanes where a == 0 take zero_value
+    friend Lanes SelectZero(Lanes a, Lanes zero_value, Lanes other) {
+        __m128 mask = _mm_cmpeq_ps(a.v, _mm_setzero_ps());
+        return _mm_or_ps(_mm_and_ps(mask, zero_value.v),
+                _mm_andnot_ps(mask, other.v));
+    }
+#else
+    float v[4];
+
+    Lanes() = default;
+    Lanes(float f) : v{f, f, f, f} {}
+
+    static Lanes Load(const float* p) { Lanes r; std::memcpy(r.v, p, sizeof(r.v)); return r; }
+    void Store(float* p) const { std::memcpy(p, v, sizeof(v)); }
+
+    template <typename F>
+    static Lanes Map(F f) { Lanes r; for (unsigned i = 0; i < 4; i++) r.v[i] = f(i); return r; }
+
+    friend Lanes operator+(Lanes a, Lanes b) { return Map([&](unsigned i) { return a.v[i] + b.v[i]; }); }
+    friend Lanes operator-(Lanes a, Lanes b) { return Map([&](unsigned i) { return a.v[i] - b.v[i]; }); }
+    friend Lanes operator*(Lanes a, Lanes b) { return Map([&](unsigned i) { return a.v[i] * b.v[i]; }); }
+    friend Lanes operator/(Lanes a, Lanes b) { return Map([&](unsigned i) { return a.v[i] / b.v[i]; }); }
+    friend Lanes operator-(Lanes a) { return Map([&](unsigned i) { return -a.v[i]; }); }
+    friend Lanes Min(Lanes a, Lanes b) { return Map([&](unsigned i) { return a.v[i] < b.v[i] ? a.v[i] : b.v[i]; }); }
+    friend Lanes Max(Lanes a, Lanes b) { return Map([&](unsigned i) { return a.v[i] > b.v[i] ? a.v[i] : b.v[i]; }); }
+    friend Lanes Abs(Lanes a) { return Map([&](unsigned i) { return std::fabs(a.v[i]); }); }
+    friend Lanes Sqrt(Lanes a) { return Map([&](unsigned i) { return std::sqrt(a.v[i]); }); }
+    friend Lanes Floor(Lanes a) { return Map([&](unsigned i) { return std::floor(a.v[i]); }); }
+    friend Lanes SelectZero(Lanes a, Lanes zero_value, Lanes other) {
+        return Map([&](unsigned i) { return a.v[i] == 0.0f ? zero_value.v[i] : other.v[i]; });
+    }
+#endif
+};
+
+static inline Lanes Clamp(Lanes a, float lo, float hi) {
+    return Min(Max(a, lo), hi);
+}
+
+// Convert a color channel of a quad, scaling each value
+static inline Lanes ChannelToFloat(const uint8_t* channel, float scale) {
+    float f[4];
+    for (unsigned i = 0; i < 4; i++)
+        f[i] = channel[i] * scale;
+    return Lanes::Load(f);
+}
+
+// Saturate to [0, 1] and convert back to an 8-bit channel
+static inline void FloatToChannel(Lanes value, uint8_t* channel) {
+    float f[4];
+    (Clamp(value, 0.0f, 1.0f) * Lanes(255.0f)).Store(f);
+    for (unsigned i = 0; i < 4; i++)
+        channel[i] = static_cast<uint8_t>(f[i]);
+}
@@ -0,0 +1,337 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Fragment lighting unit
+#include "cos.h"
+#include "isa.h"
+#include "fragment.h"
+
+namespace Lighting {
+    constexpr unsigned NUM_LIGHTS = 8;
+    constexpr unsigned NUM_LUTS = 24;
+    constexpr unsigned LUT_SIZE = 256;
+
+    // First register of the block, GPUREG_LIGHT0_SPECULAR0
+    constexpr unsigned REGISTER_BASE = 0x140;
+
+    enum class Sampler : uint32_t {
+        Distribution0 = 0,
+        Distribution1 = 1,
+        Fresnel = 3,
+        ReflectBlue = 4,
+        ReflectGreen = 5,
+        ReflectRed = 6,
+        SpotlightAttenuation = 8,
+        DistanceAttenuation = 16
+    };
+
+    enum class LutInput : uint32_t {
+        NH = 0, // Cosine of the angle between the normal and half-angle vectors
+        VH = 1, // Cosine of the angle between the view and half-angle vectors
+        NV = 2, // Cosine of the angle between the normal and the view vector
+        LN = 3, // Cosine of the angle between the light and the normal vectors
+        SP = 4, // Cosine of the angle between the light and the inverse spotlight vectors
+        CP = 5  // Cosine of the angle between the tangent and projection of half-angle vectors
+    };
+
+    enum class Scale : uint32_t {
+        x1 = 0,
+        x2 = 1,
+        x4 = 2,
+        x8 = 3,
+        x1_4 = 6,
+        x1_2 = 7
+    };
+
+    enum class BumpMode : uint32_t {
+        None = 0,
+        NormalMap = 1,
+        TangentMap = 2
+    };
+
+    // Which alpha channel the Fresnel factor is written to
+    enum class FresnelSelector : uint32_t {
+        None = 0,
+        PrimaryAlpha = 1,
+        SecondaryAlpha = 2,
+        Both = 3
+    };
+
+    // LUT availability, see IsSamplerSupported()
+    enum class LightingConfig : uint32_t {
+        Config0 = 0,
+        Config1 = 1,
+        Config2 = 2,
+        Config3 = 3,
+        Config4 = 4,
+        Config5 = 5,
+        Config6 = 6,
+        Config7 = 7
+    };
+
+    union LightColor {
+        uint32_t hex;
+        isa::BitField<0, 10, uint32_t> b;
+        isa::BitField<10, 10, uint32_t> g;
+        isa::BitField<20, 10, uint32_t> r;
+    };
+
+    // GPUREG_LIGHTi_*, 0x10 words per light
+    struct LightSource {
+        LightColor specular_0;
+        LightColor specular_1;
+        LightColor diffuse;
+        LightColor ambient;
+
+        // Encoded as 16-bit floating point
+        union {
+            uint32_t xy;
+            isa::BitField<0, 16, uint32_t> x;
+            isa::BitField<16, 16, uint32_t> y;
+        };
+        union {
+            uint32_t z_raw;
+            isa::BitField<0, 16, uint32_t> z;
+        };
+
+        // Inverse spotlight direction vector, encoded as fixed1.1.11
+        union {
+            uint32_t spot_xy;
+            isa::BitField<0, 13, int32_t> spot_x;
+            isa::BitField<16, 13, int32_t> spot_y;
+        };
+        union {
+            uint32_t spot_z_raw;
+            isa::BitField<0, 13, int32_t> spot_z;
+        };
+
+        INSERT_PADDING_WORDS(1);
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 1, uint32_t> directional;
+            // When disabled, clamp dot-product to 0
+            isa::BitField<1, 1, uint32_t> two_sided_diffuse;
+            isa::BitField<2, 1, uint32_t> geometric_factor_0;
+            isa::BitField<3, 1, uint32_t> geometric_factor_1;
+        } config;
+
+        // float20 values
+        uint32_t dist_atten_bias;
+        uint32_t dist_atten_scale;
+
+        INSERT_PADDING_WORDS(4);
+    };
+
+    static_assert(sizeof(LightSource) == 0x10 * sizeof(uint32_t),
+            "LightSource has invalid size");
+
+    // GPUREG_LIGHT0_SPECULAR0 - GPUREG_LIGHTING_LIGHT_PERMUTATION
+    struct Registers {
+        LightSource light[NUM_LIGHTS];
+
+        // Emission + (material.ambient * lighting.ambient)
+        LightColor global_ambient;
+
+        INSERT_PADDING_WORDS(1);
+
+        // Number of enabled lights - 1
+        uint32_t max_light_index;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 1, uint32_t> enable_shadow;
+            isa::BitField<2, 2, FresnelSelector> fresnel_selector;
+            isa::BitField<4, 4, LightingConfig> config;
+            isa::BitField<16, 1, uint32_t> shadow_primary;
+            isa::BitField<17, 1, uint32_t> shadow_secondary;
+            isa::BitField<18, 1, uint32_t> shadow_invert;
+            isa::BitField<19, 1, uint32_t> shadow_alpha;
+            // 0: Texture 0, 1: Texture 1, 2: Texture 2
+            isa::BitField<22, 2, uint32_t> bump_selector;
+            isa::BitField<24, 2, uint32_t> shadow_selector;
+            isa::BitField<27, 1, uint32_t> clamp_highlights;
+            isa::BitField<28, 2, BumpMode> bump_mode;
+            isa::BitField<30, 1, uint32_t> disable_bump_renorm;
+        } config0;
+
+        union {
+            uint32_t hex;
+            // One bit per light each
+            isa::BitField<0, 8, uint32_t> disable_shadow;
+            isa::BitField<8, 8, uint32_t> disable_spot_atten;
+            isa::BitField<16, 1, uint32_t> disable_lut_d0;
+            isa::BitField<17, 1, uint32_t> disable_lut_d1;
+            isa::BitField<19, 1, uint32_t> disable_lut_fr;
+            isa::BitField<20, 1, uint32_t> disable_lut_rr;
+            isa::BitField<21, 1, uint32_t> disable_lut_rg;
+            isa::BitField<22, 1, uint32_t> disable_lut_rb;
+            isa::BitField<24, 8, uint32_t> disable_dist_atten;
+        } config1;
+
+        union {
+            uint32_t hex;
+            // Index at which to set data in the LUT
+            isa::BitField<0, 8, uint32_t> index;
+            // Type of LUT for which to set data
+            isa::BitField<8, 5, uint32_t> type;
+        } lut_config;
+
+        uint32_t disable;
+
+        INSERT_PADDING_WORDS(1);
+
+        // All eight data registers write to the LUT selected by lut_config
+        uint32_t lut_data[8];
+
+        // When abs mode is disabled, LUT indexes are in the range of
+        // (-1.0, 1.0). Otherwise, they are in the range of (0.0, 1.0).
+        union {
+            uint32_t hex;
+            isa::BitField<1, 1, uint32_t> disable_d0;
+            isa::BitField<5, 1, uint32_t> disable_d1;
+            isa::BitField<9, 1, uint32_t> disable_sp;
+            isa::BitField<13, 1, uint32_t> disable_fr;
+            isa::BitField<17, 1, uint32_t> disable_rb;
+            isa::BitField<21, 1, uint32_t> disable_rg;
+            isa::BitField<25, 1, uint32_t> disable_rr;
+        } abs_lut_input;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, LutInput> d0;
+            isa::BitField<4, 3, LutInput> d1;
+            isa::BitField<8, 3, LutInput> sp;
+            isa::BitField<12, 3, LutInput> fr;
+            isa::BitField<16, 3, LutInput> rb;
+            isa::BitField<20, 3, LutInput> rg;
+            isa::BitField<24, 3, LutInput> rr;
+        } lut_input;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, Scale> d0;
+            isa::BitField<4, 3, Scale> d1;
+            isa::BitField<8, 3, Scale> sp;
+            isa::BitField<12, 3, Scale> fr;
+            isa::BitField<16, 3, Scale> rb;
+            isa::BitField<20, 3, Scale> rg;
+            isa::BitField<24, 3, Scale> rr;
+        } lut_scale;
+
+        INSERT_PADDING_WORDS(6);
+
+        // For N enabled lights, the first N slots hold the light used
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, uint32_t> slot_0;
+            isa::BitField<4, 3, uint32_t> slot_1;
+            isa::BitField<8, 3, uint32_t> slot_2;
+            isa::BitField<12, 3, uint32_t> slot_3;
+            isa::BitField<16, 3, uint32_t> slot_4;
+            isa::BitField<20, 3, uint32_t> slot_5;
+            isa::BitField<24, 3, uint32_t> slot_6;
+            isa::BitField<28, 3, uint32_t> slot_7;
+        } light_enable;
+    };
+
+    static_assert(sizeof(Registers) == (0x1d9 - REGISTER_BASE + 1) * sizeof(uint32_t),
+            "Lighting Registers has invalid size");
+
+    class LightingUnit {
+    public:
+        LightingUnit();
+
+        /**
+        * Write a register of the lighting block. Writes to the LUT data
+        * registers are unpacked to float and advance the LUT index.
+        * @param index Register index relative to REGISTER_BASE
+        */
+        void WriteRegister(unsigned index, uint32_t value);
+
+        const Registers& GetRegisters() const {
+            return regs;
+        }
+
+        // GPUREG_LIGHTING_ENABLE1 clears this bit to enable lighting
+        bool IsEnabled() const {
+            return !(regs.disable & 1);
+        }
+
+        /**
+        * Compute the primary and secondary fragment colors of a quad.
+        * @param quat,view Interpolated quaternion and view vector per lane
+        * @param texture_color Texture unit outputs, for shadows and bump maps
+        * @param primary,secondary Diffuse and specular colors
+        */
+        void Compute(const float (&quat)[4][QUAD_SIZE],
+                const float (&view)[3][QUAD_SIZE],
+                const ColorQuad (&texture_color)[4],
+                ColorQuad& primary, ColorQuad& secondary) const;
+
+    private:
+        // Entries are unpacked from 12-bit fixed point on write
+        struct LUT {
+            float value[LUT_SIZE];
+            float diff[LUT_SIZE];
+        };
+
+        // Per light values derived from the registers
+        struct LightSetup {
+            float specular_0[3];
+            float specular_1[3];
+            float diffuse[3];
+            float ambient[3];
+            float position[3];
+            float spot_direction[3];
+            float dist_atten_scale;
+            float dist_atten_bias;
+            unsigned num;
+            bool directional;
+            bool two_sided_diffuse;
+            bool geometric_factor_0;
+            bool geometric_factor_1;
+            bool dist_atten;
+            bool spot_atten;
+            bool shadow;
+        };
+
+        // Evaluation of one LUT, resolved once per register change
+        struct LUTSetup {
+            bool enable;
+            bool abs;
+            LutInput input;
+            float scale;
+            Sampler sampler;
+        };
+
+        static bool IsSamplerSupported(LightingConfig config, Sampler sampler);
+
+        void UpdateSetup();
+
+        Registers regs;
+        LUT luts[NUM_LUTS];
+
+        LightSetup lights[NUM_LIGHTS];
+        unsigned num_lights;
+        LUTSetup d0, d1, fr, rr, rg, rb, sp;
+        float global_ambient[3];
+    };
+}
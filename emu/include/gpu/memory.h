@@ -0,0 +1,75 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Emulated physical memory
+#include "cos.h"
+
+namespace Memory {
+    // Physical address map, as seen by the GPU
+    constexpr uint32_t VRAM_PADDR = 0x18000000;
+    constexpr uint32_t VRAM_SIZE = 0x00600000;
+    constexpr uint32_t FCRAM_PADDR = 0x20000000;
+    constexpr uint32_t FCRAM_SIZE = 0x08000000;
+
+    // Granularity of write tracking
+    constexpr unsigned PAGE_SHIFT = 12;
+    constexpr uint32_t PAGE_SIZE = 1u << PAGE_SHIFT;
+
+    /**
+    * Map the regions to host memory. Called on first access with the
+    * defaults if not called before.
+    * @param huge_pages Back the regions with reserved huge pages, falls back
+    * to normal (transparent huge) pages if none are available
+    * @return False if memory was already mapped or mapping failed
+    */
+    bool Init(bool huge_pages = false);
+
+    /**
+    * Translate a physical address to a host pointer.
+    * @param address Physical address
+    * @return Host pointer, or nullptr if the address is not mapped
+    */
+    uint8_t* GetPhysicalPointer(uint32_t address);
+
+    /**
+    * Check whether a whole physical address range is backed by one region,
+    * so that it can be accessed through a single host pointer.
+    * @param size Size in 64 bits, computed sizes may exceed 32 bits
+    */
+    bool IsValidRange(uint32_t address, uint64_t size);
+
+    // Receives written ranges, consecutive pages are merged
+    using WriteCallback = void (*)(uint32_t address, uint32_t size);
+
+    /**
+    * Set the function FlushWrites() reports written pages to. Writes are
+    * only tracked while a callback is set.
+    */
+    void SetWriteCallback(WriteCallback callback);
+
+    /**
+    * Record a write by the GPU, e.g. rendering or a memory fill, to
+    * memory other units may have cached.
+    * @param address,size Physical range written
+    */
+    void MarkWritten(uint32_t address, uint32_t size);
+
+    // Report the pages written since the last call, e.g. before a draw
+    void FlushWrites();
+}
@@ -0,0 +1,180 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2017  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Procedural texture unit (texture unit 3)
+#include "cos.h"
+#include "isa.h"
+#include "texturing.h"
+
+namespace Texturing {
+    enum class ProcTexClamp : uint32_t {
+        ToZero = 0,
+        ToEdge = 1,
+        SymmetricalRepeat = 2,
+        MirroredRepeat = 3,
+        Pulse = 4
+    };
+
+    enum class ProcTexCombiner : uint32_t {
+        U = 0,        // u
+        U2 = 1,       // u * u
+        V = 2,        // v
+        V2 = 3,       // v * v
+        Add = 4,      // (u + v) / 2
+        Add2 = 5,     // (u * u + v * v) / 2
+        SqrtAdd2 = 6, // sqrt(u * u + v * v)
+        Min = 7,      // min(u, v)
+        Max = 8,      // max(u, v)
+        RMax = 9      // Average of Add and SqrtAdd2
+    };
+
+    enum class ProcTexShift : uint32_t {
+        None = 0,
+        Odd = 1,
+        Even = 2
+    };
+
+    enum class ProcTexFilter : uint32_t {
+        Nearest = 0,
+        Linear = 1,
+        NearestMipmapNearest = 2,
+        LinearMipmapNearest = 3,
+        NearestMipmapLinear = 4,
+        LinearMipmapLinear = 5
+    };
+
+    // Table selector written to bits 8-11 of GPUREG_PROCTEX_LUT
+    enum class ProcTexLUT : uint32_t {
+        Noise = 0,
+        RGBMap = 2,
+        AlphaMap = 3,
+        Color = 4,
+        ColorDiff = 5
+    };
+
+    // GPUREG_TEXUNIT3_PROCTEX0 - GPUREG_TEXUNIT3_PROCTEX5
+    struct ProcTexConfig {
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, ProcTexClamp> u_clamp;
+            isa::BitField<3, 3, ProcTexClamp> v_clamp;
+            isa::BitField<6, 4, ProcTexCombiner> color_combiner;
+            isa::BitField<10, 4, ProcTexCombiner> alpha_combiner;
+            isa::BitField<14, 1, uint32_t> separate_alpha;
+            isa::BitField<15, 1, uint32_t> noise_enable;
+            isa::BitField<16, 2, ProcTexShift> u_shift;
+            isa::BitField<18, 2, ProcTexShift> v_shift;
+        } main;
+
+        // Amplitude is a signed 4.12 value, phase a float16
+        union {
+            uint32_t hex;
+            isa::BitField<0, 16, int32_t> amplitude;
+            isa::BitField<16, 16, uint32_t> phase;
+        } noise_u, noise_v;
+
+        // float16 values
+        union {
+            uint32_t hex;
+            isa::BitField<0, 16, uint32_t> u;
+            isa::BitField<16, 16, uint32_t> v;
+        } noise_frequency;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 3, ProcTexFilter> filter;
+            isa::BitField<11, 8, uint32_t> width;
+        } lut;
+
+        union {
+            uint32_t hex;
+            isa::BitField<0, 8, uint32_t> offset;
+        } lut_offset;
+    };
+
+    static_assert(sizeof(ProcTexConfig) == 6 * sizeof(uint32_t),
+            "ProcTexConfig has invalid size");
+
+    class ProcTexUnit {
+    public:
+        ProcTexUnit();
+
+        /**
+        * Write one of GPUREG_TEXUNIT3_PROCTEX0-5, GPUREG_PROCTEX_LUT or
+        * GPUREG_PROCTEX_LUT_DATA0-7.
+        * @param id Register number
+        */
+        void WriteRegister(unsigned id, uint32_t value);
+
+        // Write one of GPUREG_TEXUNIT3_PROCTEX0-5
+        void WriteConfig(unsigned index, uint32_t value);
+
+        // GPUREG_PROCTEX_LUT selects the table and the start index
+        void SetLUTIndex(uint32_t value);
+
+        // GPUREG_PROCTEX_LUT_DATA0-7, writes auto-increment the index
+        void WriteLUTData(uint32_t value);
+
+        /**
+        * Evaluate the procedural texture for N fragments.
+        * @param s,t Arrays of N texture coordinates
+        * @param out Generated colors
+        */
+        template <unsigned N>
+        void Lookup(const float* s, const float* t, TexelBatch<N>& out) const;
+
+    private:
+        static constexpr unsigned MAP_LUT_SIZE = 128;
+        static constexpr unsigned COLOR_LUT_SIZE = 256;
+
+        // Noise, RGB map and alpha map tables, unpacked to float on write
+        struct MapLUT {
+            float value[MAP_LUT_SIZE];
+            float diff[MAP_LUT_SIZE];
+        };
+
+        template <unsigned N>
+        static void LookupMap(const MapLUT& lut, const float* coord, float* result);
+
+        template <unsigned N>
+        static void CombineAndMap(ProcTexCombiner combiner, const MapLUT& lut,
+                const float* u, const float* v, float* result);
+
+        template <unsigned N>
+        void Noise(const float* u, const float* v, float* result) const;
+
+        ProcTexConfig config;
+
+        // Values derived from config, updated on register write
+        float noise_frequency_u, noise_frequency_v;
+        float noise_phase_u, noise_phase_v;
+        float noise_amplitude_u, noise_amplitude_v;
+
+        ProcTexLUT lut_table;
+        unsigned lut_index;
+
+        MapLUT noise_lut;
+        MapLUT rgb_map_lut;
+        MapLUT alpha_map_lut;
+        // RGBA, in 0-255 range
+        float color_lut[COLOR_LUT_SIZE][4];
+        float color_diff_lut[COLOR_LUT_SIZE][4];
+    };
+}
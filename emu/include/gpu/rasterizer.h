@@ -18,9 +18,21 @@
  */
 #pragma once
 // Rasterizer Interface
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "main.h"
-#include "frontend.h"
 #include "shader.h"
+#include "texturing.h"
+#include "proctex.h"
+#include "texenv.h"
+#include "fog.h"
+#include "lighting.h"
+#include "framebuffer.h"
+#include "earlydepth.h"
+#include "fragment.h"
 #include "fixed.h"
 
 // The rasterizer accepts output vertex from either VS or GS, rasterize the 
@@ -37,12 +49,12 @@ struct RasterizerVertex : Shader::OutputVertex {
     void Lerp(float24 factor, const RasterizerVertex& vtx) {
         pos = pos * factor + vtx.pos * (float24::FromFloat32(1) - factor);
         color = color * factor + vtx.color * (float24::FromFloat32(1) - factor);
-        /*quat = quat * factor + vtx.quat * (float24::FromFloat32(1) - factor);
+        quat = quat * factor + vtx.quat * (float24::FromFloat32(1) - factor);
         tc0 = tc0 * factor + vtx.tc0 * (float24::FromFloat32(1) - factor);
         tc1 = tc1 * factor + vtx.tc1 * (float24::FromFloat32(1) - factor);
         tc0_w = tc0_w * factor + vtx.tc0_w * (float24::FromFloat32(1) - factor);
         view = view * factor + vtx.view * (float24::FromFloat32(1) - factor);
-        tc2 = tc2 * factor + vtx.tc2 * (float24::FromFloat32(1) - factor);*/
+        tc2 = tc2 * factor + vtx.tc2 * (float24::FromFloat32(1) - factor);
     }
 
     // Linear interpolation
@@ -73,20 +85,158 @@ public:
 // Software based rasterizer
 class Rasterizer : public RasterizerInterface {
 public:
-    Rasterizer() : frontend(singleton<Frontend>()) {}
+    // Work done since the last ResetStats()
+    struct Stats {
+        uint64_t triangles = 0; // After clipping
+        uint64_t fragments = 0; // Covered and shaded
+    };
+
+    Rasterizer();
+    ~Rasterizer();
+
     void AddTriangle(
             const Shader::OutputVertex& v0,
             const Shader::OutputVertex& v1,
             const Shader::OutputVertex& v2) override;
-    // Well, actually there is no queue. For a hardware rasterizer one would
-    // need one, though.
-    // But this emulator would probably never get a hardware rasterizer...
-    void DrawTriangles() override {}
+
+    /**
+    * Rasterize the queued triangles. The screen is split into bins of
+    * BIN_SIZE pixels, each rasterized by one thread in submission order.
+    * Has to be called before the state set below changes.
+    */
+    void DrawTriangles() override;
+
+    /**
+    * Set the number of threads rasterizing a draw, including the calling
+    * thread. Defaults to the number of cores, at most 4. With a single
+    * thread, triangles are rasterized as they are added.
+    */
+    void SetThreads(unsigned threads);
+
+    // Texture units 0-2, textures are read from emulated memory
+    void SetTextureUnit(unsigned index, const Texturing::TextureUnit& unit) {
+        texture_units[index] = unit;
+    }
+
+    // Texture combiner setup, compiled into a program on first use
+    void SetTexEnv(const TexEnv::Config& config) {
+        texenv = &TexEnv::GetProgram(config);
+    }
+
+    // Fog and gas LUTs, applied when selected by the combiner config
+    void SetFog(const TexEnv::FogUnit* unit) {
+        fog = unit;
+    }
+
+    // Procedural texture unit, texture unit 3
+    void SetProcTex(const Texturing::ProcTexUnit* unit) {
+        proctex = unit;
+    }
+
+    // GPUREG_TEXUNIT_CONFIG setup of texture unit 3
+    void SetProcTexCoordinates(bool enabled, unsigned coordinates) {
+        proctex_enabled = enabled;
+        proctex_coordinates = coordinates;
+    }
+
+    // Fragment lighting, evaluated when enabled in the unit's registers
+    void SetLighting(const Lighting::LightingUnit* unit) {
+        lighting = unit;
+    }
+
+    // Per-fragment operations and the render target
+    void SetOutputMerger(Framebuffer::OutputMerger* merger) {
+        output_merger = merger;
+    }
+
+    // Coarse depth test ahead of interpolation, used when enabled
+    void SetEarlyDepth(Framebuffer::EarlyDepthUnit* unit) {
+        early_depth = unit;
+    }
+
+    // Size in pixels of the area clip space is mapped to, usually the
+    // whole render target. Supersampled targets simply use a larger one.
+    void SetViewport(unsigned width, unsigned height) {
+        viewport_halfsize_x = float24::FromFloat32(width / 2.0f);
+        viewport_halfsize_y = float24::FromFloat32(height / 2.0f);
+    }
+
+    const Stats& GetStats() const {
+        return stats;
+    }
+
+    void ResetStats() {
+        stats = Stats();
+    }
+
+    // GPUREG_DEPTHMAP_SCALE/OFFSET, depth = z / w * scale + offset
+    void SetDepthMap(float scale, float offset) {
+        depth_scale = scale;
+        depth_offset = offset;
+    }
     
 private:
-    Frontend &frontend;
+    Texturing::TextureUnit texture_units[3]{};
+    const TexEnv::Program* texenv = nullptr;
+    const Lighting::LightingUnit* lighting = nullptr;
+    const Texturing::ProcTexUnit* proctex = nullptr;
+    bool proctex_enabled = false;
+    unsigned proctex_coordinates = 0;
+    const TexEnv::FogUnit* fog = nullptr;
+    Framebuffer::OutputMerger* output_merger = nullptr;
+    Framebuffer::EarlyDepthUnit* early_depth = nullptr;
+    float24 viewport_halfsize_x = float24::FromFloat32(200.0f);
+    float24 viewport_halfsize_y = float24::FromFloat32(120.0f);
+    // Default of citro3d, near plane at 1 and far plane at 0
+    float depth_scale = -1.0f;
+    float depth_offset = 0.0f;
+    Stats stats;
+
+    // Bins are aligned to the 8x8 tiles of the framebuffer and the early
+    // depth buffer, so no two threads write to the same tile
+    static constexpr unsigned BIN_SIZE = 32;
+    // Smaller draws are not worth waking the workers for, in pixels of
+    // bounding box
+    static constexpr unsigned MIN_PARALLEL_AREA = 64 * 64;
+
+    // Pixels [x0, x1) * [y0, y1) of the screen
+    struct Area {
+        unsigned x0, y0, x1, y1;
+    };
+
+    // Triangles of the current draw, three vertices each, and the bounding
+    // box of each
+    std::vector<RasterizerVertex> queue;
+    std::vector<Area> queue_bounds;
+    // Indices of the triangles touching each bin
+    std::vector<std::vector<uint32_t>> bins;
+    unsigned bins_per_row = 0;
+    std::atomic<unsigned> next_bin{0};
+    std::atomic<uint64_t> bin_fragments{0};
+
+    std::vector<std::thread> workers;
+    std::mutex worker_mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    uint64_t work_generation = 0;
+    unsigned workers_busy = 0;
+    bool workers_exit = false;
+
+    // Fill quad.texture_color[index] from a texture unit
+    void SampleTexture(unsigned index, FragmentQuad& quad) const;
+    Area GetBounds(const RasterizerVertex& v0, const RasterizerVertex& v1,
+            const RasterizerVertex& v2) const;
     void ProcessTriangle(
             const RasterizerVertex& v0,
             const RasterizerVertex& v1,
-            const RasterizerVertex& v2);
+            const RasterizerVertex& v2,
+            const Area& area,
+            uint64_t& fragments);
+    // Match the early depth buffer to the render target
+    void ResizeEarlyDepth();
+    // Run by every thread, takes bins until none are left
+    void RasterizeBins();
+    // Pool thread, runs the draws started after the given generation
+    void WorkerLoop(uint64_t generation);
+    void StopWorkers();
 };
\ No newline at end of file
@@ -0,0 +1,211 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// PICA register numbers, named as in libctru's gpu_regs.h
+#include "cos.h"
+
+// Size of the register file, registers are 32 bits wide
+constexpr unsigned NUM_REGS = 0x300;
+
+// Miscellaneous
+constexpr unsigned GPUREG_FINALIZE = 0x010;
+
+// Rasterizer
+constexpr unsigned GPUREG_FACECULLING_CONFIG = 0x040;
+constexpr unsigned GPUREG_VIEWPORT_WIDTH = 0x041;
+constexpr unsigned GPUREG_VIEWPORT_INVW = 0x042;
+constexpr unsigned GPUREG_VIEWPORT_HEIGHT = 0x043;
+constexpr unsigned GPUREG_VIEWPORT_INVH = 0x044;
+constexpr unsigned GPUREG_FRAGOP_CLIP = 0x047;
+constexpr unsigned GPUREG_FRAGOP_CLIP_DATA0 = 0x048;
+constexpr unsigned GPUREG_FRAGOP_CLIP_DATA3 = 0x04b;
+constexpr unsigned GPUREG_DEPTHMAP_SCALE = 0x04d;
+constexpr unsigned GPUREG_DEPTHMAP_OFFSET = 0x04e;
+constexpr unsigned GPUREG_SH_OUTMAP_TOTAL = 0x04f;
+constexpr unsigned GPUREG_SH_OUTMAP_O0 = 0x050;
+constexpr unsigned GPUREG_SH_OUTMAP_O6 = 0x056;
+constexpr unsigned GPUREG_EARLYDEPTH_FUNC = 0x061;
+constexpr unsigned GPUREG_EARLYDEPTH_TEST1 = 0x062;
+constexpr unsigned GPUREG_EARLYDEPTH_CLEAR = 0x063;
+constexpr unsigned GPUREG_SH_OUTATTR_MODE = 0x064;
+constexpr unsigned GPUREG_SCISSORTEST_MODE = 0x065;
+constexpr unsigned GPUREG_SCISSORTEST_POS = 0x066;
+constexpr unsigned GPUREG_SCISSORTEST_DIM = 0x067;
+constexpr unsigned GPUREG_VIEWPORT_XY = 0x068;
+constexpr unsigned GPUREG_EARLYDEPTH_DATA = 0x06a;
+constexpr unsigned GPUREG_DEPTHMAP_ENABLE = 0x06d;
+constexpr unsigned GPUREG_RENDERBUF_DIM = 0x06e;
+constexpr unsigned GPUREG_SH_OUTATTR_CLOCK = 0x06f;
+
+// Texturing
+constexpr unsigned GPUREG_TEXUNIT_CONFIG = 0x080;
+constexpr unsigned GPUREG_TEXUNIT0_BORDER_COLOR = 0x081;
+constexpr unsigned GPUREG_TEXUNIT0_DIM = 0x082;
+constexpr unsigned GPUREG_TEXUNIT0_PARAM = 0x083;
+constexpr unsigned GPUREG_TEXUNIT0_LOD = 0x084;
+constexpr unsigned GPUREG_TEXUNIT0_ADDR1 = 0x085;
+constexpr unsigned GPUREG_TEXUNIT0_ADDR6 = 0x08a;
+constexpr unsigned GPUREG_TEXUNIT0_SHADOW = 0x08b;
+constexpr unsigned GPUREG_TEXUNIT0_TYPE = 0x08e;
+constexpr unsigned GPUREG_LIGHTING_ENABLE0 = 0x08f;
+constexpr unsigned GPUREG_TEXUNIT1_BORDER_COLOR = 0x091;
+constexpr unsigned GPUREG_TEXUNIT1_DIM = 0x092;
+constexpr unsigned GPUREG_TEXUNIT1_PARAM = 0x093;
+constexpr unsigned GPUREG_TEXUNIT1_LOD = 0x094;
+constexpr unsigned GPUREG_TEXUNIT1_ADDR = 0x095;
+constexpr unsigned GPUREG_TEXUNIT1_TYPE = 0x096;
+constexpr unsigned GPUREG_TEXUNIT2_BORDER_COLOR = 0x099;
+constexpr unsigned GPUREG_TEXUNIT2_DIM = 0x09a;
+constexpr unsigned GPUREG_TEXUNIT2_PARAM = 0x09b;
+constexpr unsigned GPUREG_TEXUNIT2_LOD = 0x09c;
+constexpr unsigned GPUREG_TEXUNIT2_ADDR = 0x09d;
+constexpr unsigned GPUREG_TEXUNIT2_TYPE = 0x09e;
+constexpr unsigned GPUREG_TEXUNIT3_PROCTEX0 = 0x0a8;
+constexpr unsigned GPUREG_TEXUNIT3_PROCTEX5 = 0x0ad;
+constexpr unsigned GPUREG_PROCTEX_LUT = 0x0af;
+constexpr unsigned GPUREG_PROCTEX_LUT_DATA0 = 0x0b0;
+constexpr unsigned GPUREG_PROCTEX_LUT_DATA7 = 0x0b7;
+
+// Texture combiners, each stage has SOURCE, OPERAND, COMBINER, COLOR and
+// SCALE registers in that order
+constexpr unsigned GPUREG_TEXENV0_SOURCE = 0x0c0;
+constexpr unsigned GPUREG_TEXENV1_SOURCE = 0x0c8;
+constexpr unsigned GPUREG_TEXENV2_SOURCE = 0x0d0;
+constexpr unsigned GPUREG_TEXENV3_SOURCE = 0x0d8;
+constexpr unsigned GPUREG_TEXENV_UPDATE_BUFFER = 0x0e0;
+constexpr unsigned GPUREG_FOG_COLOR = 0x0e1;
+constexpr unsigned GPUREG_GAS_ATTENUATION = 0x0e4;
+constexpr unsigned GPUREG_GAS_ACCMAX = 0x0e5;
+constexpr unsigned GPUREG_FOG_LUT_INDEX = 0x0e6;
+constexpr unsigned GPUREG_FOG_LUT_DATA0 = 0x0e8;
+constexpr unsigned GPUREG_FOG_LUT_DATA7 = 0x0ef;
+constexpr unsigned GPUREG_TEXENV4_SOURCE = 0x0f0;
+constexpr unsigned GPUREG_TEXENV5_SOURCE = 0x0f8;
+constexpr unsigned GPUREG_TEXENV_BUFFER_COLOR = 0x0fd;
+
+// First register of a combiner stage
+constexpr unsigned GetTexEnvRegister(unsigned stage) {
+    return (stage < 4) ? GPUREG_TEXENV0_SOURCE + stage * 8 :
+            GPUREG_TEXENV4_SOURCE + (stage - 4) * 8;
+}
+
+// Framebuffer
+constexpr unsigned GPUREG_COLOR_OPERATION = 0x100;
+constexpr unsigned GPUREG_BLEND_FUNC = 0x101;
+constexpr unsigned GPUREG_LOGIC_OP = 0x102;
+constexpr unsigned GPUREG_BLEND_COLOR = 0x103;
+constexpr unsigned GPUREG_FRAGOP_ALPHA_TEST = 0x104;
+constexpr unsigned GPUREG_STENCIL_TEST = 0x105;
+constexpr unsigned GPUREG_STENCIL_OP = 0x106;
+constexpr unsigned GPUREG_DEPTH_COLOR_MASK = 0x107;
+constexpr unsigned GPUREG_FRAMEBUFFER_INVALIDATE = 0x110;
+constexpr unsigned GPUREG_FRAMEBUFFER_FLUSH = 0x111;
+constexpr unsigned GPUREG_COLORBUFFER_READ = 0x112;
+constexpr unsigned GPUREG_COLORBUFFER_WRITE = 0x113;
+constexpr unsigned GPUREG_DEPTHBUFFER_READ = 0x114;
+constexpr unsigned GPUREG_DEPTHBUFFER_WRITE = 0x115;
+constexpr unsigned GPUREG_DEPTHBUFFER_FORMAT = 0x116;
+constexpr unsigned GPUREG_COLORBUFFER_FORMAT = 0x117;
+constexpr unsigned GPUREG_EARLYDEPTH_TEST2 = 0x118;
+constexpr unsigned GPUREG_FRAMEBUFFER_BLOCK32 = 0x11b;
+constexpr unsigned GPUREG_DEPTHBUFFER_LOC = 0x11c;
+constexpr unsigned GPUREG_COLORBUFFER_LOC = 0x11d;
+constexpr unsigned GPUREG_FRAMEBUFFER_DIM = 0x11e;
+constexpr unsigned GPUREG_GAS_LIGHT_XY = 0x120;
+constexpr unsigned GPUREG_GAS_LIGHT_Z = 0x121;
+constexpr unsigned GPUREG_GAS_LIGHT_Z_COLOR = 0x122;
+constexpr unsigned GPUREG_GAS_LUT_INDEX = 0x123;
+constexpr unsigned GPUREG_GAS_LUT_DATA = 0x124;
+constexpr unsigned GPUREG_GAS_DELTAZ_DEPTH = 0x126;
+constexpr unsigned GPUREG_FRAGOP_SHADOW = 0x130;
+
+// Fragment lighting, 0x10 registers per light
+constexpr unsigned GPUREG_LIGHT0_SPECULAR0 = 0x140;
+constexpr unsigned GPUREG_LIGHTING_AMBIENT = 0x1c0;
+constexpr unsigned GPUREG_LIGHTING_NUM_LIGHTS = 0x1c2;
+constexpr unsigned GPUREG_LIGHTING_CONFIG0 = 0x1c3;
+constexpr unsigned GPUREG_LIGHTING_CONFIG1 = 0x1c4;
+constexpr unsigned GPUREG_LIGHTING_LUT_INDEX = 0x1c5;
+constexpr unsigned GPUREG_LIGHTING_ENABLE1 = 0x1c6;
+constexpr unsigned GPUREG_LIGHTING_LUT_DATA0 = 0x1c8;
+constexpr unsigned GPUREG_LIGHTING_LUT_DATA7 = 0x1cf;
+constexpr unsigned GPUREG_LIGHTING_LUTINPUT_ABS = 0x1d0;
+constexpr unsigned GPUREG_LIGHTING_LUTINPUT_SELECT = 0x1d1;
+constexpr unsigned GPUREG_LIGHTING_LUTINPUT_SCALE = 0x1d2;
+constexpr unsigned GPUREG_LIGHTING_LIGHT_PERMUTATION = 0x1d9;
+
+// Geometry pipeline
+constexpr unsigned GPUREG_ATTRIBBUFFERS_LOC = 0x200;
+constexpr unsigned GPUREG_ATTRIBBUFFERS_FORMAT_LOW = 0x201;
+constexpr unsigned GPUREG_ATTRIBBUFFERS_FORMAT_HIGH = 0x202;
+// OFFSET, CONFIG1 and CONFIG2 for each of the 12 buffers
+constexpr unsigned GPUREG_ATTRIBBUFFER0_OFFSET = 0x203;
+constexpr unsigned GPUREG_ATTRIBBUFFER0_CONFIG1 = 0x204;
+constexpr unsigned GPUREG_ATTRIBBUFFER0_CONFIG2 = 0x205;
+constexpr unsigned GPUREG_INDEXBUFFER_CONFIG = 0x227;
+constexpr unsigned GPUREG_NUMVERTICES = 0x228;
+constexpr unsigned GPUREG_GEOSTAGE_CONFIG = 0x229;
+constexpr unsigned GPUREG_VERTEX_OFFSET = 0x22a;
+constexpr unsigned GPUREG_POST_VERTEX_CACHE_NUM = 0x22d;
+constexpr unsigned GPUREG_DRAWARRAYS = 0x22e;
+constexpr unsigned GPUREG_DRAWELEMENTS = 0x22f;
+constexpr unsigned GPUREG_VTX_FUNC = 0x231;
+constexpr unsigned GPUREG_FIXEDATTRIB_INDEX = 0x232;
+constexpr unsigned GPUREG_FIXEDATTRIB_DATA0 = 0x233;
+constexpr unsigned GPUREG_FIXEDATTRIB_DATA2 = 0x235;
+constexpr unsigned GPUREG_CMDBUF_SIZE0 = 0x238;
+constexpr unsigned GPUREG_CMDBUF_SIZE1 = 0x239;
+constexpr unsigned GPUREG_CMDBUF_ADDR0 = 0x23a;
+constexpr unsigned GPUREG_CMDBUF_ADDR1 = 0x23b;
+constexpr unsigned GPUREG_CMDBUF_JUMP0 = 0x23c;
+constexpr unsigned GPUREG_CMDBUF_JUMP1 = 0x23d;
+constexpr unsigned GPUREG_VSH_NUM_ATTR = 0x242;
+constexpr unsigned GPUREG_VSH_COM_MODE = 0x244;
+constexpr unsigned GPUREG_START_DRAW_FUNC0 = 0x245;
+constexpr unsigned GPUREG_VSH_OUTMAP_TOTAL1 = 0x24a;
+constexpr unsigned GPUREG_VSH_OUTMAP_TOTAL2 = 0x251;
+constexpr unsigned GPUREG_GSH_MISC0 = 0x252;
+constexpr unsigned GPUREG_GEOSTAGE_CONFIG2 = 0x253;
+constexpr unsigned GPUREG_GSH_MISC1 = 0x254;
+constexpr unsigned GPUREG_PRIMITIVE_CONFIG = 0x25e;
+constexpr unsigned GPUREG_RESTART_PRIMITIVE = 0x25f;
+
+// Geometry shader
+constexpr unsigned GPUREG_GSH_BOOLUNIFORM = 0x280;
+constexpr unsigned GPUREG_GSH_OPDESCS_DATA7 = 0x2ad;
+
+// Vertex shader
+constexpr unsigned GPUREG_VSH_BOOLUNIFORM = 0x2b0;
+constexpr unsigned GPUREG_VSH_INTUNIFORM_I0 = 0x2b1;
+constexpr unsigned GPUREG_VSH_INTUNIFORM_I3 = 0x2b4;
+constexpr unsigned GPUREG_VSH_INPUTBUFFER_CONFIG = 0x2b9;
+constexpr unsigned GPUREG_VSH_ENTRYPOINT = 0x2ba;
+constexpr unsigned GPUREG_VSH_ATTRIBUTES_PERMUTATION_LOW = 0x2bb;
+constexpr unsigned GPUREG_VSH_ATTRIBUTES_PERMUTATION_HIGH = 0x2bc;
+constexpr unsigned GPUREG_VSH_OUTMAP_MASK = 0x2bd;
+constexpr unsigned GPUREG_VSH_CODETRANSFER_END = 0x2bf;
+constexpr unsigned GPUREG_VSH_FLOATUNIFORM_INDEX = 0x2c0;
+constexpr unsigned GPUREG_VSH_FLOATUNIFORM_DATA0 = 0x2c1;
+constexpr unsigned GPUREG_VSH_FLOATUNIFORM_DATA7 = 0x2c8;
+constexpr unsigned GPUREG_VSH_CODETRANSFER_INDEX = 0x2cb;
+constexpr unsigned GPUREG_VSH_CODETRANSFER_DATA0 = 0x2cc;
+constexpr unsigned GPUREG_VSH_CODETRANSFER_DATA7 = 0x2d3;
+constexpr unsigned GPUREG_VSH_OPDESCS_INDEX = 0x2d5;
+constexpr unsigned GPUREG_VSH_OPDESCS_DATA0 = 0x2d6;
+constexpr unsigned GPUREG_VSH_OPDESCS_DATA7 = 0x2dd;
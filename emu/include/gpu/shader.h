@@ -38,11 +38,51 @@ namespace Shader {
         Vec4<float24> attr[16];
     };
 
+    // Vertex attribute semantics, GPUREG_SH_OUTMAP_Oi selects one per
+    // output register component
+    enum class OutputSemantic : uint32_t {
+        POSITION_X = 0x00, POSITION_Y, POSITION_Z, POSITION_W,
+        QUATERNION_X = 0x04, QUATERNION_Y, QUATERNION_Z, QUATERNION_W,
+        COLOR_R = 0x08, COLOR_G, COLOR_B, COLOR_A,
+        TEXCOORD0_U = 0x0c, TEXCOORD0_V,
+        TEXCOORD1_U = 0x0e, TEXCOORD1_V,
+        TEXCOORD0_W = 0x10,
+        VIEW_X = 0x12, VIEW_Y, VIEW_Z,
+        TEXCOORD2_U = 0x16, TEXCOORD2_V,
+        INVALID = 0x1f
+    };
+
+    // GPUREG_SH_OUTMAP_O0 - GPUREG_SH_OUTMAP_O6
+    union OutputAttributes {
+        uint32_t hex;
+        isa::BitField<0, 5, OutputSemantic> map_x;
+        isa::BitField<8, 5, OutputSemantic> map_y;
+        isa::BitField<16, 5, OutputSemantic> map_z;
+        isa::BitField<24, 5, OutputSemantic> map_w;
+    };
+
+    struct OutputMap {
+        unsigned total; // GPUREG_SH_OUTMAP_TOTAL
+        OutputAttributes attributes[7];
+    };
+
     // TODO: Actually, when programmable FS is used, these shouldn't be predefined.
+    // Members are laid out in OutputSemantic order.
     struct OutputVertex {
         Vec4<float24> pos;
+        Vec4<float24> quat;
         Vec4<float24> color;
-        Vec4<float24> attr[14];
+        Vec2<float24> tc0;
+        Vec2<float24> tc1;
+        float24 tc0_w;
+        INSERT_PADDING_WORDS(1);
+        Vec3<float24> view;
+        INSERT_PADDING_WORDS(1);
+        Vec2<float24> tc2;
+
+        // Gather the output registers into their semantic slots
+        static OutputVertex FromAttributeBuffer(const OutputMap& map,
+                const AttributeBuffer& output);
     };
 
     // Register file owned by each hardware thread
@@ -110,6 +150,12 @@ namespace Shader {
         std::array<uint32_t, MAX_PROGRAM_CODE_LENGTH> program_code;
         std::array<uint32_t, MAX_SWIZZLE_DATA_LENGTH> swizzle_data;
         unsigned int entry_point;
+
+        // Identifies the program, for caches of decoded programs
+        uint64_t Hash() const;
+
+        // Bit i is set if the program reads input register i
+        uint16_t GetInputMask() const;
     };
 
     class ShaderEngine {
@@ -120,6 +166,11 @@ namespace Shader {
         void WriteOutput(AttributeBuffer& output);
         void SetupBatch(unsigned int entry_point);
         void Run();
+
+        // For loaders converting vertices in place
+        Vec4<float24>* GetInputRegisters() {
+            return registers.input;
+        }
             
     private:
         // Common among shaders at the same stage
@@ -132,6 +183,6 @@ namespace Shader {
         signed int address_registers[3];
     };
 
-    static_assert(sizeof(OutputVertex) == sizeof(AttributeBuffer), "OutputVertex has invalid size");
+    static_assert(sizeof(OutputVertex) == 24 * sizeof(float24), "OutputVertex has invalid size");
 
 };
@@ -0,0 +1,126 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Shader binary (SHBIN/DVLB) loader and program cache
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cos.h"
+#include "shader.h"
+
+namespace Command {
+    class CommandList;
+}
+
+namespace Shader {
+    // Float constant, packed as uploaded in float24 mode
+    struct FloatConstant {
+        unsigned index;
+        uint32_t words[3];
+    };
+
+    // Named uniform range, in the register IDs of the binary: 0x10-0x6f are
+    // float, 0x70-0x73 integer and 0x78-0x87 bool uniforms
+    struct Uniform {
+        std::string name;
+        unsigned first;
+        unsigned last;
+    };
+
+    // A vertex shader and the state that goes along with it
+    struct Program {
+        // Code, operand descriptors and entry point
+        Setup setup;
+        unsigned code_length;
+        unsigned swizzle_length;
+
+        OutputMap output_map;
+        uint16_t output_mask; // GPUREG_VSH_OUTMAP_MASK
+
+        // Constant uniforms, set when the program is used
+        uint16_t bool_constant_mask;
+        uint16_t bool_constants;
+        uint8_t int_constant_mask;
+        uint32_t int_constants[4];
+        std::vector<FloatConstant> float_constants;
+
+        std::vector<Uniform> uniforms;
+
+        // Setup::Hash() of the program
+        uint64_t hash;
+
+        /**
+        * Find the first register of a uniform by name.
+        * @param name Symbol of the uniform
+        * @return Float, integer or bool uniform index, -1 if not found
+        */
+        int GetUniformLocation(const char* name) const;
+    };
+
+    /**
+    * Parse one vertex shader out of a SHBIN/DVLB file.
+    * @param data,size Contents of the file
+    * @param index DVLE to use, binaries may hold several shaders
+    * @param program Receives the shader
+    * @return false on error, the reason is printed to stderr
+    */
+    bool ParseShaderBinary(const uint8_t* data, size_t size, unsigned index,
+            Program& program);
+
+    /**
+    * Append the register writes that upload a program and its constants.
+    * @param list Command list to append to
+    * @param program Program to use
+    */
+    void AddProgramWrites(Command::CommandList& list, const Program& program);
+
+    // Parsed programs, keyed by a hash of the binary they come from
+    class ProgramCache {
+    public:
+        /**
+        * Load a shader from a SHBIN file, the file is mapped, not read
+        * upfront. A binary seen before is hashed and compared with the
+        * cached copy, not parsed again.
+        * @param path Shader binary
+        * @param index DVLE to use
+        * @return The program, or nullptr on error
+        */
+        const Program* Load(const char* path, unsigned index = 0);
+
+        // Same as above, from a binary already in memory
+        const Program* Load(const uint8_t* data, size_t size,
+                unsigned index = 0);
+
+        size_t Size() const {
+            return count;
+        }
+
+    private:
+        struct Entry {
+            std::vector<uint8_t> binary;
+            unsigned index;
+            std::unique_ptr<Program> program;
+        };
+
+        // Binaries with the same hash share a bucket
+        std::unordered_map<uint64_t, std::vector<Entry>> programs;
+        size_t count = 0;
+    };
+}
@@ -0,0 +1,118 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Texture cache model, used to size the texture cache of the hardware
+#include <unordered_set>
+#include <vector>
+#include "cos.h"
+#include "texturing.h"
+
+namespace Texturing {
+    enum class CacheTagging {
+        // Lines hold consecutive bytes of the tiled texture in memory
+        Tiled = 0,
+        // Lines hold consecutive texels of a row of the (untiled) texture
+        Linear
+    };
+
+    struct CacheConfig {
+        uint32_t size = 8192;       // Total capacity in bytes
+        uint32_t associativity = 4; // Number of ways per set
+        uint32_t line_size = 64;    // Line size in bytes
+        CacheTagging tagging = CacheTagging::Tiled;
+
+        // Parse "size,ways,line,tiled|linear", returns false on bad input
+        bool Parse(const char* str);
+    };
+
+    struct CacheStats {
+        uint64_t accesses = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t unique_tiles = 0;
+        uint64_t bytes_fetched = 0;
+
+        float HitRate() const {
+            return accesses ? (float)hits / (float)accesses : 0.0f;
+        }
+    };
+
+    class TextureCacheModel {
+    public:
+        explicit TextureCacheModel(const CacheConfig& config);
+
+        /**
+        * Record a texel access.
+        * @param info TextureInfo of the texture being sampled
+        * @param tile_offset Byte offset of the 8x8 tile from the texture base
+        * @param morton Morton index of the texel inside the tile
+        * @param x,y Texel coordinates
+        */
+        void Access(const TextureInfo& info, uint32_t tile_offset,
+                uint32_t morton, uint16_t x, uint16_t y);
+
+        // Drop all lines, e.g. when texture memory gets overwritten
+        void Invalidate();
+
+        /**
+        * Drop the lines holding any byte of a physical address range. With
+        * linear tagging lines do not map to memory, all lines are dropped.
+        */
+        void InvalidateRange(uint32_t address, uint32_t size);
+
+        // Draw boundaries, EndDraw() returns statistics since BeginDraw()
+        void BeginDraw();
+        CacheStats EndDraw();
+
+        const CacheConfig& GetConfig() const {
+            return config;
+        }
+
+    private:
+        struct Line {
+            uint32_t tag;
+            uint32_t last_used;
+            bool valid;
+        };
+
+        CacheConfig config;
+        uint32_t num_sets;
+        uint32_t line_shift;
+        uint32_t timestamp = 0;
+        std::vector<Line> lines;
+        std::unordered_set<uint32_t> tiles;
+        CacheStats stats;
+    };
+
+    /**
+    * Attach a cache model to the texture unit. All subsequent lookups are
+    * recorded in the model. Pass nullptr to disable, which is the default.
+    */
+    void SetCacheModel(TextureCacheModel* model);
+
+    // The attached cache model, it is not safe to use from several threads
+    TextureCacheModel* GetCacheModel();
+
+    /**
+    * Notify the texture unit that emulated memory was written by something
+    * else than the CPU side texture upload, e.g. by rendering to it.
+    * @param address,size Physical range written
+    */
+    void InvalidateTextureMemory(uint32_t address, uint32_t size);
+}
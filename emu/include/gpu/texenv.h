@@ -0,0 +1,231 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Texture combiner (TexEnv) unit
+#include <memory>
+#include <vector>
+#include "cos.h"
+#include "isa.h"
+#include "fragment.h"
+
+namespace TexEnv {
+    constexpr unsigned NUM_STAGES = 6;
+
+    enum class Source : uint32_t {
+        PrimaryColor = 0x0,
+        PrimaryFragmentColor = 0x1,
+        SecondaryFragmentColor = 0x2,
+        Texture0 = 0x3,
+        Texture1 = 0x4,
+        Texture2 = 0x5,
+        Texture3 = 0x6,
+        PreviousBuffer = 0xd,
+        Constant = 0xe,
+        Previous = 0xf
+    };
+
+    enum class ColorModifier : uint32_t {
+        SourceColor = 0x0,
+        OneMinusSourceColor = 0x1,
+        SourceAlpha = 0x2,
+        OneMinusSourceAlpha = 0x3,
+        SourceRed = 0x4,
+        OneMinusSourceRed = 0x5,
+        SourceGreen = 0x8,
+        OneMinusSourceGreen = 0x9,
+        SourceBlue = 0xc,
+        OneMinusSourceBlue = 0xd
+    };
+
+    enum class AlphaModifier : uint32_t {
+        SourceAlpha = 0x0,
+        OneMinusSourceAlpha = 0x1,
+        SourceRed = 0x2,
+        OneMinusSourceRed = 0x3,
+        SourceGreen = 0x4,
+        OneMinusSourceGreen = 0x5,
+        SourceBlue = 0x6,
+        OneMinusSourceBlue = 0x7
+    };
+
+    enum class Operation : uint32_t {
+        Replace = 0,
+        Modulate = 1,
+        Add = 2,
+        AddSigned = 3,
+        Lerp = 4,
+        Subtract = 5,
+        Dot3_RGB = 6,
+        Dot3_RGBA = 7,
+        MultiplyThenAdd = 8,
+        AddThenMultiply = 9
+    };
+
+    constexpr unsigned NUM_OPERATIONS = 10;
+
+    // GPUREG_TEXENVi_SOURCE, OPERAND, COMBINER, COLOR and SCALE
+    struct Stage {
+        union {
+            uint32_t sources_raw;
+            isa::BitField<0, 4, Source> color_source1;
+            isa::BitField<4, 4, Source> color_source2;
+            isa::BitField<8, 4, Source> color_source3;
+            isa::BitField<16, 4, Source> alpha_source1;
+            isa::BitField<20, 4, Source> alpha_source2;
+            isa::BitField<24, 4, Source> alpha_source3;
+        };
+
+        union {
+            uint32_t modifiers_raw;
+            isa::BitField<0, 4, ColorModifier> color_modifier1;
+            isa::BitField<4, 4, ColorModifier> color_modifier2;
+            isa::BitField<8, 4, ColorModifier> color_modifier3;
+            isa::BitField<12, 3, AlphaModifier> alpha_modifier1;
+            isa::BitField<16, 3, AlphaModifier> alpha_modifier2;
+            isa::BitField<20, 3, AlphaModifier> alpha_modifier3;
+        };
+
+        union {
+            uint32_t ops_raw;
+            isa::BitField<0, 4, Operation> color_op;
+            isa::BitField<16, 4, Operation> alpha_op;
+        };
+
+        union {
+            uint32_t const_color;
+            isa::BitField<0, 8, uint32_t> const_r;
+            isa::BitField<8, 8, uint32_t> const_g;
+            isa::BitField<16, 8, uint32_t> const_b;
+            isa::BitField<24, 8, uint32_t> const_a;
+        };
+
+        union {
+            uint32_t scales_raw;
+            isa::BitField<0, 2, uint32_t> color_scale;
+            isa::BitField<16, 2, uint32_t> alpha_scale;
+        };
+
+        unsigned GetColorMultiplier() const {
+            return (color_scale < 3) ? (1 << color_scale) : 1;
+        }
+
+        unsigned GetAlphaMultiplier() const {
+            return (alpha_scale < 3) ? (1 << alpha_scale) : 1;
+        }
+    };
+
+    enum class FogMode : uint32_t {
+        None = 0,
+        Fog = 5,
+        Gas = 7
+    };
+
+    // Gas density the shading pass reads from the combiner output
+    enum class GasDensity : uint32_t {
+        Plain = 0, // Red channel
+        Depth = 1  // Green channel
+    };
+
+    // GPUREG_TEXENV_UPDATE_BUFFER
+    union UpdateBuffer {
+        uint32_t hex;
+        isa::BitField<0, 3, FogMode> fog_mode;
+        isa::BitField<3, 1, GasDensity> shading_density_source;
+        isa::BitField<8, 4, uint32_t> update_mask_rgb;
+        isa::BitField<12, 4, uint32_t> update_mask_a;
+        // Index the fog LUT with 1 - depth
+        isa::BitField<16, 1, uint32_t> fog_flip;
+
+        // Only the first four stages can write to the combiner buffer
+        bool UpdatesColor(unsigned stage) const {
+            return (stage < 4) && (update_mask_rgb & (1 << stage));
+        }
+
+        bool UpdatesAlpha(unsigned stage) const {
+            return (stage < 4) && (update_mask_a & (1 << stage));
+        }
+    };
+
+    // Complete combiner register state
+    struct Config {
+        Stage stages[NUM_STAGES];
+        UpdateBuffer update_buffer;
+        uint32_t buffer_color; // GPUREG_TEXENV_BUFFER_COLOR
+
+        uint64_t Hash() const;
+        bool operator==(const Config& other) const;
+    };
+
+    // Stage inputs which are the same for every stage
+    struct Inputs {
+        const ColorQuad* primary_color;
+        const ColorQuad* primary_fragment_color;
+        const ColorQuad* secondary_fragment_color;
+        const ColorQuad* texture[4];
+    };
+
+    /**
+    * A combiner configuration compiled into a list of specialized stage
+    * kernels. Stages passing the previous result through unchanged and
+    * stages whose result is never used are dropped, the combiner buffer is
+    * only maintained if some stage reads it.
+    */
+    class Program {
+    public:
+        explicit Program(const Config& config);
+
+        // Combine the inputs of a quad of fragments
+        void Run(const Inputs& inputs, ColorQuad& output) const;
+
+        // Whether any remaining stage reads the given source
+        bool UsesSource(Source source) const {
+            return used_sources & (1u << static_cast<uint32_t>(source));
+        }
+
+        const Config& GetConfig() const {
+            return config;
+        }
+
+        struct State;
+        struct CompiledStage;
+        using StageKernel = void (*)(const CompiledStage& stage, State& state);
+
+        struct CompiledStage {
+            StageKernel kernel;
+            Stage stage;
+            ColorQuad constant;
+            // Also maintain the combiner buffer after this stage
+            bool buffer_update;
+            bool update_color;
+            bool update_alpha;
+        };
+
+    private:
+        Config config;
+        std::vector<CompiledStage> stages;
+        ColorQuad initial_buffer;
+        uint32_t used_sources;
+    };
+
+    /**
+    * Return the program for a combiner configuration. Programs are cached
+    * by the hash of the register state and only compiled on first use.
+    */
+    const Program& GetProgram(const Config& config);
+}
@@ -0,0 +1,53 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Host side texture import: tiling and encoding of linear images
+#include "cos.h"
+#include "texturing.h"
+
+namespace Texturing {
+    /**
+    * Tile a linear image into 8x8 Morton ordered tiles and encode it.
+    * Row 0 of the image becomes texel row 0.
+    * @param source Linear pixels, rows without padding
+    * @param width,height Image size, must be multiples of 8
+    * @param channels 1 (intensity), 2 (intensity, alpha), 3 (RGB) or 4 (RGBA)
+    * @param format Format to encode to
+    * @param dest Destination, needs width * height / 64 tiles of storage
+    * @return false if the image can't be encoded to the given format
+    */
+    bool EncodeTexture(const uint8_t* source, unsigned width, unsigned height,
+            unsigned channels, TextureFormat format, uint8_t* dest);
+
+    /**
+    * Load a binary PGM/PPM (P5/P6) or PAM (P7) image and write it into
+    * emulated memory as a texture. The file is mapped, not read upfront.
+    * Both dimensions must be multiples of 8 and at most 1024.
+    * @param path Image file
+    * @param address Physical address to write the texture to
+    * @param format Format to encode the texture in
+    * @param info Receives the setup to sample the imported texture with
+    * @return false on error, the reason is printed to stderr
+    */
+    bool ImportTexture(const char* path, uint32_t address,
+            TextureFormat format, TextureInfo& info);
+
+    // Parse a format name like "rgba8" or "RGB565", returns false if unknown
+    bool ParseTextureFormat(const char* name, TextureFormat& format);
+}
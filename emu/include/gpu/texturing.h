@@ -34,11 +34,25 @@ namespace Texturing {
         Disabled
     };
 
+    enum CubeFace {
+        PositiveX = 0,
+        NegativeX,
+        PositiveY,
+        NegativeY,
+        PositiveZ,
+        NegativeZ
+    };
+
     enum WrapMode {
         ClampToEdge = 0,
         ClampToBorder,
         Repeat,
-        MirroredRepeat
+        MirroredRepeat,
+        // Same as the above for positive coordinates, negative ones repeat
+        ClampToEdge2,
+        ClampToBorder2,
+        Repeat2,
+        Repeat3
     };
 
     enum TextureFilter {
@@ -71,7 +85,75 @@ namespace Texturing {
         TextureFormat format;
     };
 
-    int GetWrappedTexCoord(int val, unsigned size);
+    // GPUREG_TEXUNIT0_SHADOW
+    union ShadowConfig {
+        uint32_t hex;
+
+        // When cleared, texture coordinates are divided by w (perspective)
+        isa::BitField<0, 1, uint32_t> orthographic;
+        // Subtracted from the reference depth, in units of 2 LSBs of D24
+        isa::BitField<1, 23, uint32_t> bias;
+    };
+
+    // GPUREG_TEXUNITi_PARAM
+    union TextureParams {
+        uint32_t hex;
+
+        isa::BitField<1, 1, TextureFilter> mag_filter;
+        isa::BitField<2, 1, TextureFilter> min_filter;
+        isa::BitField<8, 3, WrapMode> wrap_t;
+        isa::BitField<12, 3, WrapMode> wrap_s;
+        // Texture unit 0 only, the others are always 2D
+        isa::BitField<28, 3, TextureType> type;
+    };
+
+    // Setup of one texture unit, from its GPUREG_TEXUNITi registers
+    struct TextureUnit {
+        bool enabled;
+        TextureType type;
+        TextureInfo info;
+        TextureParams params;
+        Vec4<uint8_t> border_color;
+        // Texture coordinate set sampled, 0-2
+        unsigned coordinates;
+        // Faces of a cube map, indexed by CubeFace, texture unit 0 only
+        uint32_t face_address[6];
+        ShadowConfig shadow;
+    };
+
+    // Texels fetched for a group of fragments, stored as structure of arrays
+    template <unsigned N>
+    struct TexelBatch {
+        static_assert(N == 4 || N == 8 || N == 16, "Unsupported batch size");
+        alignas(16) uint8_t r[N];
+        alignas(16) uint8_t g[N];
+        alignas(16) uint8_t b[N];
+        alignas(16) uint8_t a[N];
+
+        Vec4<uint8_t> Get(unsigned i) const {
+            return {r[i], g[i], b[i], a[i]};
+        }
+    };
+
+    // 8x8 Z-Order coordinate from 2D coordinates
+    constexpr uint32_t MortonInterleave(uint32_t x, uint32_t y) {
+        constexpr uint32_t xlut[] = {0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15};
+        constexpr uint32_t ylut[] = {0x00, 0x02, 0x08, 0x0a, 0x20, 0x22, 0x28, 0x2a};
+        return xlut[x % 8] + ylut[y % 8];
+    }
+
+    /**
+    * Apply a wrap mode to an integer texel coordinate.
+    * @param mode Wrap mode of the coordinate
+    * @param val Texel coordinate, may be outside the texture
+    * @param size Texture size along the coordinate
+    * @return Coordinate in [0, size), ClampToBorder coordinates outside the
+    *         texture are returned as is and read the border color
+    */
+    int GetWrappedTexCoord(WrapMode mode, int val, unsigned size);
+
+    // Whether a coordinate wrapped with the given mode reads the border color
+    bool IsBorderTexCoord(WrapMode mode, int val, unsigned size);
 
     // Returns the byte size of a 8*8 tile of the specified texture format.
     uint32_t CalculateTileSize(TextureFormat format);
@@ -86,6 +168,18 @@ namespace Texturing {
     Vec4<uint8_t> LookupTexture(const uint8_t* source, uint16_t x, uint16_t y,
             const TextureInfo& info);
 
+    /**
+    * Lookup N texels (a quad or a span of fragments) sharing the same texture
+    * setup. Format dispatch happens once per batch instead of once per texel.
+    * @param source Source pointer to read data from
+    * @param x,y Arrays of N texture coordinates
+    * @param info TextureInfo object describing the texture setup
+    * @param out Decoded texels, one lane per coordinate pair
+    */
+    template <unsigned N>
+    void LookupTextureBatch(const uint8_t* source, const uint16_t* x,
+            const uint16_t* y, const TextureInfo& info, TexelBatch<N>& out);
+
     /**
     * Looks up a texel from a single 8x8 texture tile.
     *
@@ -97,5 +191,49 @@ namespace Texturing {
             uint16_t y, const TextureInfo& info);
 
     Vec3<uint8_t> SampleETC1Subtile(uint64_t value, unsigned int x, unsigned int y);
+
+    /**
+    * Select the cube map face a direction points to, and project the
+    * direction onto that face.
+    * @param s,t,r Direction vector, need not be normalized
+    * @param u,v Output coordinates on the selected face, in [0, 1]
+    * @return The selected face
+    */
+    CubeFace SelectCubeFace(float s, float t, float r, float& u, float& v);
+
+    /**
+    * Lookup the texel of a cube map a direction points to.
+    * @param faces Pointers to the six faces, indexed by CubeFace
+    * @param s,t,r Direction vector
+    * @param info TextureInfo describing a single face
+    */
+    Vec4<uint8_t> LookupTextureCube(const uint8_t* const faces[6], float s,
+            float t, float r, const TextureInfo& info);
+
+    /**
+    * Calculate the 24-bit reference depth shadow texels are compared with.
+    * @param z Fragment depth in light space, in [0, 1]
+    * @param config Shadow setup of texture unit 0
+    */
+    uint32_t CalculateShadowReference(float z, const ShadowConfig& config);
+
+    /**
+    * Shadow-compare the texels around the given coordinates and filter the
+    * results. Shadow textures are RGBA8 tiles holding a 24-bit depth and an
+    * 8-bit attenuation per texel.
+    * @param source Source pointer of the shadow texture
+    * @param u,v Normalized texture coordinates, already projected
+    * @param ref Reference depth from CalculateShadowReference()
+    * @param info TextureInfo describing the shadow texture
+    * @param filter Linear filtering compares and blends a 2x2 footprint
+    * @return The stored attenuation where lit, 0 where the stored depth is
+    *         not beyond the reference
+    */
+    uint8_t LookupShadow(const uint8_t* source, float u, float v, uint32_t ref,
+            const TextureInfo& info, TextureFilter filter);
+
+    // Same as LookupShadow(), on the cube face the direction s,t,r points to
+    uint8_t LookupShadowCube(const uint8_t* const faces[6], float s, float t,
+            float r, uint32_t ref, const TextureInfo& info, TextureFilter filter);
     
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Display transfer and texture copy engine
+#include "cos.h"
+#include "isa.h"
+#include "framebuffer.h"
+
+namespace Transfer {
+    // GX_TRANSFER_FMT_*, numbered differently from the color buffer formats
+    enum class PixelFormat : uint32_t {
+        RGBA8 = 0,
+        RGB8 = 1,
+        RGB565 = 2,
+        RGB5A1 = 3,
+        RGBA4 = 4
+    };
+
+    unsigned BytesPerPixel(PixelFormat format);
+
+    // GPU registers of a transfer, 0x1EF00C00 - 0x1EF00C24
+    struct Config {
+        uint32_t input_address;
+        uint32_t output_address;
+
+        union {
+            uint32_t output_size;
+            isa::BitField<0, 16, uint32_t> output_width;
+            isa::BitField<16, 16, uint32_t> output_height;
+        };
+
+        union {
+            uint32_t input_size;
+            isa::BitField<0, 16, uint32_t> input_width;
+            isa::BitField<16, 16, uint32_t> input_height;
+        };
+
+        union {
+            uint32_t flags;
+            isa::BitField<0, 1, uint32_t> flip_vertically;
+            // Tiled output, the input is tiled otherwise
+            isa::BitField<1, 1, uint32_t> input_linear;
+            isa::BitField<3, 1, uint32_t> is_texture_copy;
+            // Keep the layout of the input
+            isa::BitField<5, 1, uint32_t> dont_swizzle;
+            isa::BitField<8, 3, PixelFormat> input_format;
+            isa::BitField<12, 3, PixelFormat> output_format;
+            // 32x32 blocks instead of 8x8 tiles
+            isa::BitField<16, 1, uint32_t> block_32;
+            isa::BitField<24, 2, Framebuffer::DownscaleMode> scaling;
+        };
+
+        // Texture copy, widths and gaps in units of 16 bytes
+        uint32_t texture_copy_size;
+
+        union {
+            uint32_t texture_copy_input;
+            isa::BitField<0, 16, uint32_t> input_line_width;
+            isa::BitField<16, 16, uint32_t> input_line_gap;
+        };
+
+        union {
+            uint32_t texture_copy_output;
+            isa::BitField<0, 16, uint32_t> output_line_width;
+            isa::BitField<16, 16, uint32_t> output_line_gap;
+        };
+    };
+
+    /**
+    * Run a display transfer or a texture copy, depending on
+    * is_texture_copy. Buffers the output merger writes to must be flushed
+    * first, see Framebuffer::OutputMerger::Flush().
+    * @return False if a buffer lies outside of emulated memory or the
+    * configuration is invalid
+    */
+    bool Execute(const Config& config);
+
+    /**
+    * Copy an image converting between tiled and linear layouts and pixel
+    * formats, optionally flipped and box filtered down by 2x1 or 2x2.
+    * Output rows are split among worker threads.
+    */
+    bool DisplayTransfer(const Config& config);
+
+    // Copy lines of bytes, skipping gaps between lines on either side
+    bool TextureCopy(const Config& config);
+
+    /**
+    * Set the number of threads display transfers use, including the
+    * calling thread. Defaults to the number of cores, at most 4.
+    */
+    void SetThreads(unsigned threads);
+}
@@ -0,0 +1,102 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Vertex attribute loader
+#include "cos.h"
+#include "vec.h"
+#include "float.h"
+
+namespace Shader {
+    // Component types of GPUREG_ATTRIBBUFFERS_FORMAT_LOW/HIGH
+    enum class AttributeFormat : uint32_t {
+        Byte = 0,
+        UnsignedByte = 1,
+        Short = 2,
+        Float = 3
+    };
+
+    constexpr unsigned MAX_ATTRIBUTES = 12;
+
+    /**
+    * Reads vertices from the attribute buffers in emulated memory and
+    * converts them straight into the vertex shader input registers. Only
+    * attributes the shader reads are loaded, the conversion routine of each
+    * is selected once per layout change.
+    */
+    class VertexLoader {
+    public:
+        // An attribute not backed by a buffer, read from the fixed values
+        struct FixedAttribute {
+            unsigned attribute;
+            unsigned input;
+        };
+
+        /**
+        * Decode the attribute buffer registers.
+        * @param regs Register file, indexed by register number
+        * @param input_mask Bit i is set if the shader reads input register i
+        */
+        void Setup(const uint32_t* regs, unsigned input_mask);
+
+        /**
+        * Resolve the buffer addresses to host pointers for a draw.
+        * @param max_index Highest vertex index the draw reads
+        * @return False if a buffer lies outside of emulated memory
+        */
+        bool Map(unsigned max_index);
+
+        /**
+        * Convert the buffer attributes of a vertex. Input registers of
+        * fixed attributes are not written.
+        * @param input Input registers of the vertex shader
+        */
+        void Load(unsigned index, Vec4<float24>* input) const {
+            for (unsigned i = 0; i < num_loads; i++) {
+                const AttributeLoad& load = loads[i];
+                load.convert(load.data + index * load.stride, input[load.input]);
+            }
+        }
+
+        unsigned GetNumFixedAttributes() const {
+            return num_fixed;
+        }
+
+        const FixedAttribute& GetFixedAttribute(unsigned i) const {
+            return fixed[i];
+        }
+
+    private:
+        using ConvertFunc = void (*)(const uint8_t* src, Vec4<float24>& dst);
+
+        struct AttributeLoad {
+            ConvertFunc convert;
+            const uint8_t* data;
+            uint32_t address;
+            unsigned size;
+            unsigned stride;
+            unsigned input;
+        };
+
+        AttributeLoad loads[MAX_ATTRIBUTES];
+        unsigned num_loads = 0;
+        FixedAttribute fixed[MAX_ATTRIBUTES];
+        unsigned num_fixed = 0;
+    };
+}
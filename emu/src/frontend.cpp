@@ -18,6 +18,7 @@
  */
 #include "main.h"
 #include "frontend.h"
+#include <algorithm>
 
 Frontend::Frontend() {
     // Initialize the window
@@ -75,6 +76,21 @@ void Frontend::DrawPixel(int x, int y, int r, int g, int b) {
     buffer[y * VIDEO_WIDTH + x] = color; 
 }
 
+void Frontend::Present(const uint8_t* rgba, unsigned width, unsigned height,
+        unsigned x, unsigned y) {
+    uint32_t *buffer = (uint32_t *)screen->pixels;
+    const unsigned stride = width * 4;
+    width = std::min(width, VIDEO_WIDTH - x);
+    height = std::min(height, VIDEO_HEIGHT - y);
+    for (unsigned j = 0; j < height; j++) {
+        const uint8_t *src = rgba + j * stride;
+        uint32_t *dst = buffer + (y + j) * VIDEO_WIDTH + x;
+        for (unsigned i = 0; i < width; i++)
+            dst[i] = SDL_MapRGB(screen->format, src[i * 4], src[i * 4 + 1],
+                    src[i * 4 + 2]);
+    }
+}
+
 void Frontend::Flip() {
     SDL_Flip(screen);
 }
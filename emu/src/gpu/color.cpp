@@ -0,0 +1,838 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include "cos.h"
+#include "color.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// The SSSE3 and AVX2 kernels hand their tails to the SSE2 ones
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define COLOR_X86
+#endif
+
+namespace Color {
+
+    using DecodeSpanFn = void (*)(const uint8_t* src, uint8_t* rgba, size_t count);
+    using EncodeSpanFn = void (*)(const uint8_t* rgba, uint8_t* dst, size_t count);
+    using DecodeDepthSpanFn = void (*)(const uint8_t* src, uint32_t* depth, size_t count);
+    using EncodeDepthSpanFn = void (*)(const uint32_t* depth, uint8_t* dst, size_t count);
+    using DecodeDepthStencilSpanFn = void (*)(const uint8_t* src, uint32_t* depth,
+            uint8_t* stencil, size_t count);
+    using EncodeDepthStencilSpanFn = void (*)(const uint32_t* depth, const uint8_t* stencil,
+            uint8_t* dst, size_t count);
+    using BoxFilterSpanFn = void (*)(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+            size_t count);
+
+    struct SpanKernels {
+        DecodeSpanFn decode_rgba8, decode_rgb8, decode_rg8;
+        DecodeSpanFn decode_rgb565, decode_rgb5a1, decode_rgba4;
+        EncodeSpanFn encode_rgba8, encode_rgb8, encode_rg8;
+        EncodeSpanFn encode_rgb565, encode_rgb5a1, encode_rgba4;
+        DecodeDepthSpanFn decode_d16, decode_d24;
+        DecodeDepthStencilSpanFn decode_d24s8;
+        EncodeDepthSpanFn encode_d16, encode_d24;
+        EncodeDepthStencilSpanFn encode_d24s8;
+        BoxFilterSpanFn box_filter_2x1, box_filter_2x2;
+    };
+
+    // Scalar reference, also used for the tails the vector loops leave over
+
+    template <Vec4<uint8_t> (*Decode)(const uint8_t*), unsigned BYTES>
+    static void DecodeScalar(const uint8_t* src, uint8_t* rgba, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            const Vec4<uint8_t> color = Decode(src + i * BYTES);
+            rgba[i * 4 + 0] = color.r();
+            rgba[i * 4 + 1] = color.g();
+            rgba[i * 4 + 2] = color.b();
+            rgba[i * 4 + 3] = color.a();
+        }
+    }
+
+    template <void (*Encode)(const Vec4<uint8_t>&, uint8_t*), unsigned BYTES>
+    static void EncodeScalar(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t* p = rgba + i * 4;
+            Encode({p[0], p[1], p[2], p[3]}, dst + i * BYTES);
+        }
+    }
+
+    template <uint32_t (*Decode)(const uint8_t*), unsigned BYTES>
+    static void DecodeDepthScalar(const uint8_t* src, uint32_t* depth, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            depth[i] = Decode(src + i * BYTES);
+    }
+
+    template <void (*Encode)(uint32_t, uint8_t*), unsigned BYTES>
+    static void EncodeDepthScalar(const uint32_t* depth, uint8_t* dst, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            Encode(depth[i], dst + i * BYTES);
+    }
+
+    static void DecodeD24S8Scalar(const uint8_t* src, uint32_t* depth, uint8_t* stencil,
+            size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            const Vec2<uint32_t> value = DecodeD24S8(src + i * 4);
+            depth[i] = value.x;
+            stencil[i] = static_cast<uint8_t>(value.y);
+        }
+    }
+
+    static void EncodeD24S8Scalar(const uint32_t* depth, const uint8_t* stencil, uint8_t* dst,
+            size_t count) {
+        for (size_t i = 0; i < count; i++)
+            EncodeD24S8(depth[i], stencil[i], dst + i * 4);
+    }
+
+    // Without VERTICAL, row1 is not read and pairs of row0 are averaged
+    template <bool VERTICAL>
+    static void BoxFilterScalar(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+            size_t count) {
+        for (size_t i = 0; i < count * 4; i++) {
+            const unsigned c = (i / 4) * 8 + i % 4;
+            if (VERTICAL)
+                dst[i] = (row0[c] + row0[c + 4] + row1[c] + row1[c + 4]) / 4;
+            else
+                dst[i] = (row0[c] + row0[c + 4]) / 2;
+        }
+    }
+
+    // RGBA8 decode and encode are the same byte reversal
+    static void ReverseRGBA8Scalar(const uint8_t* src, uint8_t* dst, size_t count) {
+        DecodeScalar<DecodeRGBA8, 4>(src, dst, count);
+    }
+
+    // The three 16-bit color formats share their vector kernels
+    enum class Packed16 {
+        RGB565,
+        RGB5A1,
+        RGBA4
+    };
+
+    template <Packed16 FORMAT>
+    static void DecodePacked16Scalar(const uint8_t* src, uint8_t* rgba, size_t count) {
+        switch (FORMAT) {
+        case Packed16::RGB565: DecodeScalar<DecodeRGB565, 2>(src, rgba, count); break;
+        case Packed16::RGB5A1: DecodeScalar<DecodeRGB5A1, 2>(src, rgba, count); break;
+        case Packed16::RGBA4:  DecodeScalar<DecodeRGBA4, 2>(src, rgba, count); break;
+        }
+    }
+
+    template <Packed16 FORMAT>
+    static void EncodePacked16Scalar(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        switch (FORMAT) {
+        case Packed16::RGB565: EncodeScalar<EncodeRGB565, 2>(rgba, dst, count); break;
+        case Packed16::RGB5A1: EncodeScalar<EncodeRGB5A1, 2>(rgba, dst, count); break;
+        case Packed16::RGBA4:  EncodeScalar<EncodeRGBA4, 2>(rgba, dst, count); break;
+        }
+    }
+
+#if defined(__SSE2__)
+    static __m128i ByteSwap32SSE2(__m128i v) {
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+    }
+
+    static void ReverseRGBA8SSE2(const uint8_t* src, uint8_t* dst, size_t count) {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), ByteSwap32SSE2(v));
+        }
+        ReverseRGBA8Scalar(src + i * 4, dst + i * 4, count - i);
+    }
+
+    // Split 8 16-bit pixels into 8-bit channels held in 16-bit lanes
+    template <Packed16 FORMAT>
+    static void UnpackPacked16SSE2(__m128i v, __m128i& r, __m128i& g, __m128i& b, __m128i& a) {
+        auto Expand4 = [](__m128i c) { return _mm_or_si128(_mm_slli_epi16(c, 4), c); };
+        auto Expand5 = [](__m128i c) {
+            return _mm_or_si128(_mm_slli_epi16(c, 3), _mm_srli_epi16(c, 2));
+        };
+        auto Expand6 = [](__m128i c) {
+            return _mm_or_si128(_mm_slli_epi16(c, 2), _mm_srli_epi16(c, 4));
+        };
+        const __m128i mask4 = _mm_set1_epi16(0xF);
+        const __m128i mask5 = _mm_set1_epi16(0x1F);
+
+        switch (FORMAT) {
+        case Packed16::RGB565:
+            r = Expand5(_mm_srli_epi16(v, 11));
+            g = Expand6(_mm_and_si128(_mm_srli_epi16(v, 5), _mm_set1_epi16(0x3F)));
+            b = Expand5(_mm_and_si128(v, mask5));
+            a = _mm_set1_epi16(0xFF);
+            break;
+        case Packed16::RGB5A1:
+            r = Expand5(_mm_srli_epi16(v, 11));
+            g = Expand5(_mm_and_si128(_mm_srli_epi16(v, 6), mask5));
+            b = Expand5(_mm_and_si128(_mm_srli_epi16(v, 1), mask5));
+            a = _mm_and_si128(_mm_sub_epi16(_mm_setzero_si128(),
+                    _mm_and_si128(v, _mm_set1_epi16(1))), _mm_set1_epi16(0xFF));
+            break;
+        case Packed16::RGBA4:
+            r = Expand4(_mm_srli_epi16(v, 12));
+            g = Expand4(_mm_and_si128(_mm_srli_epi16(v, 8), mask4));
+            b = Expand4(_mm_and_si128(_mm_srli_epi16(v, 4), mask4));
+            a = Expand4(_mm_and_si128(v, mask4));
+            break;
+        }
+    }
+
+    // Inverse of UnpackPacked16SSE2, channels are 8-bit values in 16-bit lanes
+    template <Packed16 FORMAT>
+    static __m128i PackPacked16SSE2(__m128i r, __m128i g, __m128i b, __m128i a) {
+        auto Field = [](__m128i c, int drop, int shift) {
+            return _mm_slli_epi16(_mm_srli_epi16(c, drop), shift);
+        };
+
+        switch (FORMAT) {
+        case Packed16::RGB565:
+            return _mm_or_si128(_mm_or_si128(Field(r, 3, 11), Field(g, 2, 5)),
+                    _mm_srli_epi16(b, 3));
+        case Packed16::RGB5A1:
+            return _mm_or_si128(_mm_or_si128(Field(r, 3, 11), Field(g, 3, 6)),
+                    _mm_or_si128(Field(b, 3, 1), _mm_srli_epi16(a, 7)));
+        case Packed16::RGBA4:
+        default:
+            return _mm_or_si128(_mm_or_si128(Field(r, 4, 12), Field(g, 4, 8)),
+                    _mm_or_si128(Field(b, 4, 4), _mm_srli_epi16(a, 4)));
+        }
+    }
+
+    template <Packed16 FORMAT>
+    static void DecodePacked16SSE2(const uint8_t* src, uint8_t* rgba, size_t count) {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+            __m128i r, g, b, a;
+            UnpackPacked16SSE2<FORMAT>(v, r, g, b, a);
+            __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+            __m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4),
+                    _mm_unpacklo_epi16(rg, ba));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4 + 16),
+                    _mm_unpackhi_epi16(rg, ba));
+        }
+        DecodePacked16Scalar<FORMAT>(src + i * 2, rgba + i * 4, count - i);
+    }
+
+    template <Packed16 FORMAT>
+    static void EncodePacked16SSE2(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        const __m128i byte_mask = _mm_set1_epi32(0xFF);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4));
+            __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4 + 16));
+            auto Channel = [&](int shift) {
+                return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, shift), byte_mask),
+                        _mm_and_si128(_mm_srli_epi32(p1, shift), byte_mask));
+            };
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2),
+                    PackPacked16SSE2<FORMAT>(Channel(0), Channel(8), Channel(16), Channel(24)));
+        }
+        EncodePacked16Scalar<FORMAT>(rgba + i * 4, dst + i * 2, count - i);
+    }
+
+    static void DecodeD16SSE2(const uint8_t* src, uint32_t* depth, size_t count) {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + i), _mm_unpacklo_epi16(v, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + i + 4),
+                    _mm_unpackhi_epi16(v, zero));
+        }
+        DecodeDepthScalar<DecodeD16, 2>(src + i * 2, depth + i, count - i);
+    }
+
+    // Sign extending the low halves first turns the saturating pack into a truncation
+    static __m128i TruncatePack32SSE2(__m128i lo, __m128i hi) {
+        return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16),
+                _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+    }
+
+    static void EncodeD16SSE2(const uint32_t* depth, uint8_t* dst, size_t count) {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i d0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i));
+            __m128i d1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i + 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2), TruncatePack32SSE2(d0, d1));
+        }
+        EncodeDepthScalar<EncodeD16, 2>(depth + i, dst + i * 2, count - i);
+    }
+
+    static void DecodeD24S8SSE2(const uint8_t* src, uint32_t* depth, uint8_t* stencil,
+            size_t count) {
+        const __m128i depth_mask = _mm_set1_epi32(0xFFFFFF);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i w0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+            __m128i w1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + i), _mm_and_si128(w0, depth_mask));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + i + 4),
+                    _mm_and_si128(w1, depth_mask));
+            __m128i s = _mm_packs_epi32(_mm_srli_epi32(w0, 24), _mm_srli_epi32(w1, 24));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(stencil + i),
+                    _mm_packus_epi16(s, _mm_setzero_si128()));
+        }
+        DecodeD24S8Scalar(src + i * 4, depth + i, stencil + i, count - i);
+    }
+
+    static void EncodeD24S8SSE2(const uint32_t* depth, const uint8_t* stencil, uint8_t* dst,
+            size_t count) {
+        const __m128i depth_mask = _mm_set1_epi32(0xFFFFFF);
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i d0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i));
+            __m128i d1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i + 4));
+            __m128i s = _mm_unpacklo_epi8(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(stencil + i)), zero);
+            __m128i s0 = _mm_slli_epi32(_mm_unpacklo_epi16(s, zero), 24);
+            __m128i s1 = _mm_slli_epi32(_mm_unpackhi_epi16(s, zero), 24);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4),
+                    _mm_or_si128(_mm_and_si128(d0, depth_mask), s0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4 + 16),
+                    _mm_or_si128(_mm_and_si128(d1, depth_mask), s1));
+        }
+        EncodeD24S8Scalar(depth + i, stencil + i, dst + i * 4, count - i);
+    }
+
+    template <bool VERTICAL>
+    static void BoxFilterSSE2(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+            size_t count) {
+        const __m128i zero = _mm_setzero_si128();
+        // Channel sums of 4 source pixels per row, pairwise added into 2 pixels
+        auto Sum = [&](const uint8_t* p0, const uint8_t* p1) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p0));
+            __m128i lo = _mm_unpacklo_epi8(a, zero);
+            __m128i hi = _mm_unpackhi_epi8(a, zero);
+            if (VERTICAL) {
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p1));
+                lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(b, zero));
+                hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(b, zero));
+            }
+            __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+            return VERTICAL ? _mm_srli_epi16(sum, 2) : _mm_srli_epi16(sum, 1);
+        };
+
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i first = Sum(row0 + i * 8, row1 + i * 8);
+            __m128i second = Sum(row0 + i * 8 + 16, row1 + i * 8 + 16);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4),
+                    _mm_packus_epi16(first, second));
+        }
+        BoxFilterScalar<VERTICAL>(row0 + i * 8, row1 + i * 8, dst + i * 4, count - i);
+    }
+#endif
+
+#ifdef COLOR_X86
+    static bool HasSSSE3() {
+        static const bool result = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3"));
+        return result;
+    }
+
+    static bool HasAVX2() {
+        static const bool result = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return result;
+    }
+
+    // Byte shuffles moving whole pixels, 0x80 clears the destination byte
+    __attribute__((target("ssse3")))
+    static void ShuffleSpanSSSE3(const uint8_t* src, uint8_t* dst, size_t count) {
+        const __m128i reverse = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_shuffle_epi8(v, reverse));
+        }
+        ReverseRGBA8Scalar(src + i * 4, dst + i * 4, count - i);
+    }
+
+    // Store the low 12 bytes of v
+    __attribute__((target("ssse3")))
+    static void Store12SSSE3(uint8_t* dst, __m128i v) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), v);
+        const uint32_t high = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+        std::memcpy(dst + 8, &high, sizeof(high));
+    }
+
+    __attribute__((target("ssse3")))
+    static void DecodeRGB8SSSE3(const uint8_t* src, uint8_t* rgba, size_t count) {
+        const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128,
+                8, 7, 6, -128, 11, 10, 9, -128);
+        const __m128i alpha = _mm_set1_epi32(0xFF000000);
+        size_t i = 0;
+        // The 16-byte load reads 4 bytes past the 4 pixels converted
+        for (; i * 3 + 16 <= count * 3; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4),
+                    _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+        }
+        DecodeScalar<DecodeRGB8, 3>(src + i * 3, rgba + i * 4, count - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static void EncodeRGB8SSSE3(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                -128, -128, -128, -128);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4));
+            Store12SSSE3(dst + i * 3, _mm_shuffle_epi8(v, shuffle));
+        }
+        EncodeScalar<EncodeRGB8, 3>(rgba + i * 4, dst + i * 3, count - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static void DecodeRG8SSSE3(const uint8_t* src, uint8_t* rgba, size_t count) {
+        const __m128i shuffle_lo = _mm_setr_epi8(1, 0, -128, -128, 3, 2, -128, -128,
+                5, 4, -128, -128, 7, 6, -128, -128);
+        const __m128i shuffle_hi = _mm_setr_epi8(9, 8, -128, -128, 11, 10, -128, -128,
+                13, 12, -128, -128, 15, 14, -128, -128);
+        const __m128i alpha = _mm_set1_epi32(0xFF000000);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4),
+                    _mm_or_si128(_mm_shuffle_epi8(v, shuffle_lo), alpha));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4 + 16),
+                    _mm_or_si128(_mm_shuffle_epi8(v, shuffle_hi), alpha));
+        }
+        DecodeScalar<DecodeRG8, 2>(src + i * 2, rgba + i * 4, count - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static void EncodeRG8SSSE3(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        const __m128i shuffle = _mm_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12,
+                -128, -128, -128, -128, -128, -128, -128, -128);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4));
+            __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2),
+                    _mm_unpacklo_epi64(_mm_shuffle_epi8(p0, shuffle),
+                            _mm_shuffle_epi8(p1, shuffle)));
+        }
+        EncodeScalar<EncodeRG8, 2>(rgba + i * 4, dst + i * 2, count - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static void DecodeD24SSSE3(const uint8_t* src, uint32_t* depth, size_t count) {
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128,
+                6, 7, 8, -128, 9, 10, 11, -128);
+        size_t i = 0;
+        for (; i * 3 + 16 <= count * 3; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(depth + i), _mm_shuffle_epi8(v, shuffle));
+        }
+        DecodeDepthScalar<DecodeD24, 3>(src + i * 3, depth + i, count - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static void EncodeD24SSSE3(const uint32_t* depth, uint8_t* dst, size_t count) {
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                -128, -128, -128, -128);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i));
+            Store12SSSE3(dst + i * 3, _mm_shuffle_epi8(v, shuffle));
+        }
+        EncodeDepthScalar<EncodeD24, 3>(depth + i, dst + i * 3, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void ShuffleSpanAVX2(const uint8_t* src, uint8_t* dst, size_t count) {
+        const __m256i reverse = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+                11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4),
+                    _mm256_shuffle_epi8(v, reverse));
+        }
+        ShuffleSpanSSSE3(src + i * 4, dst + i * 4, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i Expand4AVX2(__m256i c) {
+        return _mm256_or_si256(_mm256_slli_epi16(c, 4), c);
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i Expand5AVX2(__m256i c) {
+        return _mm256_or_si256(_mm256_slli_epi16(c, 3), _mm256_srli_epi16(c, 2));
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i Expand6AVX2(__m256i c) {
+        return _mm256_or_si256(_mm256_slli_epi16(c, 2), _mm256_srli_epi16(c, 4));
+    }
+
+    // Keep the top bits of the 8-bit channel c and move them to bit shift
+    __attribute__((target("avx2")))
+    static __m256i FieldAVX2(__m256i c, int drop, int shift) {
+        return _mm256_slli_epi16(_mm256_srli_epi16(c, drop), shift);
+    }
+
+    // AVX2 versions of UnpackPacked16SSE2/PackPacked16SSE2, for 16 pixels
+    template <Packed16 FORMAT>
+    __attribute__((target("avx2")))
+    static void UnpackPacked16AVX2(__m256i v, __m256i& r, __m256i& g, __m256i& b, __m256i& a) {
+        const __m256i mask4 = _mm256_set1_epi16(0xF);
+        const __m256i mask5 = _mm256_set1_epi16(0x1F);
+
+        switch (FORMAT) {
+        case Packed16::RGB565:
+            r = Expand5AVX2(_mm256_srli_epi16(v, 11));
+            g = Expand6AVX2(_mm256_and_si256(_mm256_srli_epi16(v, 5), _mm256_set1_epi16(0x3F)));
+            b = Expand5AVX2(_mm256_and_si256(v, mask5));
+            a = _mm256_set1_epi16(0xFF);
+            break;
+        case Packed16::RGB5A1:
+            r = Expand5AVX2(_mm256_srli_epi16(v, 11));
+            g = Expand5AVX2(_mm256_and_si256(_mm256_srli_epi16(v, 6), mask5));
+            b = Expand5AVX2(_mm256_and_si256(_mm256_srli_epi16(v, 1), mask5));
+            a = _mm256_and_si256(_mm256_sub_epi16(_mm256_setzero_si256(),
+                    _mm256_and_si256(v, _mm256_set1_epi16(1))), _mm256_set1_epi16(0xFF));
+            break;
+        case Packed16::RGBA4:
+            r = Expand4AVX2(_mm256_srli_epi16(v, 12));
+            g = Expand4AVX2(_mm256_and_si256(_mm256_srli_epi16(v, 8), mask4));
+            b = Expand4AVX2(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask4));
+            a = Expand4AVX2(_mm256_and_si256(v, mask4));
+            break;
+        }
+    }
+
+    template <Packed16 FORMAT>
+    __attribute__((target("avx2")))
+    static __m256i PackPacked16AVX2(__m256i r, __m256i g, __m256i b, __m256i a) {
+        switch (FORMAT) {
+        case Packed16::RGB565:
+            return _mm256_or_si256(_mm256_or_si256(FieldAVX2(r, 3, 11), FieldAVX2(g, 2, 5)),
+                    _mm256_srli_epi16(b, 3));
+        case Packed16::RGB5A1:
+            return _mm256_or_si256(_mm256_or_si256(FieldAVX2(r, 3, 11), FieldAVX2(g, 3, 6)),
+                    _mm256_or_si256(FieldAVX2(b, 3, 1), _mm256_srli_epi16(a, 7)));
+        case Packed16::RGBA4:
+        default:
+            return _mm256_or_si256(_mm256_or_si256(FieldAVX2(r, 4, 12), FieldAVX2(g, 4, 8)),
+                    _mm256_or_si256(FieldAVX2(b, 4, 4), _mm256_srli_epi16(a, 4)));
+        }
+    }
+
+    template <Packed16 FORMAT>
+    __attribute__((target("avx2")))
+    static void DecodePacked16AVX2(const uint8_t* src, uint8_t* rgba, size_t count) {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 2));
+            __m256i r, g, b, a;
+            UnpackPacked16AVX2<FORMAT>(v, r, g, b, a);
+            __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+            __m256i ba = _mm256_or_si256(b, _mm256_slli_epi16(a, 8));
+            // Unpacking works per 128-bit lane, put the pixels back in order
+            __m256i lo = _mm256_unpacklo_epi16(rg, ba);
+            __m256i hi = _mm256_unpackhi_epi16(rg, ba);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + i * 4),
+                    _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + i * 4 + 32),
+                    _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+        DecodePacked16SSE2<FORMAT>(src + i * 2, rgba + i * 4, count - i);
+    }
+
+    template <Packed16 FORMAT>
+    __attribute__((target("avx2")))
+    static void EncodePacked16AVX2(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i p0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba + i * 4));
+            __m256i p1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba + i * 4 + 32));
+            __m256i channel[4];
+            for (int c = 0; c < 4; c++) {
+                channel[c] = _mm256_packs_epi32(
+                        _mm256_and_si256(_mm256_srli_epi32(p0, c * 8), byte_mask),
+                        _mm256_and_si256(_mm256_srli_epi32(p1, c * 8), byte_mask));
+            }
+            __m256i packed = PackPacked16AVX2<FORMAT>(channel[0], channel[1], channel[2],
+                    channel[3]);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 2),
+                    _mm256_permute4x64_epi64(packed, 0xD8));
+        }
+        EncodePacked16SSE2<FORMAT>(rgba + i * 4, dst + i * 2, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void DecodeD16AVX2(const uint8_t* src, uint32_t* depth, size_t count) {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(depth + i), _mm256_cvtepu16_epi32(v));
+        }
+        DecodeDepthScalar<DecodeD16, 2>(src + i * 2, depth + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void EncodeD16AVX2(const uint32_t* depth, uint8_t* dst, size_t count) {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i d0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(depth + i));
+            __m256i d1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(depth + i + 8));
+            d0 = _mm256_srai_epi32(_mm256_slli_epi32(d0, 16), 16);
+            d1 = _mm256_srai_epi32(_mm256_slli_epi32(d1, 16), 16);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 2),
+                    _mm256_permute4x64_epi64(_mm256_packs_epi32(d0, d1), 0xD8));
+        }
+        EncodeD16SSE2(depth + i, dst + i * 2, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void DecodeD24S8AVX2(const uint8_t* src, uint32_t* depth, uint8_t* stencil,
+            size_t count) {
+        const __m256i depth_mask = _mm256_set1_epi32(0xFFFFFF);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(depth + i),
+                    _mm256_and_si256(w, depth_mask));
+            __m256i s = _mm256_srli_epi32(w, 24);
+            __m128i s16 = _mm_packs_epi32(_mm256_castsi256_si128(s),
+                    _mm256_extracti128_si256(s, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(stencil + i),
+                    _mm_packus_epi16(s16, _mm_setzero_si128()));
+        }
+        DecodeD24S8Scalar(src + i * 4, depth + i, stencil + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void EncodeD24S8AVX2(const uint32_t* depth, const uint8_t* stencil, uint8_t* dst,
+            size_t count) {
+        const __m256i depth_mask = _mm256_set1_epi32(0xFFFFFF);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(depth + i));
+            __m256i s = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(stencil + i)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4),
+                    _mm256_or_si256(_mm256_and_si256(d, depth_mask), _mm256_slli_epi32(s, 24)));
+        }
+        EncodeD24S8Scalar(depth + i, stencil + i, dst + i * 4, count - i);
+    }
+#endif
+
+    static SpanISA DetectSpanISA() {
+#ifdef COLOR_X86
+        if (HasAVX2())
+            return SpanISA::AVX2;
+        if (HasSSSE3())
+            return SpanISA::SSSE3;
+#endif
+#if defined(__SSE2__)
+        return SpanISA::SSE2;
+#else
+        return SpanISA::Scalar;
+#endif
+    }
+
+    // Each level starts from the one below and replaces the kernels it speeds up
+    static SpanKernels SelectKernels(SpanISA isa) {
+        SpanKernels k;
+        k.decode_rgba8 = ReverseRGBA8Scalar;
+        k.decode_rgb8 = DecodeScalar<DecodeRGB8, 3>;
+        k.decode_rg8 = DecodeScalar<DecodeRG8, 2>;
+        k.decode_rgb565 = DecodePacked16Scalar<Packed16::RGB565>;
+        k.decode_rgb5a1 = DecodePacked16Scalar<Packed16::RGB5A1>;
+        k.decode_rgba4 = DecodePacked16Scalar<Packed16::RGBA4>;
+        k.encode_rgba8 = ReverseRGBA8Scalar;
+        k.encode_rgb8 = EncodeScalar<EncodeRGB8, 3>;
+        k.encode_rg8 = EncodeScalar<EncodeRG8, 2>;
+        k.encode_rgb565 = EncodePacked16Scalar<Packed16::RGB565>;
+        k.encode_rgb5a1 = EncodePacked16Scalar<Packed16::RGB5A1>;
+        k.encode_rgba4 = EncodePacked16Scalar<Packed16::RGBA4>;
+        k.decode_d16 = DecodeDepthScalar<DecodeD16, 2>;
+        k.decode_d24 = DecodeDepthScalar<DecodeD24, 3>;
+        k.decode_d24s8 = DecodeD24S8Scalar;
+        k.encode_d16 = EncodeDepthScalar<EncodeD16, 2>;
+        k.encode_d24 = EncodeDepthScalar<EncodeD24, 3>;
+        k.encode_d24s8 = EncodeD24S8Scalar;
+        k.box_filter_2x1 = BoxFilterScalar<false>;
+        k.box_filter_2x2 = BoxFilterScalar<true>;
+
+#if defined(__SSE2__)
+        if (isa >= SpanISA::SSE2) {
+            k.decode_rgba8 = k.encode_rgba8 = ReverseRGBA8SSE2;
+            k.decode_rgb565 = DecodePacked16SSE2<Packed16::RGB565>;
+            k.decode_rgb5a1 = DecodePacked16SSE2<Packed16::RGB5A1>;
+            k.decode_rgba4 = DecodePacked16SSE2<Packed16::RGBA4>;
+            k.encode_rgb565 = EncodePacked16SSE2<Packed16::RGB565>;
+            k.encode_rgb5a1 = EncodePacked16SSE2<Packed16::RGB5A1>;
+            k.encode_rgba4 = EncodePacked16SSE2<Packed16::RGBA4>;
+            k.decode_d16 = DecodeD16SSE2;
+            k.encode_d16 = EncodeD16SSE2;
+            k.decode_d24s8 = DecodeD24S8SSE2;
+            k.encode_d24s8 = EncodeD24S8SSE2;
+            k.box_filter_2x1 = BoxFilterSSE2<false>;
+            k.box_filter_2x2 = BoxFilterSSE2<true>;
+        }
+#endif
+#ifdef COLOR_X86
+        if (isa >= SpanISA::SSSE3) {
+            k.decode_rgba8 = k.encode_rgba8 = ShuffleSpanSSSE3;
+            k.decode_rgb8 = DecodeRGB8SSSE3;
+            k.encode_rgb8 = EncodeRGB8SSSE3;
+            k.decode_rg8 = DecodeRG8SSSE3;
+            k.encode_rg8 = EncodeRG8SSSE3;
+            k.decode_d24 = DecodeD24SSSE3;
+            k.encode_d24 = EncodeD24SSSE3;
+        }
+        if (isa >= SpanISA::AVX2) {
+            k.decode_rgba8 = k.encode_rgba8 = ShuffleSpanAVX2;
+            k.decode_rgb565 = DecodePacked16AVX2<Packed16::RGB565>;
+            k.decode_rgb5a1 = DecodePacked16AVX2<Packed16::RGB5A1>;
+            k.decode_rgba4 = DecodePacked16AVX2<Packed16::RGBA4>;
+            k.encode_rgb565 = EncodePacked16AVX2<Packed16::RGB565>;
+            k.encode_rgb5a1 = EncodePacked16AVX2<Packed16::RGB5A1>;
+            k.encode_rgba4 = EncodePacked16AVX2<Packed16::RGBA4>;
+            k.decode_d16 = DecodeD16AVX2;
+            k.encode_d16 = EncodeD16AVX2;
+            k.decode_d24s8 = DecodeD24S8AVX2;
+            k.encode_d24s8 = EncodeD24S8AVX2;
+        }
+#endif
+        return k;
+    }
+
+    struct SpanState {
+        SpanISA isa;
+        SpanKernels kernels;
+
+        SpanState() : isa(GetHostSpanISA()), kernels(SelectKernels(isa)) {}
+    };
+
+    static SpanState& GetSpanState() {
+        static SpanState state;
+        return state;
+    }
+
+    SpanISA GetHostSpanISA() {
+        static const SpanISA host = DetectSpanISA();
+        return host;
+    }
+
+    SpanISA GetSpanISA() {
+        return GetSpanState().isa;
+    }
+
+    SpanISA SetSpanISA(SpanISA isa) {
+        SpanState& state = GetSpanState();
+        state.isa = std::min(isa, GetHostSpanISA());
+        state.kernels = SelectKernels(state.isa);
+        return state.isa;
+    }
+
+    void DecodeRGBA8Span(const uint8_t* src, uint8_t* rgba, size_t count) {
+        GetSpanState().kernels.decode_rgba8(src, rgba, count);
+    }
+
+    void DecodeRGB8Span(const uint8_t* src, uint8_t* rgba, size_t count) {
+        GetSpanState().kernels.decode_rgb8(src, rgba, count);
+    }
+
+    void DecodeRG8Span(const uint8_t* src, uint8_t* rgba, size_t count) {
+        GetSpanState().kernels.decode_rg8(src, rgba, count);
+    }
+
+    void DecodeRGB565Span(const uint8_t* src, uint8_t* rgba, size_t count) {
+        GetSpanState().kernels.decode_rgb565(src, rgba, count);
+    }
+
+    void DecodeRGB5A1Span(const uint8_t* src, uint8_t* rgba, size_t count) {
+        GetSpanState().kernels.decode_rgb5a1(src, rgba, count);
+    }
+
+    void DecodeRGBA4Span(const uint8_t* src, uint8_t* rgba, size_t count) {
+        GetSpanState().kernels.decode_rgba4(src, rgba, count);
+    }
+
+    void EncodeRGBA8Span(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_rgba8(rgba, dst, count);
+    }
+
+    void EncodeRGB8Span(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_rgb8(rgba, dst, count);
+    }
+
+    void EncodeRG8Span(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_rg8(rgba, dst, count);
+    }
+
+    void EncodeRGB565Span(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_rgb565(rgba, dst, count);
+    }
+
+    void EncodeRGB5A1Span(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_rgb5a1(rgba, dst, count);
+    }
+
+    void EncodeRGBA4Span(const uint8_t* rgba, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_rgba4(rgba, dst, count);
+    }
+
+    void DecodeD16Span(const uint8_t* src, uint32_t* depth, size_t count) {
+        GetSpanState().kernels.decode_d16(src, depth, count);
+    }
+
+    void DecodeD24Span(const uint8_t* src, uint32_t* depth, size_t count) {
+        GetSpanState().kernels.decode_d24(src, depth, count);
+    }
+
+    void DecodeD24S8Span(const uint8_t* src, uint32_t* depth, uint8_t* stencil, size_t count) {
+        GetSpanState().kernels.decode_d24s8(src, depth, stencil, count);
+    }
+
+    void EncodeD16Span(const uint32_t* depth, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_d16(depth, dst, count);
+    }
+
+    void EncodeD24Span(const uint32_t* depth, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.encode_d24(depth, dst, count);
+    }
+
+    void EncodeD24S8Span(const uint32_t* depth, const uint8_t* stencil, uint8_t* dst,
+            size_t count) {
+        GetSpanState().kernels.encode_d24s8(depth, stencil, dst, count);
+    }
+
+    void BoxFilter2x1Span(const uint8_t* row, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.box_filter_2x1(row, row, dst, count);
+    }
+
+    void BoxFilter2x2Span(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, size_t count) {
+        GetSpanState().kernels.box_filter_2x2(row0, row1, dst, count);
+    }
+
+}
@@ -0,0 +1,911 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <numeric>
+#include "command.h"
+#include "memory.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Command {
+
+    // Byte enable mask to bit mask
+    static uint32_t ExpandMask(unsigned mask) {
+        return ((mask & 1) ? 0x000000ff : 0) | ((mask & 2) ? 0x0000ff00 : 0) |
+                ((mask & 4) ? 0x00ff0000 : 0) | ((mask & 8) ? 0xff000000 : 0);
+    }
+
+    // Uniforms and fixed attributes are written as four packed floats
+    static_assert(sizeof(Vec4<float24>) == 4 * sizeof(float),
+            "Vec4<float24> is not four floats");
+
+#if defined(__SSE2__)
+    // Widen four float24 in the low 24 bits of each lane to float32, bit
+    // exact with float24::FromRaw()
+    static __m128i Float24ToFloat32(__m128i raw) {
+        const __m128i magnitude = _mm_and_si128(raw, _mm_set1_epi32(0x7fffff));
+        // Rebias the 7-bit exponent to 8 bits
+        __m128i result = _mm_add_epi32(_mm_slli_epi32(magnitude, 7),
+                _mm_set1_epi32(64 << 23));
+        // Maximum exponent is infinity or NaN
+        const __m128i exponent = _mm_and_si128(raw, _mm_set1_epi32(0x7f0000));
+        const __m128i special = _mm_cmpeq_epi32(exponent,
+                _mm_set1_epi32(0x7f0000));
+        result = _mm_or_si128(result,
+                _mm_and_si128(special, _mm_set1_epi32(0x7f800000)));
+        // Zero keeps only the sign
+        const __m128i zero = _mm_cmpeq_epi32(magnitude, _mm_setzero_si128());
+        result = _mm_andnot_si128(zero, result);
+        const __m128i sign = _mm_and_si128(_mm_slli_epi32(raw, 8),
+                _mm_set1_epi32(0x80000000));
+        return _mm_or_si128(result, sign);
+    }
+
+    // Three words, most significant first, to x, y, z, w in the low 24 bits
+    static __m128i SplitFloat24(__m128i words) {
+        // Reverse the words so the 96 bits are contiguous, x in the low bits
+        const __m128i bits = _mm_shuffle_epi32(words, _MM_SHUFFLE(3, 0, 1, 2));
+        const __m128i xy = _mm_unpacklo_epi32(bits, _mm_srli_si128(bits, 3));
+        const __m128i zw = _mm_unpacklo_epi32(_mm_srli_si128(bits, 6),
+                _mm_srli_si128(bits, 9));
+        return _mm_unpacklo_epi64(xy, zw);
+    }
+#endif
+
+    /**
+    * Unpack vectors of four float24, each packed into three words w first
+    * @param words Source words, 3 per vector
+    * @param out Destination vectors
+    * @param count Number of vectors
+    */
+    static void UnpackFloat24(const uint32_t* words, Vec4<float24>* out,
+            unsigned count) {
+#if defined(__SSE2__)
+        unsigned i = 0;
+        // Every vector but the last has a word to spare for a 16-byte load
+        for (; i + 1 < count; i++, words += 3) {
+            const __m128i raw = SplitFloat24(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(words)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&out[i]),
+                    Float24ToFloat32(raw));
+        }
+        if (i < count) {
+            uint32_t last[4] = {};
+            std::memcpy(last, words, 3 * sizeof(uint32_t));
+            const __m128i raw = SplitFloat24(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(last)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&out[i]),
+                    Float24ToFloat32(raw));
+        }
+#else
+        for (unsigned i = 0; i < count; i++, words += 3) {
+            out[i] = MakeVec(
+                    float24::FromRaw(words[2] & 0xffffff),
+                    float24::FromRaw(((words[1] & 0xffff) << 8) | (words[2] >> 24)),
+                    float24::FromRaw(((words[0] & 0xff) << 16) | (words[1] >> 16)),
+                    float24::FromRaw(words[0] >> 8));
+        }
+#endif
+    }
+
+    /**
+    * Unpack vectors of four float32, w first
+    * @param words Source words, 4 per vector
+    * @param out Destination vectors
+    * @param count Number of vectors
+    */
+    static void UnpackFloat32(const uint32_t* words, Vec4<float24>* out,
+            unsigned count) {
+#if defined(__SSE2__)
+        // float24 holds a plain float, only the order changes
+        for (unsigned i = 0; i < count; i++, words += 4) {
+            const __m128i value = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(words));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&out[i]),
+                    _mm_shuffle_epi32(value, _MM_SHUFFLE(0, 1, 2, 3)));
+        }
+#else
+        for (unsigned i = 0; i < count; i++, words += 4) {
+            float value[4];
+            std::memcpy(value, words, sizeof(value));
+            out[i] = MakeVec(
+                    float24::FromFloat32(value[3]),
+                    float24::FromFloat32(value[2]),
+                    float24::FromFloat32(value[1]),
+                    float24::FromFloat32(value[0]));
+        }
+#endif
+    }
+
+    void CommandList::Add(unsigned id, unsigned mask, const uint32_t* values,
+            unsigned count, bool incremental) {
+        while (count) {
+            const unsigned length = std::min(count, MAX_BURST_LENGTH);
+
+            CommandHeader header;
+            header.hex = 0;
+            header.id = id;
+            header.mask = mask;
+            header.extra_params = length - 1;
+            header.incremental = incremental;
+
+            words.push_back(values[0]);
+            words.push_back(header.hex);
+            words.insert(words.end(), values + 1, values + length);
+            if (words.size() % 2)
+                words.push_back(0);
+
+            values += length;
+            count -= length;
+            if (incremental)
+                id += length;
+        }
+    }
+
+    CommandProcessor::CommandProcessor(Rasterizer& rasterizer,
+            Framebuffer::OutputMerger& output_merger,
+            Framebuffer::EarlyDepthUnit& early_depth,
+            TexEnv::FogUnit& fog, Lighting::LightingUnit& lighting,
+            Texturing::ProcTexUnit& proctex) :
+            rasterizer(rasterizer), output_merger(output_merger),
+            early_depth(early_depth), fog(fog), lighting(lighting),
+            proctex(proctex), shader_engine(setup, uniforms) {
+        rasterizer.SetOutputMerger(&output_merger);
+        rasterizer.SetEarlyDepth(&early_depth);
+        rasterizer.SetFog(&fog);
+        rasterizer.SetLighting(&lighting);
+        rasterizer.SetProcTex(&proctex);
+
+        setup.program_code.fill(0);
+        setup.swizzle_data.fill(0);
+        setup.entry_point = 0;
+        std::memset(uniforms.f, 0, sizeof(uniforms.f));
+        uniforms.b.fill(false);
+        uniforms.i.fill(MakeVec<uint8_t>(0, 0, 0, 0));
+        output_map.total = 0;
+        for (unsigned i = 0; i < 7; i++)
+            output_map.attributes[i].hex = 0x1f1f1f1f;
+        for (unsigned i = 0; i < 12; i++)
+            fixed_attributes[i] = MakeVec(float24::Zero(), float24::Zero(),
+                    float24::Zero(), float24::FromFloat32(1.0f));
+
+        // Depth map of citro3d, near plane at 1 and far plane at 0
+        regs[GPUREG_DEPTHMAP_SCALE] = 0xbf0000; // -1.0
+    }
+
+    const std::array<CommandProcessor::RegisterInfo, NUM_REGS>&
+            CommandProcessor::GetRegisterInfo() {
+        static const std::array<RegisterInfo, NUM_REGS> info = [] {
+            std::array<RegisterInfo, NUM_REGS> t;
+            t.fill({Target::None, false, 0});
+
+            auto target = [&t](unsigned first, unsigned last, Target target,
+                    bool strobe = false) {
+                for (unsigned id = first; id <= last; id++) {
+                    t[id].target = target;
+                    t[id].strobe = strobe;
+                }
+            };
+
+            auto dirty = [&t](unsigned first, unsigned last, uint8_t flags) {
+                for (unsigned id = first; id <= last; id++)
+                    t[id].dirty |= flags;
+            };
+
+            target(Framebuffer::REGISTER_BASE, GPUREG_FRAGOP_SHADOW,
+                    Target::OutputMerger);
+            target(GPUREG_FRAMEBUFFER_INVALIDATE, GPUREG_FRAMEBUFFER_FLUSH,
+                    Target::OutputMerger, true);
+            target(Lighting::REGISTER_BASE, GPUREG_LIGHTING_LIGHT_PERMUTATION,
+                    Target::Lighting);
+            target(GPUREG_LIGHTING_LUT_INDEX, GPUREG_LIGHTING_LUT_INDEX,
+                    Target::Lighting, true);
+            target(GPUREG_LIGHTING_LUT_DATA0, GPUREG_LIGHTING_LUT_DATA7,
+                    Target::Lighting, true);
+
+            target(GPUREG_TEXUNIT3_PROCTEX0, GPUREG_TEXUNIT3_PROCTEX5,
+                    Target::ProcTex);
+            target(GPUREG_PROCTEX_LUT, GPUREG_PROCTEX_LUT, Target::ProcTex, true);
+            target(GPUREG_PROCTEX_LUT_DATA0, GPUREG_PROCTEX_LUT_DATA7,
+                    Target::ProcTex, true);
+
+            target(GPUREG_EARLYDEPTH_FUNC, GPUREG_EARLYDEPTH_TEST1,
+                    Target::EarlyDepth);
+            target(GPUREG_EARLYDEPTH_CLEAR, GPUREG_EARLYDEPTH_CLEAR,
+                    Target::EarlyDepth, true);
+            target(GPUREG_EARLYDEPTH_DATA, GPUREG_EARLYDEPTH_DATA,
+                    Target::EarlyDepth);
+            target(GPUREG_EARLYDEPTH_TEST2, GPUREG_EARLYDEPTH_TEST2,
+                    Target::EarlyDepth);
+
+            target(GPUREG_FOG_COLOR, GPUREG_FOG_COLOR, Target::Fog);
+            target(GPUREG_GAS_ATTENUATION, GPUREG_GAS_ACCMAX, Target::Fog);
+            target(GPUREG_FOG_LUT_INDEX, GPUREG_FOG_LUT_INDEX, Target::Fog, true);
+            target(GPUREG_FOG_LUT_DATA0, GPUREG_FOG_LUT_DATA7, Target::Fog, true);
+            target(GPUREG_GAS_LIGHT_XY, GPUREG_GAS_LIGHT_Z_COLOR, Target::Fog);
+            target(GPUREG_GAS_LUT_INDEX, GPUREG_GAS_LUT_DATA, Target::Fog, true);
+
+            target(GPUREG_FINALIZE, GPUREG_FINALIZE, Target::Processor, true);
+            target(GPUREG_DRAWARRAYS, GPUREG_DRAWELEMENTS, Target::Processor,
+                    true);
+            target(GPUREG_FIXEDATTRIB_INDEX, GPUREG_FIXEDATTRIB_INDEX,
+                    Target::Processor, true);
+            target(GPUREG_FIXEDATTRIB_DATA0, GPUREG_FIXEDATTRIB_DATA2,
+                    Target::FixedAttributeData, true);
+            target(GPUREG_CMDBUF_JUMP0, GPUREG_CMDBUF_JUMP1, Target::Processor,
+                    true);
+            target(GPUREG_START_DRAW_FUNC0, GPUREG_START_DRAW_FUNC0,
+                    Target::Processor, true);
+            target(GPUREG_RESTART_PRIMITIVE, GPUREG_RESTART_PRIMITIVE,
+                    Target::Processor, true);
+            target(GPUREG_VSH_BOOLUNIFORM, GPUREG_VSH_INTUNIFORM_I3,
+                    Target::Processor);
+            target(GPUREG_VSH_CODETRANSFER_END, GPUREG_VSH_CODETRANSFER_END,
+                    Target::Processor, true);
+            target(GPUREG_VSH_FLOATUNIFORM_INDEX, GPUREG_VSH_FLOATUNIFORM_INDEX,
+                    Target::Processor, true);
+            target(GPUREG_VSH_CODETRANSFER_INDEX, GPUREG_VSH_CODETRANSFER_INDEX,
+                    Target::Processor, true);
+            target(GPUREG_VSH_OPDESCS_INDEX, GPUREG_VSH_OPDESCS_INDEX,
+                    Target::Processor, true);
+
+            target(GPUREG_VSH_FLOATUNIFORM_DATA0, GPUREG_VSH_FLOATUNIFORM_DATA7,
+                    Target::FloatUniformData, true);
+            target(GPUREG_VSH_CODETRANSFER_DATA0, GPUREG_VSH_CODETRANSFER_DATA7,
+                    Target::CodeData, true);
+            target(GPUREG_VSH_OPDESCS_DATA0, GPUREG_VSH_OPDESCS_DATA7,
+                    Target::SwizzleData, true);
+
+            dirty(GPUREG_TEXENV0_SOURCE, GPUREG_TEXENV_UPDATE_BUFFER,
+                    DIRTY_TEXENV);
+            dirty(GPUREG_TEXENV4_SOURCE, GPUREG_TEXENV_BUFFER_COLOR,
+                    DIRTY_TEXENV);
+            dirty(GPUREG_TEXUNIT_CONFIG, GPUREG_TEXUNIT2_TYPE, DIRTY_TEXTURE);
+            dirty(GPUREG_VIEWPORT_WIDTH, GPUREG_VIEWPORT_INVH, DIRTY_VIEWPORT);
+            dirty(GPUREG_DEPTHMAP_SCALE, GPUREG_DEPTHMAP_OFFSET, DIRTY_DEPTH_MAP);
+            dirty(GPUREG_SH_OUTMAP_TOTAL, GPUREG_SH_OUTMAP_O6, DIRTY_OUTPUT_MAP);
+            dirty(GPUREG_ATTRIBBUFFERS_LOC, GPUREG_ATTRIBBUFFER0_OFFSET + 3 * 12 - 1,
+                    DIRTY_VERTEX_LAYOUT);
+            dirty(GPUREG_VSH_ATTRIBUTES_PERMUTATION_LOW,
+                    GPUREG_VSH_ATTRIBUTES_PERMUTATION_HIGH, DIRTY_VERTEX_LAYOUT);
+            dirty(GPUREG_VSH_ENTRYPOINT, GPUREG_VSH_ENTRYPOINT,
+                    DIRTY_ENTRY_POINT);
+            return t;
+        }();
+        return info;
+    }
+
+    void CommandProcessor::ProcessCommandList(const uint32_t* list,
+            size_t words) {
+        const uint32_t* end = list + words;
+        finalized = false;
+
+        while (list + 2 <= end && !finalized) {
+            CommandHeader header;
+            header.hex = list[1];
+            const unsigned extra = header.extra_params;
+            const size_t length = 2 + extra + (extra & 1);
+            if (list + length > end) {
+                fprintf(stderr, "Command list truncated at register %x\n",
+                        (unsigned)header.id);
+                break;
+            }
+
+            // The first parameter precedes the header
+            WriteRegisters(header.id, list, 1, header.mask, header.incremental);
+            if (extra)
+                WriteRegisters(header.id + (header.incremental ? 1 : 0),
+                        list + 2, extra, header.mask, header.incremental);
+            list += length;
+
+            if (jump_target) {
+                list = jump_target;
+                end = list + jump_words;
+                jump_target = nullptr;
+            }
+        }
+
+        // Register writes of the next list may affect the vertices
+        FlushImmediate();
+    }
+
+    void CommandProcessor::WriteRegister(unsigned id, uint32_t value,
+            unsigned mask) {
+        if (id >= NUM_REGS) {
+            fprintf(stderr, "Invalid register %x\n", id);
+            return;
+        }
+
+        const RegisterInfo& info = GetRegisterInfo()[id];
+        if (!immediate_attributes.empty() &&
+                info.target != Target::FixedAttributeData)
+            FlushImmediate();
+
+        const uint32_t bits = ExpandMask(mask);
+        value = (regs[id] & ~bits) | (value & bits);
+        if (value == regs[id] && !info.strobe) {
+            stats.redundant_writes++;
+            return;
+        }
+        regs[id] = value;
+        dirty |= info.dirty;
+
+        switch (info.target) {
+        case Target::None:
+            break;
+        case Target::OutputMerger:
+            output_merger.WriteRegister(id - Framebuffer::REGISTER_BASE, value);
+            break;
+        case Target::EarlyDepth:
+            early_depth.WriteRegister(id, value);
+            break;
+        case Target::Fog:
+            fog.WriteRegister(id, value);
+            break;
+        case Target::Lighting:
+            lighting.WriteRegister(id - Lighting::REGISTER_BASE, value);
+            break;
+        case Target::ProcTex:
+            proctex.WriteRegister(id, value);
+            break;
+        case Target::Processor:
+            Execute(id, value);
+            break;
+        case Target::CodeData:
+            UploadCode(&value, 1);
+            break;
+        case Target::SwizzleData:
+            UploadSwizzle(&value, 1);
+            break;
+        case Target::FloatUniformData:
+            UploadFloatUniforms(&value, 1);
+            break;
+        case Target::FixedAttributeData:
+            UploadFixedAttributes(&value, 1);
+            break;
+        }
+    }
+
+    void CommandProcessor::WriteRegisters(unsigned id, const uint32_t* values,
+            unsigned count, unsigned mask, bool incremental) {
+        if (mask != 0xf) {
+            for (unsigned i = 0; i < count; i++)
+                WriteRegister(incremental ? id + i : id, values[i], mask);
+            return;
+        }
+
+        const auto& info = GetRegisterInfo();
+        if (incremental && id + count > NUM_REGS) {
+            fprintf(stderr, "Invalid register %x\n", id + count - 1);
+            count = (id < NUM_REGS) ? NUM_REGS - id : 0;
+        }
+
+        while (count) {
+            if (id >= NUM_REGS) {
+                fprintf(stderr, "Invalid register %x\n", id);
+                return;
+            }
+
+            // Number of values consumed by this iteration
+            unsigned n = 1;
+            const Target target = info[id].target;
+            if (!immediate_attributes.empty() &&
+                    target != Target::FixedAttributeData)
+                FlushImmediate();
+            if (incremental) {
+                while (n < count && info[id + n].target == target)
+                    n++;
+            } else {
+                n = count;
+            }
+
+            switch (target) {
+            case Target::None: {
+                // No side effects, only the last value of a run to a single
+                // register is visible
+                const unsigned first = incremental ? 0 : n - 1;
+                const unsigned length = incremental ? n : 1;
+                if (std::memcmp(&regs[id], &values[first],
+                        length * sizeof(uint32_t)) == 0) {
+                    stats.redundant_writes += n;
+                    break;
+                }
+                std::memcpy(&regs[id], &values[first], length * sizeof(uint32_t));
+                for (unsigned i = 0; i < length; i++)
+                    dirty |= info[id + i].dirty;
+                break;
+            }
+            case Target::CodeData:
+                regs[id] = values[n - 1];
+                UploadCode(values, n);
+                break;
+            case Target::SwizzleData:
+                regs[id] = values[n - 1];
+                UploadSwizzle(values, n);
+                break;
+            case Target::FloatUniformData:
+                regs[id] = values[n - 1];
+                UploadFloatUniforms(values, n);
+                break;
+            case Target::FixedAttributeData:
+                regs[id] = values[n - 1];
+                UploadFixedAttributes(values, n);
+                break;
+            default:
+                // The units unpack LUT data as it arrives
+                for (unsigned i = 0; i < n; i++)
+                    WriteRegister(incremental ? id + i : id, values[i]);
+                break;
+            }
+
+            values += n;
+            count -= n;
+            if (incremental)
+                id += n;
+        }
+    }
+
+    void CommandProcessor::Execute(unsigned id, uint32_t value) {
+        switch (id) {
+        case GPUREG_FINALIZE:
+            finalized = true;
+            break;
+
+        case GPUREG_DRAWARRAYS:
+        case GPUREG_DRAWELEMENTS:
+            if (value & 1)
+                Draw(id == GPUREG_DRAWELEMENTS);
+            break;
+
+        case GPUREG_FIXEDATTRIB_INDEX:
+            fixed_attribute_index = value & 0xf;
+            fixed_attribute_words = 0;
+            // Drop an incomplete immediate vertex
+            immediate_attributes.clear();
+            break;
+
+        case GPUREG_CMDBUF_JUMP0:
+        case GPUREG_CMDBUF_JUMP1: {
+            const unsigned channel = id - GPUREG_CMDBUF_JUMP0;
+            const uint32_t address = regs[GPUREG_CMDBUF_ADDR0 + channel] << 3;
+            const uint32_t size = regs[GPUREG_CMDBUF_SIZE0 + channel] << 3;
+            if (!Memory::IsValidRange(address, size)) {
+                fprintf(stderr, "Invalid command buffer %08x size %x\n",
+                        address, size);
+                finalized = true;
+                break;
+            }
+            jump_target = reinterpret_cast<const uint32_t*>(
+                    Memory::GetPhysicalPointer(address));
+            jump_words = size / 4;
+            break;
+        }
+
+        case GPUREG_START_DRAW_FUNC0:
+            // Cleared before draws, set again when going back to
+            // configuration
+            configuring = value & 1;
+            if (!configuring)
+                SyncState();
+            else
+                rasterizer.DrawTriangles();
+            break;
+
+        case GPUREG_RESTART_PRIMITIVE:
+            primitive_index = 0;
+            strip_ready = false;
+            break;
+
+        case GPUREG_VSH_BOOLUNIFORM:
+            for (unsigned i = 0; i < 16; i++)
+                uniforms.b[i] = (value >> i) & 1;
+            break;
+
+        case GPUREG_VSH_INTUNIFORM_I0:
+        case GPUREG_VSH_INTUNIFORM_I0 + 1:
+        case GPUREG_VSH_INTUNIFORM_I0 + 2:
+        case GPUREG_VSH_INTUNIFORM_I3:
+            uniforms.i[id - GPUREG_VSH_INTUNIFORM_I0] = MakeVec<uint8_t>(
+                    value & 0xff, (value >> 8) & 0xff,
+                    (value >> 16) & 0xff, value >> 24);
+            break;
+
+        case GPUREG_VSH_FLOATUNIFORM_INDEX:
+            float_uniform_index = value & 0xff;
+            float_uniform_f32 = value >> 31;
+            float_uniform_words = 0;
+            break;
+
+        case GPUREG_VSH_CODETRANSFER_END:
+            // Rehash once per upload, only if some word changed
+            if (dirty & DIRTY_PROGRAM)
+                UpdateProgram();
+            dirty &= ~DIRTY_PROGRAM;
+            break;
+
+        case GPUREG_VSH_CODETRANSFER_INDEX:
+            code_offset = value & 0xfff;
+            break;
+
+        case GPUREG_VSH_OPDESCS_INDEX:
+            swizzle_offset = value & 0xfff;
+            break;
+
+        default:
+            UNREACHABLE();
+        }
+    }
+
+    void CommandProcessor::UploadCode(const uint32_t* values, unsigned count) {
+        const unsigned n = (code_offset < MAX_PROGRAM_CODE_LENGTH) ?
+                std::min(count, MAX_PROGRAM_CODE_LENGTH - code_offset) : 0;
+        if (n < count)
+            fprintf(stderr, "Shader code upload exceeds %u words\n",
+                    MAX_PROGRAM_CODE_LENGTH);
+        // Re-uploading the same program keeps it valid
+        uint32_t* dst = &setup.program_code[code_offset];
+        if (std::memcmp(dst, values, n * sizeof(uint32_t)) != 0) {
+            std::memcpy(dst, values, n * sizeof(uint32_t));
+            dirty |= DIRTY_PROGRAM;
+        }
+        code_offset += n;
+    }
+
+    void CommandProcessor::UploadSwizzle(const uint32_t* values,
+            unsigned count) {
+        const unsigned n = (swizzle_offset < MAX_SWIZZLE_DATA_LENGTH) ?
+                std::min(count, MAX_SWIZZLE_DATA_LENGTH - swizzle_offset) : 0;
+        if (n < count)
+            fprintf(stderr, "Swizzle data upload exceeds %u words\n",
+                    MAX_SWIZZLE_DATA_LENGTH);
+        uint32_t* dst = &setup.swizzle_data[swizzle_offset];
+        if (std::memcmp(dst, values, n * sizeof(uint32_t)) != 0) {
+            std::memcpy(dst, values, n * sizeof(uint32_t));
+            dirty |= DIRTY_PROGRAM;
+        }
+        swizzle_offset += n;
+    }
+
+    void CommandProcessor::UploadFloatUniforms(const uint32_t* values,
+            unsigned count) {
+        const unsigned words = float_uniform_f32 ? 4 : 3;
+        auto store = [this](const uint32_t* vectors, unsigned n) {
+            if (float_uniform_index + n > 96) {
+                fprintf(stderr, "Invalid float uniform %u\n",
+                        std::max(float_uniform_index, 96u));
+                n = float_uniform_index < 96 ? 96 - float_uniform_index : 0;
+            }
+            if (float_uniform_f32)
+                UnpackFloat32(vectors, &uniforms.f[float_uniform_index], n);
+            else
+                UnpackFloat24(vectors, &uniforms.f[float_uniform_index], n);
+            float_uniform_index += n;
+        };
+
+        while (count) {
+            if (float_uniform_words == 0 && count >= words) {
+                // Whole vectors straight from the list, in one go
+                const unsigned n = count / words;
+                store(values, n);
+                values += n * words;
+                count -= n * words;
+            } else {
+                float_uniform_buffer[float_uniform_words++] = *values++;
+                count--;
+                if (float_uniform_words == words) {
+                    store(float_uniform_buffer, 1);
+                    float_uniform_words = 0;
+                }
+            }
+        }
+    }
+
+    void CommandProcessor::UploadFixedAttributes(const uint32_t* values,
+            unsigned count) {
+        auto store = [this](const uint32_t* words) {
+            // Converted once here, draws copy the stored vectors
+            Vec4<float24> attribute;
+            UnpackFloat24(words, &attribute, 1);
+            if (fixed_attribute_index == 0xf) {
+                // Immediate mode, queued until a write that may change how
+                // the vertices are processed
+                immediate_attributes.push_back(attribute);
+            } else if (fixed_attribute_index < 12) {
+                fixed_attributes[fixed_attribute_index++] = attribute;
+            } else {
+                fprintf(stderr, "Invalid fixed attribute %u\n",
+                        fixed_attribute_index);
+            }
+        };
+
+        while (count) {
+            if (fixed_attribute_words == 0 && count >= 3) {
+                store(values);
+                values += 3;
+                count -= 3;
+            } else {
+                fixed_attribute_buffer[fixed_attribute_words++] = *values++;
+                count--;
+                if (fixed_attribute_words == 3) {
+                    store(fixed_attribute_buffer);
+                    fixed_attribute_words = 0;
+                }
+            }
+        }
+    }
+
+    Texturing::TextureUnit CommandProcessor::GetTextureUnit(unsigned index) const {
+        // First register of each unit, GPUREG_TEXUNITi_BORDER_COLOR
+        static const unsigned base[3] = {GPUREG_TEXUNIT0_BORDER_COLOR,
+                GPUREG_TEXUNIT1_BORDER_COLOR, GPUREG_TEXUNIT2_BORDER_COLOR};
+        static const unsigned format[3] = {GPUREG_TEXUNIT0_TYPE,
+                GPUREG_TEXUNIT1_TYPE, GPUREG_TEXUNIT2_TYPE};
+        const uint32_t config = regs[GPUREG_TEXUNIT_CONFIG];
+        const uint32_t* unit_regs = &regs[base[index]];
+
+        Texturing::TextureUnit unit{};
+        Texturing::TextureInfo& info = unit.info;
+        info.physical_address = unit_regs[4] << 3;
+        info.width = (unit_regs[1] >> 16) & 0x7ff;
+        info.height = unit_regs[1] & 0x7ff;
+        info.format = static_cast<Texturing::TextureFormat>(
+                regs[format[index]] & 0xf);
+        info.stride = (info.width / 8) *
+                Texturing::CalculateTileSize(info.format);
+        unit.enabled = ((config >> index) & 1) && info.width && info.height;
+        unit.params.hex = unit_regs[2];
+        unit.type = (index == 0) ? unit.params.type.Value() :
+                Texturing::Texture2D;
+        const uint32_t border = unit_regs[0];
+        unit.border_color = MakeVec<uint8_t>(border & 0xff, (border >> 8) & 0xff,
+                (border >> 16) & 0xff, border >> 24);
+        // Texture 2 may sample with coordinate 1
+        unit.coordinates = (index == 2 && (config & (1 << 13))) ? 1 : index;
+
+        if (index == 0) {
+            unit.shadow.hex = regs[GPUREG_TEXUNIT0_SHADOW];
+            // The other faces only hold the low 22 bits of their address
+            const uint32_t high = regs[GPUREG_TEXUNIT0_ADDR1] & ~0x3fffffu;
+            for (unsigned face = 0; face < 6; face++) {
+                const uint32_t low = regs[GPUREG_TEXUNIT0_ADDR1 + face] & 0x3fffff;
+                unit.face_address[face] = (face ? (high | low) :
+                        regs[GPUREG_TEXUNIT0_ADDR1]) << 3;
+            }
+        }
+        return unit;
+    }
+
+    void CommandProcessor::SyncState() {
+        if (dirty & DIRTY_TEXENV) {
+            TexEnv::Config texenv{};
+            for (unsigned i = 0; i < TexEnv::NUM_STAGES; i++) {
+                const uint32_t* stage = &regs[GetTexEnvRegister(i)];
+                texenv.stages[i].sources_raw = stage[0];
+                texenv.stages[i].modifiers_raw = stage[1];
+                texenv.stages[i].ops_raw = stage[2];
+                texenv.stages[i].const_color = stage[3];
+                texenv.stages[i].scales_raw = stage[4];
+            }
+            texenv.update_buffer.hex = regs[GPUREG_TEXENV_UPDATE_BUFFER];
+            texenv.buffer_color = regs[GPUREG_TEXENV_BUFFER_COLOR];
+            rasterizer.SetTexEnv(texenv);
+        }
+
+        if (dirty & DIRTY_TEXTURE) {
+            for (unsigned i = 0; i < 3; i++)
+                rasterizer.SetTextureUnit(i, GetTextureUnit(i));
+            // Texture unit 3 samples the coordinate set in bits 8-9
+            const uint32_t config = regs[GPUREG_TEXUNIT_CONFIG];
+            rasterizer.SetProcTexCoordinates((config >> 10) & 1,
+                    std::min((config >> 8) & 3, 2u));
+        }
+
+        // The registers hold half the viewport size
+        if ((dirty & DIRTY_VIEWPORT) && regs[GPUREG_VIEWPORT_WIDTH] &&
+                regs[GPUREG_VIEWPORT_HEIGHT]) {
+            rasterizer.SetViewport(
+                    float24::FromRaw(regs[GPUREG_VIEWPORT_WIDTH] & 0xffffff)
+                            .ToFloat32() * 2,
+                    float24::FromRaw(regs[GPUREG_VIEWPORT_HEIGHT] & 0xffffff)
+                            .ToFloat32() * 2);
+        }
+
+        if (dirty & DIRTY_DEPTH_MAP) {
+            rasterizer.SetDepthMap(
+                    float24::FromRaw(regs[GPUREG_DEPTHMAP_SCALE] & 0xffffff)
+                            .ToFloat32(),
+                    float24::FromRaw(regs[GPUREG_DEPTHMAP_OFFSET] & 0xffffff)
+                            .ToFloat32());
+        }
+
+        if (dirty & DIRTY_OUTPUT_MAP) {
+            output_map.total = regs[GPUREG_SH_OUTMAP_TOTAL] & 7;
+            for (unsigned i = 0; i < 7; i++)
+                output_map.attributes[i].hex = regs[GPUREG_SH_OUTMAP_O0 + i];
+        }
+
+        if (dirty & DIRTY_ENTRY_POINT)
+            setup.entry_point = regs[GPUREG_VSH_ENTRYPOINT] & 0xffff;
+
+        // Uploads not terminated by GPUREG_VSH_CODETRANSFER_END
+        if (dirty & DIRTY_PROGRAM)
+            UpdateProgram();
+
+        if (dirty & DIRTY_VERTEX_LAYOUT)
+            vertex_loader.Setup(regs.data(), input_mask);
+
+        dirty = 0;
+    }
+
+    void CommandProcessor::UpdateProgram() {
+        program_hash = setup.Hash();
+        // Attributes the new program does not read are no longer loaded
+        const uint16_t mask = setup.GetInputMask();
+        if (mask != input_mask)
+            dirty |= DIRTY_VERTEX_LAYOUT;
+        input_mask = mask;
+    }
+
+    Vec4<float24>* CommandProcessor::ClearInputRegisters() {
+        // Registers not loaded by a vertex keep the value they had for the
+        // previous one
+        Vec4<float24>* input = shader_engine.GetInputRegisters();
+        std::fill(input, input + 16, MakeVec(float24::Zero(), float24::Zero(),
+                float24::Zero(), float24::Zero()));
+        return input;
+    }
+
+    template <typename LoadFunc>
+    void CommandProcessor::ShadeVertices(unsigned count, LoadFunc load) {
+        // Caches see what earlier draws and fills wrote
+        Memory::FlushWrites();
+
+        stats.draws++;
+        stats.vertices += count;
+
+        Vec4<float24>* input = shader_engine.GetInputRegisters();
+        Shader::AttributeBuffer output;
+        for (unsigned i = 0; i < count; i++) {
+            load(i, input);
+            shader_engine.Run();
+            shader_engine.WriteOutput(output);
+            SubmitVertex(Shader::OutputVertex::FromAttributeBuffer(output_map,
+                    output));
+        }
+    }
+
+    void CommandProcessor::Draw(bool indexed) {
+        if (dirty)
+            SyncState();
+
+        const unsigned count = regs[GPUREG_NUMVERTICES];
+        const uint32_t base = (regs[GPUREG_ATTRIBBUFFERS_LOC] & 0x1ffffffe) << 3;
+        const uint32_t index_config = regs[GPUREG_INDEXBUFFER_CONFIG];
+        const bool index_u16 = index_config >> 31;
+        const uint32_t index_address = base + (index_config & 0x0fffffff);
+
+        std::vector<unsigned> indices(count);
+        if (indexed) {
+            const unsigned index_size = index_u16 ? 2 : 1;
+            if (!Memory::IsValidRange(index_address, uint64_t(count) * index_size)) {
+                fprintf(stderr, "Invalid index buffer %08x\n", index_address);
+                return;
+            }
+            const uint8_t* src = Memory::GetPhysicalPointer(index_address);
+            for (unsigned i = 0; i < count; i++) {
+                if (index_u16) {
+                    uint16_t index;
+                    std::memcpy(&index, src + i * 2, sizeof(index));
+                    indices[i] = index;
+                } else {
+                    indices[i] = src[i];
+                }
+            }
+        } else {
+            std::iota(indices.begin(), indices.end(),
+                    regs[GPUREG_VERTEX_OFFSET]);
+        }
+
+        unsigned max_index = 0;
+        for (unsigned index : indices)
+            max_index = std::max(max_index, index);
+
+        if (!vertex_loader.Map(max_index))
+            return;
+
+        // The shader never writes its inputs, fixed attributes are stored
+        // once for the whole draw
+        Vec4<float24>* input = ClearInputRegisters();
+        for (unsigned i = 0; i < vertex_loader.GetNumFixedAttributes(); i++) {
+            const auto& fixed = vertex_loader.GetFixedAttribute(i);
+            input[fixed.input] = fixed_attributes[fixed.attribute];
+        }
+
+        ShadeVertices(count, [&](unsigned i, Vec4<float24>* input) {
+            vertex_loader.Load(indices[i], input);
+        });
+
+        // The rasterizer state may change after the draw
+        rasterizer.DrawTriangles();
+    }
+
+    void CommandProcessor::FlushImmediate() {
+        if (immediate_attributes.empty())
+            return;
+
+        const unsigned num_attributes =
+                (regs[GPUREG_ATTRIBBUFFERS_FORMAT_HIGH] >> 28) + 1;
+        const unsigned count = immediate_attributes.size() / num_attributes;
+        if (!count)
+            return;
+
+        if (dirty)
+            SyncState();
+
+        // Attributes arrive in order, only those the shader reads are loaded
+        const uint64_t permutation = regs[GPUREG_VSH_ATTRIBUTES_PERMUTATION_LOW] |
+                (uint64_t(regs[GPUREG_VSH_ATTRIBUTES_PERMUTATION_HIGH]) << 32);
+        unsigned attributes[12], inputs[12];
+        unsigned num_loads = 0;
+        for (unsigned i = 0; i < num_attributes; i++) {
+            const unsigned input = (permutation >> (i * 4)) & 0xf;
+            if ((input_mask >> input) & 1) {
+                attributes[num_loads] = i;
+                inputs[num_loads++] = input;
+            }
+        }
+
+        ClearInputRegisters();
+        const Vec4<float24>* vertices = immediate_attributes.data();
+        ShadeVertices(count, [&](unsigned i, Vec4<float24>* input) {
+            const Vec4<float24>* vertex = vertices + i * num_attributes;
+            for (unsigned j = 0; j < num_loads; j++)
+                input[inputs[j]] = vertex[attributes[j]];
+        });
+
+        // Keep the attributes of an incomplete vertex
+        immediate_attributes.erase(immediate_attributes.begin(),
+                immediate_attributes.begin() + count * num_attributes);
+        rasterizer.DrawTriangles();
+    }
+
+    void CommandProcessor::SubmitVertex(const Shader::OutputVertex& vtx) {
+        // GPUREG_PRIMITIVE_CONFIG topology
+        enum : uint32_t { List = 0, Strip = 1, Fan = 2, Geometry = 3 };
+        const uint32_t topology = (regs[GPUREG_PRIMITIVE_CONFIG] >> 8) & 3;
+
+        if (topology == Strip || topology == Fan) {
+            if (strip_ready)
+                rasterizer.AddTriangle(primitive_buffer[0], primitive_buffer[1],
+                        vtx);
+            primitive_buffer[primitive_index] = vtx;
+            strip_ready |= (primitive_index == 1);
+            // Strips alternate the slot replaced to keep the winding order
+            primitive_index = (topology == Strip) ? !primitive_index : 1;
+        } else if (primitive_index < 2) {
+            primitive_buffer[primitive_index++] = vtx;
+        } else {
+            primitive_index = 0;
+            rasterizer.AddTriangle(primitive_buffer[0], primitive_buffer[1], vtx);
+        }
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include "earlydepth.h"
+#include "regs.h"
+
+namespace Framebuffer {
+
+    EarlyDepthUnit::EarlyDepthUnit() {
+        width = 0;
+        height = 0;
+        tiles_per_row = 0;
+        depth_bits = 24;
+        func = EarlyDepthFunc::GreaterThanOrEqual;
+        clear_value = 0;
+        test1 = false;
+        test2 = false;
+    }
+
+    void EarlyDepthUnit::WriteRegister(unsigned id, uint32_t value) {
+        switch (id) {
+        case GPUREG_EARLYDEPTH_FUNC:
+            func = static_cast<EarlyDepthFunc>(value & 3);
+            break;
+        case GPUREG_EARLYDEPTH_TEST1:
+            test1 = value & 1;
+            break;
+        case GPUREG_EARLYDEPTH_CLEAR:
+            if (value & 1)
+                Clear();
+            break;
+        case GPUREG_EARLYDEPTH_DATA:
+            clear_value = value & 0xffffff;
+            break;
+        case GPUREG_EARLYDEPTH_TEST2:
+            test2 = value & 1;
+            break;
+        default:
+            fprintf(stderr, "Invalid early depth register %x\n", id);
+            break;
+        }
+    }
+
+    void EarlyDepthUnit::SetDimensions(unsigned width, unsigned height,
+            unsigned depth_bits) {
+        if ((width == this->width) && (height == this->height) &&
+                (depth_bits == this->depth_bits))
+            return;
+        this->width = width;
+        this->height = height;
+        this->depth_bits = depth_bits;
+        tiles_per_row = (width + 7) / 8;
+        tiles.resize(tiles_per_row * ((height + 7) / 8));
+        Clear();
+    }
+
+    void EarlyDepthUnit::Clear() {
+        std::fill(tiles.begin(), tiles.end(), Tile{0, (1u << depth_bits) - 1, 0});
+    }
+}
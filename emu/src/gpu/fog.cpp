@@ -0,0 +1,194 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include "fog.h"
+#include "regs.h"
+#include "lanes.h"
+#include "float.h"
+
+namespace TexEnv {
+
+    FogUnit::FogUnit() {
+        std::memset(fog_value, 0, sizeof(fog_value));
+        std::memset(fog_diff, 0, sizeof(fog_diff));
+        std::memset(fog_color, 0, sizeof(fog_color));
+        std::memset(gas_color, 0, sizeof(gas_color));
+        std::memset(gas_diff, 0, sizeof(gas_diff));
+        fog_lut_index = 0;
+        gas_light_xy.hex = 0;
+        gas_light_z.hex = 0;
+        gas_light_direction = 0.0f;
+        gas_lut_input = GasLUTInput::Density;
+        gas_attenuation = 0.0f;
+        gas_accmax = 0.0f;
+        gas_lut_index = 0;
+    }
+
+    void FogUnit::WriteRegister(unsigned id, uint32_t value) {
+        if (id >= GPUREG_FOG_LUT_DATA0 && id <= GPUREG_FOG_LUT_DATA7) {
+            union {
+                uint32_t raw;
+                // Difference to the next entry, signed 1.1.11 fixed point
+                isa::BitField<0, 13, int32_t> difference;
+                isa::BitField<13, 11, uint32_t> value;
+            } entry;
+            entry.raw = value;
+            fog_value[fog_lut_index] = entry.value / 2047.0f;
+            fog_diff[fog_lut_index] = entry.difference / 2047.0f;
+            fog_lut_index = (fog_lut_index + 1) % FOG_LUT_SIZE;
+            return;
+        }
+
+        switch (id) {
+        case GPUREG_FOG_COLOR:
+            fog_color[0] = value & 0xff;
+            fog_color[1] = (value >> 8) & 0xff;
+            fog_color[2] = (value >> 16) & 0xff;
+            break;
+        case GPUREG_GAS_ATTENUATION:
+            gas_attenuation = float16::FromRaw(value & 0xffff).ToFloat32();
+            break;
+        case GPUREG_GAS_ACCMAX:
+            // Reciprocal of the maximum accumulated density
+            gas_accmax = float16::FromRaw(value & 0xffff).ToFloat32();
+            break;
+        case GPUREG_FOG_LUT_INDEX:
+            fog_lut_index = value % FOG_LUT_SIZE;
+            break;
+        case GPUREG_GAS_LIGHT_XY:
+            gas_light_xy.hex = value;
+            break;
+        case GPUREG_GAS_LIGHT_Z:
+            gas_light_z.hex = value;
+            break;
+        case GPUREG_GAS_LIGHT_Z_COLOR:
+            gas_light_direction = (value & 0xff) / 255.0f;
+            gas_lut_input = static_cast<GasLUTInput>((value >> 8) & 1);
+            break;
+        case GPUREG_GAS_LUT_INDEX:
+            gas_lut_index = value % (GAS_LUT_SIZE * 2);
+            break;
+        case GPUREG_GAS_LUT_DATA:
+            for (unsigned c = 0; c < 3; c++) {
+                uint32_t channel = (value >> (c * 8)) & 0xff;
+                if (gas_lut_index < GAS_LUT_SIZE) {
+                    // Sign and 7-bit magnitude of the step to the next color
+                    float diff = (channel & 0x7f) * (255.0f / 127.0f);
+                    gas_diff[gas_lut_index][c] = (channel & 0x80) ? -diff : diff;
+                }
+                else {
+                    gas_color[gas_lut_index - GAS_LUT_SIZE][c] = channel;
+                }
+            }
+            gas_lut_index = (gas_lut_index + 1) % (GAS_LUT_SIZE * 2);
+            break;
+        default:
+            fprintf(stderr, "Invalid fog register %x\n", id);
+            break;
+        }
+    }
+
+    void FogUnit::Apply(const UpdateBuffer& config,
+            const float (&depth)[QUAD_SIZE], ColorQuad& color) const {
+        switch (config.fog_mode) {
+        case FogMode::Fog:
+            ApplyFog(config.fog_flip, depth, color);
+            break;
+        case FogMode::Gas:
+            ApplyGas(config.shading_density_source, color);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void FogUnit::ApplyFog(bool flip, const float (&depth)[QUAD_SIZE],
+            ColorQuad& color) const {
+        Lanes z = Lanes::Load(depth);
+        Lanes fog_index = (flip ? Lanes(1.0f) - z : z) * Lanes(128.0f);
+
+        // Generate clamped fog factor from LUT for given fog index
+        Lanes fog_i = Clamp(Floor(fog_index), 0.0f, 127.0f);
+        Lanes fog_f = fog_index - fog_i;
+        float index[4], value[4], diff[4];
+        fog_i.Store(index);
+        for (unsigned i = 0; i < 4; i++) {
+            unsigned entry = static_cast<unsigned>(index[i]);
+            value[i] = fog_value[entry];
+            diff[i] = fog_diff[entry];
+        }
+        Lanes fog_factor = Clamp(Lanes::Load(value) + Lanes::Load(diff) * fog_f,
+                0.0f, 1.0f);
+        Lanes color_factor = Lanes(1.0f) - fog_factor;
+
+        // Blend the fog color with the combiner output
+        uint8_t* channels[3] = {color.r, color.g, color.b};
+        for (unsigned c = 0; c < 3; c++) {
+            float result[4];
+            (ChannelToFloat(channels[c], 1.0f) * fog_factor +
+                    Lanes(fog_color[c]) * color_factor).Store(result);
+            for (unsigned i = 0; i < 4; i++)
+                channels[c][i] = static_cast<uint8_t>(result[i]);
+        }
+    }
+
+    // The hardware gas shading equations are not documented. This follows
+    // the register semantics: light passing through the gas falls off
+    // exponentially with density, planar (xy) and view (z) light terms
+    // interpolate between their min and max, and the gas LUT maps density
+    // or the light factor to a color. Alpha is the gas opacity.
+    void FogUnit::ApplyGas(GasDensity source, ColorQuad& color) const {
+        Lanes density = ChannelToFloat(
+                source == GasDensity::Plain ? color.r : color.g, 1.0f / 255.0f);
+
+        float transmit_f[4];
+        (-Lanes(gas_attenuation) * density).Store(transmit_f);
+        for (unsigned i = 0; i < 4; i++)
+            transmit_f[i] = std::exp(transmit_f[i]);
+        Lanes transmit = Lanes::Load(transmit_f);
+
+        auto LightTerm = [&](const GasLight& light) {
+            Lanes min = light.min / 255.0f;
+            Lanes max = light.max / 255.0f;
+            return (min + (max - min) * transmit) * Lanes(light.attenuation / 255.0f);
+        };
+        Lanes light_factor = Clamp(LightTerm(gas_light_xy) +
+                LightTerm(gas_light_z) * Lanes(gas_light_direction), 0.0f, 1.0f);
+
+        Lanes input = (gas_lut_input == GasLUTInput::Density) ? density : light_factor;
+        Lanes position = input * Lanes(static_cast<float>(GAS_LUT_SIZE));
+        Lanes entry_f = Clamp(Floor(position), 0.0f, GAS_LUT_SIZE - 1.0f);
+        Lanes delta = position - entry_f;
+
+        float entry[4], delta_f[4];
+        entry_f.Store(entry);
+        delta.Store(delta_f);
+        uint8_t* channels[3] = {color.r, color.g, color.b};
+        for (unsigned i = 0; i < 4; i++) {
+            unsigned e = static_cast<unsigned>(entry[i]);
+            for (unsigned c = 0; c < 3; c++) {
+                float value = gas_color[e][c] + gas_diff[e][c] * delta_f[i];
+                channels[c][i] = static_cast<uint8_t>(std::clamp(value, 0.0f, 255.0f));
+            }
+        }
+
+        FloatToChannel(Lanes(1.0f) - transmit, color.a);
+    }
+}
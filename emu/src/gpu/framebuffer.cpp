@@ -0,0 +1,1067 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "framebuffer.h"
+#include "color.h"
+#include "memory.h"
+#include "texcache.h"
+#include "regs.h"
+#include "float.h"
+#include <algorithm>
+#include <functional>
+
+namespace Framebuffer {
+    unsigned BytesPerPixel(ColorFormat format) {
+        switch (format) {
+        case ColorFormat::RGBA8:
+            return 4;
+        case ColorFormat::RGB8:
+            return 3;
+        case ColorFormat::RGB5A1:
+        case ColorFormat::RGB565:
+        case ColorFormat::RGBA4:
+            return 2;
+        }
+        return 0;
+    }
+
+    unsigned BytesPerPixel(DepthFormat format) {
+        switch (format) {
+        case DepthFormat::D16:
+            return 2;
+        case DepthFormat::D24:
+            return 3;
+        case DepthFormat::D24S8:
+            return 4;
+        }
+        return 0;
+    }
+
+    unsigned DepthBitsPerPixel(DepthFormat format) {
+        return (format == DepthFormat::D16) ? 16 : 24;
+    }
+
+    uint32_t GetPixelOffset(unsigned x, unsigned y, unsigned width,
+            unsigned height, unsigned bytes_per_pixel) {
+        y = height - 1 - y;
+        const uint32_t coarse_y = y & ~7;
+        return (Texturing::MortonInterleave(x, y) + (x & ~7) * 8 +
+                coarse_y * width) * bytes_per_pixel;
+    }
+
+    template <unsigned N>
+    using Batch = Texturing::TexelBatch<N>;
+
+    template <unsigned N>
+    static const uint8_t* Channel(const Batch<N>& batch, unsigned channel) {
+        const uint8_t* const channels[] = {batch.r, batch.g, batch.b, batch.a};
+        return channels[channel];
+    }
+
+    template <unsigned N>
+    static uint8_t* Channel(Batch<N>& batch, unsigned channel) {
+        uint8_t* const channels[] = {batch.r, batch.g, batch.b, batch.a};
+        return channels[channel];
+    }
+
+    template <unsigned N, typename T, typename Op>
+    static unsigned CompareLanes(const T* a, const T* b, Op op) {
+        unsigned pass = 0;
+        for (unsigned i = 0; i < N; i++)
+            pass |= op(a[i], b[i]) ? (1u << i) : 0;
+        return pass;
+    }
+
+    // Returns a lane mask of a[i] func b[i]
+    template <unsigned N, typename T>
+    static unsigned Compare(CompareFunc func, const T* a, const T* b) {
+        switch (func) {
+        case CompareFunc::Never:
+            return 0;
+        case CompareFunc::Always:
+            return (1u << N) - 1;
+        case CompareFunc::Equal:
+            return CompareLanes<N>(a, b, std::equal_to<T>());
+        case CompareFunc::NotEqual:
+            return CompareLanes<N>(a, b, std::not_equal_to<T>());
+        case CompareFunc::LessThan:
+            return CompareLanes<N>(a, b, std::less<T>());
+        case CompareFunc::LessThanOrEqual:
+            return CompareLanes<N>(a, b, std::less_equal<T>());
+        case CompareFunc::GreaterThan:
+            return CompareLanes<N>(a, b, std::greater<T>());
+        case CompareFunc::GreaterThanOrEqual:
+            return CompareLanes<N>(a, b, std::greater_equal<T>());
+        }
+        UNREACHABLE();
+        return 0;
+    }
+
+    static uint8_t PerformStencilAction(StencilAction action, uint8_t old_stencil,
+            uint8_t ref) {
+        switch (action) {
+        case StencilAction::Keep:
+            return old_stencil;
+        case StencilAction::Zero:
+            return 0;
+        case StencilAction::Replace:
+            return ref;
+        case StencilAction::Increment:
+            // Saturated increment
+            return std::min<uint8_t>(old_stencil, 254) + 1;
+        case StencilAction::Decrement:
+            // Saturated decrement
+            return std::max<uint8_t>(old_stencil, 1) - 1;
+        case StencilAction::Invert:
+            return ~old_stencil;
+        case StencilAction::IncrementWrap:
+            return old_stencil + 1;
+        case StencilAction::DecrementWrap:
+            return old_stencil - 1;
+        }
+        UNREACHABLE();
+        return 0;
+    }
+
+    static bool FactorReadsDest(BlendFactor factor) {
+        return (factor == BlendFactor::DestColor) ||
+                (factor == BlendFactor::OneMinusDestColor) ||
+                (factor == BlendFactor::DestAlpha) ||
+                (factor == BlendFactor::OneMinusDestAlpha) ||
+                (factor == BlendFactor::SourceAlphaSaturate);
+    }
+
+    static bool EquationReadsDest(BlendEquation equation) {
+        return (equation == BlendEquation::Min) ||
+                (equation == BlendEquation::Max);
+    }
+
+    static bool LogicOpReadsDest(LogicOp op) {
+        return (op != LogicOp::Clear) && (op != LogicOp::Copy) &&
+                (op != LogicOp::Set) && (op != LogicOp::CopyInverted);
+    }
+
+    /**
+    * Fill a blend factor for one channel of a span.
+    * @param channel 0-3 for red, green, blue and alpha
+    */
+    template <unsigned N>
+    static void LookupFactor(BlendFactor factor, unsigned channel,
+            const Batch<N>& src, const Batch<N>& dest,
+            const uint8_t (&constant)[4], uint8_t* out) {
+        const uint8_t* source = Channel(src, channel);
+        const uint8_t* destination = Channel(dest, channel);
+
+        switch (factor) {
+        case BlendFactor::Zero:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 0;
+            break;
+        case BlendFactor::One:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255;
+            break;
+        case BlendFactor::SourceColor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = source[i];
+            break;
+        case BlendFactor::OneMinusSourceColor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255 - source[i];
+            break;
+        case BlendFactor::DestColor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = destination[i];
+            break;
+        case BlendFactor::OneMinusDestColor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255 - destination[i];
+            break;
+        case BlendFactor::SourceAlpha:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src.a[i];
+            break;
+        case BlendFactor::OneMinusSourceAlpha:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255 - src.a[i];
+            break;
+        case BlendFactor::DestAlpha:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = dest.a[i];
+            break;
+        case BlendFactor::OneMinusDestAlpha:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255 - dest.a[i];
+            break;
+        case BlendFactor::ConstantColor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = constant[channel];
+            break;
+        case BlendFactor::OneMinusConstantColor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255 - constant[channel];
+            break;
+        case BlendFactor::ConstantAlpha:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = constant[3];
+            break;
+        case BlendFactor::OneMinusConstantAlpha:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255 - constant[3];
+            break;
+        case BlendFactor::SourceAlphaSaturate:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = (channel == 3) ? 255 :
+                        std::min<uint8_t>(src.a[i], 255 - dest.a[i]);
+            break;
+        default:
+            fprintf(stderr, "Unknown blend factor %d\n", (int)factor);
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255;
+            break;
+        }
+    }
+
+    template <unsigned N>
+    static void BlendChannel(BlendEquation equation, const uint8_t* src,
+            const uint8_t* src_factor, const uint8_t* dest,
+            const uint8_t* dest_factor, uint8_t* out) {
+        switch (equation) {
+        case BlendEquation::Add:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = std::min((src[i] * src_factor[i] +
+                        dest[i] * dest_factor[i]) / 255, 255);
+            break;
+        case BlendEquation::Subtract:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = std::max(src[i] * src_factor[i] -
+                        dest[i] * dest_factor[i], 0) / 255;
+            break;
+        case BlendEquation::ReverseSubtract:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = std::max(dest[i] * dest_factor[i] -
+                        src[i] * src_factor[i], 0) / 255;
+            break;
+        case BlendEquation::Min:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = std::min(src[i], dest[i]);
+            break;
+        case BlendEquation::Max:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = std::max(src[i], dest[i]);
+            break;
+        default:
+            fprintf(stderr, "Unknown blend equation %d\n", (int)equation);
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i];
+            break;
+        }
+    }
+
+    template <unsigned N>
+    static void LogicOpChannel(LogicOp op, const uint8_t* src,
+            const uint8_t* dest, uint8_t* out) {
+        switch (op) {
+        case LogicOp::Clear:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 0;
+            break;
+        case LogicOp::And:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i] & dest[i];
+            break;
+        case LogicOp::AndReverse:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i] & ~dest[i];
+            break;
+        case LogicOp::Copy:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i];
+            break;
+        case LogicOp::Set:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = 255;
+            break;
+        case LogicOp::CopyInverted:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~src[i];
+            break;
+        case LogicOp::NoOp:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = dest[i];
+            break;
+        case LogicOp::Invert:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~dest[i];
+            break;
+        case LogicOp::Nand:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~(src[i] & dest[i]);
+            break;
+        case LogicOp::Or:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i] | dest[i];
+            break;
+        case LogicOp::Nor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~(src[i] | dest[i]);
+            break;
+        case LogicOp::Xor:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i] ^ dest[i];
+            break;
+        case LogicOp::Equiv:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~(src[i] ^ dest[i]);
+            break;
+        case LogicOp::AndInverted:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~src[i] & dest[i];
+            break;
+        case LogicOp::OrReverse:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = src[i] | ~dest[i];
+            break;
+        case LogicOp::OrInverted:
+            for (unsigned i = 0; i < N; i++)
+                out[i] = ~src[i] | dest[i];
+            break;
+        }
+    }
+
+    template <unsigned N>
+    static void DecodeColors(ColorFormat format, const uint8_t* const* src,
+            unsigned mask, Batch<N>& out) {
+        auto Decode = [&](auto decode) {
+            for (unsigned i = 0; i < N; i++) {
+                if (!(mask & (1u << i)))
+                    continue;
+                Vec4<uint8_t> color = decode(src[i]);
+                out.r[i] = color.r();
+                out.g[i] = color.g();
+                out.b[i] = color.b();
+                out.a[i] = color.a();
+            }
+        };
+
+        switch (format) {
+        case ColorFormat::RGBA8:
+            Decode(Color::DecodeRGBA8);
+            break;
+        case ColorFormat::RGB8:
+            Decode(Color::DecodeRGB8);
+            break;
+        case ColorFormat::RGB5A1:
+            Decode(Color::DecodeRGB5A1);
+            break;
+        case ColorFormat::RGB565:
+            Decode(Color::DecodeRGB565);
+            break;
+        case ColorFormat::RGBA4:
+            Decode(Color::DecodeRGBA4);
+            break;
+        }
+    }
+
+    template <unsigned N>
+    static void EncodeColors(ColorFormat format, const Batch<N>& colors,
+            uint8_t* const* dst, unsigned mask) {
+        auto Encode = [&](auto encode) {
+            for (unsigned i = 0; i < N; i++) {
+                if (mask & (1u << i))
+                    encode(colors.Get(i), dst[i]);
+            }
+        };
+
+        switch (format) {
+        case ColorFormat::RGBA8:
+            Encode(Color::EncodeRGBA8);
+            break;
+        case ColorFormat::RGB8:
+            Encode(Color::EncodeRGB8);
+            break;
+        case ColorFormat::RGB5A1:
+            Encode(Color::EncodeRGB5A1);
+            break;
+        case ColorFormat::RGB565:
+            Encode(Color::EncodeRGB565);
+            break;
+        case ColorFormat::RGBA4:
+            Encode(Color::EncodeRGBA4);
+            break;
+        }
+    }
+
+    constexpr unsigned TILE_PIXELS = 8 * 8;
+
+    static void DecodeColorSpan(ColorFormat format, const uint8_t* src, uint8_t* rgba,
+            size_t count) {
+        switch (format) {
+        case ColorFormat::RGBA8:
+            Color::DecodeRGBA8Span(src, rgba, count);
+            break;
+        case ColorFormat::RGB8:
+            Color::DecodeRGB8Span(src, rgba, count);
+            break;
+        case ColorFormat::RGB5A1:
+            Color::DecodeRGB5A1Span(src, rgba, count);
+            break;
+        case ColorFormat::RGB565:
+            Color::DecodeRGB565Span(src, rgba, count);
+            break;
+        case ColorFormat::RGBA4:
+            Color::DecodeRGBA4Span(src, rgba, count);
+            break;
+        }
+    }
+
+    static void DecodeDepthSpan(DepthFormat format, const uint8_t* src, uint32_t* depth,
+            size_t count) {
+        switch (format) {
+        case DepthFormat::D16:
+            Color::DecodeD16Span(src, depth, count);
+            break;
+        case DepthFormat::D24:
+            Color::DecodeD24Span(src, depth, count);
+            break;
+        case DepthFormat::D24S8: {
+            uint8_t stencil[TILE_PIXELS];
+            for (size_t i = 0; i < count; i += TILE_PIXELS) {
+                const size_t n = std::min<size_t>(count - i, TILE_PIXELS);
+                Color::DecodeD24S8Span(src + i * 4, depth + i, stencil, n);
+            }
+            break;
+        }
+        }
+    }
+
+    /**
+     * Call func for every 8x8 tile of a buffer, tiles are stored contiguously
+     * so a whole tile can be converted in one go.
+     * @param func Called with the index of the first pixel of the tile in
+     *             memory and the top left corner of the tile on screen
+     */
+    template <typename Func>
+    static void ForEachTile(unsigned width, unsigned height, Func func) {
+        for (unsigned ty = 0; ty < height; ty += 8) {
+            for (unsigned tx = 0; tx < width; tx += 8) {
+                const uint32_t first =
+                        GetPixelOffset(tx, ty, width, height, 1) & ~(TILE_PIXELS - 1);
+                func(first, tx, ty);
+            }
+        }
+    }
+
+    void TileTracker::Reset(unsigned num_tiles, unsigned bytes_per_pixel) {
+        pending.assign(num_tiles, 0);
+        dirty.assign(num_tiles, false);
+        this->bytes_per_pixel = bytes_per_pixel;
+    }
+
+    void TileTracker::Fill(uint32_t value) {
+        std::memcpy(this->value, &value, sizeof(this->value));
+        std::fill(pending.begin(), pending.end(), ~uint64_t(0));
+    }
+
+    void TileTracker::Flush(uint8_t* buffer, uint32_t address) {
+        const uint32_t tile_size = TILE_PIXELS * bytes_per_pixel;
+
+        for (uint32_t tile = 0; tile < pending.size(); tile++) {
+            const uint64_t bits = pending[tile];
+            if (!bits)
+                continue;
+            uint8_t* dst = buffer + tile * tile_size;
+            for (unsigned i = 0; i < TILE_PIXELS; i++) {
+                if ((bits >> i) & 1)
+                    std::memcpy(dst + i * bytes_per_pixel, value, bytes_per_pixel);
+            }
+            pending[tile] = 0;
+            dirty[tile] = true;
+        }
+
+        for (uint32_t tile = 0; tile < dirty.size(); tile++) {
+            if (dirty[tile]) {
+                Memory::MarkWritten(address + tile * tile_size, tile_size);
+                dirty[tile] = false;
+            }
+        }
+    }
+
+    OutputMerger::OutputMerger() {
+        std::memset(&regs, 0, sizeof(regs));
+        UpdateSetup();
+        color_tiles.Reset(0, 0);
+        depth_tiles.Reset(0, 0);
+    }
+
+    void OutputMerger::WriteRegister(unsigned index, uint32_t value) {
+        if (index >= sizeof(Registers) / 4) {
+            fprintf(stderr, "Invalid framebuffer register %x\n", index + REGISTER_BASE);
+            return;
+        }
+
+        // Pending fills belong to the old buffer layout
+        const bool layout = (index >= offsetof(Registers, depth_format) / 4) &&
+                (index <= offsetof(Registers, dim) / 4);
+        if (layout)
+            Flush();
+
+        if (index == GPUREG_FRAMEBUFFER_FLUSH - REGISTER_BASE) {
+            if (value & 1)
+                Flush();
+            return;
+        }
+
+        reinterpret_cast<uint32_t*>(&regs)[index] = value;
+
+        UpdateSetup();
+
+        if (layout) {
+            const unsigned tiles = regs.GetWidth() * regs.GetHeight() / TILE_PIXELS;
+            color_tiles.Reset(tiles, color_bytes_per_pixel);
+            depth_tiles.Reset(tiles, depth_bytes_per_pixel);
+        }
+    }
+
+    void OutputMerger::UpdateSetup() {
+        const unsigned pixels = regs.GetWidth() * regs.GetHeight();
+
+        color_bytes_per_pixel = BytesPerPixel(regs.color_format.color_format);
+        const uint32_t color_address = regs.GetColorBufferPhysicalAddress();
+        const uint32_t color_size = pixels * color_bytes_per_pixel;
+        color_buffer = nullptr;
+        if ((color_size != 0) && Memory::IsValidRange(color_address, color_size))
+            color_buffer = Memory::GetPhysicalPointer(color_address);
+
+        depth_bytes_per_pixel = BytesPerPixel(regs.depth_format.depth_format);
+        const uint32_t depth_address = regs.GetDepthBufferPhysicalAddress();
+        const uint32_t depth_size = pixels * depth_bytes_per_pixel;
+        depth_buffer = nullptr;
+        if ((depth_size != 0) && Memory::IsValidRange(depth_address, depth_size))
+            depth_buffer = Memory::GetPhysicalPointer(depth_address);
+
+        // Only D24S8 has a stencil buffer
+        stencil_enable = depth_buffer && regs.stencil_test.enable &&
+                (regs.depth_format.depth_format == DepthFormat::D24S8);
+    }
+
+    template <unsigned N>
+    unsigned OutputMerger::AlphaTest(const Batch<N>& color,
+            unsigned mask) const {
+        if (!regs.alpha_test.enable)
+            return mask;
+
+        uint8_t ref[N];
+        for (unsigned i = 0; i < N; i++)
+            ref[i] = regs.alpha_test.ref;
+        return mask & Compare<N>(regs.alpha_test.func, color.a, ref);
+    }
+
+    template <unsigned N>
+    unsigned OutputMerger::Merge(const uint16_t* x, const uint16_t* y,
+            const float* depth, const Batch<N>& color, unsigned mask) {
+        const FragmentOperationMode mode =
+                regs.color_operation.fragment_operation_mode;
+        if ((mode != FragmentOperationMode::Default) &&
+                (mode != FragmentOperationMode::Shadow) &&
+                (mode != FragmentOperationMode::Gas))
+            return 0;
+
+        const unsigned width = regs.GetWidth();
+        const unsigned height = regs.GetHeight();
+
+        uint32_t pixel[N];
+        for (unsigned i = 0; i < N; i++) {
+            if ((x[i] >= width) || (y[i] >= height))
+                mask &= ~(1u << i);
+            pixel[i] = GetPixelOffset(x[i], y[i], width, height, 1);
+        }
+
+        // Shadow maps bypass the depth buffer
+        if (mode == FragmentOperationMode::Shadow) {
+            MergeShadow(pixel, depth, color, mask);
+            return 0;
+        }
+
+        // Gas reads the depth buffer but never writes it
+        if (mode == FragmentOperationMode::Gas) {
+            MergeGas(pixel, depth, color, mask);
+            return 0;
+        }
+
+        unsigned depth_written = 0;
+        if (depth_buffer && mask) {
+            const DepthFormat format = regs.depth_format.depth_format;
+            const bool depth_test = regs.depth_color_mask.depth_test_enable;
+            const bool depth_write = regs.depth_color_mask.depth_write_enable &&
+                    (regs.depth_stencil_write & 2);
+            const bool stencil_write = stencil_enable &&
+                    (regs.depth_stencil_write & 1);
+
+            // Pixels still holding a fill value are read from the tracker
+            uint8_t* dst[N];
+            const uint8_t* src[N];
+            for (unsigned i = 0; i < N; i++) {
+                dst[i] = depth_buffer + pixel[i] * depth_bytes_per_pixel;
+                src[i] = depth_tiles.IsPending(pixel[i]) ?
+                        depth_tiles.GetValue() : dst[i];
+            }
+
+            const uint32_t max_z = (1u << DepthBitsPerPixel(format)) - 1;
+            uint32_t z[N];
+            for (unsigned i = 0; i < N; i++)
+                z[i] = static_cast<uint32_t>(depth[i] * max_z);
+
+            // Disabled reads return zero
+            uint32_t dest_z[N] = {};
+            uint8_t dest_stencil[N] = {};
+            if (depth_test && (regs.depth_stencil_read & 2)) {
+                for (unsigned i = 0; i < N; i++) {
+                    if (!(mask & (1u << i)))
+                        continue;
+                    dest_z[i] = (format == DepthFormat::D16) ?
+                            Color::DecodeD16(src[i]) : Color::DecodeD24(src[i]);
+                }
+            }
+            if (stencil_enable && (regs.depth_stencil_read & 1)) {
+                for (unsigned i = 0; i < N; i++) {
+                    if (mask & (1u << i))
+                        dest_stencil[i] = src[i][3];
+                }
+            }
+
+            unsigned stencil_fail = 0;
+            unsigned depth_fail = 0;
+            if (stencil_enable) {
+                const uint8_t input_mask = regs.stencil_test.input_mask;
+                uint8_t ref[N], dest[N];
+                for (unsigned i = 0; i < N; i++) {
+                    ref[i] = regs.stencil_test.reference_value & input_mask;
+                    dest[i] = dest_stencil[i] & input_mask;
+                }
+                unsigned pass = mask & Compare<N>(regs.stencil_test.func, ref, dest);
+                stencil_fail = mask & ~pass;
+                mask = pass;
+            }
+
+            if (depth_test) {
+                unsigned pass = mask & Compare<N>(
+                        regs.depth_color_mask.depth_test_func, z, dest_z);
+                depth_fail = mask & ~pass;
+                mask = pass;
+            }
+
+            if (depth_write) {
+                depth_written = mask;
+                for (unsigned i = 0; i < N; i++) {
+                    if (!(mask & (1u << i)))
+                        continue;
+                    // The stencil byte of D24S8 is left untouched
+                    depth_tiles.Write(pixel[i], dst[i],
+                            format == DepthFormat::D24S8);
+                    if (format == DepthFormat::D16)
+                        Color::EncodeD16(z[i], dst[i]);
+                    else
+                        Color::EncodeD24(z[i], dst[i]);
+                }
+            }
+
+            if (stencil_write) {
+                const uint8_t ref = regs.stencil_test.reference_value;
+                const uint8_t write_mask = regs.stencil_test.write_mask;
+                const unsigned updated = stencil_fail | depth_fail | mask;
+                for (unsigned i = 0; i < N; i++) {
+                    const unsigned bit = 1u << i;
+                    if (!(updated & bit))
+                        continue;
+                    StencilAction action = regs.stencil_op.action_depth_pass;
+                    if (stencil_fail & bit)
+                        action = regs.stencil_op.action_stencil_fail;
+                    else if (depth_fail & bit)
+                        action = regs.stencil_op.action_depth_fail;
+                    uint8_t new_stencil = PerformStencilAction(action,
+                            dest_stencil[i], ref);
+                    depth_tiles.Write(pixel[i], dst[i], true);
+                    Color::EncodeX24S8((new_stencil & write_mask) |
+                            (dest_stencil[i] & ~write_mask), dst[i]);
+                }
+            }
+        }
+
+        const unsigned channels = (regs.depth_color_mask.hex >> 8) & 0xf;
+        if (!mask || !color_buffer || !regs.color_write || !channels)
+            return depth_written;
+
+        const ColorFormat format = regs.color_format.color_format;
+        uint8_t* dst[N];
+        for (unsigned i = 0; i < N; i++)
+            dst[i] = color_buffer + pixel[i] * color_bytes_per_pixel;
+
+        const bool blend = regs.color_operation.alphablend_enable;
+        const auto& blending = regs.alpha_blending;
+        const LogicOp logic_op = regs.logic_op.logic_op;
+
+        // Skip the read when the result does not depend on the destination
+        bool read_dest = (channels != 0xf);
+        if (blend) {
+            read_dest |= FactorReadsDest(blending.factor_source_rgb) ||
+                    FactorReadsDest(blending.factor_dest_rgb) ||
+                    FactorReadsDest(blending.factor_source_a) ||
+                    FactorReadsDest(blending.factor_dest_a) ||
+                    EquationReadsDest(blending.blend_equation_rgb) ||
+                    EquationReadsDest(blending.blend_equation_a) ||
+                    (blending.factor_dest_rgb != BlendFactor::Zero) ||
+                    (blending.factor_dest_a != BlendFactor::Zero);
+        }
+        else {
+            read_dest |= LogicOpReadsDest(logic_op);
+        }
+
+        Batch<N> dest{};
+        if (read_dest && regs.color_read) {
+            const uint8_t* src[N];
+            for (unsigned i = 0; i < N; i++)
+                src[i] = color_tiles.IsPending(pixel[i]) ?
+                        color_tiles.GetValue() : dst[i];
+            DecodeColors(format, src, mask, dest);
+        }
+
+        Batch<N> result;
+        if (blend) {
+            const uint8_t constant[4] = {
+                static_cast<uint8_t>(regs.blend_const.r),
+                static_cast<uint8_t>(regs.blend_const.g),
+                static_cast<uint8_t>(regs.blend_const.b),
+                static_cast<uint8_t>(regs.blend_const.a)
+            };
+            for (unsigned c = 0; c < 4; c++) {
+                const bool alpha = (c == 3);
+                BlendFactor factor_source = alpha ?
+                        blending.factor_source_a.Value() :
+                        blending.factor_source_rgb.Value();
+                BlendFactor factor_dest = alpha ?
+                        blending.factor_dest_a.Value() :
+                        blending.factor_dest_rgb.Value();
+                BlendEquation equation = alpha ?
+                        blending.blend_equation_a.Value() :
+                        blending.blend_equation_rgb.Value();
+
+                uint8_t src_factor[N], dest_factor[N];
+                LookupFactor(factor_source, c, color, dest, constant, src_factor);
+                LookupFactor(factor_dest, c, color, dest, constant, dest_factor);
+                BlendChannel<N>(equation, Channel(color, c), src_factor,
+                        Channel(dest, c), dest_factor, Channel(result, c));
+            }
+        }
+        else {
+            for (unsigned c = 0; c < 4; c++)
+                LogicOpChannel<N>(logic_op, Channel(color, c),
+                        Channel(dest, c), Channel(result, c));
+        }
+
+        // Masked channels keep the destination value
+        for (unsigned c = 0; c < 4; c++) {
+            if (channels & (1u << c))
+                continue;
+            const uint8_t* src = Channel(dest, c);
+            uint8_t* dst = Channel(result, c);
+            for (unsigned i = 0; i < N; i++)
+                dst[i] = src[i];
+        }
+
+        // Every format writes whole pixels
+        for (unsigned i = 0; i < N; i++) {
+            if (mask & (1u << i))
+                color_tiles.Write(pixel[i], dst[i], false);
+        }
+        EncodeColors(format, result, dst, mask);
+        return depth_written;
+    }
+
+    template <unsigned N>
+    void OutputMerger::MergeShadow(const uint32_t* pixel, const float* depth,
+            const Batch<N>& color, unsigned mask) {
+        // Shadow maps are always 32 bits per pixel
+        if (!mask || !color_buffer || (color_bytes_per_pixel != 4))
+            return;
+
+        // Depth is stored most significant byte first in bytes 0-2, the
+        // attenuation in byte 3. LookupShadow() reads this layout back: a
+        // texel is lit, and yields its attenuation, while its depth lies
+        // beyond the reference, so the closest occluder must be kept here.
+        uint8_t* dst[N];
+        uint32_t z[N], ref_z[N];
+        uint8_t ref_s[N];
+        for (unsigned i = 0; i < N; i++) {
+            dst[i] = color_buffer + pixel[i] * 4;
+            const uint8_t* src = color_tiles.IsPending(pixel[i]) ?
+                    color_tiles.GetValue() : dst[i];
+            z[i] = static_cast<uint32_t>(depth[i] * 0xffffff);
+            ref_z[i] = (src[0] << 16) | (src[1] << 8) | src[2];
+            ref_s[i] = src[3];
+        }
+
+        // Only fragments closer to the light than the stored depth count
+        const unsigned closer = mask & Compare<N>(CompareFunc::LessThan, z, ref_z);
+        if (!closer)
+            return;
+
+        // The green channel of the combiner output carries the attenuation.
+        // Opaque fragments store their depth, translucent ones attenuate
+        // the stored value instead. The hardware evaluates the falloff in
+        // float16, float32 is used here.
+        const float constant = float16::FromRaw(regs.shadow.constant).ToFloat32();
+        const float linear = float16::FromRaw(regs.shadow.linear).ToFloat32();
+        uint8_t s[N];
+        for (unsigned i = 0; i < N; i++) {
+            float attenuation = color.g[i] / (constant + linear *
+                    (static_cast<float>(z[i]) / std::max(ref_z[i], 1u)));
+            s[i] = color.g[i] ? static_cast<uint8_t>(
+                    std::clamp(attenuation, 0.0f, 255.0f)) : 0;
+        }
+
+        for (unsigned i = 0; i < N; i++) {
+            if (!(closer & (1u << i)))
+                continue;
+            if (color.g[i] == 0) {
+                color_tiles.Write(pixel[i], dst[i], true);
+                dst[i][0] = (z[i] >> 16) & 0xff;
+                dst[i][1] = (z[i] >> 8) & 0xff;
+                dst[i][2] = z[i] & 0xff;
+            }
+            else if (s[i] < ref_s[i]) {
+                color_tiles.Write(pixel[i], dst[i], true);
+                dst[i][3] = s[i];
+            }
+        }
+    }
+
+    template <unsigned N>
+    void OutputMerger::MergeGas(const uint32_t* pixel, const float* depth,
+            const Batch<N>& color, unsigned mask) {
+        if (!mask || !color_buffer || !regs.color_write)
+            return;
+
+        // The depth difference to the scene behind the gas weighs the
+        // shading density, so that gas fades out where it meets geometry.
+        // Without a readable depth buffer every fragment has full weight.
+        const uint32_t delta_z = regs.gas_delta_z_depth.delta_z;
+        uint32_t z[N] = {}, dest_z[N] = {};
+        float weight[N];
+        for (unsigned i = 0; i < N; i++)
+            weight[i] = 1.0f;
+        if (depth_buffer && (regs.depth_stencil_read & 2)) {
+            const DepthFormat format = regs.depth_format.depth_format;
+            const uint32_t max_z = (1u << DepthBitsPerPixel(format)) - 1;
+            const unsigned shift = 24 - DepthBitsPerPixel(format);
+            for (unsigned i = 0; i < N; i++) {
+                if (!(mask & (1u << i)))
+                    continue;
+                const uint8_t* dst = depth_buffer + pixel[i] * depth_bytes_per_pixel;
+                const uint8_t* src = depth_tiles.IsPending(pixel[i]) ?
+                        depth_tiles.GetValue() : dst;
+                z[i] = static_cast<uint32_t>(depth[i] * max_z) << shift;
+                dest_z[i] = ((format == DepthFormat::D16) ?
+                        Color::DecodeD16(src) : Color::DecodeD24(src)) << shift;
+            }
+
+            static constexpr CompareFunc funcs[] = {
+                CompareFunc::Never, CompareFunc::Always,
+                CompareFunc::GreaterThanOrEqual, CompareFunc::LessThanOrEqual
+            };
+            const GasDepthFunc func = regs.gas_delta_z_depth.depth_func;
+            mask &= Compare<N>(funcs[static_cast<uint32_t>(func)], z, dest_z);
+            if (!mask)
+                return;
+
+            for (unsigned i = 0; i < N; i++) {
+                const uint32_t distance = (z[i] > dest_z[i]) ?
+                        z[i] - dest_z[i] : dest_z[i] - z[i];
+                if (distance < delta_z)
+                    weight[i] = static_cast<float>(distance) / delta_z;
+            }
+        }
+
+        const ColorFormat format = regs.color_format.color_format;
+        uint8_t* dst[N];
+        const uint8_t* src[N];
+        for (unsigned i = 0; i < N; i++) {
+            dst[i] = color_buffer + pixel[i] * color_bytes_per_pixel;
+            src[i] = color_tiles.IsPending(pixel[i]) ? color_tiles.GetValue() : dst[i];
+        }
+        Batch<N> dest{};
+        if (regs.color_read)
+            DecodeColors(format, src, mask, dest);
+
+        // The red channel of the combiner output is the density of the
+        // fragment. Red accumulates the plain density and green the depth
+        // weighted density, FogUnit::ApplyGas() shades with either of them.
+        Batch<N> result = dest;
+        for (unsigned i = 0; i < N; i++) {
+            const unsigned plain = dest.r[i] + color.r[i];
+            const unsigned weighted = dest.g[i] +
+                    static_cast<unsigned>(color.r[i] * weight[i]);
+            result.r[i] = static_cast<uint8_t>(std::min(plain, 255u));
+            result.g[i] = static_cast<uint8_t>(std::min(weighted, 255u));
+        }
+
+        for (unsigned i = 0; i < N; i++) {
+            if (mask & (1u << i))
+                color_tiles.Write(pixel[i], dst[i], false);
+        }
+        EncodeColors(format, result, dst, mask);
+    }
+
+    // Average the 2x1 or 2x2 blocks of a linear RGBA8 image into dst
+    static void Downscale(const uint8_t* src, unsigned width, unsigned height,
+            DownscaleMode scaling, uint8_t* dst) {
+        const unsigned out_width = width / 2;
+        if (scaling == DownscaleMode::X) {
+            for (unsigned y = 0; y < height; y++)
+                Color::BoxFilter2x1Span(src + y * width * 4, dst + y * out_width * 4,
+                        out_width);
+        } else {
+            for (unsigned y = 0; y < height / 2; y++)
+                Color::BoxFilter2x2Span(src + 2 * y * width * 4,
+                        src + (2 * y + 1) * width * 4, dst + y * out_width * 4, out_width);
+        }
+    }
+
+    void OutputMerger::ReadColorBuffer(uint8_t* rgba, DownscaleMode scaling) const {
+        const unsigned width = regs.GetWidth();
+        const unsigned height = regs.GetHeight();
+
+        if (scaling != DownscaleMode::None) {
+            std::vector<uint8_t> full(width * height * 4);
+            ReadColorBuffer(full.data());
+            Downscale(full.data(), width, height, scaling, rgba);
+            return;
+        }
+
+        if (!color_buffer) {
+            std::memset(rgba, 0, width * height * 4);
+            return;
+        }
+
+        const ColorFormat format = regs.color_format.color_format;
+        uint8_t fill[4];
+        DecodeColorSpan(format, color_tiles.GetValue(), fill, 1);
+        ForEachTile(width, height, [&](uint32_t first, unsigned tx, unsigned ty) {
+            uint8_t tile[TILE_PIXELS * 4];
+            DecodeColorSpan(format, color_buffer + first * color_bytes_per_pixel, tile,
+                    TILE_PIXELS);
+            for (unsigned y = ty; y < std::min(ty + 8, height); y++) {
+                for (unsigned x = tx; x < std::min(tx + 8, width); x++) {
+                    const uint32_t pixel = GetPixelOffset(x, y, width, height, 1);
+                    const uint8_t* src = color_tiles.IsPending(pixel) ?
+                            fill : tile + (pixel - first) * 4;
+                    std::memcpy(rgba + (y * width + x) * 4, src, 4);
+                }
+            }
+        });
+    }
+
+    void OutputMerger::ReadDepthBuffer(uint8_t* rgba, DownscaleMode scaling) const {
+        const unsigned width = regs.GetWidth();
+        const unsigned height = regs.GetHeight();
+
+        if (scaling != DownscaleMode::None) {
+            std::vector<uint8_t> full(width * height * 4);
+            ReadDepthBuffer(full.data());
+            Downscale(full.data(), width, height, scaling, rgba);
+            return;
+        }
+
+        if (!depth_buffer) {
+            std::memset(rgba, 0, width * height * 4);
+            return;
+        }
+
+        const DepthFormat format = regs.depth_format.depth_format;
+        const unsigned shift = DepthBitsPerPixel(format) - 8;
+        uint32_t fill;
+        DecodeDepthSpan(format, depth_tiles.GetValue(), &fill, 1);
+        ForEachTile(width, height, [&](uint32_t first, unsigned tx, unsigned ty) {
+            uint32_t tile[TILE_PIXELS];
+            DecodeDepthSpan(format, depth_buffer + first * depth_bytes_per_pixel, tile,
+                    TILE_PIXELS);
+            for (unsigned y = ty; y < std::min(ty + 8, height); y++) {
+                for (unsigned x = tx; x < std::min(tx + 8, width); x++) {
+                    const uint32_t pixel = GetPixelOffset(x, y, width, height, 1);
+                    const uint32_t z = depth_tiles.IsPending(pixel) ?
+                            fill : tile[pixel - first];
+                    uint8_t* dst = rgba + (y * width + x) * 4;
+                    dst[0] = dst[1] = dst[2] = z >> shift;
+                    dst[3] = 255;
+                }
+            }
+        });
+    }
+
+    void OutputMerger::MemoryFill(uint32_t address, uint32_t size,
+            uint32_t value, unsigned value_bytes) {
+        if ((value_bytes < 2) || (value_bytes > 4)) {
+            fprintf(stderr, "Invalid memory fill width %d\n", value_bytes);
+            return;
+        }
+
+        const uint32_t pixels = regs.GetWidth() * regs.GetHeight();
+        // The contents change now, even if memory is written later
+        Memory::MarkWritten(address, size);
+
+        if (color_buffer && (address == regs.GetColorBufferPhysicalAddress()) &&
+                (size == pixels * color_bytes_per_pixel) &&
+                (value_bytes == color_bytes_per_pixel)) {
+            color_tiles.Fill(value);
+            return;
+        }
+        if (depth_buffer && (address == regs.GetDepthBufferPhysicalAddress()) &&
+                (size == pixels * depth_bytes_per_pixel) &&
+                (value_bytes == depth_bytes_per_pixel)) {
+            depth_tiles.Fill(value);
+            return;
+        }
+
+        if (!Memory::IsValidRange(address, size)) {
+            fprintf(stderr, "Invalid memory fill range %08x-%08x\n", address,
+                    address + size);
+            return;
+        }
+
+        // The range may overlap a bound buffer with fills still pending
+        Flush();
+        uint8_t* dst = Memory::GetPhysicalPointer(address);
+        for (uint32_t i = 0; i + value_bytes <= size; i += value_bytes)
+            std::memcpy(dst + i, &value, value_bytes);
+    }
+
+    void OutputMerger::Flush() {
+        if (color_buffer)
+            color_tiles.Flush(color_buffer, regs.GetColorBufferPhysicalAddress());
+        if (depth_buffer)
+            depth_tiles.Flush(depth_buffer, regs.GetDepthBufferPhysicalAddress());
+    }
+
+    template unsigned OutputMerger::AlphaTest<4>(const Batch<4>&, unsigned) const;
+    template unsigned OutputMerger::AlphaTest<8>(const Batch<8>&, unsigned) const;
+    template unsigned OutputMerger::Merge<4>(const uint16_t*, const uint16_t*,
+            const float*, const Batch<4>&, unsigned);
+    template unsigned OutputMerger::Merge<8>(const uint16_t*, const uint16_t*,
+            const float*, const Batch<8>&, unsigned);
+}
@@ -0,0 +1,141 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "gxqueue.h"
+
+namespace GX {
+
+    CommandQueue::CommandQueue(Command::CommandProcessor& processor,
+            Framebuffer::OutputMerger& output_merger) :
+            processor(processor), output_merger(output_merger),
+            worker(&CommandQueue::Run, this) {}
+
+    CommandQueue::~CommandQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        pushed.notify_one();
+        worker.join();
+    }
+
+    Fence CommandQueue::Push(Entry& entry) {
+        Fence fence;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fence = entry.fence = ++last_fence;
+            entries.push_back(std::move(entry));
+        }
+        pushed.notify_one();
+        return fence;
+    }
+
+    Fence CommandQueue::ProcessCommandList(const uint32_t* list, size_t words,
+            Callback callback) {
+        Entry entry{};
+        entry.type = Type::CommandList;
+        entry.callback = std::move(callback);
+        entry.list = list;
+        entry.words = words;
+        return Push(entry);
+    }
+
+    Fence CommandQueue::MemoryFill(uint32_t address, uint32_t size,
+            uint32_t value, unsigned value_bytes, Callback callback) {
+        Entry entry{};
+        entry.type = Type::MemoryFill;
+        entry.callback = std::move(callback);
+        entry.address = address;
+        entry.size = size;
+        entry.value = value;
+        entry.value_bytes = value_bytes;
+        return Push(entry);
+    }
+
+    Fence CommandQueue::DisplayTransfer(const Transfer::Config& config,
+            Callback callback) {
+        Entry entry{};
+        entry.type = Type::DisplayTransfer;
+        entry.callback = std::move(callback);
+        entry.transfer = config;
+        return Push(entry);
+    }
+
+    bool CommandQueue::IsSignaled(Fence fence) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return completed_fence >= fence;
+    }
+
+    void CommandQueue::Wait(Fence fence) {
+        std::unique_lock<std::mutex> lock(mutex);
+        completed.wait(lock, [&] { return completed_fence >= fence; });
+    }
+
+    void CommandQueue::Finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        completed.wait(lock, [&] { return completed_fence >= last_fence; });
+    }
+
+    void CommandQueue::SetFinishCallback(Callback callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finish_callback = std::move(callback);
+    }
+
+    void CommandQueue::Run() {
+        for (;;) {
+            Entry entry;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pushed.wait(lock, [&] { return stop || !entries.empty(); });
+                // Pending commands complete before the queue stops
+                if (entries.empty())
+                    return;
+                entry = std::move(entries.front());
+                entries.pop_front();
+            }
+
+            switch (entry.type) {
+            case Type::CommandList:
+                processor.ProcessCommandList(entry.list, entry.words);
+                break;
+            case Type::MemoryFill:
+                output_merger.MemoryFill(entry.address, entry.size, entry.value,
+                        entry.value_bytes);
+                break;
+            case Type::DisplayTransfer:
+                // The source may be a render target with fills pending
+                output_merger.Flush();
+                Transfer::Execute(entry.transfer);
+                break;
+            }
+            if (entry.callback)
+                entry.callback();
+
+            Callback finish;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                completed_fence = entry.fence;
+                if (entries.empty())
+                    finish = finish_callback;
+            }
+            completed.notify_all();
+            if (finish)
+                finish();
+        }
+    }
+}
@@ -0,0 +1,455 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include "lighting.h"
+#include "lanes.h"
+#include "float.h"
+
+// The whole quad is lit at once: every vector below holds one lane per
+// fragment, so the per-light work is a sequence of 4-wide float operations.
+// Only the LUT reads are done lane by lane.
+
+namespace Lighting {
+
+    struct Vec3Lanes {
+        Lanes x, y, z;
+
+        Vec3Lanes operator+(const Vec3Lanes& o) const { return {x + o.x, y + o.y, z + o.z}; }
+        Vec3Lanes operator-(const Vec3Lanes& o) const { return {x - o.x, y - o.y, z - o.z}; }
+        Vec3Lanes operator*(Lanes f) const { return {x * f, y * f, z * f}; }
+        Vec3Lanes operator-() const { return {-x, -y, -z}; }
+
+        Lanes Length2() const { return x * x + y * y + z * z; }
+        Lanes Length() const { return Sqrt(Length2()); }
+        Vec3Lanes Normalized() const { return *this * (Lanes(1.0f) / Length()); }
+    };
+
+    static inline Lanes Dot(const Vec3Lanes& a, const Vec3Lanes& b) {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    static inline Vec3Lanes Cross(const Vec3Lanes& a, const Vec3Lanes& b) {
+        return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+    }
+
+    static inline Vec3Lanes Broadcast(const float (&v)[3]) {
+        return {v[0], v[1], v[2]};
+    }
+
+    // Rotate v by the normalized quaternion (q, w)
+    static inline Vec3Lanes QuaternionRotate(const Vec3Lanes& q, Lanes w,
+            const Vec3Lanes& v) {
+        return v + Cross(q, Cross(q, v) + v * w) * Lanes(2.0f);
+    }
+
+    static float GetScale(Scale scale) {
+        switch (scale) {
+        case Scale::x1: return 1.0f;
+        case Scale::x2: return 2.0f;
+        case Scale::x4: return 4.0f;
+        case Scale::x8: return 8.0f;
+        case Scale::x1_4: return 0.25f;
+        case Scale::x1_2: return 0.5f;
+        }
+        return 0.0f;
+    }
+
+    static void ColorToFloat(const LightColor& color, float (&out)[3]) {
+        out[0] = color.r / 255.0f;
+        out[1] = color.g / 255.0f;
+        out[2] = color.b / 255.0f;
+    }
+
+    LightingUnit::LightingUnit() {
+        std::memset(&regs, 0, sizeof(regs));
+        std::memset(luts, 0, sizeof(luts));
+        // Lighting is off until GPUREG_LIGHTING_ENABLE1 is written
+        regs.disable = 1;
+        UpdateSetup();
+    }
+
+    bool LightingUnit::IsSamplerSupported(LightingConfig config, Sampler sampler) {
+        switch (sampler) {
+        case Sampler::Distribution0:
+            return (config != LightingConfig::Config1);
+        case Sampler::Distribution1:
+            return (config != LightingConfig::Config0) &&
+                    (config != LightingConfig::Config1) &&
+                    (config != LightingConfig::Config5);
+        case Sampler::SpotlightAttenuation:
+            return (config != LightingConfig::Config2) &&
+                    (config != LightingConfig::Config3);
+        case Sampler::Fresnel:
+            return (config != LightingConfig::Config0) &&
+                    (config != LightingConfig::Config2) &&
+                    (config != LightingConfig::Config4);
+        case Sampler::ReflectRed:
+            return (config != LightingConfig::Config3);
+        case Sampler::ReflectGreen:
+        case Sampler::ReflectBlue:
+            return (config == LightingConfig::Config4) ||
+                    (config == LightingConfig::Config5) ||
+                    (config == LightingConfig::Config7);
+        default:
+            UNREACHABLE();
+        }
+        return false;
+    }
+
+    void LightingUnit::WriteRegister(unsigned index, uint32_t value) {
+        constexpr unsigned lut_data_begin = offsetof(Registers, lut_data) / 4;
+        constexpr unsigned lut_data_end = lut_data_begin + 8;
+
+        if (index >= sizeof(Registers) / 4) {
+            fprintf(stderr, "Invalid lighting register %x\n", index + REGISTER_BASE);
+            return;
+        }
+
+        if (index >= lut_data_begin && index < lut_data_end) {
+            unsigned type = regs.lut_config.type;
+            unsigned lut_index = regs.lut_config.index;
+            if (type < NUM_LUTS) {
+                union {
+                    uint32_t raw;
+                    isa::BitField<0, 12, uint32_t> value;
+                    // Difference to the next entry
+                    isa::BitField<12, 12, int32_t> difference;
+                } entry;
+                entry.raw = value;
+                luts[type].value[lut_index] = entry.value / 4095.0f;
+                luts[type].diff[lut_index] = entry.difference / 4095.0f;
+            }
+            else {
+                fprintf(stderr, "Invalid lighting LUT %d\n", type);
+            }
+            regs.lut_config.index = (lut_index + 1) & 0xff;
+            return;
+        }
+
+        reinterpret_cast<uint32_t*>(&regs)[index] = value;
+        UpdateSetup();
+    }
+
+    void LightingUnit::UpdateSetup() {
+        LightingConfig config = regs.config0.config;
+
+        num_lights = (regs.max_light_index & 7) + 1;
+        const uint32_t slots = regs.light_enable.hex;
+        for (unsigned i = 0; i < num_lights; i++) {
+            LightSetup& setup = lights[i];
+            unsigned num = (slots >> (i * 4)) & 7;
+            const LightSource& light = regs.light[num];
+
+            setup.num = num;
+            ColorToFloat(light.specular_0, setup.specular_0);
+            ColorToFloat(light.specular_1, setup.specular_1);
+            ColorToFloat(light.diffuse, setup.diffuse);
+            ColorToFloat(light.ambient, setup.ambient);
+            setup.position[0] = float16::FromRaw(light.x).ToFloat32();
+            setup.position[1] = float16::FromRaw(light.y).ToFloat32();
+            setup.position[2] = float16::FromRaw(light.z).ToFloat32();
+            setup.spot_direction[0] = light.spot_x / 2047.0f;
+            setup.spot_direction[1] = light.spot_y / 2047.0f;
+            setup.spot_direction[2] = light.spot_z / 2047.0f;
+            setup.dist_atten_scale =
+                    float20::FromRaw(light.dist_atten_scale & 0xfffff).ToFloat32();
+            setup.dist_atten_bias =
+                    float20::FromRaw(light.dist_atten_bias & 0xfffff).ToFloat32();
+            setup.directional = light.config.directional;
+            setup.two_sided_diffuse = light.config.two_sided_diffuse;
+            setup.geometric_factor_0 = light.config.geometric_factor_0;
+            setup.geometric_factor_1 = light.config.geometric_factor_1;
+            setup.dist_atten = !(regs.config1.disable_dist_atten & (1 << num));
+            setup.spot_atten = !(regs.config1.disable_spot_atten & (1 << num)) &&
+                    IsSamplerSupported(config, Sampler::SpotlightAttenuation);
+            setup.shadow = !(regs.config1.disable_shadow & (1 << num));
+        }
+
+        auto SetupLUT = [&](LUTSetup& lut, bool disable, bool disable_abs,
+                LutInput input, Scale scale, Sampler sampler) {
+            lut.enable = !disable && IsSamplerSupported(config, sampler);
+            lut.abs = !disable_abs;
+            lut.input = input;
+            lut.scale = GetScale(scale);
+            lut.sampler = sampler;
+        };
+
+        const auto& c1 = regs.config1;
+        const auto& abs = regs.abs_lut_input;
+        const auto& input = regs.lut_input;
+        const auto& scale = regs.lut_scale;
+        SetupLUT(d0, c1.disable_lut_d0, abs.disable_d0, input.d0, scale.d0,
+                Sampler::Distribution0);
+        SetupLUT(d1, c1.disable_lut_d1, abs.disable_d1, input.d1, scale.d1,
+                Sampler::Distribution1);
+        SetupLUT(fr, c1.disable_lut_fr, abs.disable_fr, input.fr, scale.fr,
+                Sampler::Fresnel);
+        SetupLUT(rr, c1.disable_lut_rr, abs.disable_rr, input.rr, scale.rr,
+                Sampler::ReflectRed);
+        SetupLUT(rg, c1.disable_lut_rg, abs.disable_rg, input.rg, scale.rg,
+                Sampler::ReflectGreen);
+        SetupLUT(rb, c1.disable_lut_rb, abs.disable_rb, input.rb, scale.rb,
+                Sampler::ReflectBlue);
+        // Enable and sampler of the spotlight LUT are per light
+        SetupLUT(sp, false, abs.disable_sp, input.sp, scale.sp,
+                Sampler::SpotlightAttenuation);
+
+        ColorToFloat(regs.global_ambient, global_ambient);
+    }
+
+    // Sample a LUT with linear interpolation between entries. In abs mode
+    // the position covers [0, 1], otherwise [-1, 1] with the negative half
+    // stored in the upper 128 entries.
+    static Lanes SampleLUT(const float* value, const float* diff, Lanes position,
+            bool abs) {
+        Lanes scaled = position * Lanes(abs ? 256.0f : 128.0f);
+        Lanes index = abs ? Clamp(Floor(scaled), 0.0f, 255.0f) :
+                Clamp(Floor(scaled), -128.0f, 127.0f);
+        Lanes delta = scaled - index;
+
+        float index_f[4], delta_f[4], result[4];
+        index.Store(index_f);
+        delta.Store(delta_f);
+        for (unsigned i = 0; i < 4; i++) {
+            unsigned entry = static_cast<int>(index_f[i]) & 0xff;
+            result[i] = value[entry] + diff[entry] * delta_f[i];
+        }
+        return Lanes::Load(result);
+    }
+
+    void LightingUnit::Compute(const float (&quat)[4][QUAD_SIZE],
+            const float (&view_in)[3][QUAD_SIZE],
+            const ColorQuad (&texture_color)[4],
+            ColorQuad& primary, ColorQuad& secondary) const {
+        const auto& config0 = regs.config0;
+
+        Lanes shadow[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+        if (config0.enable_shadow) {
+            const ColorQuad& texel = texture_color[config0.shadow_selector];
+            const uint8_t* channels[4] = {texel.r, texel.g, texel.b, texel.a};
+            for (unsigned c = 0; c < 4; c++) {
+                shadow[c] = ChannelToFloat(channels[c], 1.0f / 255.0f);
+                if (config0.shadow_invert)
+                    shadow[c] = Lanes(1.0f) - shadow[c];
+            }
+        }
+
+        Vec3Lanes surface_normal{0.0f, 0.0f, 1.0f};
+        Vec3Lanes surface_tangent{1.0f, 0.0f, 0.0f};
+        BumpMode bump_mode = config0.bump_mode;
+        if (bump_mode != BumpMode::None) {
+            const ColorQuad& texel = texture_color[config0.bump_selector];
+            Vec3Lanes perturbation{
+                    ChannelToFloat(texel.r, 1.0f / 127.5f) - Lanes(1.0f),
+                    ChannelToFloat(texel.g, 1.0f / 127.5f) - Lanes(1.0f),
+                    ChannelToFloat(texel.b, 1.0f / 127.5f) - Lanes(1.0f)};
+            if (bump_mode == BumpMode::NormalMap) {
+                if (!config0.disable_bump_renorm) {
+                    Lanes z_square = Lanes(1.0f) - perturbation.x * perturbation.x -
+                            perturbation.y * perturbation.y;
+                    perturbation.z = Sqrt(Max(z_square, 0.0f));
+                }
+                surface_normal = perturbation;
+            }
+            else if (bump_mode == BumpMode::TangentMap) {
+                surface_tangent = perturbation;
+            }
+            else {
+                fprintf(stderr, "Unknown bump mode %d\n",
+                        static_cast<uint32_t>(bump_mode));
+            }
+        }
+
+        // Use the normalized quaternion when performing the rotation
+        Vec3Lanes q{Lanes::Load(quat[0]), Lanes::Load(quat[1]), Lanes::Load(quat[2])};
+        Lanes qw = Lanes::Load(quat[3]);
+        Lanes inv_length = Lanes(1.0f) / Sqrt(q.Length2() + qw * qw);
+        q = q * inv_length;
+        qw = qw * inv_length;
+        Vec3Lanes normal = QuaternionRotate(q, qw, surface_normal);
+        Vec3Lanes tangent = QuaternionRotate(q, qw, surface_tangent);
+
+        Vec3Lanes view{Lanes::Load(view_in[0]), Lanes::Load(view_in[1]),
+                Lanes::Load(view_in[2])};
+        Vec3Lanes norm_view = view.Normalized();
+
+        Vec3Lanes diffuse_sum{0.0f, 0.0f, 0.0f};
+        Vec3Lanes specular_sum{0.0f, 0.0f, 0.0f};
+        Lanes diffuse_alpha = 1.0f;
+        Lanes specular_alpha = 1.0f;
+
+        for (unsigned light_index = 0; light_index < num_lights; light_index++) {
+            const LightSetup& light = lights[light_index];
+
+            Vec3Lanes position = Broadcast(light.position);
+            Vec3Lanes light_vector = light.directional ? position : position + view;
+            light_vector = light_vector.Normalized();
+
+            Vec3Lanes half_vector = norm_view + light_vector;
+            Vec3Lanes norm_half_vector = half_vector.Normalized();
+
+            auto GetLutValue = [&](const LUTSetup& setup, unsigned lut) {
+                Lanes result;
+                switch (setup.input) {
+                case LutInput::NH:
+                    result = Dot(normal, norm_half_vector);
+                    break;
+                case LutInput::VH:
+                    result = Dot(norm_view, norm_half_vector);
+                    break;
+                case LutInput::NV:
+                    result = Dot(normal, norm_view);
+                    break;
+                case LutInput::LN:
+                    result = Dot(light_vector, normal);
+                    break;
+                case LutInput::SP:
+                    result = Dot(light_vector, Broadcast(light.spot_direction));
+                    break;
+                case LutInput::CP:
+                    if (regs.config0.config == LightingConfig::Config7) {
+                        Vec3Lanes half_vector_proj = norm_half_vector -
+                                normal * Dot(normal, norm_half_vector);
+                        result = Dot(half_vector_proj, tangent);
+                    }
+                    else {
+                        result = 0.0f;
+                    }
+                    break;
+                default:
+                    fprintf(stderr, "Unknown lighting LUT input %d\n",
+                            static_cast<uint32_t>(setup.input));
+                    UNIMPLEMENTED();
+                    result = 0.0f;
+                }
+
+                if (setup.abs)
+                    result = light.two_sided_diffuse ? Abs(result) : Max(result, 0.0f);
+
+                return Lanes(setup.scale) *
+                        SampleLUT(luts[lut].value, luts[lut].diff, result, setup.abs);
+            };
+
+            Lanes dist_atten = 1.0f;
+            if (light.dist_atten) {
+                Lanes distance = (-view - position).Length();
+                Lanes sample_loc = Clamp(distance * Lanes(light.dist_atten_scale) +
+                        Lanes(light.dist_atten_bias), 0.0f, 1.0f);
+                unsigned lut = static_cast<unsigned>(Sampler::DistanceAttenuation) + light.num;
+                dist_atten = SampleLUT(luts[lut].value, luts[lut].diff, sample_loc, true);
+            }
+
+            Lanes spot_atten = 1.0f;
+            if (light.spot_atten)
+                spot_atten = GetLutValue(sp,
+                        static_cast<unsigned>(Sampler::SpotlightAttenuation) + light.num);
+
+            Lanes d0_lut_value = 1.0f;
+            if (d0.enable)
+                d0_lut_value = GetLutValue(d0, static_cast<unsigned>(d0.sampler));
+            Vec3Lanes specular_0 = Broadcast(light.specular_0) * d0_lut_value;
+
+            Vec3Lanes refl_value;
+            refl_value.x = rr.enable ?
+                    GetLutValue(rr, static_cast<unsigned>(rr.sampler)) : Lanes(1.0f);
+            refl_value.y = rg.enable ?
+                    GetLutValue(rg, static_cast<unsigned>(rg.sampler)) : refl_value.x;
+            refl_value.z = rb.enable ?
+                    GetLutValue(rb, static_cast<unsigned>(rb.sampler)) : refl_value.x;
+
+            Lanes d1_lut_value = 1.0f;
+            if (d1.enable)
+                d1_lut_value = GetLutValue(d1, static_cast<unsigned>(d1.sampler));
+            Vec3Lanes specular_1 = Broadcast(light.specular_1) * d1_lut_value;
+            specular_1 = {specular_1.x * refl_value.x, specular_1.y * refl_value.y,
+                    specular_1.z * refl_value.z};
+
+            // Only the last entry in the light slots applies the Fresnel factor
+            if (light_index == num_lights - 1 && fr.enable) {
+                Lanes lut_value = GetLutValue(fr, static_cast<unsigned>(fr.sampler));
+                FresnelSelector selector = config0.fresnel_selector;
+                if (selector == FresnelSelector::PrimaryAlpha ||
+                        selector == FresnelSelector::Both)
+                    diffuse_alpha = lut_value;
+                if (selector == FresnelSelector::SecondaryAlpha ||
+                        selector == FresnelSelector::Both)
+                    specular_alpha = lut_value;
+            }
+
+            Lanes dot_product = Dot(light_vector, normal);
+            dot_product = light.two_sided_diffuse ?
+                    Abs(dot_product) : Max(dot_product, 0.0f);
+
+            Lanes clamp_highlights = 1.0f;
+            if (config0.clamp_highlights)
+                clamp_highlights = SelectZero(dot_product, 0.0f, 1.0f);
+
+            if (light.geometric_factor_0 || light.geometric_factor_1) {
+                Lanes geo_factor = half_vector.Length2();
+                geo_factor = SelectZero(geo_factor, 0.0f,
+                        Min(dot_product / geo_factor, 1.0f));
+                if (light.geometric_factor_0)
+                    specular_0 = specular_0 * geo_factor;
+                if (light.geometric_factor_1)
+                    specular_1 = specular_1 * geo_factor;
+            }
+
+            Lanes atten = dist_atten * spot_atten;
+            Vec3Lanes diffuse = (Broadcast(light.diffuse) * dot_product +
+                    Broadcast(light.ambient)) * atten;
+            Vec3Lanes specular = (specular_0 + specular_1) * (clamp_highlights * atten);
+
+            if (light.shadow) {
+                if (config0.shadow_primary)
+                    diffuse = {diffuse.x * shadow[0], diffuse.y * shadow[1],
+                            diffuse.z * shadow[2]};
+                if (config0.shadow_secondary)
+                    specular = {specular.x * shadow[0], specular.y * shadow[1],
+                            specular.z * shadow[2]};
+            }
+
+            diffuse_sum = diffuse_sum + diffuse;
+            specular_sum = specular_sum + specular;
+        }
+
+        if (config0.shadow_alpha) {
+            // Alpha shadow also uses the Fresnel selector to determine which
+            // alpha to apply
+            FresnelSelector selector = config0.fresnel_selector;
+            if (selector == FresnelSelector::PrimaryAlpha ||
+                    selector == FresnelSelector::Both)
+                diffuse_alpha = diffuse_alpha * shadow[3];
+            if (selector == FresnelSelector::SecondaryAlpha ||
+                    selector == FresnelSelector::Both)
+                specular_alpha = specular_alpha * shadow[3];
+        }
+
+        diffuse_sum = diffuse_sum + Broadcast(global_ambient);
+
+        FloatToChannel(diffuse_sum.x, primary.r);
+        FloatToChannel(diffuse_sum.y, primary.g);
+        FloatToChannel(diffuse_sum.z, primary.b);
+        FloatToChannel(diffuse_alpha, primary.a);
+        FloatToChannel(specular_sum.x, secondary.r);
+        FloatToChannel(specular_sum.y, secondary.g);
+        FloatToChannel(specular_sum.z, secondary.b);
+        FloatToChannel(specular_alpha, secondary.a);
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "memory.h"
+
+namespace Memory {
+
+    // Translation granularity, regions are aligned to it
+    constexpr unsigned SECTION_SHIFT = 20;
+    constexpr uint32_t SECTION_SIZE = 1u << SECTION_SHIFT;
+    constexpr unsigned NUM_SECTIONS = 1u << (32 - SECTION_SHIFT);
+    constexpr unsigned NUM_PAGES = 1u << (32 - PAGE_SHIFT);
+    // Longest run of pages reported at once, its size must fit in 32 bits
+    constexpr uint32_t MAX_RUN_PAGES = NUM_PAGES / 2;
+
+    struct Region {
+        uint32_t base;
+        uint32_t size;
+    };
+
+    static constexpr Region regions[] = {
+        {VRAM_PADDR, VRAM_SIZE},
+        {FCRAM_PADDR, FCRAM_SIZE}
+    };
+
+    static_assert(VRAM_PADDR % SECTION_SIZE == 0 && VRAM_SIZE % SECTION_SIZE == 0 &&
+            FCRAM_PADDR % SECTION_SIZE == 0 && FCRAM_SIZE % SECTION_SIZE == 0,
+            "Regions are not aligned to sections");
+
+    struct Section {
+        // Host pointer of the first byte, nullptr if not mapped
+        uint8_t* host;
+        // Physical end of the region containing the section
+        uint64_t end;
+    };
+
+    // Page table, one lookup translates any address
+    static Section sections[NUM_SECTIONS];
+    static bool initialized = false;
+
+    // Pages written since the last FlushWrites(), as a list and as a bitmap
+    // to add each page once
+    static WriteCallback write_callback = nullptr;
+    static std::vector<uint64_t> written_bitmap;
+    static std::vector<uint32_t> written_pages;
+
+    static uint8_t* MapRegion(uint32_t size, bool huge_pages) {
+#ifndef _WIN32
+        // Pages are committed lazily on first access
+        void* host = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (huge_pages)
+            host = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                    MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+#endif
+        if (host == MAP_FAILED) {
+            host = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (host == MAP_FAILED)
+                return nullptr;
+#ifdef MADV_HUGEPAGE
+            // Fewer TLB misses on framebuffer and texture access
+            madvise(host, size, MADV_HUGEPAGE);
+#endif
+        }
+        return static_cast<uint8_t*>(host);
+#else
+        (void)huge_pages;
+        return static_cast<uint8_t*>(calloc(size, 1));
+#endif
+    }
+
+    bool Init(bool huge_pages) {
+        if (initialized)
+            return false;
+        initialized = true;
+
+        for (const Region& region : regions) {
+            uint8_t* host = MapRegion(region.size, huge_pages);
+            if (!host) {
+                fprintf(stderr, "Unable to map memory at %08x\n", region.base);
+                return false;
+            }
+            for (uint32_t offset = 0; offset < region.size; offset += SECTION_SIZE) {
+                Section& section = sections[(region.base + offset) >> SECTION_SHIFT];
+                section.host = host + offset;
+                section.end = uint64_t(region.base) + region.size;
+            }
+        }
+        return true;
+    }
+
+    uint8_t* GetPhysicalPointer(uint32_t address) {
+        if (!initialized)
+            Init();
+        const Section& section = sections[address >> SECTION_SHIFT];
+        return section.host ?
+                section.host + (address & (SECTION_SIZE - 1)) : nullptr;
+    }
+
+    bool IsValidRange(uint32_t address, uint64_t size) {
+        if (!initialized)
+            Init();
+        const Section& section = sections[address >> SECTION_SHIFT];
+        return section.host && (size <= section.end - address);
+    }
+
+    void SetWriteCallback(WriteCallback callback) {
+        write_callback = callback;
+        if (written_bitmap.empty())
+            written_bitmap.resize(NUM_PAGES / 64);
+    }
+
+    void MarkWritten(uint32_t address, uint32_t size) {
+        if (!write_callback || !size)
+            return;
+
+        const uint32_t first = address >> PAGE_SHIFT;
+        const uint32_t last = std::min<uint64_t>(uint64_t(address) + size - 1,
+                UINT32_MAX) >> PAGE_SHIFT;
+        for (uint32_t page = first; page <= last; page++) {
+            uint64_t& word = written_bitmap[page / 64];
+            const uint64_t bit = uint64_t(1) << (page % 64);
+            if (!(word & bit)) {
+                word |= bit;
+                written_pages.push_back(page);
+            }
+        }
+    }
+
+    void FlushWrites() {
+        if (written_pages.empty())
+            return;
+
+        std::sort(written_pages.begin(), written_pages.end());
+        size_t i = 0;
+        while (i < written_pages.size()) {
+            const uint32_t first = written_pages[i];
+            uint32_t count = 0;
+            do {
+                const uint32_t page = written_pages[i++];
+                written_bitmap[page / 64] &= ~(uint64_t(1) << (page % 64));
+                count++;
+            } while (i < written_pages.size() && written_pages[i] == first + count &&
+                    count < MAX_RUN_PAGES);
+
+            if (write_callback)
+                write_callback(first << PAGE_SHIFT, count << PAGE_SHIFT);
+        }
+        written_pages.clear();
+    }
+}
@@ -0,0 +1,378 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2017  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include "proctex.h"
+#include "regs.h"
+#include "float.h"
+
+// Per-fragment evaluation works on arrays of N lanes. Every mode switch is
+// resolved once per batch, so the lane loops are branch-free table lookups
+// and a few multiplies.
+
+namespace Texturing {
+
+    // The noise generator below is periodic with 9 * 16 in both directions
+    constexpr unsigned NOISE_PERIOD = 144;
+
+    // These functions are used to generate random noise for procedural
+    // texture. Their results are verified against real hardware, but it's
+    // not known if the algorithm is the same as hardware.
+    static unsigned NoiseRand1D(unsigned v) {
+        static constexpr unsigned table[16] =
+                {0, 4, 10, 8, 4, 9, 7, 12, 5, 15, 13, 14, 11, 15, 2, 11};
+        return ((v % 9 + 2) * 3 & 0xF) ^ table[(v / 9) & 0xF];
+    }
+
+    static float NoiseRand2D(unsigned x, unsigned y) {
+        static constexpr unsigned table[16] =
+                {10, 2, 15, 8, 0, 7, 4, 5, 5, 13, 2, 6, 13, 9, 3, 14};
+        unsigned u2 = NoiseRand1D(x);
+        unsigned v2 = NoiseRand1D(y);
+        v2 += ((u2 & 3) == 1) ? 4 : 0;
+        v2 ^= (u2 & 1) * 6;
+        v2 += 10 + u2;
+        v2 &= 0xF;
+        v2 ^= table[u2];
+        return -1.0f + v2 * 2.0f / 15.0f;
+    }
+
+    // One period of NoiseRand2D, with one extra row and column so that the
+    // four corners of a cell can be read without wrapping
+    struct NoiseTable {
+        float value[NOISE_PERIOD + 1][NOISE_PERIOD + 1];
+
+        NoiseTable() {
+            for (unsigned y = 0; y <= NOISE_PERIOD; y++)
+                for (unsigned x = 0; x <= NOISE_PERIOD; x++)
+                    value[y][x] = NoiseRand2D(x, y);
+        }
+    };
+
+    static const NoiseTable& GetNoiseTable() {
+        static const NoiseTable table;
+        return table;
+    }
+
+    ProcTexUnit::ProcTexUnit() {
+        std::memset(&config, 0, sizeof(config));
+        std::memset(&noise_lut, 0, sizeof(noise_lut));
+        std::memset(&rgb_map_lut, 0, sizeof(rgb_map_lut));
+        std::memset(&alpha_map_lut, 0, sizeof(alpha_map_lut));
+        std::memset(color_lut, 0, sizeof(color_lut));
+        std::memset(color_diff_lut, 0, sizeof(color_diff_lut));
+        lut_table = ProcTexLUT::Noise;
+        lut_index = 0;
+        for (unsigned i = 0; i < 6; i++)
+            WriteConfig(i, 0);
+    }
+
+    void ProcTexUnit::WriteRegister(unsigned id, uint32_t value) {
+        if (id >= GPUREG_TEXUNIT3_PROCTEX0 && id <= GPUREG_TEXUNIT3_PROCTEX5)
+            WriteConfig(id - GPUREG_TEXUNIT3_PROCTEX0, value);
+        else if (id == GPUREG_PROCTEX_LUT)
+            SetLUTIndex(value);
+        else if (id >= GPUREG_PROCTEX_LUT_DATA0 && id <= GPUREG_PROCTEX_LUT_DATA7)
+            WriteLUTData(value);
+        else
+            fprintf(stderr, "Invalid procedural texture register %x\n", id);
+    }
+
+    void ProcTexUnit::WriteConfig(unsigned index, uint32_t value) {
+        switch (index) {
+        case 0: config.main.hex = value; break;
+        case 1: config.noise_u.hex = value; break;
+        case 2: config.noise_v.hex = value; break;
+        case 3: config.noise_frequency.hex = value; break;
+        case 4: config.lut.hex = value; break;
+        case 5: config.lut_offset.hex = value; break;
+        default: UNREACHABLE();
+        }
+
+        noise_frequency_u = float16::FromRaw(config.noise_frequency.u).ToFloat32();
+        noise_frequency_v = float16::FromRaw(config.noise_frequency.v).ToFloat32();
+        noise_phase_u = float16::FromRaw(config.noise_u.phase).ToFloat32();
+        noise_phase_v = float16::FromRaw(config.noise_v.phase).ToFloat32();
+        noise_amplitude_u = config.noise_u.amplitude / 4095.0f;
+        noise_amplitude_v = config.noise_v.amplitude / 4095.0f;
+    }
+
+    void ProcTexUnit::SetLUTIndex(uint32_t value) {
+        lut_index = value & 0xFF;
+        lut_table = static_cast<ProcTexLUT>((value >> 8) & 0xF);
+    }
+
+    void ProcTexUnit::WriteLUTData(uint32_t value) {
+        // Map tables: 12-bit value, signed 12-bit difference to the next one
+        auto WriteMap = [&](MapLUT& lut) {
+            if (lut_index >= MAP_LUT_SIZE)
+                return;
+            const int32_t diff = static_cast<int32_t>(value << 8) >> 20;
+            lut.value[lut_index] = (value & 0xFFF) / 4095.0f;
+            lut.diff[lut_index] = diff / 4095.0f;
+        };
+
+        switch (lut_table) {
+        case ProcTexLUT::Noise:
+            WriteMap(noise_lut);
+            break;
+        case ProcTexLUT::RGBMap:
+            WriteMap(rgb_map_lut);
+            break;
+        case ProcTexLUT::AlphaMap:
+            WriteMap(alpha_map_lut);
+            break;
+        case ProcTexLUT::Color:
+            for (unsigned c = 0; c < 4; c++)
+                color_lut[lut_index][c] = static_cast<float>((value >> (c * 8)) & 0xFF);
+            break;
+        case ProcTexLUT::ColorDiff:
+            // Stored as half of the signed difference
+            for (unsigned c = 0; c < 4; c++)
+                color_diff_lut[lut_index][c] =
+                        static_cast<float>(static_cast<int8_t>(value >> (c * 8)) * 2);
+            break;
+        default:
+            fprintf(stderr, "ProcTex: Unknown LUT %u\n", (uint32_t)lut_table);
+            break;
+        }
+
+        lut_index = (lut_index + 1) & 0xFF;
+    }
+
+    template <unsigned N>
+    void ProcTexUnit::LookupMap(const MapLUT& lut, const float* coord, float* result) {
+        // coord=0.0 is lut[0], coord=127.0/128.0 is lut[127] and coord=1.0
+        // is lut[127]+lut_diff[127]
+        for (unsigned i = 0; i < N; i++) {
+            const float scaled = coord[i] * MAP_LUT_SIZE;
+            const int index = std::clamp(static_cast<int>(scaled), 0,
+                    static_cast<int>(MAP_LUT_SIZE) - 1);
+            result[i] = lut.value[index] + (scaled - index) * lut.diff[index];
+        }
+    }
+
+    template <unsigned N>
+    void ProcTexUnit::CombineAndMap(ProcTexCombiner combiner, const MapLUT& lut,
+            const float* u, const float* v, float* result) {
+        alignas(16) float f[N];
+        switch (combiner) {
+        case ProcTexCombiner::U:
+            std::copy(u, u + N, f);
+            break;
+        case ProcTexCombiner::U2:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = u[i] * u[i];
+            break;
+        case ProcTexCombiner::V:
+            std::copy(v, v + N, f);
+            break;
+        case ProcTexCombiner::V2:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = v[i] * v[i];
+            break;
+        case ProcTexCombiner::Add:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = (u[i] + v[i]) * 0.5f;
+            break;
+        case ProcTexCombiner::Add2:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = (u[i] * u[i] + v[i] * v[i]) * 0.5f;
+            break;
+        case ProcTexCombiner::SqrtAdd2:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = std::min(std::sqrt(u[i] * u[i] + v[i] * v[i]), 1.0f);
+            break;
+        case ProcTexCombiner::Min:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = std::min(u[i], v[i]);
+            break;
+        case ProcTexCombiner::Max:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = std::max(u[i], v[i]);
+            break;
+        case ProcTexCombiner::RMax:
+            for (unsigned i = 0; i < N; i++)
+                f[i] = std::min(((u[i] + v[i]) * 0.5f +
+                        std::sqrt(u[i] * u[i] + v[i] * v[i])) * 0.5f, 1.0f);
+            break;
+        default:
+            fprintf(stderr, "ProcTex: Unknown combiner %u\n", (uint32_t)combiner);
+            std::fill(f, f + N, 0.0f);
+            break;
+        }
+        LookupMap<N>(lut, f, result);
+    }
+
+    template <unsigned N>
+    void ProcTexUnit::Noise(const float* u, const float* v, float* result) const {
+        const NoiseTable& table = GetNoiseTable();
+        alignas(16) float x_frac[N], y_frac[N], x_noise[N], y_noise[N];
+        unsigned x_int[N], y_int[N];
+
+        for (unsigned i = 0; i < N; i++) {
+            const float x = 9 * noise_frequency_u * std::fabs(u[i] + noise_phase_u);
+            const float y = 9 * noise_frequency_v * std::fabs(v[i] + noise_phase_v);
+            x_int[i] = static_cast<unsigned>(x);
+            y_int[i] = static_cast<unsigned>(y);
+            x_frac[i] = x - x_int[i];
+            y_frac[i] = y - y_int[i];
+        }
+
+        LookupMap<N>(noise_lut, x_frac, x_noise);
+        LookupMap<N>(noise_lut, y_frac, y_noise);
+
+        for (unsigned i = 0; i < N; i++) {
+            const unsigned x = x_int[i] % NOISE_PERIOD;
+            const unsigned y = y_int[i] % NOISE_PERIOD;
+            const float sum = x_frac[i] + y_frac[i];
+            const float g0 = table.value[y][x] * sum;
+            const float g1 = table.value[y][x + 1] * (sum - 1);
+            const float g2 = table.value[y + 1][x] * (sum - 1);
+            const float g3 = table.value[y + 1][x + 1] * (sum - 2);
+            const float top = g0 + (g1 - g0) * x_noise[i];
+            const float bottom = g2 + (g3 - g2) * x_noise[i];
+            result[i] = top + (bottom - top) * y_noise[i];
+        }
+    }
+
+    // Offset applied to one coordinate depending on the other one
+    template <unsigned N>
+    static void ShiftOffset(const float* coord, ProcTexShift mode,
+            ProcTexClamp clamp, float* result) {
+        const float offset = (clamp == ProcTexClamp::MirroredRepeat) ? 1.0f : 0.5f;
+        switch (mode) {
+        case ProcTexShift::Odd:
+            for (unsigned i = 0; i < N; i++)
+                result[i] = offset * ((static_cast<int>(coord[i]) / 2) % 2);
+            break;
+        case ProcTexShift::Even:
+            for (unsigned i = 0; i < N; i++)
+                result[i] = offset * (((static_cast<int>(coord[i]) + 1) / 2) % 2);
+            break;
+        default:
+            std::fill(result, result + N, 0.0f);
+            break;
+        }
+    }
+
+    template <unsigned N>
+    static void ClampCoord(float* coord, ProcTexClamp mode) {
+        switch (mode) {
+        case ProcTexClamp::ToZero:
+            for (unsigned i = 0; i < N; i++)
+                coord[i] = (coord[i] > 1.0f) ? 0.0f : coord[i];
+            break;
+        case ProcTexClamp::SymmetricalRepeat:
+            for (unsigned i = 0; i < N; i++)
+                coord[i] = coord[i] - std::floor(coord[i]);
+            break;
+        case ProcTexClamp::MirroredRepeat:
+            for (unsigned i = 0; i < N; i++) {
+                const int integer = static_cast<int>(coord[i]);
+                const float frac = coord[i] - integer;
+                coord[i] = (integer % 2) == 0 ? frac : (1.0f - frac);
+            }
+            break;
+        case ProcTexClamp::Pulse:
+            for (unsigned i = 0; i < N; i++)
+                coord[i] = (coord[i] <= 0.5f) ? 0.0f : 1.0f;
+            break;
+        case ProcTexClamp::ToEdge:
+        default:
+            for (unsigned i = 0; i < N; i++)
+                coord[i] = std::min(coord[i], 1.0f);
+            break;
+        }
+    }
+
+    template <unsigned N>
+    void ProcTexUnit::Lookup(const float* s, const float* t, TexelBatch<N>& out) const {
+        alignas(16) float u[N], v[N], u_shift[N], v_shift[N], coord[N];
+
+        for (unsigned i = 0; i < N; i++) {
+            u[i] = std::fabs(s[i]);
+            v[i] = std::fabs(t[i]);
+        }
+
+        // Get shift offset before noise generation
+        ShiftOffset<N>(v, config.main.u_shift, config.main.u_clamp, u_shift);
+        ShiftOffset<N>(u, config.main.v_shift, config.main.v_clamp, v_shift);
+
+        if (config.main.noise_enable) {
+            alignas(16) float noise[N];
+            Noise<N>(u, v, noise);
+            for (unsigned i = 0; i < N; i++) {
+                u[i] = std::fabs(u[i] + noise[i] * noise_amplitude_u);
+                v[i] = std::fabs(v[i] + noise[i] * noise_amplitude_v);
+            }
+        }
+
+        for (unsigned i = 0; i < N; i++) {
+            u[i] += u_shift[i];
+            v[i] += v_shift[i];
+        }
+
+        ClampCoord<N>(u, config.main.u_clamp);
+        ClampCoord<N>(v, config.main.v_clamp);
+
+        CombineAndMap<N>(config.main.color_combiner, rgb_map_lut, u, v, coord);
+
+        // For the color lut, coord=0.0 is lut[offset] and coord=1.0 is
+        // lut[offset+width-1]
+        // TODO: implement mipmap
+        const float offset = static_cast<float>(config.lut_offset.offset);
+        const float width = static_cast<float>(config.lut.width);
+        const ProcTexFilter filter = config.lut.filter;
+        const bool linear = (filter == ProcTexFilter::Linear ||
+                filter == ProcTexFilter::LinearMipmapNearest ||
+                filter == ProcTexFilter::LinearMipmapLinear);
+
+        for (unsigned i = 0; i < N; i++) {
+            const float index = offset + coord[i] * (width - 1);
+            float color[4];
+            if (linear) {
+                const int index_int = std::clamp(static_cast<int>(index), 0,
+                        static_cast<int>(COLOR_LUT_SIZE) - 1);
+                const float frac = index - index_int;
+                for (unsigned c = 0; c < 4; c++)
+                    color[c] = color_lut[index_int][c] + frac * color_diff_lut[index_int][c];
+            } else {
+                const int index_int = std::clamp(static_cast<int>(std::round(index)), 0,
+                        static_cast<int>(COLOR_LUT_SIZE) - 1);
+                for (unsigned c = 0; c < 4; c++)
+                    color[c] = color_lut[index_int][c];
+            }
+            out.r[i] = static_cast<uint8_t>(std::clamp(color[0], 0.0f, 255.0f));
+            out.g[i] = static_cast<uint8_t>(std::clamp(color[1], 0.0f, 255.0f));
+            out.b[i] = static_cast<uint8_t>(std::clamp(color[2], 0.0f, 255.0f));
+            out.a[i] = static_cast<uint8_t>(std::clamp(color[3], 0.0f, 255.0f));
+        }
+
+        if (config.main.separate_alpha) {
+            CombineAndMap<N>(config.main.alpha_combiner, alpha_map_lut, u, v, coord);
+            for (unsigned i = 0; i < N; i++)
+                out.a[i] = static_cast<uint8_t>(std::clamp(coord[i], 0.0f, 1.0f) * 255);
+        }
+    }
+
+    template void ProcTexUnit::Lookup<4>(const float*, const float*, TexelBatch<4>&) const;
+    template void ProcTexUnit::Lookup<8>(const float*, const float*, TexelBatch<8>&) const;
+    template void ProcTexUnit::Lookup<16>(const float*, const float*, TexelBatch<16>&) const;
+}
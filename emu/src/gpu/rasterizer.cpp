@@ -19,9 +19,9 @@
  */
 #include "rasterizer.h"
 // TODO: remove these.
-#include "frontend.h"
 #include "texturing.h"
-#include "kitten.h"
+#include "texcache.h"
+#include "memory.h"
 
 struct ClippingEdge {
 public:
@@ -53,7 +53,8 @@ private:
     Vec4<float24> bias;
 };
 
-static void InitScreenCoordinates(RasterizerVertex& vtx) {
+static void InitScreenCoordinates(RasterizerVertex& vtx, float24 halfsize_x,
+        float24 halfsize_y) {
     struct {
         float24 halfsize_x;
         float24 offset_x;
@@ -64,20 +65,20 @@ static void InitScreenCoordinates(RasterizerVertex& vtx) {
     } viewport;
 
     // TODO: Read these from register
-    viewport.halfsize_x = float24::FromFloat32(200.0);
-    viewport.halfsize_y = float24::FromFloat32(120.0);
+    viewport.halfsize_x = halfsize_x;
+    viewport.halfsize_y = halfsize_y;
     viewport.offset_x = float24::FromFloat32(0.0f);
     viewport.offset_y = float24::FromFloat32(0.0f);
 
     float24 inv_w = float24::FromFloat32(1.f) / vtx.pos.w;
     vtx.pos.w = inv_w;
     vtx.color *= inv_w;
-    /*vtx.quat *= inv_w;
+    vtx.quat *= inv_w;
     vtx.tc0 *= inv_w;
     vtx.tc1 *= inv_w;
     vtx.tc0_w *= inv_w;
     vtx.view *= inv_w;
-    vtx.tc2 *= inv_w;*/
+    vtx.tc2 *= inv_w;
 
     vtx.screen_position[0] =
         (vtx.pos.x * inv_w + float24::FromFloat32(1.0)) * viewport.halfsize_x + viewport.offset_x;
@@ -155,9 +156,9 @@ void Rasterizer::AddTriangle(
         RasterizerVertex vtx1((*output_list)[i + 1]);
         RasterizerVertex vtx2((*output_list)[i + 2]);
 
-        InitScreenCoordinates(vtx0);
-        InitScreenCoordinates(vtx1);
-        InitScreenCoordinates(vtx2);
+        InitScreenCoordinates(vtx0, viewport_halfsize_x, viewport_halfsize_y);
+        InitScreenCoordinates(vtx1, viewport_halfsize_x, viewport_halfsize_y);
+        InitScreenCoordinates(vtx2, viewport_halfsize_x, viewport_halfsize_y);
 
         /*printf(
                 "Triangle at position (%.3f, %.3f, %.3f, %.3f), "
@@ -170,7 +171,16 @@ void Rasterizer::AddTriangle(
                 vtx1.screen_position.x.ToFloat32(), vtx1.screen_position.y.ToFloat32(), vtx1.screen_position.z.ToFloat32(),
                 vtx2.screen_position.x.ToFloat32(), vtx2.screen_position.y.ToFloat32(), vtx2.screen_position.z.ToFloat32());*/
 
-        Rasterizer::ProcessTriangle(vtx0, vtx1, vtx2);
+        stats.triangles++;
+        if (workers.empty()) {
+            ResizeEarlyDepth();
+            ProcessTriangle(vtx0, vtx1, vtx2, {0, 0, 4096, 4096}, stats.fragments);
+        } else {
+            queue.push_back(vtx0);
+            queue.push_back(vtx1);
+            queue.push_back(vtx2);
+            queue_bounds.push_back(GetBounds(vtx0, vtx1, vtx2));
+        }
     }
 }
 
@@ -218,10 +228,149 @@ static int SignedArea(const Vec2<Fix12P4>& vtx1, const Vec2<Fix12P4>& vtx2,
     return Cross(vec1, vec2).z;
 };
 
+void Rasterizer::SampleTexture(unsigned index, FragmentQuad& quad) const {
+    const Texturing::TextureUnit& unit = texture_units[index];
+    const Texturing::TextureInfo& info = unit.info;
+    ColorQuad& out = quad.texture_color[index];
+    const uint8_t* data = Memory::GetPhysicalPointer(info.physical_address);
+    if (!data) {
+        out = ColorQuad{};
+        return;
+    }
+
+    const float* u = quad.tc_u[unit.coordinates];
+    const float* v = quad.tc_v[unit.coordinates];
+    float projected_u[QUAD_SIZE], projected_v[QUAD_SIZE];
+    switch (unit.type) {
+    case Texturing::TextureCube: {
+        // u, v, w form the direction, every face has the size of the first
+        const uint8_t* faces[6];
+        for (unsigned face = 0; face < 6; face++) {
+            faces[face] = Memory::GetPhysicalPointer(unit.face_address[face]);
+            if (!faces[face]) {
+                out = ColorQuad{};
+                return;
+            }
+        }
+        for (unsigned i = 0; i < QUAD_SIZE; i++) {
+            const Vec4<uint8_t> texel = Texturing::LookupTextureCube(faces,
+                    u[i], v[i], quad.tc0_w[i], info);
+            out.r[i] = texel.r();
+            out.g[i] = texel.g();
+            out.b[i] = texel.b();
+            out.a[i] = texel.a();
+        }
+        return;
+    }
+
+    case Texturing::Shadow2D:
+    case Texturing::ShadowCube: {
+        // Shadow maps are RGBA8 color buffers, w is the depth in light space
+        const uint8_t* faces[6] = {data, data, data, data, data, data};
+        if (unit.type == Texturing::ShadowCube) {
+            for (unsigned face = 0; face < 6; face++) {
+                faces[face] = Memory::GetPhysicalPointer(unit.face_address[face]);
+                if (!faces[face]) {
+                    out = ColorQuad{};
+                    return;
+                }
+            }
+        }
+        Texturing::TextureInfo shadow_info = info;
+        shadow_info.format = Texturing::RGBA8;
+        shadow_info.stride = (info.width / 8) *
+                Texturing::CalculateTileSize(Texturing::RGBA8);
+        const Texturing::TextureFilter filter = unit.params.mag_filter;
+        for (unsigned i = 0; i < QUAD_SIZE; i++) {
+            const float w = quad.tc0_w[i];
+            uint8_t value;
+            if (unit.type == Texturing::Shadow2D) {
+                const bool perspective = !unit.shadow.orthographic;
+                const uint32_t ref = Texturing::CalculateShadowReference(w,
+                        unit.shadow);
+                value = Texturing::LookupShadow(data,
+                        perspective ? u[i] / w : u[i],
+                        perspective ? v[i] / w : v[i], ref, shadow_info, filter);
+            } else {
+                // The distance along the major axis is the depth
+                const float z = std::max({std::fabs(u[i]), std::fabs(v[i]),
+                        std::fabs(w)});
+                const uint32_t ref = Texturing::CalculateShadowReference(z,
+                        unit.shadow);
+                value = Texturing::LookupShadowCube(faces, u[i], v[i], w, ref,
+                        shadow_info, filter);
+            }
+            out.r[i] = out.g[i] = out.b[i] = out.a[i] = value;
+        }
+        return;
+    }
+
+    case Texturing::Projection2D:
+        for (unsigned i = 0; i < QUAD_SIZE; i++) {
+            projected_u[i] = u[i] / quad.tc0_w[i];
+            projected_v[i] = v[i] / quad.tc0_w[i];
+        }
+        u = projected_u;
+        v = projected_v;
+        break;
+
+    default:
+        break;
+    }
+
+    const Texturing::WrapMode wrap_s = unit.params.wrap_s;
+    const Texturing::WrapMode wrap_t = unit.params.wrap_t;
+    const int width = info.width;
+    const int height = info.height;
+
+    uint16_t x[QUAD_SIZE], y[QUAD_SIZE];
+    unsigned border = 0;
+    for (unsigned i = 0; i < QUAD_SIZE; i++) {
+        const int s = static_cast<int>(u[i] * width);
+        const int t = static_cast<int>(v[i] * height);
+        if (Texturing::IsBorderTexCoord(wrap_s, s, width) ||
+                Texturing::IsBorderTexCoord(wrap_t, t, height))
+            border |= 1 << i;
+        // Border lanes still need an address inside the texture
+        x[i] = std::clamp(Texturing::GetWrappedTexCoord(wrap_s, s, width),
+                0, width - 1);
+        // Row 0 is the bottom of the texture
+        y[i] = height - 1 - std::clamp(Texturing::GetWrappedTexCoord(wrap_t,
+                t, height), 0, height - 1);
+    }
+
+    Texturing::LookupTextureBatch(data, x, y, info, out);
+
+    for (unsigned i = 0; border; i++, border >>= 1) {
+        if (border & 1) {
+            out.r[i] = unit.border_color.r();
+            out.g[i] = unit.border_color.g();
+            out.b[i] = unit.border_color.b();
+            out.a[i] = unit.border_color.a();
+        }
+    }
+}
+
+Rasterizer::Area Rasterizer::GetBounds(const RasterizerVertex& v0,
+        const RasterizerVertex& v1, const RasterizerVertex& v2) const {
+    const Vec3<Fix12P4> vtxpos[3]{
+            ScreenToRasterizerCoordinates(v0.screen_position),
+            ScreenToRasterizerCoordinates(v1.screen_position),
+            ScreenToRasterizerCoordinates(v2.screen_position)};
+    // Same rounding as ProcessTriangle()
+    const unsigned min_x = std::min({vtxpos[0].x, vtxpos[1].x, vtxpos[2].x});
+    const unsigned min_y = std::min({vtxpos[0].y, vtxpos[1].y, vtxpos[2].y});
+    const unsigned max_x = std::max({vtxpos[0].x, vtxpos[1].x, vtxpos[2].x});
+    const unsigned max_y = std::max({vtxpos[0].y, vtxpos[1].y, vtxpos[2].y});
+    return {min_x >> 4, min_y >> 4, (max_x + 15) >> 4, (max_y + 15) >> 4};
+}
+
 void Rasterizer::ProcessTriangle(
             const RasterizerVertex& v0,
             const RasterizerVertex& v1,
-            const RasterizerVertex& v2) {
+            const RasterizerVertex& v2,
+            const Area& area,
+            uint64_t& fragments) {
 
     Vec3<Fix12P4> vtxpos[3]{
             ScreenToRasterizerCoordinates(v0.screen_position),
@@ -260,6 +409,12 @@ void Rasterizer::ProcessTriangle(
     max_x = ((max_x + Fix12P4::FracMask()) & Fix12P4::IntMask()); // Round up
     max_y = ((max_y + Fix12P4::FracMask()) & Fix12P4::IntMask());
 
+    // Only the pixels of the given area, a bin of the screen
+    min_x = std::max<unsigned>(min_x, area.x0 << 4);
+    min_y = std::max<unsigned>(min_y, area.y0 << 4);
+    max_x = std::min<unsigned>(max_x, area.x1 << 4);
+    max_y = std::min<unsigned>(max_y, area.y1 << 4);
+
     int bias0 =
         IsRightSideOrFlatBottomEdge(vtxpos[0].xy(), vtxpos[1].xy(), vtxpos[2].xy()) ? -1 : 0;
     int bias1 =
@@ -274,6 +429,106 @@ void Rasterizer::ProcessTriangle(
     printf("(%d, %d) \n", vtxpos[2].x, vtxpos[2].y);
     printf("Min X %d, Min Y %d, Max X %d, Max Y %d\n", min_x, min_y, max_x, max_y);*/
 
+    // Nothing to render into
+    if (!output_merger)
+        return;
+
+    // Covered fragments are shaded in groups of four, so the texture unit
+    // can resolve all addresses of a quad at once.
+    FragmentQuad quad{};
+    bool use_lighting = lighting && lighting->IsEnabled();
+    // Resolved once per triangle, disabled fog costs nothing per quad
+    bool use_fog = fog && texenv && texenv->GetConfig().update_buffer.fog_mode !=
+            TexEnv::FogMode::None;
+    // Units read by the combiner or by bump mapping, and the coordinate
+    // sets they sample with
+    bool use_texture[3];
+    unsigned texcoord_mask = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        const auto source = static_cast<TexEnv::Source>(
+                static_cast<uint32_t>(TexEnv::Source::Texture0) + i);
+        use_texture[i] = texture_units[i].enabled && texenv &&
+                (texenv->UsesSource(source) || use_lighting);
+        if (use_texture[i])
+            texcoord_mask |= 1 << texture_units[i].coordinates;
+    }
+    bool use_proctex = proctex && proctex_enabled && texenv &&
+            texenv->UsesSource(TexEnv::Source::Texture3);
+    if (use_proctex)
+        texcoord_mask |= 1 << proctex_coordinates;
+    // Sized to the render target by DrawTriangles() and AddTriangle()
+    bool use_early_depth = early_depth && early_depth->IsEnabled();
+
+    auto FlushQuad = [&]() {
+        if (quad.count == 0)
+            return;
+
+        // Unused lanes repeat the first fragment, their results are dropped
+        for (unsigned i = quad.count; i < QUAD_SIZE; i++) {
+            quad.x[i] = quad.x[0];
+            quad.y[i] = quad.y[0];
+            for (unsigned c = 0; c < 3; c++) {
+                quad.tc_u[c][i] = quad.tc_u[c][0];
+                quad.tc_v[c][i] = quad.tc_v[c][0];
+            }
+            quad.tc0_w[i] = quad.tc0_w[0];
+            quad.depth[i] = quad.depth[0];
+            quad.primary_color.r[i] = quad.primary_color.r[0];
+            quad.primary_color.g[i] = quad.primary_color.g[0];
+            quad.primary_color.b[i] = quad.primary_color.b[0];
+            quad.primary_color.a[i] = quad.primary_color.a[0];
+            for (unsigned c = 0; c < 4; c++)
+                quad.quat[c][i] = quad.quat[c][0];
+            for (unsigned c = 0; c < 3; c++)
+                quad.view[c][i] = quad.view[c][0];
+        }
+
+        for (unsigned i = 0; i < 3; i++) {
+            if (use_texture[i])
+                SampleTexture(i, quad);
+        }
+        if (use_proctex)
+            proctex->Lookup<QUAD_SIZE>(quad.tc_u[proctex_coordinates],
+                    quad.tc_v[proctex_coordinates], quad.texture_color[3]);
+
+        if (use_lighting)
+            lighting->Compute(quad.quat, quad.view, quad.texture_color,
+                    quad.primary_fragment_color, quad.secondary_fragment_color);
+
+        ColorQuad combiner_output;
+        if (texenv) {
+            TexEnv::Inputs inputs;
+            inputs.primary_color = &quad.primary_color;
+            inputs.primary_fragment_color = &quad.primary_fragment_color;
+            inputs.secondary_fragment_color = &quad.secondary_fragment_color;
+            for (unsigned t = 0; t < 4; t++)
+                inputs.texture[t] = &quad.texture_color[t];
+            texenv->Run(inputs, combiner_output);
+        }
+        else {
+            combiner_output = quad.primary_color;
+        }
+
+        fragments += quad.count;
+        unsigned mask = output_merger->AlphaTest(combiner_output,
+                (1u << quad.count) - 1);
+        quad.count = 0;
+        if (!mask)
+            return;
+
+        if (use_fog)
+            fog->Apply(texenv->GetConfig().update_buffer, quad.depth,
+                    combiner_output);
+        unsigned written = output_merger->Merge(quad.x, quad.y, quad.depth,
+                combiner_output, mask);
+        if (use_early_depth) {
+            for (unsigned i = 0; i < QUAD_SIZE; i++) {
+                if (written & (1u << i))
+                    early_depth->Update(quad.x[i], quad.y[i], quad.depth[i]);
+            }
+        }
+    };
+
     // Enter rasterization loop, starting at the center of the topleft bounding box corner.
     // TODO: Not sure if looping through x first might be faster
     for (uint16_t y = min_y + 8; y < max_y; y += 0x10) {
@@ -314,11 +569,6 @@ void Rasterizer::ProcessTriangle(
 
             // Not fully accurate. About 3 bits in precision are missing.
             // Z-Buffer (z / w * scale + offset)
-            /*float depth_scale = float24::FromRaw(regs.rasterizer.viewport_depth_range).ToFloat32();
-            float depth_offset =
-                float24::FromRaw(regs.rasterizer.viewport_depth_near_plane).ToFloat32();*/
-            float depth_scale = 1.0;
-            float depth_offset = 0.1;
             float depth = interpolated_z_over_w * depth_scale + depth_offset;
 
             // Potentially switch to W-Buffer
@@ -331,8 +581,9 @@ void Rasterizer::ProcessTriangle(
             // Clamp the result
             depth = std::clamp(depth, 0.0f, 1.0f);
 
-            frontend.DrawPixel((x >> 4) + VIDEO_WIDTH / 2, y >> 4, 
-                depth * 255.0, depth * 255.0, depth * 255.0);
+            // Occluded fragments are dropped before interpolation and shading
+            if (use_early_depth && !early_depth->Test(x >> 4, y >> 4, depth))
+                continue;
 
             // Perspective correct attribute interpolation:
             // Attribute values cannot be calculated by simple linear interpolation since
@@ -357,31 +608,184 @@ void Rasterizer::ProcessTriangle(
                 return interpolated_attr_over_w * interpolated_w_inverse;
             };
 
-            Vec4<uint8_t> primary_color{
-                static_cast<uint8_t>(round(
-                    GetInterpolatedAttribute(v0.color.r(), v1.color.r(), v2.color.r()).ToFloat32() *
-                    64)),
-                static_cast<uint8_t>(round(
-                    GetInterpolatedAttribute(v0.color.g(), v1.color.g(), v2.color.g()).ToFloat32() *
-                    64)),
-                static_cast<uint8_t>(round(
-                    GetInterpolatedAttribute(v0.color.b(), v1.color.b(), v2.color.b()).ToFloat32() *
-                    64)),
-                static_cast<uint8_t>(round(
-                    GetInterpolatedAttribute(v0.color.a(), v1.color.a(), v2.color.a()).ToFloat32() *
-                    64)),
+            auto InterpolateColor = [&](float24 c0, float24 c1, float24 c2) {
+                float c = GetInterpolatedAttribute(c0, c1, c2).ToFloat32();
+                return static_cast<uint8_t>(round(std::clamp(c, 0.0f, 1.0f) * 255));
             };
 
-            // These need eventually be moved into Fragment Shader
-            Texturing::TextureInfo textureInfo;
-	        textureInfo.width = 64;
-	        textureInfo.height = 64;
-	        textureInfo.stride = 8 * 8 * 4 * 8;
-	        textureInfo.format = Texturing::RGBA8;
-            Vec4<uint8_t> color = Texturing::LookupTexture(kitten_raw + 4,
-					primary_color.x, primary_color.y, textureInfo);
+            unsigned lane = quad.count;
+            quad.x[lane] = x >> 4;
+            quad.y[lane] = y >> 4;
+            quad.depth[lane] = depth;
+            quad.primary_color.r[lane] = InterpolateColor(
+                    v0.color.r(), v1.color.r(), v2.color.r());
+            quad.primary_color.g[lane] = InterpolateColor(
+                    v0.color.g(), v1.color.g(), v2.color.g());
+            quad.primary_color.b[lane] = InterpolateColor(
+                    v0.color.b(), v1.color.b(), v2.color.b());
+            quad.primary_color.a[lane] = InterpolateColor(
+                    v0.color.a(), v1.color.a(), v2.color.a());
+
+            auto TexCoord = [](const RasterizerVertex& vtx, unsigned c)
+                    -> const Vec2<float24>& {
+                return (c == 0) ? vtx.tc0 : (c == 1) ? vtx.tc1 : vtx.tc2;
+            };
+            for (unsigned c = 0; c < 3; c++) {
+                if (!(texcoord_mask & (1 << c)))
+                    continue;
+                quad.tc_u[c][lane] = GetInterpolatedAttribute(TexCoord(v0, c).u(),
+                        TexCoord(v1, c).u(), TexCoord(v2, c).u()).ToFloat32();
+                quad.tc_v[c][lane] = GetInterpolatedAttribute(TexCoord(v0, c).v(),
+                        TexCoord(v1, c).v(), TexCoord(v2, c).v()).ToFloat32();
+            }
+            if (use_texture[0] && texture_units[0].type != Texturing::Texture2D)
+                quad.tc0_w[lane] = GetInterpolatedAttribute(
+                        v0.tc0_w, v1.tc0_w, v2.tc0_w).ToFloat32();
+            if (use_lighting) {
+                for (unsigned c = 0; c < 4; c++)
+                    quad.quat[c][lane] = GetInterpolatedAttribute(
+                            v0.quat[c], v1.quat[c], v2.quat[c]).ToFloat32();
+                for (unsigned c = 0; c < 3; c++)
+                    quad.view[c][lane] = GetInterpolatedAttribute(
+                            v0.view[c], v1.view[c], v2.view[c]).ToFloat32();
+            }
+            if (++quad.count == QUAD_SIZE)
+                FlushQuad();
+        }
+    }
+
+    FlushQuad();
+}
+
+Rasterizer::Rasterizer() {
+    SetThreads(std::min(4u, std::thread::hardware_concurrency()));
+}
 
-            frontend.DrawPixel(x >> 4, y >> 4, color.r(), color.g(), color.b());
+Rasterizer::~Rasterizer() {
+    StopWorkers();
+}
+
+void Rasterizer::SetThreads(unsigned threads) {
+    DrawTriangles();
+    StopWorkers();
+    // New workers wait for the next draw, not the last one
+    std::lock_guard<std::mutex> lock(worker_mutex);
+    for (unsigned i = 1; i < threads; i++)
+        workers.emplace_back(&Rasterizer::WorkerLoop, this, work_generation);
+}
+
+void Rasterizer::StopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        workers_exit = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& worker : workers)
+        worker.join();
+    workers.clear();
+    workers_exit = false;
+}
+
+void Rasterizer::WorkerLoop(uint64_t generation) {
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(worker_mutex);
+            work_ready.wait(lock, [&] {
+                return workers_exit || (work_generation != generation);
+            });
+            if (workers_exit)
+                return;
+            generation = work_generation;
         }
+
+        RasterizeBins();
+
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        if (--workers_busy == 0)
+            work_done.notify_one();
+    }
+}
+
+void Rasterizer::ResizeEarlyDepth() {
+    if (early_depth && output_merger && early_depth->IsEnabled()) {
+        const auto& regs = output_merger->GetRegisters();
+        early_depth->SetDimensions(regs.GetWidth(), regs.GetHeight(),
+                Framebuffer::DepthBitsPerPixel(regs.depth_format.depth_format));
     }
-}
\ No newline at end of file
+}
+
+void Rasterizer::RasterizeBins() {
+    uint64_t fragments = 0;
+    for (unsigned bin = next_bin++; bin < bins.size(); bin = next_bin++) {
+        const unsigned x0 = (bin % bins_per_row) * BIN_SIZE;
+        const unsigned y0 = (bin / bins_per_row) * BIN_SIZE;
+        const Area area{x0, y0, x0 + BIN_SIZE, y0 + BIN_SIZE};
+        for (uint32_t i : bins[bin])
+            ProcessTriangle(queue[i * 3], queue[i * 3 + 1], queue[i * 3 + 2],
+                    area, fragments);
+    }
+    bin_fragments += fragments;
+}
+
+void Rasterizer::DrawTriangles() {
+    if (queue_bounds.empty())
+        return;
+    ResizeEarlyDepth();
+
+    // Covering the bounding boxes rather than the render target keeps the
+    // fragment count of the single threaded path
+    unsigned width = 0, height = 0;
+    uint64_t area = 0;
+    for (const Area& bounds : queue_bounds) {
+        width = std::max(width, bounds.x1);
+        height = std::max(height, bounds.y1);
+        area += (bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0);
+    }
+
+    // The bins only line up with the framebuffer tiles, which are counted
+    // from the bottom, if the height is a multiple of 8. The texture cache
+    // model is not thread safe.
+    const bool parallel = output_merger && (area >= MIN_PARALLEL_AREA) &&
+            (output_merger->GetRegisters().GetHeight() % 8 == 0) &&
+            !Texturing::GetCacheModel();
+    if (!parallel) {
+        for (size_t i = 0; i < queue_bounds.size(); i++)
+            ProcessTriangle(queue[i * 3], queue[i * 3 + 1], queue[i * 3 + 2],
+                    {0, 0, 4096, 4096}, stats.fragments);
+        queue.clear();
+        queue_bounds.clear();
+        return;
+    }
+
+    bins_per_row = (width + BIN_SIZE - 1) / BIN_SIZE;
+    const unsigned bin_rows = (height + BIN_SIZE - 1) / BIN_SIZE;
+    bins.resize(bins_per_row * bin_rows);
+    for (auto& bin : bins)
+        bin.clear();
+    for (uint32_t i = 0; i < queue_bounds.size(); i++) {
+        const Area& bounds = queue_bounds[i];
+        if ((bounds.x0 >= bounds.x1) || (bounds.y0 >= bounds.y1))
+            continue;
+        for (unsigned y = bounds.y0 / BIN_SIZE; y <= (bounds.y1 - 1) / BIN_SIZE; y++)
+            for (unsigned x = bounds.x0 / BIN_SIZE; x <= (bounds.x1 - 1) / BIN_SIZE; x++)
+                bins[y * bins_per_row + x].push_back(i);
+    }
+
+    next_bin = 0;
+    bin_fragments = 0;
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        work_generation++;
+        workers_busy = workers.size();
+    }
+    work_ready.notify_all();
+    RasterizeBins();
+    {
+        std::unique_lock<std::mutex> lock(worker_mutex);
+        work_done.wait(lock, [&] { return workers_busy == 0; });
+    }
+
+    stats.fragments += bin_fragments;
+    queue.clear();
+    queue_bounds.clear();
+}
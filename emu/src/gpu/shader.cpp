@@ -17,6 +17,7 @@
  *  with this program; if not, write to the Free Software Foundation, Inc.,
  *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
+#include <algorithm>
 #include "shader.h"
 
 using isa::Instruction;
@@ -36,6 +37,54 @@ namespace Shader {
         uint32_t loop_address;   // The address where we'll return to after each loop iteration
     };
 
+    uint64_t Setup::Hash() const {
+        // FNV-1a over the code and swizzle data, the entry point is not
+        // part of the program
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (uint32_t word : program_code) {
+            hash ^= word;
+            hash *= 0x100000001b3ull;
+        }
+        for (uint32_t word : swizzle_data) {
+            hash ^= word;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    uint16_t Setup::GetInputMask() const {
+        uint16_t mask = 0;
+        // Relative addressing may reach any register from the base upwards
+        auto AddSource = [&](const SourceRegister& reg, bool relative) {
+            if (reg.GetRegisterType() != RegisterType::Input)
+                return;
+            mask |= relative ? (0xffff << reg.GetIndex()) : (1 << reg.GetIndex());
+        };
+
+        for (uint32_t word : program_code) {
+            const Instruction instr = {word};
+            const auto& info = instr.opcode.Value().GetInfo();
+            if (info.type == OpCode::Type::Arithmetic) {
+                const bool is_inverted = info.subtype & OpCode::Info::SrcInversed;
+                const bool relative = instr.common.address_register_index != 0;
+                if (info.subtype & OpCode::Info::Src1)
+                    AddSource(instr.common.GetSrc1(is_inverted),
+                            relative && !is_inverted);
+                if (info.subtype & OpCode::Info::Src2)
+                    AddSource(instr.common.GetSrc2(is_inverted),
+                            relative && is_inverted);
+            } else if (info.type == OpCode::Type::MultiplyAdd) {
+                const bool is_inverted =
+                        instr.opcode.Value().EffectiveOpCode() == OpCode::Id::MADI;
+                const bool relative = instr.mad.address_register_index != 0;
+                AddSource(instr.mad.GetSrc1(is_inverted), false);
+                AddSource(instr.mad.GetSrc2(is_inverted), relative && !is_inverted);
+                AddSource(instr.mad.GetSrc3(is_inverted), relative && is_inverted);
+            }
+        }
+        return mask;
+    }
+
     void ShaderEngine::LoadInput(const AttributeBuffer& input) {
         // TODO: mapping should be modifiable from register settings
         for (unsigned attr = 0; attr < 16; ++attr) {
@@ -50,6 +99,34 @@ namespace Shader {
         }
     }
 
+    OutputVertex OutputVertex::FromAttributeBuffer(const OutputMap& map,
+            const AttributeBuffer& output) {
+        OutputVertex ret{};
+        float24* vertex_slots = reinterpret_cast<float24*>(&ret);
+        constexpr unsigned NUM_SLOTS = sizeof(OutputVertex) / sizeof(float24);
+
+        unsigned total = std::min(map.total, 7u);
+        for (unsigned i = 0; i < total; i++) {
+            const auto& attributes = map.attributes[i];
+            const OutputSemantic semantics[4] = {attributes.map_x,
+                    attributes.map_y, attributes.map_z, attributes.map_w};
+            for (unsigned comp = 0; comp < 4; comp++) {
+                unsigned slot = static_cast<unsigned>(semantics[comp]);
+                if (slot < NUM_SLOTS)
+                    vertex_slots[slot] = output.attr[i][comp];
+            }
+        }
+
+        // The hardware takes the absolute and saturates vertex colors like
+        // this, *before* doing interpolation
+        for (unsigned i = 0; i < 4; i++) {
+            ret.color[i] = float24::FromFloat32(
+                    std::fmin(std::fabs(ret.color[i].ToFloat32()), 1.0f));
+        }
+
+        return ret;
+    }
+
     void ShaderEngine::SetupBatch(unsigned int entry_point) {
         setup.entry_point = entry_point;
     }
@@ -0,0 +1,409 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "shbin.h"
+#include "command.h"
+#include "regs.h"
+
+namespace Shader {
+
+    constexpr uint32_t DVLB_MAGIC = 0x424c5644;
+    constexpr uint32_t DVLP_MAGIC = 0x504c5644;
+    constexpr uint32_t DVLE_MAGIC = 0x454c5644;
+
+    constexpr unsigned CONSTANT_ENTRY_SIZE = 20;
+    constexpr unsigned OUTPUT_ENTRY_SIZE = 8;
+    constexpr unsigned UNIFORM_ENTRY_SIZE = 8;
+    constexpr unsigned OPDESC_ENTRY_SIZE = 8;
+
+    enum ConstantType {
+        ConstantBool = 0,
+        ConstantInt,
+        ConstantFloat24
+    };
+
+    // Output map of each output type, x in the low byte
+    static const uint32_t output_semantics[] = {
+        0x03020100, // Position
+        0x07060504, // Quaternion
+        0x0b0a0908, // Color
+        0x1f1f0d0c, // Texture coordinate 0
+        0x10101010, // Texture coordinate 0 w
+        0x1f1f0f0e, // Texture coordinate 1
+        0x1f1f1716, // Texture coordinate 2
+        0x1f1f1f1f,
+        0x1f141312, // View vector
+    };
+
+    // Bounds checked little endian reads, files need not be aligned
+    class Reader {
+    public:
+        Reader(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+        bool Has(size_t offset, size_t length) const {
+            return offset <= size && length <= size - offset;
+        }
+
+        uint32_t Read32(size_t offset) const {
+            uint32_t value;
+            std::memcpy(&value, data + offset, sizeof(value));
+            return value;
+        }
+
+        uint16_t Read16(size_t offset) const {
+            uint16_t value;
+            std::memcpy(&value, data + offset, sizeof(value));
+            return value;
+        }
+
+        const uint8_t* data;
+        size_t size;
+    };
+
+    // FNV-1a over the binary, eight bytes at a time
+    static uint64_t HashBinary(const uint8_t* data, size_t size,
+            unsigned index) {
+        uint64_t hash = 0xcbf29ce484222325ull ^ index;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash ^= word;
+            hash *= 0x100000001b3ull;
+        }
+        for (; i < size; i++) {
+            hash ^= data[i];
+            hash *= 0x100000001b3ull;
+        }
+        hash ^= size;
+        hash *= 0x100000001b3ull;
+        return hash;
+    }
+
+    int Program::GetUniformLocation(const char* name) const {
+        for (const Uniform& uniform : uniforms) {
+            if (uniform.name != name)
+                continue;
+            if (uniform.first >= 0x78)
+                return uniform.first - 0x78;
+            if (uniform.first >= 0x70)
+                return uniform.first - 0x70;
+            return uniform.first - 0x10;
+        }
+        return -1;
+    }
+
+    static bool ParseProgram(const Reader& file, size_t dvlp, Program& program) {
+        if (!file.Has(dvlp, 0x1c) || file.Read32(dvlp) != DVLP_MAGIC) {
+            fprintf(stderr, "Shader: Missing DVLP\n");
+            return false;
+        }
+
+        const size_t code = dvlp + file.Read32(dvlp + 0x08);
+        const unsigned code_length = file.Read32(dvlp + 0x0c);
+        const size_t opdescs = dvlp + file.Read32(dvlp + 0x10);
+        const unsigned opdesc_count = file.Read32(dvlp + 0x14);
+
+        if (code_length > MAX_PROGRAM_CODE_LENGTH ||
+                opdesc_count > MAX_SWIZZLE_DATA_LENGTH) {
+            fprintf(stderr, "Shader: %u words of code and %u operand "
+                    "descriptors do not fit\n", code_length, opdesc_count);
+            return false;
+        }
+        if (!file.Has(code, code_length * 4) ||
+                !file.Has(opdescs, opdesc_count * OPDESC_ENTRY_SIZE)) {
+            fprintf(stderr, "Shader: Program is truncated\n");
+            return false;
+        }
+
+        program.setup.program_code.fill(0);
+        program.setup.swizzle_data.fill(0);
+        std::memcpy(program.setup.program_code.data(), file.data + code,
+                code_length * 4);
+        // Each descriptor is followed by an unused word
+        for (unsigned i = 0; i < opdesc_count; i++)
+            program.setup.swizzle_data[i] = file.Read32(
+                    opdescs + i * OPDESC_ENTRY_SIZE);
+        program.code_length = code_length;
+        program.swizzle_length = opdesc_count;
+        return true;
+    }
+
+    static bool ParseConstants(const Reader& file, size_t table,
+            unsigned count, Program& program) {
+        if (!file.Has(table, static_cast<size_t>(count) * CONSTANT_ENTRY_SIZE)) {
+            fprintf(stderr, "Shader: Constant table is truncated\n");
+            return false;
+        }
+
+        for (unsigned i = 0; i < count; i++) {
+            const size_t entry = table + i * CONSTANT_ENTRY_SIZE;
+            const unsigned type = file.Read16(entry);
+            const unsigned id = file.Read16(entry + 2);
+            uint32_t data[4];
+            for (unsigned j = 0; j < 4; j++)
+                data[j] = file.Read32(entry + 4 + j * 4);
+
+            if (type == ConstantBool && id < 16) {
+                program.bool_constant_mask |= 1 << id;
+                if (data[0] & 1)
+                    program.bool_constants |= 1 << id;
+            } else if (type == ConstantInt && id < 4) {
+                program.int_constant_mask |= 1 << id;
+                program.int_constants[id] = data[0];
+            } else if (type == ConstantFloat24 && id < 96) {
+                // Raw float24 x, y, z, w, packed w first
+                FloatConstant constant;
+                constant.index = id;
+                constant.words[0] = (data[3] << 8) | ((data[2] >> 16) & 0xff);
+                constant.words[1] = (data[2] << 16) | ((data[1] >> 8) & 0xffff);
+                constant.words[2] = (data[1] << 24) | (data[0] & 0xffffff);
+                program.float_constants.push_back(constant);
+            } else {
+                fprintf(stderr, "Shader: Invalid constant type %u, id %u\n",
+                        type, id);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool ParseOutputs(const Reader& file, size_t table, unsigned count,
+            Program& program) {
+        if (!file.Has(table, static_cast<size_t>(count) * OUTPUT_ENTRY_SIZE)) {
+            fprintf(stderr, "Shader: Output table is truncated\n");
+            return false;
+        }
+
+        program.output_map.total = 0;
+        for (auto& attributes : program.output_map.attributes)
+            attributes.hex = 0x1f1f1f1f;
+
+        for (unsigned i = 0; i < count; i++) {
+            const size_t entry = table + i * OUTPUT_ENTRY_SIZE;
+            const unsigned type = file.Read16(entry);
+            const unsigned reg = file.Read16(entry + 2);
+            const unsigned components = file.Read32(entry + 4) & 0xf;
+
+            if (reg >= 7 || type >= sizeof(output_semantics) / sizeof(uint32_t)) {
+                fprintf(stderr, "Shader: Invalid output type %u, o%u\n",
+                        type, reg);
+                return false;
+            }
+
+            // Components the entry writes, a byte each
+            uint32_t mask = 0;
+            for (unsigned comp = 0; comp < 4; comp++) {
+                if (components & (1 << comp))
+                    mask |= 0xff << (comp * 8);
+            }
+            uint32_t& map = program.output_map.attributes[reg].hex;
+            map = (map & ~mask) | (output_semantics[type] & mask);
+            program.output_mask |= 1 << reg;
+            program.output_map.total = std::max(program.output_map.total,
+                    reg + 1);
+        }
+        return true;
+    }
+
+    static bool ParseUniforms(const Reader& file, size_t table, unsigned count,
+            size_t symbols, size_t symbols_size, Program& program) {
+        if (!file.Has(table, static_cast<size_t>(count) * UNIFORM_ENTRY_SIZE) ||
+                !file.Has(symbols, symbols_size)) {
+            fprintf(stderr, "Shader: Uniform table is truncated\n");
+            return false;
+        }
+
+        for (unsigned i = 0; i < count; i++) {
+            const size_t entry = table + i * UNIFORM_ENTRY_SIZE;
+            const size_t symbol = file.Read32(entry);
+            if (symbol >= symbols_size) {
+                fprintf(stderr, "Shader: Invalid uniform symbol\n");
+                return false;
+            }
+            const char* name = reinterpret_cast<const char*>(
+                    file.data + symbols + symbol);
+            Uniform uniform;
+            uniform.name.assign(name, strnlen(name, symbols_size - symbol));
+            uniform.first = file.Read16(entry + 4);
+            uniform.last = file.Read16(entry + 6);
+            program.uniforms.push_back(std::move(uniform));
+        }
+        return true;
+    }
+
+    bool ParseShaderBinary(const uint8_t* data, size_t size, unsigned index,
+            Program& program) {
+        const Reader file(data, size);
+        if (!file.Has(0, 8) || file.Read32(0) != DVLB_MAGIC) {
+            fprintf(stderr, "Shader: Not a DVLB file\n");
+            return false;
+        }
+        const unsigned num_dvle = file.Read32(4);
+        if (!file.Has(8, static_cast<size_t>(num_dvle) * 4)) {
+            fprintf(stderr, "Shader: DVLB header is truncated\n");
+            return false;
+        }
+        if (index >= num_dvle) {
+            fprintf(stderr, "Shader: No shader %u, the file has %u\n",
+                    index, num_dvle);
+            return false;
+        }
+
+        program = Program{};
+        if (!ParseProgram(file, 8 + num_dvle * 4, program))
+            return false;
+
+        const size_t dvle = file.Read32(8 + index * 4);
+        if (!file.Has(dvle, 0x40) || file.Read32(dvle) != DVLE_MAGIC) {
+            fprintf(stderr, "Shader: Missing DVLE %u\n", index);
+            return false;
+        }
+        if (file.data[dvle + 6] != 0) {
+            fprintf(stderr, "Shader: DVLE %u is not a vertex shader\n", index);
+            return false;
+        }
+
+        const unsigned entry_point = file.Read32(dvle + 0x08);
+        if (entry_point >= program.code_length) {
+            fprintf(stderr, "Shader: Entry point %u is out of the code\n",
+                    entry_point);
+            return false;
+        }
+        program.setup.entry_point = entry_point;
+
+        if (!ParseConstants(file, dvle + file.Read32(dvle + 0x18),
+                file.Read32(dvle + 0x1c), program))
+            return false;
+        if (!ParseOutputs(file, dvle + file.Read32(dvle + 0x28),
+                file.Read32(dvle + 0x2c), program))
+            return false;
+        if (!ParseUniforms(file, dvle + file.Read32(dvle + 0x30),
+                file.Read32(dvle + 0x34), dvle + file.Read32(dvle + 0x38),
+                file.Read32(dvle + 0x3c), program))
+            return false;
+
+        program.hash = program.setup.Hash();
+        return true;
+    }
+
+    void AddProgramWrites(Command::CommandList& list, const Program& program) {
+        list.AddWrite(GPUREG_VSH_CODETRANSFER_INDEX, 0);
+        list.AddWrites(GPUREG_VSH_CODETRANSFER_DATA0,
+                program.setup.program_code.data(), program.code_length);
+        list.AddWrite(GPUREG_VSH_CODETRANSFER_END, 1);
+        list.AddWrite(GPUREG_VSH_OPDESCS_INDEX, 0);
+        list.AddWrites(GPUREG_VSH_OPDESCS_DATA0,
+                program.setup.swizzle_data.data(), program.swizzle_length);
+        list.AddWrite(GPUREG_VSH_ENTRYPOINT,
+                0x7fff0000 | program.setup.entry_point);
+
+        if (program.bool_constant_mask)
+            list.AddWrite(GPUREG_VSH_BOOLUNIFORM,
+                    0x7fff0000 | program.bool_constants);
+        for (unsigned i = 0; i < 4; i++) {
+            if (program.int_constant_mask & (1 << i))
+                list.AddWrite(GPUREG_VSH_INTUNIFORM_I0 + i,
+                        program.int_constants[i]);
+        }
+        for (const FloatConstant& constant : program.float_constants) {
+            list.AddWrite(GPUREG_VSH_FLOATUNIFORM_INDEX, constant.index);
+            list.AddWrites(GPUREG_VSH_FLOATUNIFORM_DATA0, constant.words, 3);
+        }
+
+        list.AddWrite(GPUREG_VSH_OUTMAP_MASK, program.output_mask);
+        list.AddWrite(GPUREG_SH_OUTMAP_TOTAL, program.output_map.total);
+        for (unsigned i = 0; i < 7; i++)
+            list.AddWrite(GPUREG_SH_OUTMAP_O0 + i,
+                    program.output_map.attributes[i].hex);
+    }
+
+    const Program* ProgramCache::Load(const uint8_t* data, size_t size,
+            unsigned index) {
+        auto& bucket = programs[HashBinary(data, size, index)];
+        for (const Entry& entry : bucket)
+            if ((entry.index == index) && (entry.binary.size() == size) &&
+                    (std::memcmp(entry.binary.data(), data, size) == 0))
+                return entry.program.get();
+
+        std::unique_ptr<Program> program(new Program);
+        if (!ParseShaderBinary(data, size, index, *program))
+            return nullptr;
+        bucket.push_back({std::vector<uint8_t>(data, data + size), index,
+                std::move(program)});
+        count++;
+        return bucket.back().program.get();
+    }
+
+    const Program* ProgramCache::Load(const char* path, unsigned index) {
+#ifndef _WIN32
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Shader: Unable to open %s\n", path);
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            fprintf(stderr, "Shader: Unable to stat %s\n", path);
+            close(fd);
+            return nullptr;
+        }
+        const size_t size = st.st_size;
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Shader: Unable to map %s\n", path);
+            return nullptr;
+        }
+        const uint8_t* data = static_cast<const uint8_t*>(mapping);
+#else
+        FILE* fp = fopen(path, "rb");
+        if (!fp) {
+            fprintf(stderr, "Shader: Unable to open %s\n", path);
+            return nullptr;
+        }
+        std::vector<uint8_t> buffer;
+        uint8_t chunk[4096];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+            buffer.insert(buffer.end(), chunk, chunk + read);
+        fclose(fp);
+        const size_t size = buffer.size();
+        const uint8_t* data = buffer.data();
+#endif
+
+        const Program* program = Load(data, size, index);
+        if (!program)
+            fprintf(stderr, "Shader: Unable to load %s\n", path);
+
+#ifndef _WIN32
+        munmap(const_cast<uint8_t*>(data), size);
+#endif
+        return program;
+    }
+}
@@ -0,0 +1,152 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <cstdio>
+#include <cstring>
+#include "texcache.h"
+
+namespace Texturing {
+
+    static bool IsPowerOfTwo(uint32_t val) {
+        return val && !(val & (val - 1));
+    }
+
+    bool CacheConfig::Parse(const char* str) {
+        char mode[16] = "tiled";
+        unsigned s, a, l;
+        int fields = sscanf(str, "%u,%u,%u,%15s", &s, &a, &l, mode);
+        if (fields < 3)
+            return false;
+
+        if (strcmp(mode, "tiled") == 0)
+            tagging = CacheTagging::Tiled;
+        else if (strcmp(mode, "linear") == 0)
+            tagging = CacheTagging::Linear;
+        else
+            return false;
+
+        if (!IsPowerOfTwo(l) || !a || s < a * l || (s % (a * l)) != 0 ||
+                !IsPowerOfTwo(s / (a * l)))
+            return false;
+
+        size = s;
+        associativity = a;
+        line_size = l;
+        return true;
+    }
+
+    TextureCacheModel::TextureCacheModel(const CacheConfig& config) :
+            config(config) {
+        ASSERT(IsPowerOfTwo(config.line_size), "Line size must be a power of 2\n");
+        num_sets = config.size / (config.line_size * config.associativity);
+        ASSERT(IsPowerOfTwo(num_sets), "Set count must be a power of 2\n");
+
+        line_shift = 0;
+        while ((1u << line_shift) < config.line_size)
+            line_shift++;
+
+        lines.resize(num_sets * config.associativity);
+        Invalidate();
+    }
+
+    void TextureCacheModel::Access(const TextureInfo& info,
+            uint32_t tile_offset, uint32_t morton, uint16_t x, uint16_t y) {
+        const uint32_t bits_per_texel = CalculateTileSize(info.format) * 8 / 64;
+
+        uint32_t address;
+        if (config.tagging == CacheTagging::Tiled) {
+            address = info.physical_address + tile_offset +
+                    morton * bits_per_texel / 8;
+        } else {
+            address = info.physical_address +
+                    (y * info.width + x) * bits_per_texel / 8;
+        }
+
+        tiles.insert(info.physical_address + tile_offset);
+        stats.accesses++;
+
+        const uint32_t line_address = address >> line_shift;
+        Line* set = &lines[(line_address & (num_sets - 1)) * config.associativity];
+        timestamp++;
+
+        Line* victim = set;
+        for (uint32_t way = 0; way < config.associativity; way++) {
+            Line& line = set[way];
+            if (line.valid && line.tag == line_address) {
+                line.last_used = timestamp;
+                stats.hits++;
+                return;
+            }
+            // Prefer invalid lines, then the least recently used one
+            if (!victim->valid)
+                continue;
+            if (!line.valid || line.last_used < victim->last_used)
+                victim = &line;
+        }
+
+        stats.misses++;
+        stats.bytes_fetched += config.line_size;
+        victim->tag = line_address;
+        victim->last_used = timestamp;
+        victim->valid = true;
+    }
+
+    void TextureCacheModel::Invalidate() {
+        for (auto& line : lines)
+            line.valid = false;
+    }
+
+    void TextureCacheModel::InvalidateRange(uint32_t address, uint32_t size) {
+        if ((config.tagging != CacheTagging::Tiled) || (size == 0)) {
+            Invalidate();
+            return;
+        }
+
+        const uint32_t first = address >> line_shift;
+        const uint32_t last = (address + size - 1) >> line_shift;
+
+        // Walk whichever is shorter, the range or the whole cache
+        if (last - first >= num_sets) {
+            for (auto& line : lines) {
+                if (line.tag >= first && line.tag <= last)
+                    line.valid = false;
+            }
+            return;
+        }
+
+        for (uint32_t line_address = first; line_address <= last; line_address++) {
+            Line* set = &lines[(line_address & (num_sets - 1)) * config.associativity];
+            for (uint32_t way = 0; way < config.associativity; way++) {
+                if (set[way].tag == line_address)
+                    set[way].valid = false;
+            }
+        }
+    }
+
+    void TextureCacheModel::BeginDraw() {
+        stats = CacheStats();
+        tiles.clear();
+    }
+
+    CacheStats TextureCacheModel::EndDraw() {
+        stats.unique_tiles = tiles.size();
+        CacheStats result = stats;
+        BeginDraw();
+        return result;
+    }
+}
@@ -0,0 +1,424 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include "texenv.h"
+
+// A configuration is compiled once into a list of stage kernels. Each kernel
+// is instantiated for its color and alpha operation, so the per-fragment
+// work is straight-line arithmetic over the lanes of a quad. Operand sources
+// and modifiers are resolved once per stage and quad.
+
+namespace TexEnv {
+
+    using Channel = uint8_t[QUAD_SIZE];
+
+    struct Program::State {
+        const ColorQuad* sources[16];
+        ColorQuad previous;
+        ColorQuad buffer;
+        ColorQuad next_buffer;
+    };
+
+    static const ColorQuad zero_quad{};
+
+    static void Broadcast(uint32_t color, ColorQuad& out) {
+        for (unsigned i = 0; i < QUAD_SIZE; i++) {
+            out.r[i] = color & 0xff;
+            out.g[i] = (color >> 8) & 0xff;
+            out.b[i] = (color >> 16) & 0xff;
+            out.a[i] = color >> 24;
+        }
+    }
+
+    static const ColorQuad& GetSource(const Program::CompiledStage& stage,
+            const Program::State& state, Source source) {
+        if (source == Source::Constant)
+            return stage.constant;
+        return *state.sources[static_cast<uint32_t>(source)];
+    }
+
+    static void ApplyColorModifier(ColorModifier modifier,
+            const ColorQuad& in, Channel out[3]) {
+        const uint8_t* src[3] = {in.r, in.g, in.b};
+        bool invert = (static_cast<uint32_t>(modifier) & 1);
+        switch (modifier) {
+        case ColorModifier::SourceColor:
+        case ColorModifier::OneMinusSourceColor:
+            src[0] = in.r; src[1] = in.g; src[2] = in.b;
+            break;
+        case ColorModifier::SourceAlpha:
+        case ColorModifier::OneMinusSourceAlpha:
+            src[0] = src[1] = src[2] = in.a;
+            break;
+        case ColorModifier::SourceRed:
+        case ColorModifier::OneMinusSourceRed:
+            src[0] = src[1] = src[2] = in.r;
+            break;
+        case ColorModifier::SourceGreen:
+        case ColorModifier::OneMinusSourceGreen:
+            src[0] = src[1] = src[2] = in.g;
+            break;
+        case ColorModifier::SourceBlue:
+        case ColorModifier::OneMinusSourceBlue:
+            src[0] = src[1] = src[2] = in.b;
+            break;
+        default:
+            fprintf(stderr, "Unknown color combiner modifier %x\n",
+                    static_cast<uint32_t>(modifier));
+            UNIMPLEMENTED();
+        }
+        uint8_t mask = invert ? 0xff : 0x00;
+        for (unsigned c = 0; c < 3; c++)
+            for (unsigned i = 0; i < QUAD_SIZE; i++)
+                out[c][i] = src[c][i] ^ mask;
+    }
+
+    static void ApplyAlphaModifier(AlphaModifier modifier,
+            const ColorQuad& in, Channel out) {
+        const uint8_t* src = in.a;
+        switch (static_cast<uint32_t>(modifier) >> 1) {
+        case 0: break;
+        case 1: src = in.r; break;
+        case 2: src = in.g; break;
+        case 3: src = in.b; break;
+        default:
+            fprintf(stderr, "Unknown alpha combiner modifier %x\n",
+                    static_cast<uint32_t>(modifier));
+            UNIMPLEMENTED();
+        }
+        uint8_t mask = (static_cast<uint32_t>(modifier) & 1) ? 0xff : 0x00;
+        for (unsigned i = 0; i < QUAD_SIZE; i++)
+            out[i] = src[i] ^ mask;
+    }
+
+    static constexpr unsigned NumOperands(Operation op) {
+        return (op == Operation::Replace) ? 1 :
+               (op == Operation::Lerp ||
+                op == Operation::MultiplyThenAdd ||
+                op == Operation::AddThenMultiply) ? 3 : 2;
+    }
+
+    // Combine one channel of all lanes
+    template <Operation OP>
+    static inline void Combine(const Channel& a, const Channel& b,
+            const Channel& c, Channel& out) {
+        for (unsigned i = 0; i < QUAD_SIZE; i++) {
+            int result;
+            switch (OP) {
+            case Operation::Replace:
+                result = a[i];
+                break;
+            case Operation::Modulate:
+                result = a[i] * b[i] / 255;
+                break;
+            case Operation::Add:
+                result = std::min(255, a[i] + b[i]);
+                break;
+            case Operation::AddSigned:
+                // TODO(bunnei): Verify that the color conversion from (float)
+                // 0.5f to (byte) 128 is correct
+                result = std::clamp(a[i] + b[i] - 128, 0, 255);
+                break;
+            case Operation::Lerp:
+                result = (a[i] * c[i] + b[i] * (255 - c[i])) / 255;
+                break;
+            case Operation::Subtract:
+                result = std::max(0, a[i] - b[i]);
+                break;
+            case Operation::MultiplyThenAdd:
+                result = std::min(255, (a[i] * b[i] + 255 * c[i]) / 255);
+                break;
+            case Operation::AddThenMultiply:
+                result = std::min(255, a[i] + b[i]) * c[i] / 255;
+                break;
+            default:
+                result = 0;
+                break;
+            }
+            out[i] = result;
+        }
+    }
+
+    // Not fully accurate. Worst case scenario seems to yield a +/-3 error.
+    static inline void Dot3(const Channel a[3], const Channel b[3],
+            Channel& out) {
+        for (unsigned i = 0; i < QUAD_SIZE; i++) {
+            int result = 0;
+            for (unsigned c = 0; c < 3; c++)
+                result += ((a[c][i] * 2 - 255) * (b[c][i] * 2 - 255) + 128) / 256;
+            out[i] = std::clamp(result, 0, 255);
+        }
+    }
+
+    static inline void Scale(Channel& channel, unsigned multiplier) {
+        for (unsigned i = 0; i < QUAD_SIZE; i++)
+            channel[i] = std::min(255u, channel[i] * multiplier);
+    }
+
+    template <Operation COLOR_OP, Operation ALPHA_OP>
+    static void RunStage(const Program::CompiledStage& compiled,
+            Program::State& state) {
+        const Stage& stage = compiled.stage;
+        constexpr unsigned color_operands = NumOperands(COLOR_OP);
+        constexpr unsigned alpha_operands = NumOperands(ALPHA_OP);
+        constexpr bool dot3 = (COLOR_OP == Operation::Dot3_RGB) ||
+                (COLOR_OP == Operation::Dot3_RGBA);
+
+        const Source color_sources[3] = {stage.color_source1,
+                stage.color_source2, stage.color_source3};
+        const ColorModifier color_modifiers[3] = {stage.color_modifier1,
+                stage.color_modifier2, stage.color_modifier3};
+        alignas(16) Channel color_in[3][3];
+        for (unsigned k = 0; k < color_operands; k++)
+            ApplyColorModifier(color_modifiers[k],
+                    GetSource(compiled, state, color_sources[k]), color_in[k]);
+
+        alignas(16) Channel color_out[3];
+        if (dot3) {
+            Dot3(color_in[0], color_in[1], color_out[0]);
+            std::memcpy(color_out[1], color_out[0], QUAD_SIZE);
+            std::memcpy(color_out[2], color_out[0], QUAD_SIZE);
+        }
+        else {
+            for (unsigned c = 0; c < 3; c++)
+                Combine<COLOR_OP>(color_in[0][c], color_in[1][c],
+                        color_in[2][c], color_out[c]);
+        }
+
+        alignas(16) Channel alpha_out;
+        if (COLOR_OP == Operation::Dot3_RGBA) {
+            std::memcpy(alpha_out, color_out[0], QUAD_SIZE);
+        }
+        else {
+            const Source alpha_sources[3] = {stage.alpha_source1,
+                    stage.alpha_source2, stage.alpha_source3};
+            const AlphaModifier alpha_modifiers[3] = {stage.alpha_modifier1,
+                    stage.alpha_modifier2, stage.alpha_modifier3};
+            alignas(16) Channel alpha_in[3];
+            for (unsigned k = 0; k < alpha_operands; k++)
+                ApplyAlphaModifier(alpha_modifiers[k],
+                        GetSource(compiled, state, alpha_sources[k]),
+                        alpha_in[k]);
+            // Dot3 is only defined for the color channels
+            if (ALPHA_OP == Operation::Dot3_RGB ||
+                    ALPHA_OP == Operation::Dot3_RGBA)
+                std::memset(alpha_out, 0, QUAD_SIZE);
+            else
+                Combine<ALPHA_OP>(alpha_in[0], alpha_in[1], alpha_in[2],
+                        alpha_out);
+        }
+
+        unsigned color_multiplier = stage.GetColorMultiplier();
+        unsigned alpha_multiplier = stage.GetAlphaMultiplier();
+        if (color_multiplier != 1)
+            for (unsigned c = 0; c < 3; c++)
+                Scale(color_out[c], color_multiplier);
+        if (alpha_multiplier != 1)
+            Scale(alpha_out, alpha_multiplier);
+
+        std::memcpy(state.previous.r, color_out[0], QUAD_SIZE);
+        std::memcpy(state.previous.g, color_out[1], QUAD_SIZE);
+        std::memcpy(state.previous.b, color_out[2], QUAD_SIZE);
+        std::memcpy(state.previous.a, alpha_out, QUAD_SIZE);
+    }
+
+    // Kernel table indexed by color and alpha operation
+    template <unsigned... I>
+    static constexpr std::array<Program::StageKernel, sizeof...(I)>
+            MakeKernelTable(std::integer_sequence<unsigned, I...>) {
+        return {{&RunStage<static_cast<Operation>(I / NUM_OPERATIONS),
+                static_cast<Operation>(I % NUM_OPERATIONS)>...}};
+    }
+
+    static constexpr auto kernel_table = MakeKernelTable(
+            std::make_integer_sequence<unsigned,
+                    NUM_OPERATIONS * NUM_OPERATIONS>());
+
+    // Skipped stage used where a stage only advances the combiner buffer
+    static void RunNothing(const Program::CompiledStage&, Program::State&) {
+    }
+
+    // Unknown operations output zero, as in Citra
+    static void RunUnknown(const Program::CompiledStage&, Program::State& state) {
+        state.previous = zero_quad;
+    }
+
+    static bool ReadsSource(const Stage& stage, Source source) {
+        unsigned color_operands = NumOperands(stage.color_op);
+        unsigned alpha_operands = NumOperands(stage.alpha_op);
+        const Source color_sources[3] = {stage.color_source1,
+                stage.color_source2, stage.color_source3};
+        const Source alpha_sources[3] = {stage.alpha_source1,
+                stage.alpha_source2, stage.alpha_source3};
+        if (stage.color_op == Operation::Dot3_RGBA)
+            alpha_operands = 0;
+        for (unsigned k = 0; k < color_operands; k++)
+            if (color_sources[k] == source)
+                return true;
+        for (unsigned k = 0; k < alpha_operands; k++)
+            if (alpha_sources[k] == source)
+                return true;
+        return false;
+    }
+
+    // Stage output equals its Previous input
+    static bool IsPassthrough(const Stage& stage) {
+        return stage.color_op == Operation::Replace &&
+                stage.alpha_op == Operation::Replace &&
+                stage.color_source1 == Source::Previous &&
+                stage.color_modifier1 == ColorModifier::SourceColor &&
+                stage.alpha_source1 == Source::Previous &&
+                stage.alpha_modifier1 == AlphaModifier::SourceAlpha &&
+                stage.GetColorMultiplier() == 1 &&
+                stage.GetAlphaMultiplier() == 1;
+    }
+
+    uint64_t Config::Hash() const {
+        // FNV-1a over the raw register words
+        uint32_t words[sizeof(Config) / 4];
+        std::memcpy(words, this, sizeof(words));
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (uint32_t word : words) {
+            hash ^= word;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    bool Config::operator==(const Config& other) const {
+        return std::memcmp(this, &other, sizeof(Config)) == 0;
+    }
+
+    Program::Program(const Config& config) : config(config) {
+        used_sources = 0;
+        Broadcast(config.buffer_color, initial_buffer);
+
+        bool buffer_used = false;
+        for (unsigned i = 0; i < NUM_STAGES; i++)
+            if (!IsPassthrough(config.stages[i]) &&
+                    ReadsSource(config.stages[i], Source::PreviousBuffer))
+                buffer_used = true;
+
+        // Walk backwards to find the stages whose output is consumed: by the
+        // next stage reading Previous, by the combiner buffer, or as the
+        // final result.
+        bool live[NUM_STAGES];
+        bool output_needed = true;
+        for (int i = NUM_STAGES - 1; i >= 0; i--) {
+            const Stage& stage = config.stages[i];
+            bool buffered = buffer_used &&
+                    (config.update_buffer.UpdatesColor(i) ||
+                    config.update_buffer.UpdatesAlpha(i));
+            live[i] = output_needed || buffered;
+            if (!live[i])
+                output_needed = false;
+            else if (IsPassthrough(stage))
+                output_needed = true;
+            else
+                output_needed = ReadsSource(stage, Source::Previous);
+        }
+
+        for (unsigned i = 0; i < NUM_STAGES; i++) {
+            const Stage& stage = config.stages[i];
+            bool run = live[i] && !IsPassthrough(stage);
+            if (!run && !buffer_used)
+                continue;
+
+            CompiledStage compiled;
+            compiled.stage = stage;
+            compiled.kernel = &RunNothing;
+            if (run) {
+                const uint32_t color_op = static_cast<uint32_t>(stage.color_op.Value());
+                const uint32_t alpha_op = static_cast<uint32_t>(stage.alpha_op.Value());
+                if ((color_op >= NUM_OPERATIONS) || (alpha_op >= NUM_OPERATIONS)) {
+                    fprintf(stderr, "Unknown combiner operation %x\n", stage.ops_raw);
+                    compiled.kernel = &RunUnknown;
+                }
+                else {
+                    compiled.kernel = kernel_table[color_op * NUM_OPERATIONS + alpha_op];
+                }
+            }
+            Broadcast(stage.const_color, compiled.constant);
+            compiled.buffer_update = buffer_used;
+            compiled.update_color = config.update_buffer.UpdatesColor(i);
+            compiled.update_alpha = config.update_buffer.UpdatesAlpha(i);
+            stages.push_back(compiled);
+
+            if (run) {
+                for (uint32_t s = 0; s < 16; s++)
+                    if (ReadsSource(stage, static_cast<Source>(s)))
+                        used_sources |= 1u << s;
+            }
+        }
+    }
+
+    void Program::Run(const Inputs& inputs, ColorQuad& output) const {
+        State state;
+        for (unsigned s = 0; s < 16; s++)
+            state.sources[s] = &zero_quad;
+        state.sources[static_cast<uint32_t>(Source::PrimaryColor)] =
+                inputs.primary_color;
+        state.sources[static_cast<uint32_t>(Source::PrimaryFragmentColor)] =
+                inputs.primary_fragment_color;
+        state.sources[static_cast<uint32_t>(Source::SecondaryFragmentColor)] =
+                inputs.secondary_fragment_color;
+        for (unsigned t = 0; t < 4; t++)
+            state.sources[static_cast<uint32_t>(Source::Texture0) + t] =
+                    inputs.texture[t];
+        state.sources[static_cast<uint32_t>(Source::PreviousBuffer)] =
+                &state.buffer;
+        state.sources[static_cast<uint32_t>(Source::Previous)] =
+                &state.previous;
+
+        state.previous = zero_quad;
+        state.buffer = zero_quad;
+        state.next_buffer = initial_buffer;
+
+        for (const CompiledStage& stage : stages) {
+            stage.kernel(stage, state);
+            if (!stage.buffer_update)
+                continue;
+            state.buffer = state.next_buffer;
+            if (stage.update_color) {
+                std::memcpy(state.next_buffer.r, state.previous.r, QUAD_SIZE);
+                std::memcpy(state.next_buffer.g, state.previous.g, QUAD_SIZE);
+                std::memcpy(state.next_buffer.b, state.previous.b, QUAD_SIZE);
+            }
+            if (stage.update_alpha)
+                std::memcpy(state.next_buffer.a, state.previous.a, QUAD_SIZE);
+        }
+
+        output = state.previous;
+    }
+
+    const Program& GetProgram(const Config& config) {
+        static std::unordered_map<uint64_t, std::vector<std::unique_ptr<Program>>> cache;
+
+        auto& bucket = cache[config.Hash()];
+        for (const auto& program : bucket)
+            if (program->GetConfig() == config)
+                return *program;
+        bucket.push_back(std::make_unique<Program>(config));
+        return *bucket.back();
+    }
+}
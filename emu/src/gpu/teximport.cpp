@@ -0,0 +1,314 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "teximport.h"
+#include "color.h"
+#include "memory.h"
+
+namespace Texturing {
+
+    constexpr unsigned TILE_TEXELS = 8 * 8;
+
+    // Largest texture dimension the hardware samples
+    constexpr unsigned MAX_TEXTURE_SIZE = 1024;
+
+    // Encodes the 64 texels of a tile, already in Morton order
+    using TileEncoder = void (*)(const Vec4<uint8_t>* texels, uint8_t* dest);
+
+    static uint8_t Intensity(const Vec4<uint8_t>& color) {
+        return static_cast<uint8_t>((color.r() * 77 + color.g() * 150 + color.b() * 29) >> 8);
+    }
+
+    static void EncodeIA8(const Vec4<uint8_t>& color, uint8_t* bytes) {
+        bytes[1] = Intensity(color);
+        bytes[0] = color.a();
+    }
+
+    static void EncodeI8(const Vec4<uint8_t>& color, uint8_t* bytes) {
+        bytes[0] = Intensity(color);
+    }
+
+    static void EncodeA8(const Vec4<uint8_t>& color, uint8_t* bytes) {
+        bytes[0] = color.a();
+    }
+
+    static void EncodeIA4(const Vec4<uint8_t>& color, uint8_t* bytes) {
+        bytes[0] = (Color::Convert8To4(Intensity(color)) << 4) |
+                Color::Convert8To4(color.a());
+    }
+
+    template <void (*Encode)(const Vec4<uint8_t>&, uint8_t*), unsigned BYTES>
+    static void EncodeTileWith(const Vec4<uint8_t>* texels, uint8_t* dest) {
+        for (unsigned i = 0; i < TILE_TEXELS; i++)
+            Encode(texels[i], dest + i * BYTES);
+    }
+
+    // Formats Color has a bulk encoder for convert the whole tile at once
+    template <void (*EncodeSpan)(const uint8_t*, uint8_t*, size_t)>
+    static void EncodeTileSpan(const Vec4<uint8_t>* texels, uint8_t* dest) {
+        static_assert(sizeof(Vec4<uint8_t>) == 4, "Texels must be packed RGBA8");
+        EncodeSpan(reinterpret_cast<const uint8_t*>(texels), dest, TILE_TEXELS);
+    }
+
+    // 4-bit formats, even Morton indices go to the low nibble
+    template <bool ALPHA>
+    static void EncodeTile4(const Vec4<uint8_t>* texels, uint8_t* dest) {
+        for (unsigned i = 0; i < TILE_TEXELS; i += 2) {
+            uint8_t lo = ALPHA ? texels[i].a() : Intensity(texels[i]);
+            uint8_t hi = ALPHA ? texels[i + 1].a() : Intensity(texels[i + 1]);
+            dest[i / 2] = (Color::Convert8To4(hi) << 4) | Color::Convert8To4(lo);
+        }
+    }
+
+    static TileEncoder GetTileEncoder(TextureFormat format) {
+        switch (format) {
+        case TextureFormat::RGBA8:  return EncodeTileSpan<Color::EncodeRGBA8Span>;
+        case TextureFormat::RGB8:   return EncodeTileSpan<Color::EncodeRGB8Span>;
+        case TextureFormat::RGB5A1: return EncodeTileSpan<Color::EncodeRGB5A1Span>;
+        case TextureFormat::RGB565: return EncodeTileSpan<Color::EncodeRGB565Span>;
+        case TextureFormat::RGBA4:  return EncodeTileSpan<Color::EncodeRGBA4Span>;
+        case TextureFormat::IA8:    return EncodeTileWith<EncodeIA8, 2>;
+        case TextureFormat::RG8:    return EncodeTileSpan<Color::EncodeRG8Span>;
+        case TextureFormat::I8:     return EncodeTileWith<EncodeI8, 1>;
+        case TextureFormat::A8:     return EncodeTileWith<EncodeA8, 1>;
+        case TextureFormat::IA4:    return EncodeTileWith<EncodeIA4, 1>;
+        case TextureFormat::I4:     return EncodeTile4<false>;
+        case TextureFormat::A4:     return EncodeTile4<true>;
+        default:                    return nullptr;
+        }
+    }
+
+    template <unsigned CHANNELS>
+    static Vec4<uint8_t> ReadPixel(const uint8_t* p) {
+        switch (CHANNELS) {
+        case 1:  return {p[0], p[0], p[0], 255};
+        case 2:  return {p[0], p[0], p[0], p[1]};
+        case 3:  return {p[0], p[1], p[2], 255};
+        default: return {p[0], p[1], p[2], p[3]};
+        }
+    }
+
+    template <unsigned CHANNELS>
+    static void TileImage(const uint8_t* source, unsigned width, unsigned height,
+            TileEncoder encoder, uint32_t tile_size, uint8_t* dest) {
+        Vec4<uint8_t> texels[TILE_TEXELS];
+        for (unsigned ty = 0; ty < height / 8; ty++) {
+            for (unsigned tx = 0; tx < width / 8; tx++) {
+                for (unsigned y = 0; y < 8; y++) {
+                    const uint8_t* row = source + ((ty * 8 + y) * width + tx * 8) * CHANNELS;
+                    for (unsigned x = 0; x < 8; x++)
+                        texels[MortonInterleave(x, y)] = ReadPixel<CHANNELS>(row + x * CHANNELS);
+                }
+                encoder(texels, dest);
+                dest += tile_size;
+            }
+        }
+    }
+
+    bool EncodeTexture(const uint8_t* source, unsigned width, unsigned height,
+            unsigned channels, TextureFormat format, uint8_t* dest) {
+        TileEncoder encoder = GetTileEncoder(format);
+        if (!encoder || (width % 8) || (height % 8))
+            return false;
+
+        const uint32_t tile_size = CalculateTileSize(format);
+        switch (channels) {
+        case 1: TileImage<1>(source, width, height, encoder, tile_size, dest); break;
+        case 2: TileImage<2>(source, width, height, encoder, tile_size, dest); break;
+        case 3: TileImage<3>(source, width, height, encoder, tile_size, dest); break;
+        case 4: TileImage<4>(source, width, height, encoder, tile_size, dest); break;
+        default: return false;
+        }
+        return true;
+    }
+
+    // Minimal tokenizer for the netpbm headers
+    struct HeaderParser {
+        const char* pos;
+        const char* end;
+
+        void SkipSpace() {
+            while (pos < end && (isspace(*pos) || *pos == '#')) {
+                if (*pos == '#') {
+                    while (pos < end && *pos != '\n')
+                        pos++;
+                } else {
+                    pos++;
+                }
+            }
+        }
+
+        bool Token(char* out, size_t size) {
+            SkipSpace();
+            size_t len = 0;
+            while (pos < end && !isspace(*pos) && len + 1 < size)
+                out[len++] = *pos++;
+            out[len] = '\0';
+            return len != 0;
+        }
+
+        bool Number(unsigned& value) {
+            char token[16];
+            if (!Token(token, sizeof(token)))
+                return false;
+            char* token_end;
+            value = strtoul(token, &token_end, 10);
+            return *token_end == '\0';
+        }
+    };
+
+    // Returns the offset of the pixel data, or 0 on error
+    static size_t ParseHeader(const uint8_t* data, size_t size, unsigned& width,
+            unsigned& height, unsigned& channels) {
+        HeaderParser parser{reinterpret_cast<const char*>(data),
+                reinterpret_cast<const char*>(data) + size};
+        char magic[4];
+        unsigned maxval = 0;
+        if (!parser.Token(magic, sizeof(magic)))
+            return 0;
+
+        if (strcmp(magic, "P5") == 0 || strcmp(magic, "P6") == 0) {
+            channels = (magic[1] == '5') ? 1 : 3;
+            if (!parser.Number(width) || !parser.Number(height) || !parser.Number(maxval))
+                return 0;
+        } else if (strcmp(magic, "P7") == 0) {
+            char key[16];
+            channels = 0;
+            while (parser.Token(key, sizeof(key)) && strcmp(key, "ENDHDR") != 0) {
+                char value[32];
+                if (strcmp(key, "WIDTH") == 0)
+                    parser.Number(width);
+                else if (strcmp(key, "HEIGHT") == 0)
+                    parser.Number(height);
+                else if (strcmp(key, "DEPTH") == 0)
+                    parser.Number(channels);
+                else if (strcmp(key, "MAXVAL") == 0)
+                    parser.Number(maxval);
+                else if (!parser.Token(value, sizeof(value)))
+                    return 0;
+            }
+        } else {
+            return 0;
+        }
+
+        // A single whitespace character separates header and pixel data
+        if (maxval != 255 || channels < 1 || channels > 4 || parser.pos >= parser.end)
+            return 0;
+        return reinterpret_cast<const uint8_t*>(parser.pos + 1) - data;
+    }
+
+    bool ImportTexture(const char* path, uint32_t address,
+            TextureFormat format, TextureInfo& info) {
+#ifndef _WIN32
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Texture: Unable to open %s\n", path);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            fprintf(stderr, "Texture: Unable to stat %s\n", path);
+            close(fd);
+            return false;
+        }
+        const size_t size = st.st_size;
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Texture: Unable to map %s\n", path);
+            return false;
+        }
+        const uint8_t* data = static_cast<const uint8_t*>(mapping);
+#else
+        FILE* fp = fopen(path, "rb");
+        if (!fp) {
+            fprintf(stderr, "Texture: Unable to open %s\n", path);
+            return false;
+        }
+        std::vector<uint8_t> buffer;
+        uint8_t chunk[4096];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+            buffer.insert(buffer.end(), chunk, chunk + read);
+        fclose(fp);
+        const size_t size = buffer.size();
+        const uint8_t* data = buffer.data();
+#endif
+
+        bool result = false;
+        unsigned width = 0, height = 0, channels = 0;
+        const size_t offset = ParseHeader(data, size, width, height, channels);
+        const size_t texture_size = static_cast<size_t>(width) * height /
+                TILE_TEXELS * CalculateTileSize(format);
+
+        if (!offset) {
+            fprintf(stderr, "Texture: %s is not a binary PGM, PPM or PAM file "
+                    "with 8 bits per channel\n", path);
+        } else if (width == 0 || height == 0 || (width % 8) || (height % 8)) {
+            fprintf(stderr, "Texture: %s is %ux%u, size must be a multiple of 8\n",
+                    path, width, height);
+        } else if (width > MAX_TEXTURE_SIZE || height > MAX_TEXTURE_SIZE) {
+            fprintf(stderr, "Texture: %s is %ux%u, larger than %ux%u\n", path,
+                    width, height, MAX_TEXTURE_SIZE, MAX_TEXTURE_SIZE);
+        } else if (size - offset < static_cast<size_t>(width) * height * channels) {
+            fprintf(stderr, "Texture: %s is truncated\n", path);
+        } else if (!Memory::IsValidRange(address, texture_size)) {
+            fprintf(stderr, "Texture: %s does not fit at 0x%08x\n", path, address);
+        } else if (!EncodeTexture(data + offset, width, height, channels, format,
+                Memory::GetPhysicalPointer(address))) {
+            fprintf(stderr, "Texture: Unable to encode to format %u\n", (uint32_t)format);
+        } else {
+            info.physical_address = address;
+            info.width = width;
+            info.height = height;
+            info.stride = (width / 8) * CalculateTileSize(format);
+            info.format = format;
+            result = true;
+        }
+
+#ifndef _WIN32
+        munmap(mapping, size);
+#endif
+        return result;
+    }
+
+    bool ParseTextureFormat(const char* name, TextureFormat& format) {
+        static const char* const names[] = {
+            "rgba8", "rgb8", "rgb5a1", "rgb565", "rgba4", "ia8", "rg8",
+            "i8", "a8", "ia4", "i4", "a4", "etc1", "etc1a4"
+        };
+        for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strcasecmp(name, names[i]) == 0) {
+                format = static_cast<TextureFormat>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+}
@@ -18,57 +18,80 @@
  *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include "texturing.h"
+#include "texcache.h"
 #include "color.h"
+#include "memory.h"
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXTURING_X86
+#endif
 
 namespace Texturing {
 
     constexpr size_t TILE_SIZE = 8*8;
     constexpr size_t ETC1_SUBTILES = 2*2;
 
-    // 8x8 Z-Order coordinate from 2D coordinates
-    static constexpr uint32_t MortonInterleave(uint32_t x, uint32_t y) {
-        constexpr uint32_t xlut[] = {0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15};
-        constexpr uint32_t ylut[] = {0x00, 0x02, 0x08, 0x0a, 0x20, 0x22, 0x28, 0x2a};
-        return xlut[x % 8] + ylut[y % 8];
+    // Optional cache model, lookups only pay for a null check without it
+    static TextureCacheModel* cache_model = nullptr;
+
+    void SetCacheModel(TextureCacheModel* model) {
+        cache_model = model;
+        // Rendering to textures drops the cached lines
+        Memory::SetWriteCallback(model ? InvalidateTextureMemory : nullptr);
+    }
+
+    TextureCacheModel* GetCacheModel() {
+        return cache_model;
+    }
+
+    void InvalidateTextureMemory(uint32_t address, uint32_t size) {
+        if (cache_model)
+            cache_model->InvalidateRange(address, size);
     }
 
-    int GetWrappedTexCoord(int val, unsigned size) {
-        /*switch (mode) {
-        case TexturingRegs::TextureConfig::ClampToEdge2:
+    int GetWrappedTexCoord(WrapMode mode, int val, unsigned size) {
+        switch (mode) {
+        case WrapMode::ClampToEdge2:
             // For negative coordinate, ClampToEdge2 behaves the same as Repeat
-            if (val < 0) {
+            if (val < 0)
                 return static_cast<int>(static_cast<unsigned>(val) % size);
-            }
-        // [[fallthrough]]
-        case TexturingRegs::TextureConfig::ClampToEdge:
-            val = std::max(val, 0);
-            val = std::min(val, static_cast<int>(size) - 1);
-            return val;
+            [[fallthrough]];
+        case WrapMode::ClampToEdge:
+            return std::clamp(val, 0, static_cast<int>(size) - 1);
 
-        case TexturingRegs::TextureConfig::ClampToBorder:
+        case WrapMode::ClampToBorder:
             return val;
 
-        case TexturingRegs::TextureConfig::ClampToBorder2:
-        // For ClampToBorder2, the case of positive coordinate beyond the texture size is already
-        // handled outside. Here we only handle the negative coordinate in the same way as Repeat.
-        case TexturingRegs::TextureConfig::Repeat2:
-        case TexturingRegs::TextureConfig::Repeat3:
-        case TexturingRegs::TextureConfig::Repeat:
+        case WrapMode::ClampToBorder2:
+        // For ClampToBorder2, positive coordinates beyond the texture size
+        // read the border color. Negative ones are handled like Repeat.
+        case WrapMode::Repeat2:
+        case WrapMode::Repeat3:
+        case WrapMode::Repeat:
             return static_cast<int>(static_cast<unsigned>(val) % size);
 
-        case TexturingRegs::TextureConfig::MirroredRepeat: {
+        case WrapMode::MirroredRepeat: {
             unsigned int coord = (static_cast<unsigned>(val) % (2 * size));
             if (coord >= size)
                 coord = 2 * size - 1 - coord;
             return static_cast<int>(coord);
         }
+        }
+        UNREACHABLE();
+        return 0;
+    }
 
-        default:
-            LOG_ERROR(HW_GPU, "Unknown texture coordinate wrapping mode {:x}", (int)mode);
-            UNIMPLEMENTED();
-            return 0;
-        }*/
-        return val;
+    bool IsBorderTexCoord(WrapMode mode, int val, unsigned size) {
+        if (mode == WrapMode::ClampToBorder)
+            return val < 0 || val >= static_cast<int>(size);
+        if (mode == WrapMode::ClampToBorder2)
+            return val >= static_cast<int>(size);
+        return false;
     }
 
     uint32_t CalculateTileSize(TextureFormat format) {
@@ -119,9 +142,400 @@ namespace Texturing {
 
         const uint8_t* line = source + coarse_y * info.stride;
         const uint8_t* tile = line + coarse_x * CalculateTileSize(info.format);
+
+        if (cache_model)
+            cache_model->Access(info, tile - source,
+                    MortonInterleave(fine_x, fine_y), x, y);
+
         return LookupTexelInTile(tile, fine_x, fine_y, info);
     }
 
+#ifdef TEXTURING_X86
+    static bool HasAVX2() {
+        static const bool result = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return result;
+    }
+
+    // Fetch 8 unaligned 32-bit words at base + offset[i] with a single gather
+    __attribute__((target("avx2")))
+    static void GatherWords8(const uint8_t* base, const uint32_t* offset, uint32_t* words) {
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offset));
+        __m256i data = _mm256_i32gather_epi32(reinterpret_cast<const int*>(base), index, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words), data);
+    }
+#endif
+
+    // Split N texel coordinates into the byte offset of their 8x8 tile and
+    // their Morton index inside that tile.
+    template <unsigned N>
+    static void ComputeTexelAddresses(const uint16_t* x, const uint16_t* y,
+            uint32_t stride, uint32_t tile_size, uint32_t* tile, uint32_t* morton) {
+#if defined(__SSE2__)
+        // 16x16->32 bit products are used below, so the stride must fit
+        if (stride <= 0xFFFF) {
+            const __m128i seven = _mm_set1_epi16(7);
+            const __m128i stride16 = _mm_set1_epi16(static_cast<short>(stride));
+            const __m128i tile_size16 = _mm_set1_epi16(static_cast<short>(tile_size));
+            const __m128i zero = _mm_setzero_si128();
+
+            // Spread the 3 low bits of v to bit 0, 2 and 4
+            auto Spread3 = [](__m128i v) {
+                v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi16(v, 2)), _mm_set1_epi16(0x13));
+                v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi16(v, 1)), _mm_set1_epi16(0x15));
+                return v;
+            };
+
+            // a * b for 16-bit lanes, widened to 32 bits (low half, high half)
+            auto MulWiden = [](__m128i a, __m128i b, __m128i& lo, __m128i& hi) {
+                __m128i prod_lo = _mm_mullo_epi16(a, b);
+                __m128i prod_hi = _mm_mulhi_epu16(a, b);
+                lo = _mm_unpacklo_epi16(prod_lo, prod_hi);
+                hi = _mm_unpackhi_epi16(prod_lo, prod_hi);
+            };
+
+            for (unsigned i = 0; i < N; i += 8) {
+                const bool full = (N - i >= 8);
+                __m128i vx = full ?
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)) :
+                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(x + i));
+                __m128i vy = full ?
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i)) :
+                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(y + i));
+
+                __m128i fine = _mm_or_si128(Spread3(_mm_and_si128(vx, seven)),
+                        _mm_slli_epi16(Spread3(_mm_and_si128(vy, seven)), 1));
+
+                __m128i row_lo, row_hi, col_lo, col_hi;
+                MulWiden(_mm_srli_epi16(vy, 3), stride16, row_lo, row_hi);
+                MulWiden(_mm_srli_epi16(vx, 3), tile_size16, col_lo, col_hi);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(tile + i),
+                        _mm_add_epi32(row_lo, col_lo));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(morton + i),
+                        _mm_unpacklo_epi16(fine, zero));
+                if (full) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(tile + i + 4),
+                            _mm_add_epi32(row_hi, col_hi));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(morton + i + 4),
+                            _mm_unpackhi_epi16(fine, zero));
+                }
+            }
+            return;
+        }
+#endif
+        for (unsigned i = 0; i < N; i++) {
+            tile[i] = (y[i] / 8) * stride + (x[i] / 8) * tile_size;
+            morton[i] = MortonInterleave(x[i], y[i]);
+        }
+    }
+
+    // Convert N RGBA8 texels (as loaded from memory) into SoA form
+    template <unsigned N>
+    static void SplitRGBA8(const uint32_t* words, TexelBatch<N>& out) {
+#if defined(__SSE2__)
+        const __m128i byte_mask = _mm_set1_epi32(0xFF);
+        for (unsigned i = 0; i < N; i += 8) {
+            const bool full = (N - i >= 8);
+            __m128i w0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i));
+            __m128i w1 = full ?
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i + 4)) :
+                    _mm_setzero_si128();
+
+            auto Channel = [&](int shift, uint8_t* dest) {
+                __m128i c0 = _mm_and_si128(_mm_srli_epi32(w0, shift), byte_mask);
+                __m128i c1 = _mm_and_si128(_mm_srli_epi32(w1, shift), byte_mask);
+                __m128i c = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_setzero_si128());
+                if (full)
+                    _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + i), c);
+                else
+                    *reinterpret_cast<int32_t*>(dest + i) = _mm_cvtsi128_si32(c);
+            };
+            Channel(24, out.r);
+            Channel(16, out.g);
+            Channel(8, out.b);
+            Channel(0, out.a);
+        }
+#else
+        for (unsigned i = 0; i < N; i++) {
+            out.r[i] = words[i] >> 24;
+            out.g[i] = words[i] >> 16;
+            out.b[i] = words[i] >> 8;
+            out.a[i] = words[i];
+        }
+#endif
+    }
+
+    template <unsigned N>
+    void LookupTextureBatch(const uint8_t* source, const uint16_t* x,
+            const uint16_t* y, const TextureInfo& info, TexelBatch<N>& out) {
+        // Address arrays are padded to at least 8 lanes for the gather path
+        constexpr unsigned LANES = (N < 8) ? 8 : N;
+        alignas(32) uint32_t tile[LANES];
+        alignas(32) uint32_t morton[LANES];
+
+        ComputeTexelAddresses<N>(x, y, info.stride,
+                CalculateTileSize(info.format), tile, morton);
+
+        if (cache_model) {
+            for (unsigned i = 0; i < N; i++)
+                cache_model->Access(info, tile[i], morton[i], x[i], y[i]);
+        }
+
+        auto DecodeEach = [&](auto decode) {
+            for (unsigned i = 0; i < N; i++) {
+                Vec4<uint8_t> res = decode(source + tile[i], morton[i]);
+                out.r[i] = res.r();
+                out.g[i] = res.g();
+                out.b[i] = res.b();
+                out.a[i] = res.a();
+            }
+        };
+
+        switch (info.format) {
+        case TextureFormat::RGBA8: {
+            alignas(32) uint32_t offset[LANES];
+            alignas(32) uint32_t words[LANES];
+            for (unsigned i = 0; i < LANES; i++)
+                offset[i] = (i < N) ? tile[i] + morton[i] * 4 : tile[0] + morton[0] * 4;
+#ifdef TEXTURING_X86
+            if (HasAVX2()) {
+                for (unsigned i = 0; i < N; i += 8)
+                    GatherWords8(source, offset + i, words + i);
+            } else
+#endif
+            {
+                for (unsigned i = 0; i < N; i++)
+                    std::memcpy(&words[i], source + offset[i], sizeof(uint32_t));
+            }
+            SplitRGBA8<N>(words, out);
+            break;
+        }
+
+        case TextureFormat::RGB8:
+            DecodeEach([](const uint8_t* t, uint32_t m) {
+                return Color::DecodeRGB8(t + m * 3);
+            });
+            break;
+
+        case TextureFormat::RGB5A1:
+            DecodeEach([](const uint8_t* t, uint32_t m) {
+                return Color::DecodeRGB5A1(t + m * 2);
+            });
+            break;
+
+        case TextureFormat::RGB565:
+            DecodeEach([](const uint8_t* t, uint32_t m) {
+                return Color::DecodeRGB565(t + m * 2);
+            });
+            break;
+
+        case TextureFormat::RGBA4:
+            DecodeEach([](const uint8_t* t, uint32_t m) {
+                return Color::DecodeRGBA4(t + m * 2);
+            });
+            break;
+
+        case TextureFormat::IA8:
+            DecodeEach([](const uint8_t* t, uint32_t m) -> Vec4<uint8_t> {
+                const uint8_t* p = t + m * 2;
+                return {p[1], p[1], p[1], p[0]};
+            });
+            break;
+
+        case TextureFormat::RG8:
+            DecodeEach([](const uint8_t* t, uint32_t m) {
+                return Color::DecodeRG8(t + m * 2);
+            });
+            break;
+
+        case TextureFormat::I8:
+            DecodeEach([](const uint8_t* t, uint32_t m) -> Vec4<uint8_t> {
+                return {t[m], t[m], t[m], 255};
+            });
+            break;
+
+        case TextureFormat::A8:
+            DecodeEach([](const uint8_t* t, uint32_t m) -> Vec4<uint8_t> {
+                return {0, 0, 0, t[m]};
+            });
+            break;
+
+        case TextureFormat::IA4:
+            DecodeEach([](const uint8_t* t, uint32_t m) -> Vec4<uint8_t> {
+                uint8_t i = Color::Convert4To8((t[m] & 0xF0) >> 4);
+                uint8_t a = Color::Convert4To8(t[m] & 0xF);
+                return {i, i, i, a};
+            });
+            break;
+
+        case TextureFormat::I4:
+            DecodeEach([](const uint8_t* t, uint32_t m) -> Vec4<uint8_t> {
+                uint8_t p = t[m / 2];
+                uint8_t i = Color::Convert4To8((m % 2) ? ((p & 0xF0) >> 4) : (p & 0xF));
+                return {i, i, i, 255};
+            });
+            break;
+
+        case TextureFormat::A4:
+            DecodeEach([](const uint8_t* t, uint32_t m) -> Vec4<uint8_t> {
+                uint8_t p = t[m / 2];
+                uint8_t a = Color::Convert4To8((m % 2) ? ((p & 0xF0) >> 4) : (p & 0xF));
+                return {0, 0, 0, a};
+            });
+            break;
+
+        default:
+            fprintf(stderr, "TMU: Unknown texture format: %u", (uint32_t)info.format);
+            std::memset(&out, 0, sizeof(out));
+            break;
+        }
+    }
+
+    template void LookupTextureBatch<4>(const uint8_t*, const uint16_t*,
+            const uint16_t*, const TextureInfo&, TexelBatch<4>&);
+    template void LookupTextureBatch<8>(const uint8_t*, const uint16_t*,
+            const uint16_t*, const TextureInfo&, TexelBatch<8>&);
+    template void LookupTextureBatch<16>(const uint8_t*, const uint16_t*,
+            const uint16_t*, const TextureInfo&, TexelBatch<16>&);
+
+    CubeFace SelectCubeFace(float s, float t, float r, float& u, float& v) {
+        const float abs_s = std::fabs(s);
+        const float abs_t = std::fabs(t);
+        const float abs_r = std::fabs(r);
+
+        CubeFace face;
+        float sc, tc, ma;
+        if (abs_s >= abs_t && abs_s >= abs_r) {
+            face = (s > 0) ? PositiveX : NegativeX;
+            sc = (s > 0) ? -r : r;
+            tc = -t;
+            ma = abs_s;
+        } else if (abs_t >= abs_r) {
+            face = (t > 0) ? PositiveY : NegativeY;
+            sc = s;
+            tc = (t > 0) ? r : -r;
+            ma = abs_t;
+        } else {
+            face = (r > 0) ? PositiveZ : NegativeZ;
+            sc = (r > 0) ? s : -s;
+            tc = -t;
+            ma = abs_r;
+        }
+
+        if (ma == 0.0f) {
+            u = v = 0.5f;
+            return face;
+        }
+
+        u = 0.5f * (sc / ma + 1.0f);
+        v = 0.5f * (tc / ma + 1.0f);
+        return face;
+    }
+
+    // Nearest texel to a normalized coordinate, clamped to edge
+    static uint16_t NormalizedToTexel(float coord, unsigned size) {
+        int texel = static_cast<int>(std::floor(coord * size));
+        return static_cast<uint16_t>(std::clamp(texel, 0, static_cast<int>(size) - 1));
+    }
+
+    Vec4<uint8_t> LookupTextureCube(const uint8_t* const faces[6], float s,
+            float t, float r, const TextureInfo& info) {
+        float u, v;
+        CubeFace face = SelectCubeFace(s, t, r, u, v);
+        // Row 0 is the bottom of the face, as with 2D textures
+        return LookupTexture(faces[face], NormalizedToTexel(u, info.width),
+                info.height - 1 - NormalizedToTexel(v, info.height), info);
+    }
+
+    uint32_t CalculateShadowReference(float z, const ShadowConfig& config) {
+        const uint32_t ref = static_cast<uint32_t>(std::clamp(z, 0.0f, 1.0f) * 0xFFFFFF);
+        const uint32_t bias = config.bias << 1;
+        return (ref > bias) ? ref - bias : 0;
+    }
+
+    uint8_t LookupShadow(const uint8_t* source, float u, float v, uint32_t ref,
+            const TextureInfo& info, TextureFilter filter) {
+        const uint32_t tile_size = CalculateTileSize(TextureFormat::RGBA8);
+        const int max_x = static_cast<int>(info.width) - 1;
+        const int max_y = static_cast<int>(info.height) - 1;
+
+        // 2x2 footprint and its bilinear weights, with 4 fractional bits
+        int x0, y0, frac_x, frac_y;
+        if (filter == TextureFilter::Linear) {
+            int fx = static_cast<int>(std::floor((u * info.width - 0.5f) * 16.0f));
+            int fy = static_cast<int>(std::floor((v * info.height - 0.5f) * 16.0f));
+            x0 = fx >> 4;
+            y0 = fy >> 4;
+            frac_x = fx & 0xF;
+            frac_y = fy & 0xF;
+        } else {
+            x0 = NormalizedToTexel(u, info.width);
+            y0 = NormalizedToTexel(v, info.height);
+            frac_x = frac_y = 0;
+        }
+
+        const int tap_x[4] = {x0, x0 + 1, x0, x0 + 1};
+        const int tap_y[4] = {y0, y0, y0 + 1, y0 + 1};
+        alignas(16) int16_t weight[8] = {
+            static_cast<int16_t>((16 - frac_x) * (16 - frac_y)),
+            static_cast<int16_t>(frac_x * (16 - frac_y)),
+            static_cast<int16_t>((16 - frac_x) * frac_y),
+            static_cast<int16_t>(frac_x * frac_y),
+            0, 0, 0, 0
+        };
+
+        alignas(16) uint32_t words[4];
+        for (int i = 0; i < 4; i++) {
+            const int x = std::clamp(tap_x[i], 0, max_x);
+            // Row 0 is the bottom of the texture, as written by MergeShadow()
+            const int y = max_y - std::clamp(tap_y[i], 0, max_y);
+            const uint8_t* tile = source + (y / 8) * info.stride + (x / 8) * tile_size;
+            const uint32_t morton = MortonInterleave(x, y);
+            if (cache_model)
+                cache_model->Access(info, tile - source, morton, x, y);
+            std::memcpy(&words[i], tile + morton * 4, sizeof(uint32_t));
+        }
+
+#if defined(__SSE2__)
+        // Depth is stored most significant byte first in bytes 0-2, the
+        // attenuation in byte 3.
+        const __m128i byte_mask = _mm_set1_epi32(0xFF);
+        const __m128i w = _mm_load_si128(reinterpret_cast<const __m128i*>(words));
+        const __m128i depth = _mm_or_si128(
+                _mm_or_si128(_mm_slli_epi32(_mm_and_si128(w, byte_mask), 16),
+                        _mm_and_si128(w, _mm_set1_epi32(0xFF00))),
+                _mm_and_si128(_mm_srli_epi32(w, 16), byte_mask));
+        const __m128i attenuation = _mm_srli_epi32(w, 24);
+
+        // A tap is lit when the stored depth lies beyond the reference
+        const __m128i lit = _mm_cmpgt_epi32(depth,
+                _mm_set1_epi32(static_cast<int>(ref)));
+        const __m128i value = _mm_and_si128(lit, attenuation);
+
+        const __m128i products = _mm_madd_epi16(
+                _mm_packs_epi32(value, _mm_setzero_si128()),
+                _mm_load_si128(reinterpret_cast<const __m128i*>(weight)));
+        const int sum = _mm_cvtsi128_si32(
+                _mm_add_epi32(products, _mm_srli_si128(products, 4)));
+#else
+        int sum = 0;
+        for (int i = 0; i < 4; i++) {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&words[i]);
+            const uint32_t depth = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+            const int value = (depth > ref) ? bytes[3] : 0;
+            sum += value * weight[i];
+        }
+#endif
+        return static_cast<uint8_t>((sum + 128) >> 8);
+    }
+
+    uint8_t LookupShadowCube(const uint8_t* const faces[6], float s, float t,
+            float r, uint32_t ref, const TextureInfo& info, TextureFilter filter) {
+        float u, v;
+        CubeFace face = SelectCubeFace(s, t, r, u, v);
+        return LookupShadow(faces[face], u, v, ref, info, filter);
+    }
+
     Vec4<uint8_t> LookupTexelInTile(const uint8_t* source, uint16_t x, 
             uint16_t y, const TextureInfo& info) {
         switch (info.format) {
@@ -0,0 +1,454 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "transfer.h"
+#include "color.h"
+#include "memory.h"
+#include "texturing.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Transfer {
+
+    // Rows of a band are only split off to a worker above this size
+    constexpr size_t MIN_BAND_BYTES = 64 * 1024;
+
+    static unsigned num_threads =
+            std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+
+    void SetThreads(unsigned threads) {
+        num_threads = std::max(1u, threads);
+    }
+
+    unsigned BytesPerPixel(PixelFormat format) {
+        switch (format) {
+        case PixelFormat::RGBA8:
+            return 4;
+        case PixelFormat::RGB8:
+            return 3;
+        case PixelFormat::RGB565:
+        case PixelFormat::RGB5A1:
+        case PixelFormat::RGBA4:
+            return 2;
+        }
+        return 0;
+    }
+
+    static void DecodeSpan(PixelFormat format, const uint8_t* src, uint8_t* rgba,
+            size_t count) {
+        switch (format) {
+        case PixelFormat::RGBA8:
+            Color::DecodeRGBA8Span(src, rgba, count);
+            break;
+        case PixelFormat::RGB8:
+            Color::DecodeRGB8Span(src, rgba, count);
+            break;
+        case PixelFormat::RGB565:
+            Color::DecodeRGB565Span(src, rgba, count);
+            break;
+        case PixelFormat::RGB5A1:
+            Color::DecodeRGB5A1Span(src, rgba, count);
+            break;
+        case PixelFormat::RGBA4:
+            Color::DecodeRGBA4Span(src, rgba, count);
+            break;
+        }
+    }
+
+    static void EncodeSpan(PixelFormat format, const uint8_t* rgba, uint8_t* dst,
+            size_t count) {
+        switch (format) {
+        case PixelFormat::RGBA8:
+            Color::EncodeRGBA8Span(rgba, dst, count);
+            break;
+        case PixelFormat::RGB8:
+            Color::EncodeRGB8Span(rgba, dst, count);
+            break;
+        case PixelFormat::RGB565:
+            Color::EncodeRGB565Span(rgba, dst, count);
+            break;
+        case PixelFormat::RGB5A1:
+            Color::EncodeRGB5A1Span(rgba, dst, count);
+            break;
+        case PixelFormat::RGBA4:
+            Color::EncodeRGBA4Span(rgba, dst, count);
+            break;
+        }
+    }
+
+    // A tile stores pixels in groups of 2x2, the groups of rows y and y + 1
+    // (y even) are at these Morton offsets from MortonInterleave(0, y)
+    static constexpr unsigned TILE_GROUPS[4] = {0, 4, 16, 20};
+
+    /**
+    * Move between a band of 8x8 tiles and 8 linear rows. Whole tiles are
+    * read or written at once, rows may be stored upside down.
+    * @param tiles First tile of the band
+    * @param width Width of the band in pixels, a multiple of 8
+    * @param rows Linear row matching the first row of the tiles
+    * @param stride Byte distance between consecutive linear rows
+    */
+    template <unsigned BYTES>
+    static void DetileBand(const uint8_t* tiles, unsigned width, uint8_t* rows,
+            ptrdiff_t stride) {
+        for (unsigned x = 0; x < width; x += 8, tiles += 64 * BYTES) {
+            for (unsigned y = 0; y < 8; y += 2) {
+                const uint8_t* group = tiles + Texturing::MortonInterleave(0, y) * BYTES;
+                uint8_t* row0 = rows + y * stride + x * BYTES;
+                uint8_t* row1 = row0 + stride;
+#if defined(__SSE2__)
+                if (BYTES == 4) {
+                    // Each 16 byte group holds 2 pixels of both rows
+                    const __m128i a = _mm_loadu_si128((const __m128i*)group);
+                    const __m128i b = _mm_loadu_si128((const __m128i*)(group + 16));
+                    const __m128i c = _mm_loadu_si128((const __m128i*)(group + 64));
+                    const __m128i d = _mm_loadu_si128((const __m128i*)(group + 80));
+                    _mm_storeu_si128((__m128i*)row0, _mm_unpacklo_epi64(a, b));
+                    _mm_storeu_si128((__m128i*)(row0 + 16), _mm_unpacklo_epi64(c, d));
+                    _mm_storeu_si128((__m128i*)row1, _mm_unpackhi_epi64(a, b));
+                    _mm_storeu_si128((__m128i*)(row1 + 16), _mm_unpackhi_epi64(c, d));
+                    continue;
+                }
+                if (BYTES == 2) {
+                    const __m128i ab = _mm_unpacklo_epi32(
+                            _mm_loadl_epi64((const __m128i*)group),
+                            _mm_loadl_epi64((const __m128i*)(group + 8)));
+                    const __m128i cd = _mm_unpacklo_epi32(
+                            _mm_loadl_epi64((const __m128i*)(group + 32)),
+                            _mm_loadl_epi64((const __m128i*)(group + 40)));
+                    _mm_storeu_si128((__m128i*)row0, _mm_unpacklo_epi64(ab, cd));
+                    _mm_storeu_si128((__m128i*)row1, _mm_unpackhi_epi64(ab, cd));
+                    continue;
+                }
+#endif
+                for (unsigned i = 0; i < 4; i++) {
+                    const uint8_t* pair = group + TILE_GROUPS[i] * BYTES;
+                    std::memcpy(row0 + i * 2 * BYTES, pair, 2 * BYTES);
+                    std::memcpy(row1 + i * 2 * BYTES, pair + 2 * BYTES, 2 * BYTES);
+                }
+            }
+        }
+    }
+
+    template <unsigned BYTES>
+    static void TileBand(const uint8_t* rows, ptrdiff_t stride, unsigned width,
+            uint8_t* tiles) {
+        for (unsigned x = 0; x < width; x += 8, tiles += 64 * BYTES) {
+            for (unsigned y = 0; y < 8; y += 2) {
+                uint8_t* group = tiles + Texturing::MortonInterleave(0, y) * BYTES;
+                const uint8_t* row0 = rows + y * stride + x * BYTES;
+                const uint8_t* row1 = row0 + stride;
+#if defined(__SSE2__)
+                if (BYTES == 4) {
+                    const __m128i r0 = _mm_loadu_si128((const __m128i*)row0);
+                    const __m128i r1 = _mm_loadu_si128((const __m128i*)row1);
+                    const __m128i r2 = _mm_loadu_si128((const __m128i*)(row0 + 16));
+                    const __m128i r3 = _mm_loadu_si128((const __m128i*)(row1 + 16));
+                    _mm_storeu_si128((__m128i*)group, _mm_unpacklo_epi64(r0, r1));
+                    _mm_storeu_si128((__m128i*)(group + 16), _mm_unpackhi_epi64(r0, r1));
+                    _mm_storeu_si128((__m128i*)(group + 64), _mm_unpacklo_epi64(r2, r3));
+                    _mm_storeu_si128((__m128i*)(group + 80), _mm_unpackhi_epi64(r2, r3));
+                    continue;
+                }
+                if (BYTES == 2) {
+                    const __m128i r0 = _mm_loadu_si128((const __m128i*)row0);
+                    const __m128i r1 = _mm_loadu_si128((const __m128i*)row1);
+                    const __m128i lo = _mm_unpacklo_epi32(r0, r1);
+                    const __m128i hi = _mm_unpackhi_epi32(r0, r1);
+                    _mm_storel_epi64((__m128i*)group, lo);
+                    _mm_storel_epi64((__m128i*)(group + 8), _mm_unpackhi_epi64(lo, lo));
+                    _mm_storel_epi64((__m128i*)(group + 32), hi);
+                    _mm_storel_epi64((__m128i*)(group + 40), _mm_unpackhi_epi64(hi, hi));
+                    continue;
+                }
+#endif
+                for (unsigned i = 0; i < 4; i++) {
+                    uint8_t* pair = group + TILE_GROUPS[i] * BYTES;
+                    std::memcpy(pair, row0 + i * 2 * BYTES, 2 * BYTES);
+                    std::memcpy(pair + 2 * BYTES, row1 + i * 2 * BYTES, 2 * BYTES);
+                }
+            }
+        }
+    }
+
+    using DetileFunc = void (*)(const uint8_t* tiles, unsigned width, uint8_t* rows,
+            ptrdiff_t stride);
+    using TileFunc = void (*)(const uint8_t* rows, ptrdiff_t stride, unsigned width,
+            uint8_t* tiles);
+
+    static DetileFunc GetDetileBand(unsigned bytes_per_pixel) {
+        switch (bytes_per_pixel) {
+        case 2:
+            return DetileBand<2>;
+        case 3:
+            return DetileBand<3>;
+        default:
+            return DetileBand<4>;
+        }
+    }
+
+    static TileFunc GetTileBand(unsigned bytes_per_pixel) {
+        switch (bytes_per_pixel) {
+        case 2:
+            return TileBand<2>;
+        case 3:
+            return TileBand<3>;
+        default:
+            return TileBand<4>;
+        }
+    }
+
+    /**
+    * Call func(first, last) on bands of rows, in parallel if the image is
+    * large enough to pay for starting the threads.
+    * @param rows Number of rows
+    * @param row_bytes Bytes written per row
+    */
+    template <typename Func>
+    static void ForEachBand(unsigned rows, size_t row_bytes, Func func) {
+        // Every band gets at least one tile row
+        const unsigned bands = std::min<size_t>({num_threads,
+                rows * row_bytes / MIN_BAND_BYTES, rows / 8});
+        if (bands <= 1) {
+            func(0u, rows);
+            return;
+        }
+
+        // Bands start on tile rows
+        const unsigned band_rows = (rows / 8 + bands - 1) / bands * 8;
+        std::vector<std::thread> workers;
+        for (unsigned first = band_rows; first < rows; first += band_rows)
+            workers.emplace_back(func, first, std::min(rows, first + band_rows));
+        func(0u, std::min(rows, band_rows));
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    bool DisplayTransfer(const Config& config) {
+        const Framebuffer::DownscaleMode scaling = config.scaling;
+        if (scaling != Framebuffer::DownscaleMode::None &&
+                scaling != Framebuffer::DownscaleMode::X &&
+                scaling != Framebuffer::DownscaleMode::XY) {
+            fprintf(stderr, "Invalid display transfer scaling %u\n",
+                    static_cast<uint32_t>(scaling));
+            return false;
+        }
+        if (config.block_32) {
+            fprintf(stderr, "Unimplemented display transfer with 32x32 blocks\n");
+            return false;
+        }
+
+        const PixelFormat input_format = config.input_format;
+        const PixelFormat output_format = config.output_format;
+        const unsigned src_bytes = BytesPerPixel(input_format);
+        const unsigned dst_bytes = BytesPerPixel(output_format);
+        if (!src_bytes || !dst_bytes) {
+            fprintf(stderr, "Invalid display transfer format %u -> %u\n",
+                    static_cast<uint32_t>(input_format),
+                    static_cast<uint32_t>(output_format));
+            return false;
+        }
+
+        const unsigned horizontal_scale = (scaling != Framebuffer::DownscaleMode::None);
+        const unsigned vertical_scale = (scaling == Framebuffer::DownscaleMode::XY);
+        const unsigned input_width = config.input_width;
+        const unsigned input_height = config.input_height;
+        const unsigned output_width = config.output_width >> horizontal_scale;
+        const unsigned output_height = config.output_height >> vertical_scale;
+        const bool input_tiled = !config.input_linear;
+        const bool output_tiled = config.input_linear != config.dont_swizzle;
+
+        if ((output_width << horizontal_scale) > input_width ||
+                (output_height << vertical_scale) > input_height ||
+                (input_tiled && ((input_width | input_height) & 7)) ||
+                (output_tiled && ((output_width | output_height) & 7))) {
+            fprintf(stderr, "Invalid display transfer %ux%u -> %ux%u\n",
+                    input_width, input_height, output_width, output_height);
+            return false;
+        }
+
+        const uint64_t input_size = uint64_t(input_width) * input_height * src_bytes;
+        const uint64_t output_size = uint64_t(output_width) * output_height * dst_bytes;
+        if (!Memory::IsValidRange(config.input_address, input_size) ||
+                !Memory::IsValidRange(config.output_address, output_size)) {
+            fprintf(stderr, "Invalid display transfer %08x -> %08x\n",
+                    config.input_address, config.output_address);
+            return false;
+        }
+        const uint8_t* src = Memory::GetPhysicalPointer(config.input_address);
+        uint8_t* dst = Memory::GetPhysicalPointer(config.output_address);
+
+        const DetileFunc detile = GetDetileBand(src_bytes);
+        const TileFunc tile = GetTileBand(dst_bytes);
+        const bool flip = config.flip_vertically;
+        // Same format at the same size, rows are moved without decoding
+        const bool raw = (input_format == output_format) &&
+                (scaling == Framebuffer::DownscaleMode::None);
+        const unsigned src_row_bytes = input_width * src_bytes;
+        const unsigned dst_row_bytes = output_width * dst_bytes;
+        const ptrdiff_t dst_stride = flip ? -ptrdiff_t(dst_row_bytes) : dst_row_bytes;
+        auto GetOutputRow = [&](unsigned y) {
+            return dst + (flip ? output_height - 1 - y : y) * dst_row_bytes;
+        };
+
+        if (raw && input_width == output_width && !(output_height & 7) &&
+                input_tiled != output_tiled) {
+            // Plain (de)tiling, straight between the buffers
+            ForEachBand(output_height, dst_row_bytes, [&](unsigned first, unsigned last) {
+                for (unsigned y = first; y < last; y += 8) {
+                    if (input_tiled) {
+                        detile(src + y * src_row_bytes, input_width, GetOutputRow(y),
+                                dst_stride);
+                    } else {
+                        // The first tile row is the last input row if flipped
+                        const unsigned input_y = flip ? y + 7 : y;
+                        tile(src + input_y * src_row_bytes,
+                                flip ? -ptrdiff_t(src_row_bytes) : src_row_bytes,
+                                output_width, GetOutputRow(flip ? y + 7 : y));
+                    }
+                }
+            });
+            Memory::MarkWritten(config.output_address, output_size);
+            return true;
+        }
+
+        ForEachBand(output_height, dst_row_bytes, [&](unsigned first, unsigned last) {
+            // Detiled input rows, decoded and filtered RGBA8 and tiled
+            // output rows, per band
+            std::vector<uint8_t> input_band(input_tiled ? 8 * src_row_bytes : 0);
+            unsigned input_band_y = ~0u;
+            std::vector<uint8_t> rgba(2 * input_width * 4);
+            std::vector<uint8_t> filtered(output_width * 4);
+            std::vector<uint8_t> output_band(output_tiled ? 8 * dst_row_bytes : 0);
+
+            for (unsigned y = first; y < last; y++) {
+                const unsigned output_y = flip ? output_height - 1 - y : y;
+                uint8_t* out = output_tiled ?
+                        &output_band[(output_y & 7) * dst_row_bytes] :
+                        dst + output_y * dst_row_bytes;
+
+                const uint8_t* in[2];
+                for (unsigned i = 0; i <= vertical_scale; i++) {
+                    const unsigned input_y = (y << vertical_scale) + i;
+                    if (!input_tiled) {
+                        in[i] = src + input_y * src_row_bytes;
+                        continue;
+                    }
+                    if ((input_y & ~7) != input_band_y) {
+                        input_band_y = input_y & ~7;
+                        detile(src + input_band_y * src_row_bytes, input_width,
+                                input_band.data(), src_row_bytes);
+                    }
+                    in[i] = &input_band[(input_y & 7) * src_row_bytes];
+                }
+
+                if (raw) {
+                    std::memcpy(out, in[0], dst_row_bytes);
+                } else {
+                    const unsigned count = output_width << horizontal_scale;
+                    uint8_t* row0 = rgba.data();
+                    uint8_t* row1 = rgba.data() + input_width * 4;
+                    DecodeSpan(input_format, in[0], row0, count);
+                    if (scaling == Framebuffer::DownscaleMode::XY) {
+                        DecodeSpan(input_format, in[1], row1, count);
+                        Color::BoxFilter2x2Span(row0, row1, filtered.data(),
+                                output_width);
+                        row0 = filtered.data();
+                    } else if (scaling == Framebuffer::DownscaleMode::X) {
+                        Color::BoxFilter2x1Span(row0, filtered.data(), output_width);
+                        row0 = filtered.data();
+                    }
+                    EncodeSpan(output_format, row0, out, output_width);
+                }
+
+                // Bands hold 8 rows, the last one completes the tiles
+                if (output_tiled && (y & 7) == 7)
+                    tile(output_band.data(), dst_row_bytes, output_width,
+                            dst + (output_y & ~7) * dst_row_bytes);
+            }
+        });
+
+        Memory::MarkWritten(config.output_address, output_size);
+        return true;
+    }
+
+    bool TextureCopy(const Config& config) {
+        // Sizes are multiples of 16 bytes, a zero line width copies the
+        // whole size as one line
+        uint32_t remaining = config.texture_copy_size & ~15u;
+        const uint32_t input_width = config.input_line_width ?
+                config.input_line_width * 16 : remaining;
+        const uint32_t input_gap = config.input_line_gap * 16;
+        const uint32_t output_width = config.output_line_width ?
+                config.output_line_width * 16 : remaining;
+        const uint32_t output_gap = config.output_line_gap * 16;
+        if (!remaining)
+            return true;
+
+        // Extent of the lines and gaps covering the copy on each side
+        const uint64_t input_lines = (uint64_t(remaining) + input_width - 1) / input_width;
+        const uint64_t output_lines = (uint64_t(remaining) + output_width - 1) / output_width;
+        const uint64_t input_size = input_lines * (input_width + input_gap) - input_gap;
+        const uint64_t output_size = output_lines * (output_width + output_gap) -
+                output_gap;
+        if (!Memory::IsValidRange(config.input_address, input_size) ||
+                !Memory::IsValidRange(config.output_address, output_size)) {
+            fprintf(stderr, "Invalid texture copy %08x -> %08x\n",
+                    config.input_address, config.output_address);
+            return false;
+        }
+        const uint8_t* src = Memory::GetPhysicalPointer(config.input_address);
+        uint8_t* dst = Memory::GetPhysicalPointer(config.output_address);
+
+        uint32_t input_used = 0;
+        uint32_t output_used = 0;
+        while (remaining) {
+            const uint32_t size = std::min({input_width - input_used,
+                    output_width - output_used, remaining});
+            std::memcpy(dst, src, size);
+            src += size;
+            dst += size;
+            remaining -= size;
+
+            input_used += size;
+            if (input_used == input_width) {
+                src += input_gap;
+                input_used = 0;
+            }
+            output_used += size;
+            if (output_used == output_width) {
+                dst += output_gap;
+                output_used = 0;
+            }
+        }
+
+        Memory::MarkWritten(config.output_address, output_size);
+        return true;
+    }
+
+    bool Execute(const Config& config) {
+        return config.is_texture_copy ?
+                TextureCopy(config) : DisplayTransfer(config);
+    }
+}
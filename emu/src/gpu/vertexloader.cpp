@@ -0,0 +1,215 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2015  Citra Emulator Project
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "vertexloader.h"
+#include "regs.h"
+#include "memory.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Shader {
+
+    // Input registers are written as four packed floats
+    static_assert(sizeof(Vec4<float24>) == 4 * sizeof(float),
+            "Vec4<float24> is not four floats");
+
+    static unsigned GetElementSize(AttributeFormat format) {
+        // Byte, unsigned byte, short and float
+        static const unsigned size[4] = {1, 1, 2, 4};
+        return size[static_cast<uint32_t>(format)];
+    }
+
+    static unsigned AlignUp(unsigned value, unsigned alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+#if defined(__SSE2__)
+    // Missing components default to (0, 0, 0, 1). Unloaded lanes are zero,
+    // or-ing in 1.0 sets w.
+    template <unsigned N>
+    static __m128 SetDefaultW(__m128 value) {
+        if (N == 4)
+            return value;
+        return _mm_or_ps(value, _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f));
+    }
+
+    template <AttributeFormat Format, unsigned N>
+    static void Convert(const uint8_t* src, Vec4<float24>& dst) {
+        float* out = reinterpret_cast<float*>(&dst);
+        if (Format == AttributeFormat::Float) {
+            if (N == 4) {
+                _mm_storeu_ps(out, _mm_loadu_ps(reinterpret_cast<const float*>(src)));
+            } else {
+                alignas(16) float value[4] = {};
+                std::memcpy(value, src, N * sizeof(float));
+                _mm_storeu_ps(out, SetDefaultW<N>(_mm_load_ps(value)));
+            }
+            return;
+        }
+
+        uint64_t raw = 0;
+        std::memcpy(&raw, src, N * GetElementSize(Format));
+        __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&raw));
+        switch (Format) {
+        case AttributeFormat::Byte:
+            // Move each byte to the top of its lane, shift back with sign
+            v = _mm_unpacklo_epi8(v, v);
+            v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 24);
+            break;
+        case AttributeFormat::UnsignedByte:
+            v = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+            v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+            break;
+        case AttributeFormat::Short:
+            v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            break;
+        default:
+            break;
+        }
+        _mm_storeu_ps(out, SetDefaultW<N>(_mm_cvtepi32_ps(v)));
+    }
+#else
+    template <AttributeFormat Format, unsigned N>
+    static void Convert(const uint8_t* src, Vec4<float24>& dst) {
+        float value[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+        for (unsigned c = 0; c < N; c++) {
+            switch (Format) {
+            case AttributeFormat::Byte:
+                value[c] = static_cast<int8_t>(src[c]);
+                break;
+            case AttributeFormat::UnsignedByte:
+                value[c] = src[c];
+                break;
+            case AttributeFormat::Short: {
+                int16_t element;
+                std::memcpy(&element, src + c * 2, sizeof(element));
+                value[c] = element;
+                break;
+            }
+            case AttributeFormat::Float:
+                std::memcpy(&value[c], src + c * 4, sizeof(float));
+                break;
+            }
+        }
+        dst = MakeVec(float24::FromFloat32(value[0]),
+                float24::FromFloat32(value[1]),
+                float24::FromFloat32(value[2]),
+                float24::FromFloat32(value[3]));
+    }
+#endif
+
+    template <AttributeFormat Format>
+    static constexpr std::array<void (*)(const uint8_t*, Vec4<float24>&), 4>
+            GetConverters() {
+        return {Convert<Format, 1>, Convert<Format, 2>, Convert<Format, 3>,
+                Convert<Format, 4>};
+    }
+
+    void VertexLoader::Setup(const uint32_t* regs, unsigned input_mask) {
+        const uint64_t format = regs[GPUREG_ATTRIBBUFFERS_FORMAT_LOW] |
+                (uint64_t(regs[GPUREG_ATTRIBBUFFERS_FORMAT_HIGH] & 0xffff) << 32);
+        const uint32_t fixed_mask =
+                (regs[GPUREG_ATTRIBBUFFERS_FORMAT_HIGH] >> 16) & 0xfff;
+        const uint64_t permutation = regs[GPUREG_VSH_ATTRIBUTES_PERMUTATION_LOW] |
+                (uint64_t(regs[GPUREG_VSH_ATTRIBUTES_PERMUTATION_HIGH]) << 32);
+        const uint32_t base = (regs[GPUREG_ATTRIBBUFFERS_LOC] & 0x1ffffffe) << 3;
+        const unsigned num_attributes =
+                (regs[GPUREG_ATTRIBBUFFERS_FORMAT_HIGH] >> 28) + 1;
+
+        static const std::array<ConvertFunc, 4> converters[4] = {
+            GetConverters<AttributeFormat::Byte>(),
+            GetConverters<AttributeFormat::UnsignedByte>(),
+            GetConverters<AttributeFormat::Short>(),
+            GetConverters<AttributeFormat::Float>()
+        };
+
+        // Buffer placement of each attribute, size is zero if none
+        AttributeLoad placement[MAX_ATTRIBUTES] = {};
+        for (unsigned i = 0; i < MAX_ATTRIBUTES; i++) {
+            const unsigned reg = GPUREG_ATTRIBBUFFER0_OFFSET + i * 3;
+            const uint32_t config1 = regs[reg + 1];
+            const uint32_t config2 = regs[reg + 2];
+            // Only 12 components fit in the two config words
+            const unsigned count = std::min(config2 >> 28, 12u);
+            const unsigned stride = (config2 >> 16) & 0xff;
+
+            unsigned offset = 0;
+            for (unsigned j = 0; j < count; j++) {
+                const unsigned component = (j < 8) ?
+                        (config1 >> (j * 4)) & 0xf : (config2 >> ((j - 8) * 4)) & 0xf;
+                if (component >= 12) {
+                    // 4, 8, 12 or 16 bytes of padding
+                    offset = AlignUp(offset, 4) + (component - 11) * 4;
+                    continue;
+                }
+
+                const auto type =
+                        static_cast<AttributeFormat>((format >> (component * 4)) & 3);
+                const unsigned components = ((format >> (component * 4 + 2)) & 3) + 1;
+                const unsigned element_size = GetElementSize(type);
+                offset = AlignUp(offset, element_size);
+                const unsigned size = element_size * components;
+                if (component < num_attributes &&
+                        !((fixed_mask >> component) & 1)) {
+                    auto& load = placement[component];
+                    load.address = base + regs[reg] + offset;
+                    load.size = size;
+                    load.stride = stride;
+                    load.convert = converters[static_cast<uint32_t>(type)]
+                            [components - 1];
+                }
+                offset += size;
+            }
+        }
+
+        num_loads = 0;
+        num_fixed = 0;
+        for (unsigned i = 0; i < num_attributes; i++) {
+            const unsigned input = (permutation >> (i * 4)) & 0xf;
+            if (!((input_mask >> input) & 1))
+                continue;
+            if (!placement[i].size) {
+                fixed[num_fixed++] = {i, input};
+                continue;
+            }
+            loads[num_loads] = placement[i];
+            loads[num_loads].data = nullptr;
+            loads[num_loads].input = input;
+            num_loads++;
+        }
+    }
+
+    bool VertexLoader::Map(unsigned max_index) {
+        for (unsigned i = 0; i < num_loads; i++) {
+            AttributeLoad& load = loads[i];
+            if (!Memory::IsValidRange(load.address,
+                    uint64_t(max_index) * load.stride + load.size)) {
+                fprintf(stderr, "Invalid attribute buffer %08x\n", load.address);
+                return false;
+            }
+            load.data = Memory::GetPhysicalPointer(load.address);
+        }
+        return true;
+    }
+}
@@ -20,10 +20,41 @@
 #include "frontend.h"
 #include "gpu/cos.h"
 #include "gpu/shader.h"
+#include "gpu/shbin.h"
 #include "gpu/rasterizer.h"
 #include "gpu/texturing.h"
+#include "gpu/texcache.h"
+#include "gpu/teximport.h"
+#include "gpu/memory.h"
+#include "gpu/framebuffer.h"
+#include "gpu/earlydepth.h"
+#include "gpu/command.h"
+#include "gpu/transfer.h"
+#include "gpu/gxqueue.h"
+#include "gpu/color.h"
+#include <memory>
+#include <vector>
 
-//#include "kitten.h"
+#include "kitten.h"
+
+// Textures are placed at the beginning of the linear heap
+constexpr uint32_t TEXTURE_PADDR = Memory::FCRAM_PADDR;
+
+// Render targets live in VRAM, the color buffer first. The size is the one
+// on the display, supersampling renders at twice that in one or both axes.
+constexpr unsigned FRAMEBUFFER_WIDTH = 400;
+constexpr unsigned FRAMEBUFFER_HEIGHT = 240;
+constexpr uint32_t COLORBUFFER_PADDR = Memory::VRAM_PADDR;
+
+// Vertex data is placed 8 MiB into the heap, after textures of up to
+// 1024x1024 RGBA8
+constexpr uint32_t VERTEX_PADDR = Memory::FCRAM_PADDR + 0x00800000;
+
+// Linear RGBA8 copies of the color buffer the display reads, 16 MiB into
+// the heap. One is presented while the next frame is transferred to the
+// other.
+constexpr uint32_t SCANOUT_PADDR = Memory::FCRAM_PADDR + 0x01000000;
+constexpr uint32_t SCANOUT_SIZE = 0x00200000;
 
 #define Vec4FP24(x, y, z, w) MakeVec(\
 		float24::FromFloat32(x),\
@@ -110,6 +141,34 @@ void Mtx_PerspTilt(Vec4<float24>* projection, float fovy, float aspect,
 	projection[3] = Vec4FP24(0.0f, 0.0f, z, 0.0f);
 }
 
+// float24 register encoding, 1.7.16
+uint32_t f32tof24(float f) {
+	uint32_t i;
+	memcpy(&i, &f, sizeof(i));
+	const uint32_t sign = i >> 31;
+	const int32_t exponent = ((i >> 23) & 0xff) - 64;
+	const uint32_t mantissa = (i & 0x7fffff) >> 7;
+
+	if (exponent <= 0)
+		return sign << 23;
+	if (exponent >= 0x7f)
+		return (sign << 23) | (0x7f << 16);
+	return (sign << 23) | (exponent << 16) | mantissa;
+}
+
+// Upload float uniforms in float32 mode, four words per vector, w first
+void AddFloatUniforms(Command::CommandList& list, unsigned index,
+		const Vec4<float24>* values, unsigned count) {
+	std::vector<uint32_t> words(count * 4);
+	for (unsigned i = 0; i < count; i++) {
+		const float vector[4] = {values[i].w.ToFloat32(), values[i].z.ToFloat32(),
+				values[i].y.ToFloat32(), values[i].x.ToFloat32()};
+		memcpy(&words[i * 4], vector, sizeof(vector));
+	}
+	list.AddWrite(GPUREG_VSH_FLOATUNIFORM_INDEX, 0x80000000 | index);
+	list.AddWrites(GPUREG_VSH_FLOATUNIFORM_DATA0, words.data(), words.size());
+}
+
 void Dbg_PrintVec(Vec4<float24> vec) {
 	printf("%.3f, %.3f, %.3f, %.3f\n", 
 			vec.x.ToFloat32(), vec.y.ToFloat32(), 
@@ -119,145 +178,316 @@ void Dbg_PrintVec(Vec4<float24> vec) {
 int main(int argc, char *argv[]) {
 	printf("Coscoroba Emulator\nVersion %s\n", VERSION);
 	
+	// Built-in texture, 64x64 RGBA8 after a 4 byte header
+	Texturing::TextureInfo texture;
+	texture.physical_address = TEXTURE_PADDR;
+	texture.width = 64;
+	texture.height = 64;
+	texture.stride = 8 * 8 * 4 * 8;
+	texture.format = Texturing::RGBA8;
+	// The image is stored bottom row first, texel row 0 is sampled at the
+	// top (v = 1)
+	uint8_t* texels = Memory::GetPhysicalPointer(TEXTURE_PADDR);
+	const uint8_t* source = kitten_raw + 4;
+	for (unsigned y = 0; y < texture.height; y++) {
+		for (unsigned x = 0; x < texture.width; x++) {
+			const unsigned flipped = texture.height - 1 - y;
+			memcpy(texels + (flipped / 8) * texture.stride + (x / 8) * 8 * 8 * 4 +
+					Texturing::MortonInterleave(x, flipped) * 4,
+					source + (y / 8) * texture.stride + (x / 8) * 8 * 8 * 4 +
+					Texturing::MortonInterleave(x, y) * 4, 4);
+		}
+	}
+
+	std::unique_ptr<Texturing::TextureCacheModel> texture_cache;
+	Framebuffer::DownscaleMode scaling = Framebuffer::DownscaleMode::None;
+	Shader::ProgramCache programs;
+	const Shader::Program* program = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--texture=", 10) == 0) {
+			// --texture=path[:format]
+			std::string path = argv[i] + 10;
+			Texturing::TextureFormat format = Texturing::RGBA8;
+			size_t colon = path.rfind(':');
+			if (colon != std::string::npos) {
+				if (!Texturing::ParseTextureFormat(path.c_str() + colon + 1, format)) {
+					fprintf(stderr, "Unknown texture format %s\n",
+							path.c_str() + colon + 1);
+					return 1;
+				}
+				path.resize(colon);
+			}
+			if (!Texturing::ImportTexture(path.c_str(), TEXTURE_PADDR, format, texture))
+				return 1;
+		} else if (strncmp(argv[i], "--shader=", 9) == 0) {
+			// --shader=path[:index], a SHBIN file and the DVLE to use
+			std::string path = argv[i] + 9;
+			unsigned index = 0;
+			size_t colon = path.rfind(':');
+			if (colon != std::string::npos) {
+				index = strtoul(path.c_str() + colon + 1, nullptr, 0);
+				path.resize(colon);
+			}
+			program = programs.Load(path.c_str(), index);
+			if (!program)
+				return 1;
+		} else if (strncmp(argv[i], "--texcache=", 11) == 0) {
+			Texturing::CacheConfig config;
+			if (!config.Parse(argv[i] + 11)) {
+				fprintf(stderr, "Invalid texture cache config %s, expected "
+						"size,ways,line[,tiled|linear]\n", argv[i] + 11);
+				return 1;
+			}
+			texture_cache = std::make_unique<Texturing::TextureCacheModel>(config);
+			Texturing::SetCacheModel(texture_cache.get());
+		} else if (strcmp(argv[i], "--supersample=x") == 0) {
+			scaling = Framebuffer::DownscaleMode::X;
+		} else if (strcmp(argv[i], "--supersample=xy") == 0) {
+			scaling = Framebuffer::DownscaleMode::XY;
+		} else if (strncmp(argv[i], "--supersample=", 14) == 0) {
+			fprintf(stderr, "Invalid supersampling mode %s, expected x or xy\n",
+					argv[i] + 14);
+			return 1;
+		}
+	}
+
+	const unsigned render_width = (scaling != Framebuffer::DownscaleMode::None) ?
+			FRAMEBUFFER_WIDTH * 2 : FRAMEBUFFER_WIDTH;
+	const unsigned render_height = (scaling == Framebuffer::DownscaleMode::XY) ?
+			FRAMEBUFFER_HEIGHT * 2 : FRAMEBUFFER_HEIGHT;
+	const uint32_t depthbuffer_paddr = COLORBUFFER_PADDR +
+			render_width * render_height * 4;
+
 	//Frontend::Init();
 	auto &frontend = singleton<Frontend>();
 
+	// Cube of 12 triangles, position xyz and texture coordinate uv
 	constexpr int VERTEX_COUNT = 36;
-	Shader::OutputVertex vertex[VERTEX_COUNT];
-	Shader::OutputVertex outputs[VERTEX_COUNT];
-
-	// First face (PZ)
-	// First triangle
-	vertex[0].pos    = Vec4FP24(-0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[0].color  = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	vertex[1].pos    = Vec4FP24(+0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[1].color  = Vec4FP24(1.0f, 0.0f, 0.0f, 0.0f);
-	vertex[2].pos    = Vec4FP24(+0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[2].color  = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	// Second triangle
-	vertex[3].pos    = Vec4FP24(+0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[3].color  = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	vertex[4].pos    = Vec4FP24(-0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[4].color  = Vec4FP24(0.0f, 1.0f, 0.0f, 0.0f);
-	vertex[5].pos    = Vec4FP24(-0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[5].color  = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	// Second face (MZ)
-	// First triangle
-	vertex[6].pos    = Vec4FP24(-0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[6].color  = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	vertex[7].pos    = Vec4FP24(-0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[7].color  = Vec4FP24(1.0f, 0.0f, 0.0f, 0.0f);
-	vertex[8].pos    = Vec4FP24(+0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[8].color  = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	// Second triangle
-	vertex[9].pos    = Vec4FP24(+0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[9].color  = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	vertex[10].pos   = Vec4FP24(+0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[10].color = Vec4FP24(0.0f, 1.0f, 0.0f, 0.0f);
-	vertex[11].pos   = Vec4FP24(-0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[11].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	// Third face (PX)
-	// First triangle
-	vertex[12].pos   = Vec4FP24(+0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[12].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	vertex[13].pos   = Vec4FP24(+0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[13].color = Vec4FP24(1.0f, 0.0f, 0.0f, 0.0f);
-	vertex[14].pos   = Vec4FP24(+0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[14].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	// Second triangle
-	vertex[15].pos   = Vec4FP24(+0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[15].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	vertex[16].pos   = Vec4FP24(+0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[16].color = Vec4FP24(0.0f, 1.0f, 0.0f, 0.0f);
-	vertex[17].pos   = Vec4FP24(+0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[17].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	// Fourth face (MX)
-	// First triangle
-	vertex[18].pos   = Vec4FP24(-0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[18].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	vertex[19].pos   = Vec4FP24(-0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[19].color = Vec4FP24(1.0f, 0.0f, 0.0f, 0.0f);
-	vertex[20].pos   = Vec4FP24(-0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[20].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	// Second triangle
-	vertex[21].pos   = Vec4FP24(-0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[21].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	vertex[22].pos   = Vec4FP24(-0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[22].color = Vec4FP24(0.0f, 1.0f, 0.0f, 0.0f);
-	vertex[23].pos   = Vec4FP24(-0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[23].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	// Fifth face (PY)
-	// First triangle
-	vertex[24].pos   = Vec4FP24(-0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[24].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	vertex[25].pos   = Vec4FP24(-0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[25].color = Vec4FP24(1.0f, 0.0f, 0.0f, 0.0f);
-	vertex[26].pos   = Vec4FP24(+0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[26].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	// Second triangle
-	vertex[27].pos   = Vec4FP24(+0.5f, +0.5f, +0.5f, 1.0f);
-	vertex[27].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	vertex[28].pos   = Vec4FP24(+0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[28].color = Vec4FP24(0.0f, 1.0f, 0.0f, 0.0f);
-	vertex[29].pos   = Vec4FP24(-0.5f, +0.5f, -0.5f, 1.0f);
-	vertex[29].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	// Sixth face (MY)
-	// First triangle
-	vertex[30].pos   = Vec4FP24(-0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[30].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-	vertex[31].pos   = Vec4FP24(+0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[31].color = Vec4FP24(1.0f, 0.0f, 0.0f, 0.0f);
-	vertex[32].pos   = Vec4FP24(+0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[32].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	// Second triangle
-	vertex[33].pos   = Vec4FP24(+0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[33].color = Vec4FP24(1.0f, 1.0f, 0.0f, 0.0f);
-	vertex[34].pos   = Vec4FP24(-0.5f, -0.5f, +0.5f, 1.0f);
-	vertex[34].color = Vec4FP24(0.0f, 1.0f, 0.0f, 0.0f);
-	vertex[35].pos   = Vec4FP24(-0.5f, -0.5f, -0.5f, 1.0f);
-	vertex[35].color = Vec4FP24(0.0f, 0.0f, 0.0f, 0.0f);
-
-	Shader::Uniforms uniform;
-	Vec4<float24>* projection = &uniform.f[0];
-	Vec4<float24>* modelView = &uniform.f[4];
+	static const float vertex_data[VERTEX_COUNT][5] = {
+		// First face (PZ)
+		{-0.5f, -0.5f, +0.5f, 0.0f, 0.0f},
+		{+0.5f, -0.5f, +0.5f, 1.0f, 0.0f},
+		{+0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{+0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{-0.5f, +0.5f, +0.5f, 0.0f, 1.0f},
+		{-0.5f, -0.5f, +0.5f, 0.0f, 0.0f},
+		// Second face (MZ)
+		{-0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		{-0.5f, +0.5f, -0.5f, 1.0f, 0.0f},
+		{+0.5f, +0.5f, -0.5f, 1.0f, 1.0f},
+		{+0.5f, +0.5f, -0.5f, 1.0f, 1.0f},
+		{+0.5f, -0.5f, -0.5f, 0.0f, 1.0f},
+		{-0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		// Third face (PX)
+		{+0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		{+0.5f, +0.5f, -0.5f, 1.0f, 0.0f},
+		{+0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{+0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{+0.5f, -0.5f, +0.5f, 0.0f, 1.0f},
+		{+0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		// Fourth face (MX)
+		{-0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		{-0.5f, -0.5f, +0.5f, 1.0f, 0.0f},
+		{-0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{-0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{-0.5f, +0.5f, -0.5f, 0.0f, 1.0f},
+		{-0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		// Fifth face (PY)
+		{-0.5f, +0.5f, -0.5f, 0.0f, 0.0f},
+		{-0.5f, +0.5f, +0.5f, 1.0f, 0.0f},
+		{+0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{+0.5f, +0.5f, +0.5f, 1.0f, 1.0f},
+		{+0.5f, +0.5f, -0.5f, 0.0f, 1.0f},
+		{-0.5f, +0.5f, -0.5f, 0.0f, 0.0f},
+		// Sixth face (MY)
+		{-0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+		{+0.5f, -0.5f, -0.5f, 1.0f, 0.0f},
+		{+0.5f, -0.5f, +0.5f, 1.0f, 1.0f},
+		{+0.5f, -0.5f, +0.5f, 1.0f, 1.0f},
+		{-0.5f, -0.5f, +0.5f, 0.0f, 1.0f},
+		{-0.5f, -0.5f, -0.5f, 0.0f, 0.0f},
+	};
+	memcpy(Memory::GetPhysicalPointer(VERTEX_PADDR), vertex_data,
+			sizeof(vertex_data));
+
+	Vec4<float24> projection[4];
+	Vec4<float24> modelView[4];
 	// Projection Matrix
 	Mtx_PerspTilt(projection, AngleFromDegrees(80.0f), 240.0f/400.0f, 
 			0.01f, 1000.0f, false);
 	//Mtx_Identity(projection);
 	// Constants
-	uniform.f[95] = Vec4FP24(0.0f, 1.0f, -1.0f, 0.1f);
-
-	Shader::Setup setup;
-	setup.program_code[0]  = 0x4e000000; // mov  r0.xyz_  v0.xyzw
-	setup.program_code[1]  = 0x4e07f001; // mov  r0.___w c95.yyyy
-	setup.program_code[2]  = 0x0a224802; // dp4  r1.x___  c4.xyzw  r0.xyzw
-	setup.program_code[3]  = 0x0a225803; // dp4  r1._y__  c5.xyzw  r0.xyzw
-	setup.program_code[4]  = 0x0a226804; // dp4  r1.__z_  c6.xyzw  r0.xyzw
-	setup.program_code[5]  = 0x0a227805; // dp4  r1.___w  c7.xyzw  r0.xyzw
-	setup.program_code[6]  = 0x08020882; // dp4  o0.x___  c0.xyzw  r1.xyzw
-	setup.program_code[7]  = 0x08021883; // dp4  o0._y__  c1.xyzw  r1.xyzw
-	setup.program_code[8]  = 0x08022884; // dp4  o0.__z_  c2.xyzw  r1.xyzw
-	setup.program_code[9]  = 0x08023885; // dp4  o0.___w  c3.xyzw  r1.xyzw
-	setup.program_code[10] = 0x4c201006; // mov  o1.xyzw  v1.xyzw
-	setup.program_code[11] = 0x88000000; // end
-
-	setup.swizzle_data[0]  = 0x0000036e; // xyz_, xyzw, xxxx, xxxx
-	setup.swizzle_data[1]  = 0x00000aa1; // ___w, yyyy, xxxx, xxxx
-	setup.swizzle_data[2]  = 0x0006c368; // x___, xyzw, xyzw, xxxx
-	setup.swizzle_data[3]  = 0x0006c364; // _y__, xyzw, xyzw, xxxx
-	setup.swizzle_data[4]  = 0x0006c362; // __z_, xyzw, xyzw, xxxx
-	setup.swizzle_data[5]  = 0x0006c361; // ___w, xyzw, xyzw, xxxx
-	setup.swizzle_data[6]  = 0x0000036f; // xyzw, xyzw, xxxx, xxxx
-
-	setup.entry_point = 0x0000;
-
-	Shader::ShaderEngine shader_engine(setup, uniform);
+	Vec4<float24> constants = Vec4FP24(0.0f, 1.0f, -1.0f, 0.1f);
+
+	static const uint32_t program_code[] = {
+		0x4e000000, // mov  r0.xyz_  v0.xyzw
+		0x4e07f001, // mov  r0.___w c95.yyyy
+		0x0a224802, // dp4  r1.x___  c4.xyzw  r0.xyzw
+		0x0a225803, // dp4  r1._y__  c5.xyzw  r0.xyzw
+		0x0a226804, // dp4  r1.__z_  c6.xyzw  r0.xyzw
+		0x0a227805, // dp4  r1.___w  c7.xyzw  r0.xyzw
+		0x08020882, // dp4  o0.x___  c0.xyzw  r1.xyzw
+		0x08021883, // dp4  o0._y__  c1.xyzw  r1.xyzw
+		0x08022884, // dp4  o0.__z_  c2.xyzw  r1.xyzw
+		0x08023885, // dp4  o0.___w  c3.xyzw  r1.xyzw
+		0x4c201006, // mov  o1.xyzw  v1.xyzw
+		0x88000000, // end
+	};
+
+	static const uint32_t swizzle_data[] = {
+		0x0000036e, // xyz_, xyzw, xxxx, xxxx
+		0x00000aa1, // ___w, yyyy, xxxx, xxxx
+		0x0006c368, // x___, xyzw, xyzw, xxxx
+		0x0006c364, // _y__, xyzw, xyzw, xxxx
+		0x0006c362, // __z_, xyzw, xyzw, xxxx
+		0x0006c361, // ___w, xyzw, xyzw, xxxx
+		0x0000036f, // xyzw, xyzw, xxxx, xxxx
+	};
 
 	Rasterizer rasterizer;
+	TexEnv::FogUnit fog;
+	Lighting::LightingUnit lighting;
+	Texturing::ProcTexUnit proctex;
+	Framebuffer::OutputMerger output_merger;
+	Framebuffer::EarlyDepthUnit early_depth;
+	Command::CommandProcessor processor(rasterizer, output_merger,
+			early_depth, fog, lighting, proctex);
+
+	// Everything but the model view matrix is set up once
+	Command::CommandList setup;
+
+	// RGBA8 color and D24S8 depth, depth tested with GreaterThan against
+	// the reversed depth range. Blending is off, the logic op copies.
+	setup.AddWrite(GPUREG_COLOR_OPERATION, 0x00e40000);
+	setup.AddWrite(GPUREG_LOGIC_OP, 0x00000003);
+	setup.AddWrite(GPUREG_DEPTH_COLOR_MASK, 0x00001f61);
+	setup.AddWrite(GPUREG_COLORBUFFER_READ, 0x0000000f);
+	setup.AddWrite(GPUREG_COLORBUFFER_WRITE, 0x0000000f);
+	setup.AddWrite(GPUREG_DEPTHBUFFER_READ, 0x00000003);
+	setup.AddWrite(GPUREG_DEPTHBUFFER_WRITE, 0x00000003);
+	setup.AddWrite(GPUREG_DEPTHBUFFER_FORMAT, 0x00000003);
+	setup.AddWrite(GPUREG_COLORBUFFER_FORMAT, 0x00000002);
+	setup.AddWrite(GPUREG_DEPTHBUFFER_LOC, depthbuffer_paddr >> 3);
+	setup.AddWrite(GPUREG_COLORBUFFER_LOC, COLORBUFFER_PADDR >> 3);
+	setup.AddWrite(GPUREG_FRAMEBUFFER_DIM, render_width |
+			((render_height - 1) << 12));
+
+	// Early depth with the same direction as the depth test, cleared to
+	// the far plane along with the depth buffer
+	setup.AddWrite(GPUREG_EARLYDEPTH_FUNC, 0x00000001);
+	setup.AddWrite(GPUREG_EARLYDEPTH_TEST1, 0x00000001);
+	setup.AddWrite(GPUREG_EARLYDEPTH_TEST2, 0x00000001);
+	setup.AddWrite(GPUREG_EARLYDEPTH_DATA, 0x00000000);
+
+	// Clip space covers the whole render target
+	setup.AddWrite(GPUREG_VIEWPORT_WIDTH, f32tof24(render_width / 2.0f));
+	setup.AddWrite(GPUREG_VIEWPORT_HEIGHT, f32tof24(render_height / 2.0f));
+	setup.AddWrite(GPUREG_DEPTHMAP_SCALE, f32tof24(-1.0f));
+	setup.AddWrite(GPUREG_DEPTHMAP_OFFSET, f32tof24(0.0f));
+
+	// Texture unit 0
+	setup.AddWrite(GPUREG_TEXUNIT0_DIM, (texture.width << 16) | texture.height);
+	setup.AddWrite(GPUREG_TEXUNIT0_ADDR1, texture.physical_address >> 3);
+	setup.AddWrite(GPUREG_TEXUNIT0_TYPE, texture.format);
+	setup.AddWrite(GPUREG_TEXUNIT_CONFIG, 0x00000001);
+
+	// Texture combiner: stage 0 outputs texture 0, the others pass through.
+	// Fog is off, fragment lighting stays disabled as the demo shader
+	// outputs no normals.
+	for (unsigned i = 0; i < TexEnv::NUM_STAGES; i++) {
+		TexEnv::Stage stage{};
+		stage.color_source1 = (i == 0) ? TexEnv::Source::Texture0 :
+				TexEnv::Source::Previous;
+		stage.alpha_source1 = stage.color_source1.Value();
+		const uint32_t words[] = {stage.sources_raw, stage.modifiers_raw,
+				stage.ops_raw, stage.const_color, stage.scales_raw};
+		setup.AddIncrementalWrites(GetTexEnvRegister(i), words, 5);
+	}
+	setup.AddWrite(GPUREG_TEXENV_UPDATE_BUFFER, 0x00000000);
+
+	// Vertex shader, the built-in one unless a binary is loaded
+	unsigned projection_index = 0;
+	unsigned model_view_index = 4;
+	if (program) {
+		Shader::AddProgramWrites(setup, *program);
+		int location = program->GetUniformLocation("projection");
+		if (location >= 0)
+			projection_index = location;
+		location = program->GetUniformLocation("modelView");
+		if (location >= 0)
+			model_view_index = location;
+	} else {
+		setup.AddWrite(GPUREG_VSH_CODETRANSFER_INDEX, 0);
+		setup.AddWrites(GPUREG_VSH_CODETRANSFER_DATA0, program_code,
+				sizeof(program_code) / sizeof(uint32_t));
+		setup.AddWrite(GPUREG_VSH_CODETRANSFER_END, 1);
+		setup.AddWrite(GPUREG_VSH_OPDESCS_INDEX, 0);
+		setup.AddWrites(GPUREG_VSH_OPDESCS_DATA0, swizzle_data,
+				sizeof(swizzle_data) / sizeof(uint32_t));
+		setup.AddWrite(GPUREG_VSH_ENTRYPOINT, 0x7fff0000);
+		AddFloatUniforms(setup, 95, &constants, 1);
+
+		// o0 is the position, o1 texture coordinate 0
+		setup.AddWrite(GPUREG_SH_OUTMAP_TOTAL, 2);
+		setup.AddWrite(GPUREG_SH_OUTMAP_O0, 0x03020100);
+		setup.AddWrite(GPUREG_SH_OUTMAP_O0 + 1, 0x1f1f0d0c);
+		for (unsigned i = 2; i < 7; i++)
+			setup.AddWrite(GPUREG_SH_OUTMAP_O0 + i, 0x1f1f1f1f);
+	}
+	AddFloatUniforms(setup, projection_index, projection, 4);
+
+	// Attribute 0 is three floats, attribute 1 two, both from buffer 0
+	setup.AddWrite(GPUREG_ATTRIBBUFFERS_LOC, VERTEX_PADDR >> 3);
+	setup.AddWrite(GPUREG_ATTRIBBUFFERS_FORMAT_LOW, 0x0000007b);
+	setup.AddWrite(GPUREG_ATTRIBBUFFERS_FORMAT_HIGH, 0x10000000);
+	setup.AddWrite(GPUREG_ATTRIBBUFFER0_OFFSET, 0);
+	setup.AddWrite(GPUREG_ATTRIBBUFFER0_CONFIG1, 0x00000010);
+	setup.AddWrite(GPUREG_ATTRIBBUFFER0_CONFIG2, 0x20000000 |
+			(sizeof(vertex_data[0]) << 16));
+	setup.AddWrite(GPUREG_VSH_NUM_ATTR, 1);
+	setup.AddWrite(GPUREG_VSH_ATTRIBUTES_PERMUTATION_LOW, 0x00000010);
+	setup.AddWrite(GPUREG_VSH_ATTRIBUTES_PERMUTATION_HIGH, 0x00000000);
+	processor.ProcessCommandList(setup.Data(), setup.Size());
+
+	// Untile the color buffer top row first, supersampled targets are
+	// averaged down on the way to the display
+	Transfer::Config transfer{};
+	transfer.input_address = COLORBUFFER_PADDR;
+	transfer.output_address = SCANOUT_PADDR;
+	transfer.input_size = render_width | (render_height << 16);
+	transfer.output_size = transfer.input_size;
+	transfer.flip_vertically.Assign(1);
+	transfer.input_format.Assign(Transfer::PixelFormat::RGBA8);
+	transfer.output_format.Assign(Transfer::PixelFormat::RGBA8);
+	transfer.scaling.Assign(scaling);
+
+	std::vector<uint8_t> image(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * 4);
 	float angleX = 0.0, angleY = 0.0;
 
+	// Frame N renders on the GPU thread while frame N + 1 is built and
+	// frame N - 1 is presented, command lists and scanout buffers are
+	// double buffered. Declared before the queue so they outlive it.
+	Command::CommandList frames[2];
+	GX::Fence transferred[2] = {0, 0};
+#ifdef DEBUG_BUILD
+	std::vector<uint8_t> depth_images[2];
+	for (auto& depth_image : depth_images)
+		depth_image.resize(image.size());
+#endif
+	GX::CommandQueue queue(processor, output_merger);
+	unsigned frame_index = 0;
+
+	if (texture_cache)
+		texture_cache->BeginDraw();
+
 	while (frontend.PollEvent()) {
-		frontend.Clear();
+		const unsigned buffer = frame_index % 2;
+
+		// Black, and the far plane for the depth buffer
+		queue.MemoryFill(COLORBUFFER_PADDR,
+				render_width * render_height * 4, 0x00000000, 4);
+		queue.MemoryFill(depthbuffer_paddr,
+				render_width * render_height * 4, 0x00000000, 4);
 
 		Mtx_Identity(modelView);
 		Mtx_Translate(modelView, 0.0, 0.0, -2.0 + 0.5*sinf(angleX));
@@ -268,19 +498,58 @@ int main(int argc, char *argv[]) {
 		angleX += M_PI / 180;
 		angleY += M_PI / 360;
 
-		for (int i = 0; i < VERTEX_COUNT; i++) {
-			shader_engine.LoadInput(*((Shader::AttributeBuffer *)&vertex[i]));
-			shader_engine.Run();
-			shader_engine.WriteOutput(*((Shader::AttributeBuffer *)&outputs[i]));
-		}
+		// Last used by frame N - 2, complete once its transfer is
+		Command::CommandList& frame = frames[buffer];
+		frame.Clear();
+		frame.AddWrite(GPUREG_EARLYDEPTH_CLEAR, 0x00000001);
+		AddFloatUniforms(frame, model_view_index, modelView, 4);
+		frame.AddMaskedWrite(GPUREG_PRIMITIVE_CONFIG, 0x2, 0x00000000);
+		frame.AddWrite(GPUREG_RESTART_PRIMITIVE, 0x00000001);
+		frame.AddWrite(GPUREG_INDEXBUFFER_CONFIG, 0x80000000);
+		frame.AddWrite(GPUREG_NUMVERTICES, VERTEX_COUNT);
+		frame.AddWrite(GPUREG_VERTEX_OFFSET, 0);
+		frame.AddMaskedWrite(GPUREG_START_DRAW_FUNC0, 0x1, 0x00000000);
+		frame.AddWrite(GPUREG_DRAWARRAYS, 0x00000001);
+		frame.AddMaskedWrite(GPUREG_START_DRAW_FUNC0, 0x1, 0x00000001);
+		frame.AddWrite(GPUREG_VTX_FUNC, 0x00000001);
+		frame.AddWrite(GPUREG_FRAMEBUFFER_FLUSH, 0x00000001);
+
+		// Runs on the GPU thread, before the next frame clears the buffers
+		queue.ProcessCommandList(frame.Data(), frame.Size(), [&, buffer] {
+			if (texture_cache) {
+				auto stats = texture_cache->EndDraw();
+				printf("Texture cache: %.2f%% hit, %llu tiles, %llu bytes fetched\n",
+						stats.HitRate() * 100.0f,
+						(unsigned long long)stats.unique_tiles,
+						(unsigned long long)stats.bytes_fetched);
+			}
+#ifdef DEBUG_BUILD
+			output_merger.ReadDepthBuffer(depth_images[buffer].data(), scaling);
+#endif
+		});
+
+		transfer.output_address = SCANOUT_PADDR + buffer * SCANOUT_SIZE;
+		transferred[buffer] = queue.DisplayTransfer(transfer);
 
-		for (int i = 0; i < VERTEX_COUNT; i+=3) {
-			rasterizer.AddTriangle(outputs[i], outputs[i + 1], outputs[i + 2]);
+		if (frame_index > 0) {
+			const unsigned previous = buffer ^ 1;
+			queue.Wait(transferred[previous]);
+			Color::DecodeRGBA8Span(
+					Memory::GetPhysicalPointer(SCANOUT_PADDR + previous * SCANOUT_SIZE),
+					image.data(), FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT);
+			frontend.Present(image.data(), FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+#ifdef DEBUG_BUILD
+			frontend.Present(depth_images[previous].data(), FRAMEBUFFER_WIDTH,
+					FRAMEBUFFER_HEIGHT, VIDEO_WIDTH / 2);
+#endif
+			frontend.Flip();
 		}
 
-		frontend.Flip();
-		frontend.Wait();	
+		frontend.Wait();
+		frame_index++;
 	}
 
+	queue.Finish();
+
 	//Frontend::Deinit();
-}
\ No newline at end of file
+}
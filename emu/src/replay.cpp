@@ -0,0 +1,317 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+// Headless replay of register traces, used as a benchmark
+#include "main.h"
+#include "gpu/cos.h"
+#include "gpu/command.h"
+#include "gpu/memory.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Binary traces are a GPUCMD command list after this header
+struct BinaryTraceHeader {
+    char magic[4]; // "PCMD"
+    uint32_t words;
+};
+
+static void Usage() {
+    fprintf(stderr,
+            "Usage: replay [options] trace\n"
+            "  --frames=N            Replay the trace N times (default 100)\n"
+            "  --output=file.ppm     Write the final color buffer\n"
+            "  --load=paddr:file     Load a memory dump before replaying\n"
+            "  --hugepages           Back emulated memory with huge pages\n"
+            "  --threads=N           Rasterize with N threads (default: cores, at most 4)\n"
+            "  --convert=file        Write the trace in the binary form\n");
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& data) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data.resize(size);
+    bool ok = fread(data.data(), 1, size, fp) == static_cast<size_t>(size);
+    fclose(fp);
+    if (!ok)
+        fprintf(stderr, "Unable to read %s\n", path);
+    return ok;
+}
+
+/**
+* Parse a text trace, one "NAME id mask value" line per register write with
+* the id and value in hex and the byte enables as 4 binary digits, most
+* significant first. Repeated writes to one register and writes to
+* consecutive registers are merged into bursts.
+*/
+static bool ParseTextTrace(const std::vector<uint8_t>& data,
+        Command::CommandList& list) {
+    struct Write {
+        unsigned id;
+        unsigned mask;
+        uint32_t value;
+    };
+
+    std::vector<Write> writes;
+    std::string text(data.begin(), data.end());
+    std::istringstream stream(text);
+    std::string line;
+    unsigned line_number = 0;
+    while (std::getline(stream, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#' || line[0] == '\r')
+            continue;
+
+        char mask[5];
+        Write write;
+        if (sscanf(line.c_str(), "%*s %x %4s %x", &write.id, mask,
+                &write.value) != 3) {
+            fprintf(stderr, "Invalid trace line %u: %s\n", line_number,
+                    line.c_str());
+            return false;
+        }
+        write.mask = strtoul(mask, nullptr, 2);
+        writes.push_back(write);
+    }
+
+    std::vector<uint32_t> values;
+    for (size_t i = 0; i < writes.size();) {
+        const Write& first = writes[i];
+        values.assign(1, first.value);
+        size_t n = 1;
+        if (first.mask == 0xf && i + 1 < writes.size() &&
+                writes[i + 1].mask == 0xf) {
+            // Same register, or consecutive registers
+            const bool incremental = writes[i + 1].id == first.id + 1;
+            const unsigned step = incremental ? 1 : 0;
+            if (incremental || writes[i + 1].id == first.id) {
+                while (i + n < writes.size() && writes[i + n].mask == 0xf &&
+                        writes[i + n].id == first.id + n * step) {
+                    values.push_back(writes[i + n].value);
+                    n++;
+                }
+            }
+            if (incremental && n > 1)
+                list.AddIncrementalWrites(first.id, values.data(), n);
+            else
+                list.AddWrites(first.id, values.data(), n);
+        } else {
+            list.AddMaskedWrite(first.id, first.mask, first.value);
+        }
+        i += n;
+    }
+    return true;
+}
+
+/**
+* Load a text or binary trace.
+* @param commands The trace as a command list
+*/
+static bool LoadTrace(const char* path, std::vector<uint32_t>& commands) {
+    std::vector<uint8_t> data;
+    if (!ReadFile(path, data))
+        return false;
+
+    BinaryTraceHeader header;
+    if (data.size() >= sizeof(header)) {
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, "PCMD", 4) == 0) {
+            if (data.size() < sizeof(header) + header.words * 4ull) {
+                fprintf(stderr, "Binary trace %s is truncated\n", path);
+                return false;
+            }
+            commands.resize(header.words);
+            memcpy(commands.data(), data.data() + sizeof(header),
+                    header.words * 4);
+            return true;
+        }
+    }
+
+    Command::CommandList list;
+    if (!ParseTextTrace(data, list))
+        return false;
+    commands.assign(list.Data(), list.Data() + list.Size());
+    return true;
+}
+
+static bool WriteBinaryTrace(const char* path,
+        const std::vector<uint32_t>& commands) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+    BinaryTraceHeader header;
+    memcpy(header.magic, "PCMD", 4);
+    header.words = commands.size();
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(commands.data(), 4, commands.size(), fp) == commands.size();
+    fclose(fp);
+    if (!ok)
+        fprintf(stderr, "Unable to write %s\n", path);
+    return ok;
+}
+
+static bool WritePPM(const char* path, const uint8_t* rgba, unsigned width,
+        unsigned height) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+    fprintf(fp, "P6\n%u %u\n255\n", width, height);
+    std::vector<uint8_t> rgb(width * 3);
+    for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++)
+            memcpy(&rgb[x * 3], &rgba[(y * width + x) * 4], 3);
+        fwrite(rgb.data(), 1, rgb.size(), fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned frames = 100;
+    const char* trace_path = nullptr;
+    const char* output_path = nullptr;
+    const char* convert_path = nullptr;
+    bool huge_pages = false;
+    unsigned threads = 0;
+    // Memory is mapped once all options are known
+    std::vector<std::pair<uint32_t, const char*>> dumps;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--frames=", 9) == 0) {
+            frames = strtoul(argv[i] + 9, nullptr, 10);
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            output_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--convert=", 10) == 0) {
+            convert_path = argv[i] + 10;
+        } else if (strncmp(argv[i], "--load=", 7) == 0) {
+            // --load=paddr:file
+            char* end;
+            const uint32_t address = strtoul(argv[i] + 7, &end, 16);
+            if (*end != ':') {
+                Usage();
+                return 1;
+            }
+            dumps.emplace_back(address, end + 1);
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            huge_pages = true;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = strtoul(argv[i] + 10, nullptr, 10);
+        } else if (argv[i][0] != '-' && !trace_path) {
+            trace_path = argv[i];
+        } else {
+            Usage();
+            return 1;
+        }
+    }
+
+    if (!trace_path) {
+        Usage();
+        return 1;
+    }
+
+    if (!Memory::Init(huge_pages))
+        return 1;
+    for (const auto& dump : dumps) {
+        std::vector<uint8_t> data;
+        if (!ReadFile(dump.second, data))
+            return 1;
+        if (!Memory::IsValidRange(dump.first, data.size())) {
+            fprintf(stderr, "Dump %s does not fit at %08x\n", dump.second,
+                    dump.first);
+            return 1;
+        }
+        memcpy(Memory::GetPhysicalPointer(dump.first), data.data(),
+                data.size());
+    }
+
+    std::vector<uint32_t> commands;
+    if (!LoadTrace(trace_path, commands))
+        return 1;
+    if (convert_path && !WriteBinaryTrace(convert_path, commands))
+        return 1;
+
+    Rasterizer rasterizer;
+    TexEnv::FogUnit fog;
+    Lighting::LightingUnit lighting;
+    Texturing::ProcTexUnit proctex;
+    Framebuffer::OutputMerger output_merger;
+    Framebuffer::EarlyDepthUnit early_depth;
+    Command::CommandProcessor processor(rasterizer, output_merger,
+            early_depth, fog, lighting, proctex);
+    if (threads)
+        rasterizer.SetThreads(threads);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned frame = 0; frame < frames; frame++) {
+        // Traces do not include the memory fills clearing the buffers,
+        // clear the ones bound by the previous frame
+        const auto& regs = output_merger.GetRegisters();
+        if (regs.GetWidth()) {
+            const uint32_t pixels = regs.GetWidth() * regs.GetHeight();
+            const unsigned color_bytes =
+                    Framebuffer::BytesPerPixel(regs.color_format.color_format);
+            const unsigned depth_bytes =
+                    Framebuffer::BytesPerPixel(regs.depth_format.depth_format);
+            output_merger.MemoryFill(regs.GetColorBufferPhysicalAddress(),
+                    pixels * color_bytes, 0, color_bytes);
+            output_merger.MemoryFill(regs.GetDepthBufferPhysicalAddress(),
+                    pixels * depth_bytes, 0, depth_bytes);
+        }
+        processor.ProcessCommandList(commands.data(), commands.size());
+    }
+    output_merger.Flush();
+    const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    const auto& command_stats = processor.GetStats();
+    const auto& raster_stats = rasterizer.GetStats();
+    printf("%u frames in %.3f s\n", frames, seconds);
+    printf("%.1f frames/s, %.0f vertices/s, %.0f fragments/s\n",
+            frames / seconds, command_stats.vertices / seconds,
+            raster_stats.fragments / seconds);
+    printf("%llu draws, %llu vertices, %llu triangles, %llu fragments\n",
+            (unsigned long long)command_stats.draws,
+            (unsigned long long)command_stats.vertices,
+            (unsigned long long)raster_stats.triangles,
+            (unsigned long long)raster_stats.fragments);
+    printf("%llu redundant register writes dropped\n",
+            (unsigned long long)command_stats.redundant_writes);
+
+    if (output_path) {
+        const auto& regs = output_merger.GetRegisters();
+        std::vector<uint8_t> image(regs.GetWidth() * regs.GetHeight() * 4);
+        output_merger.ReadColorBuffer(image.data());
+        if (!WritePPM(output_path, image.data(), regs.GetWidth(),
+                regs.GetHeight()))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+// Checks the span conversions of every instruction set level against the
+// per-pixel functions in color.h, bit for bit
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "color.h"
+
+namespace {
+
+    struct ColorFormat {
+        const char* name;
+        unsigned bytes;
+        Vec4<uint8_t> (*decode)(const uint8_t*);
+        void (*encode)(const Vec4<uint8_t>&, uint8_t*);
+        void (*decode_span)(const uint8_t*, uint8_t*, size_t);
+        void (*encode_span)(const uint8_t*, uint8_t*, size_t);
+    };
+
+    struct DepthFormat {
+        const char* name;
+        unsigned bytes;
+        uint32_t (*decode)(const uint8_t*);
+        void (*encode)(uint32_t, uint8_t*);
+        void (*decode_span)(const uint8_t*, uint32_t*, size_t);
+        void (*encode_span)(const uint32_t*, uint8_t*, size_t);
+    };
+
+    const ColorFormat color_formats[] = {
+        {"RGBA8", 4, Color::DecodeRGBA8, Color::EncodeRGBA8,
+                Color::DecodeRGBA8Span, Color::EncodeRGBA8Span},
+        {"RGB8", 3, Color::DecodeRGB8, Color::EncodeRGB8,
+                Color::DecodeRGB8Span, Color::EncodeRGB8Span},
+        {"RG8", 2, Color::DecodeRG8, Color::EncodeRG8,
+                Color::DecodeRG8Span, Color::EncodeRG8Span},
+        {"RGB565", 2, Color::DecodeRGB565, Color::EncodeRGB565,
+                Color::DecodeRGB565Span, Color::EncodeRGB565Span},
+        {"RGB5A1", 2, Color::DecodeRGB5A1, Color::EncodeRGB5A1,
+                Color::DecodeRGB5A1Span, Color::EncodeRGB5A1Span},
+        {"RGBA4", 2, Color::DecodeRGBA4, Color::EncodeRGBA4,
+                Color::DecodeRGBA4Span, Color::EncodeRGBA4Span},
+    };
+
+    const DepthFormat depth_formats[] = {
+        {"D16", 2, Color::DecodeD16, Color::EncodeD16,
+                Color::DecodeD16Span, Color::EncodeD16Span},
+        {"D24", 3, Color::DecodeD24, Color::EncodeD24,
+                Color::DecodeD24Span, Color::EncodeD24Span},
+    };
+
+    const char* const isa_names[] = {"Scalar", "SSE2", "SSSE3", "AVX2"};
+
+    // Longest span of the random tests, covers every vector width plus tail
+    const size_t MAX_SPAN = 300;
+    // Bytes past the end of each destination that must stay untouched
+    const size_t GUARD = 64;
+    const uint8_t GUARD_BYTE = 0xA5;
+
+    std::mt19937 rng(0x3d5);
+    unsigned failures = 0;
+
+    std::vector<uint8_t> RandomBytes(size_t size) {
+        std::vector<uint8_t> bytes(size);
+        for (uint8_t& b : bytes)
+            b = static_cast<uint8_t>(rng());
+        return bytes;
+    }
+
+    void Check(bool equal, const char* what, const char* format, size_t count) {
+        if (equal)
+            return;
+        if (failures++ < 20) {
+            fprintf(stderr, "%s %s %s mismatch, count %zu\n",
+                    isa_names[static_cast<int>(Color::GetSpanISA())], format, what,
+                    count);
+        }
+    }
+
+    // The source starts at a varying offset so the vector loads are unaligned
+    void TestColorDecode(const ColorFormat& format, const uint8_t* src, size_t count) {
+        std::vector<uint8_t> expected(count * 4 + GUARD, GUARD_BYTE);
+        std::vector<uint8_t> actual(expected);
+        for (size_t i = 0; i < count; i++) {
+            const Vec4<uint8_t> color = format.decode(src + i * format.bytes);
+            expected[i * 4 + 0] = color.r();
+            expected[i * 4 + 1] = color.g();
+            expected[i * 4 + 2] = color.b();
+            expected[i * 4 + 3] = color.a();
+        }
+        format.decode_span(src, actual.data(), count);
+        Check(expected == actual, "decode", format.name, count);
+    }
+
+    void TestColorEncode(const ColorFormat& format, const uint8_t* rgba, size_t count) {
+        std::vector<uint8_t> expected(count * format.bytes + GUARD, GUARD_BYTE);
+        std::vector<uint8_t> actual(expected);
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t* p = rgba + i * 4;
+            format.encode({p[0], p[1], p[2], p[3]}, expected.data() + i * format.bytes);
+        }
+        format.encode_span(rgba, actual.data(), count);
+        Check(expected == actual, "encode", format.name, count);
+    }
+
+    void TestDepthDecode(const DepthFormat& format, const uint8_t* src, size_t count) {
+        std::vector<uint32_t> expected(count + GUARD, 0xA5A5A5A5);
+        std::vector<uint32_t> actual(expected);
+        for (size_t i = 0; i < count; i++)
+            expected[i] = format.decode(src + i * format.bytes);
+        format.decode_span(src, actual.data(), count);
+        Check(expected == actual, "decode", format.name, count);
+    }
+
+    void TestDepthEncode(const DepthFormat& format, const uint32_t* depth, size_t count) {
+        std::vector<uint8_t> expected(count * format.bytes + GUARD, GUARD_BYTE);
+        std::vector<uint8_t> actual(expected);
+        for (size_t i = 0; i < count; i++)
+            format.encode(depth[i], expected.data() + i * format.bytes);
+        format.encode_span(depth, actual.data(), count);
+        Check(expected == actual, "encode", format.name, count);
+    }
+
+    void TestD24S8(const uint8_t* src, const uint32_t* depth, const uint8_t* stencil,
+            size_t count) {
+        std::vector<uint32_t> expected_depth(count + GUARD, 0xA5A5A5A5);
+        std::vector<uint32_t> actual_depth(expected_depth);
+        std::vector<uint8_t> expected_stencil(count + GUARD, GUARD_BYTE);
+        std::vector<uint8_t> actual_stencil(expected_stencil);
+        for (size_t i = 0; i < count; i++) {
+            const Vec2<uint32_t> value = Color::DecodeD24S8(src + i * 4);
+            expected_depth[i] = value.x;
+            expected_stencil[i] = static_cast<uint8_t>(value.y);
+        }
+        Color::DecodeD24S8Span(src, actual_depth.data(), actual_stencil.data(), count);
+        Check(expected_depth == actual_depth && expected_stencil == actual_stencil,
+                "decode", "D24S8", count);
+
+        std::vector<uint8_t> expected(count * 4 + GUARD, GUARD_BYTE);
+        std::vector<uint8_t> actual(expected);
+        for (size_t i = 0; i < count; i++)
+            Color::EncodeD24S8(depth[i], stencil[i], expected.data() + i * 4);
+        Color::EncodeD24S8Span(depth, stencil, actual.data(), count);
+        Check(expected == actual, "encode", "D24S8", count);
+    }
+
+    // Averages are truncated, see BoxFilter2x1Span()
+    void TestBoxFilter(const uint8_t* row0, const uint8_t* row1, size_t count) {
+        std::vector<uint8_t> expected(count * 4 + GUARD, GUARD_BYTE);
+        std::vector<uint8_t> actual(expected);
+        for (size_t i = 0; i < count * 4; i++) {
+            const size_t c = (i / 4) * 8 + i % 4;
+            expected[i] = (row0[c] + row0[c + 4]) / 2;
+        }
+        Color::BoxFilter2x1Span(row0, actual.data(), count);
+        Check(expected == actual, "box filter", "2x1", count);
+
+        for (size_t i = 0; i < count * 4; i++) {
+            const size_t c = (i / 4) * 8 + i % 4;
+            expected[i] = (row0[c] + row0[c + 4] + row1[c] + row1[c + 4]) / 4;
+        }
+        Color::BoxFilter2x2Span(row0, row1, actual.data(), count);
+        Check(expected == actual, "box filter", "2x2", count);
+    }
+
+    // Every 16-bit input of the 16-bit formats in a single span, and the
+    // colors decoded from them encoded back
+    void TestAll16Bit() {
+        std::vector<uint8_t> src(65536 * 2);
+        for (size_t i = 0; i < 65536; i++) {
+            src[i * 2 + 0] = static_cast<uint8_t>(i);
+            src[i * 2 + 1] = static_cast<uint8_t>(i >> 8);
+        }
+        std::vector<uint8_t> rgba(65536 * 4);
+        for (const ColorFormat& format : color_formats) {
+            if (format.bytes != 2)
+                continue;
+            TestColorDecode(format, src.data(), 65536);
+            for (size_t i = 0; i < 65536; i++) {
+                const Vec4<uint8_t> color = format.decode(src.data() + i * 2);
+                rgba[i * 4 + 0] = color.r();
+                rgba[i * 4 + 1] = color.g();
+                rgba[i * 4 + 2] = color.b();
+                rgba[i * 4 + 3] = color.a();
+            }
+            TestColorEncode(format, rgba.data(), 65536);
+        }
+        TestDepthDecode(depth_formats[0], src.data(), 65536);
+    }
+
+    void TestRandomSpans() {
+        for (size_t count = 0; count <= MAX_SPAN; count++) {
+            const size_t offset = count % 16;
+            const std::vector<uint8_t> bytes = RandomBytes(offset + count * 16);
+            const uint8_t* src = bytes.data() + offset;
+
+            for (const ColorFormat& format : color_formats) {
+                TestColorDecode(format, src, count);
+                TestColorEncode(format, src, count);
+            }
+
+            std::vector<uint32_t> depth(count);
+            for (uint32_t& d : depth)
+                d = rng();
+            for (const DepthFormat& format : depth_formats) {
+                TestDepthDecode(format, src, count);
+                TestDepthEncode(format, depth.data(), count);
+            }
+            TestD24S8(src, depth.data(), src + count * 4, count);
+            TestBoxFilter(src, src + count * 8, count);
+        }
+    }
+
+}
+
+int main() {
+    for (int level = 0; level <= static_cast<int>(Color::SpanISA::AVX2); level++) {
+        const Color::SpanISA isa = static_cast<Color::SpanISA>(level);
+        if (Color::SetSpanISA(isa) != isa) {
+            printf("%s: not supported by the host, skipped\n", isa_names[level]);
+            continue;
+        }
+        const unsigned before = failures;
+        TestAll16Bit();
+        TestRandomSpans();
+        printf("%s: %s\n", isa_names[level], (failures == before) ? "ok" : "FAILED");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+// Checks that the early depth test keeps fragments that tie with the
+// stored depth in the precision of the depth buffer
+#include <cstdio>
+#include "earlydepth.h"
+#include "regs.h"
+
+namespace {
+
+    const unsigned SIZE = 16;
+
+    // Fill the top left tile with one depth
+    void Cover(Framebuffer::EarlyDepthUnit& unit, float depth) {
+        for (unsigned y = 0; y < 8; y++)
+            for (unsigned x = 0; x < 8; x++)
+                unit.Update(x, y, depth);
+    }
+
+}
+
+int main() {
+    unsigned failures = 0;
+    auto Expect = [&](const char* what, bool pass) {
+        if (!pass) {
+            fprintf(stderr, "Expected %s\n", what);
+            failures++;
+        }
+    };
+
+    Framebuffer::EarlyDepthUnit unit;
+    unit.WriteRegister(GPUREG_EARLYDEPTH_TEST1, 1);
+    unit.WriteRegister(GPUREG_EARLYDEPTH_TEST2, 1);
+    unit.WriteRegister(GPUREG_EARLYDEPTH_FUNC,
+            static_cast<uint32_t>(Framebuffer::EarlyDepthFunc::GreaterThanOrEqual));
+
+    // Both depths store 0x8000 in D16, the tie is farther at 24 bits
+    const float stored = (0x8000 + 0.9f) / 0xffff;
+    const float tie = (0x8000 + 0.1f) / 0xffff;
+    const float farther = (0x7fff + 0.5f) / 0xffff;
+
+    unit.SetDimensions(SIZE, SIZE, 16);
+    unit.WriteRegister(GPUREG_EARLYDEPTH_CLEAR, 1);
+    Expect("D16: uncovered tile to pass", unit.Test(0, 0, 0.0f));
+    Cover(unit, stored);
+    Expect("D16: tie to pass", unit.Test(3, 3, tie));
+    Expect("D16: farther fragment to fail", !unit.Test(3, 3, farther));
+    Expect("D16: other tile to pass", unit.Test(8, 8, 0.0f));
+
+    // A format change resets the buffer, the same depths differ at 24 bits
+    unit.SetDimensions(SIZE, SIZE, 24);
+    Expect("D24: reset tile to pass", unit.Test(3, 3, 0.0f));
+    Cover(unit, stored);
+    Expect("D24: equal depth to pass", unit.Test(3, 3, stored));
+    Expect("D24: farther fragment to fail", !unit.Test(3, 3, tie));
+
+    printf("Early depth precision: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
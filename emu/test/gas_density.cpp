@@ -0,0 +1,93 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+// Accumulates gas density with the output merger over a depth buffer and
+// checks the plain and depth weighted sums in the color buffer
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "memory.h"
+#include "merger_fixture.h"
+
+using namespace MergerTest;
+
+namespace {
+
+    const unsigned SIZE = 16;
+    const uint32_t COLOR_ADDRESS = Memory::VRAM_PADDR;
+    const uint32_t DEPTH_ADDRESS = COLOR_ADDRESS + SIZE * SIZE * 4;
+
+    // Depth buffer clear value and the distance of full weight, D24 units
+    const uint32_t SCENE_Z = 0x808080;
+    const uint32_t DELTA_Z = 0x100000;
+
+}
+
+int main() {
+    std::memset(Memory::GetPhysicalPointer(COLOR_ADDRESS), 5, SIZE * SIZE * 4);
+    std::memset(Memory::GetPhysicalPointer(DEPTH_ADDRESS), 0x80, SIZE * SIZE * 4);
+
+    Framebuffer::OutputMerger merger;
+    Setup(merger, Framebuffer::FragmentOperationMode::Gas, COLOR_ADDRESS, SIZE);
+    SetRegister(merger, GPUREG_COLORBUFFER_READ, 0xf);
+    SetRegister(merger, GPUREG_COLORBUFFER_WRITE, 0xf);
+    SetRegister(merger, GPUREG_DEPTHBUFFER_READ, 3);
+    SetRegister(merger, GPUREG_DEPTHBUFFER_FORMAT,
+            static_cast<uint32_t>(Framebuffer::DepthFormat::D24S8));
+    SetRegister(merger, GPUREG_DEPTHBUFFER_LOC, DEPTH_ADDRESS / 8);
+    SetRegister(merger, GPUREG_GAS_DELTAZ_DEPTH, DELTA_Z |
+            (static_cast<uint32_t>(Framebuffer::GasDepthFunc::LessThanOrEqual) << 24));
+
+    // Two layers far in front of the scene on the left, saturating at the
+    // top. On the right one layer half a delta in front of the scene, and
+    // one behind it that fails the depth test.
+    const float near_z = (SCENE_Z - DELTA_Z / 2) / float(0xffffff);
+    Draw(merger, 0, 0, SIZE / 2, SIZE / 2, 0.25f, &Batch::r, 40);
+    Draw(merger, 0, 0, SIZE / 2, SIZE / 2, 0.25f, &Batch::r, 40);
+    Draw(merger, 0, SIZE / 2, SIZE / 2, SIZE, 0.25f, &Batch::r, 200);
+    Draw(merger, 0, SIZE / 2, SIZE / 2, SIZE, 0.25f, &Batch::r, 200);
+    Draw(merger, SIZE / 2, 0, SIZE, SIZE, near_z, &Batch::r, 100);
+    Draw(merger, SIZE / 2, 0, SIZE, SIZE, 0.75f, &Batch::r, 100);
+    merger.Flush();
+
+    uint8_t rgba[SIZE * SIZE * 4];
+    merger.ReadColorBuffer(rgba);
+
+    unsigned failures = 0;
+    for (unsigned y = 0; y < SIZE; y++) {
+        for (unsigned x = 0; x < SIZE; x++) {
+            unsigned plain = 105, weighted = 55;
+            if (x < SIZE / 2)
+                plain = weighted = (y < SIZE / 2) ? 85 : 255;
+
+            // The weight of the right half depends on the rounding of z
+            const uint8_t* pixel = rgba + (y * SIZE + x) * 4;
+            if ((pixel[0] != plain) || (std::abs(pixel[1] - int(weighted)) > 1) ||
+                    (pixel[2] != 5) || (pixel[3] != 5)) {
+                if (failures++ < 20) {
+                    fprintf(stderr, "pixel %u,%u: got %u %u %u %u, expected %u %u 5 5\n",
+                            x, y, pixel[0], pixel[1], pixel[2], pixel[3],
+                            plain, weighted);
+                }
+            }
+        }
+    }
+
+    printf("Gas density accumulation: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+// Output merger fixture shared by the tests rendering into emulated memory
+#include "framebuffer.h"
+#include "regs.h"
+#include "texturing.h"
+
+namespace MergerTest {
+
+    using Batch = Texturing::TexelBatch<4>;
+
+    // A channel of the combiner output, like &Batch::r
+    using Channel = uint8_t (Batch::*)[4];
+
+    inline void SetRegister(Framebuffer::OutputMerger& merger, unsigned reg,
+            uint32_t value) {
+        merger.WriteRegister(reg - Framebuffer::REGISTER_BASE, value);
+    }
+
+    /**
+    * Select the fragment operation mode and bind a square RGBA8 color
+    * buffer.
+    * @param address Physical address of the color buffer
+    * @param size Width and height of the buffer, a multiple of 8
+    */
+    inline void Setup(Framebuffer::OutputMerger& merger,
+            Framebuffer::FragmentOperationMode mode, uint32_t address,
+            unsigned size) {
+        SetRegister(merger, GPUREG_COLOR_OPERATION, static_cast<uint32_t>(mode));
+        SetRegister(merger, GPUREG_COLORBUFFER_FORMAT, 0);
+        SetRegister(merger, GPUREG_COLORBUFFER_LOC, address / 8);
+        SetRegister(merger, GPUREG_FRAMEBUFFER_DIM, size | ((size - 1) << 12));
+    }
+
+    /**
+    * Merge a rectangle of fragments at the same depth whose combiner
+    * output is zero except for one channel.
+    * @param x0,y0,x1,y1 Rectangle, x0 and x1 multiples of 4
+    * @param z Depth of the fragments
+    * @param channel Channel of the combiner output to set
+    * @param value Value of that channel
+    */
+    inline void Draw(Framebuffer::OutputMerger& merger, unsigned x0,
+            unsigned y0, unsigned x1, unsigned y1, float z, Channel channel,
+            uint8_t value) {
+        for (unsigned y = y0; y < y1; y++) {
+            for (unsigned x = x0; x < x1; x += 4) {
+                uint16_t px[4], py[4];
+                float depth[4];
+                Batch color{};
+                for (unsigned i = 0; i < 4; i++) {
+                    px[i] = x + i;
+                    py[i] = y;
+                    depth[i] = z;
+                    (color.*channel)[i] = value;
+                }
+                merger.Merge<4>(px, py, depth, color, 0xf);
+            }
+        }
+    }
+
+}
@@ -0,0 +1,88 @@
+/*
+ *  Project Coscoroba
+ *
+ *  Copyright (C) 2019  Wenting Zhang <zephray@outlook.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU General Public License,
+ *  version 2, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+// Renders a shadow map with the output merger and samples it back in place
+// as a Shadow2D texture
+#include <cstdio>
+#include <cstring>
+#include "memory.h"
+#include "merger_fixture.h"
+
+using namespace MergerTest;
+
+namespace {
+
+    const unsigned SIZE = 16;
+    const uint32_t ADDRESS = Memory::VRAM_PADDR;
+
+}
+
+int main() {
+    uint8_t* buffer = Memory::GetPhysicalPointer(ADDRESS);
+    // Cleared to the far plane, fully lit
+    std::memset(buffer, 0xff, SIZE * SIZE * 4);
+
+    Framebuffer::OutputMerger merger;
+    Setup(merger, Framebuffer::FragmentOperationMode::Shadow, ADDRESS, SIZE);
+    // Attenuation = g / (1.0 + 0.0 * z), float16 constant and linear terms
+    SetRegister(merger, GPUREG_FRAGOP_SHADOW, 0x3c00);
+
+    // An opaque occluder on the left, a translucent one on the top right,
+    // drawn twice as the farther one must not win
+    Draw(merger, 0, 0, SIZE / 2, SIZE, 0.25f, &Batch::g, 0);
+    Draw(merger, 0, 0, SIZE / 2, SIZE, 0.5f, &Batch::g, 0);
+    Draw(merger, SIZE / 2, SIZE / 2, SIZE, SIZE, 0.5f, &Batch::g, 128);
+    merger.Flush();
+
+    Texturing::TextureInfo info{};
+    info.physical_address = ADDRESS;
+    info.width = SIZE;
+    info.height = SIZE;
+    info.format = Texturing::RGBA8;
+    info.stride = (SIZE / 8) * Texturing::CalculateTileSize(Texturing::RGBA8);
+    Texturing::ShadowConfig shadow{};
+
+    unsigned failures = 0;
+    for (float z : {0.1f, 0.75f}) {
+        const uint32_t ref = Texturing::CalculateShadowReference(z, shadow);
+        for (unsigned y = 0; y < SIZE; y++) {
+            for (unsigned x = 0; x < SIZE; x++) {
+                uint8_t expected = 255;
+                if (x < SIZE / 2)
+                    expected = (z > 0.25f) ? 0 : 255;
+                else if (y >= SIZE / 2)
+                    expected = 128;
+
+                const float u = (x + 0.5f) / SIZE;
+                const float v = (y + 0.5f) / SIZE;
+                for (auto filter : {Texturing::TextureFilter::Nearest,
+                        Texturing::TextureFilter::Linear}) {
+                    const uint8_t value = Texturing::LookupShadow(buffer, u, v, ref,
+                            info, filter);
+                    if ((value != expected) && (failures++ < 20)) {
+                        fprintf(stderr, "z %.2f pixel %u,%u: got %u, expected %u\n",
+                                z, x, y, value, expected);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("Shadow map round trip: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}